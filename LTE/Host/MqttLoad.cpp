@@ -0,0 +1,148 @@
+// Publishes a run of QoS1|2 messages through the MQTT library the way the gateway does,
+// keeping the library's in-flight window full and publishing again what a lost
+// connection took with it, and reports how long it took. See README.txt.
+#include "application.h"
+#include "MQTT.h"
+#include <vector>
+
+struct Options
+{
+  const char *host = "127.0.0.1";
+  uint16_t port = 1883;
+  unsigned count = 1000;
+  unsigned size = 200;
+  MQTT::EMQTT_QOS qos = MQTT::QOS1;
+  int keepalive = 5;
+  unsigned long timeout = 60;
+};
+
+// Message of every message id in flight
+struct Sent
+{
+  uint16_t id;
+  unsigned message;
+};
+
+static std::vector<Sent> sent;
+static std::vector<bool> acked;
+static unsigned ackCount = 0;
+
+static void callback(char *topic, uint8_t *payload, unsigned int length)
+{
+}
+
+static void ack(unsigned int messageId)
+{
+  for (size_t i = 0; i < sent.size(); ++i)
+  {
+    if (sent[i].id != messageId)
+      continue;
+    if (!acked[sent[i].message])
+      ++ackCount;
+    acked[sent[i].message] = true;
+    sent.erase(sent.begin() + i);
+    return;
+  }
+}
+
+static void usage()
+{
+  printf("mqtt_load [--host H] [--port P] [--count N] [--size BYTES] [--qos 1|2]\n"
+         "          [--keepalive S] [--timeout S]\n");
+}
+
+int main(int argc, char **argv)
+{
+  Options options;
+  for (int i = 1; i < argc; ++i)
+  {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (!strcmp(arg, "--help"))
+    {
+      usage();
+      return 0;
+    }
+    if (value == NULL)
+    {
+      usage();
+      return 2;
+    }
+    ++i;
+    if (!strcmp(arg, "--host"))
+      options.host = value;
+    else if (!strcmp(arg, "--port"))
+      options.port = atoi(value);
+    else if (!strcmp(arg, "--count"))
+      options.count = atoi(value);
+    else if (!strcmp(arg, "--size"))
+      options.size = atoi(value);
+    else if (!strcmp(arg, "--qos"))
+      options.qos = atoi(value) == 2 ? MQTT::QOS2 : MQTT::QOS1;
+    else if (!strcmp(arg, "--keepalive"))
+      options.keepalive = atoi(value);
+    else if (!strcmp(arg, "--timeout"))
+      options.timeout = atoi(value);
+    else
+    {
+      usage();
+      return 2;
+    }
+  }
+
+  MQTT client((char *)options.host, options.port, 1098, options.keepalive, callback);
+  client.addQosCallback(ack);
+  std::vector<uint8_t> payload(options.size);
+  acked.assign(options.count, false);
+
+  unsigned next = 0;
+  unsigned publishes = 0, reconnects = 0;
+  unsigned long start = millis();
+  while (ackCount < options.count && millis() - start < options.timeout * 1000UL)
+  {
+    if (!client.isConnected())
+    {
+      if (publishes > 0)
+      {
+        ++reconnects;
+        delay(500);
+      }
+      if (!client.connect("mqtt_load"))
+        continue;
+      // The session went with the connection, what was in flight is published again
+      sent.clear();
+      next = 0;
+    }
+    client.loop();
+
+    while (client.inflightCount() < MQTT_MAX_INFLIGHT)
+    {
+      while (next < options.count && acked[next])
+        ++next;
+      if (next >= options.count)
+        break;
+      Sent s = {0, next};
+      bool inFlight = false;
+      for (size_t i = 0; i < sent.size(); ++i)
+        inFlight |= sent[i].message == next;
+      if (inFlight)
+      {
+        ++next;
+        continue;
+      }
+      memcpy(payload.data(), &next, std::min(sizeof(next), payload.size()));
+      if (!client.publish("arpa/load", payload.data(), payload.size(), options.qos, &s.id))
+        break;
+      sent.push_back(s);
+      ++publishes;
+      ++next;
+    }
+    delay(1);
+  }
+  unsigned long elapsed = millis() - start;
+
+  printf("%u of %u messages acknowledged in %.2f s (%.0f messages/s), %u publishes, %u reconnects\n",
+         ackCount, options.count, elapsed / 1000.0, ackCount * 1000.0 / (elapsed ? elapsed : 1),
+         publishes, reconnects);
+  return ackCount == options.count ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+#include "application.h"
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+USBSerial Serial;
+
+unsigned long millis()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long)(uint32_t)(now.tv_sec * 1000ULL + now.tv_nsec / 1000000);
+}
+
+void delay(unsigned long ms)
+{
+  usleep(ms * 1000);
+}
+
+TCPClient::TCPClient()
+{
+  this->fd = -1;
+}
+
+TCPClient::~TCPClient()
+{
+  this->stop();
+}
+
+int TCPClient::connect(const char *host, uint16_t port)
+{
+  this->stop();
+  struct addrinfo hints = {}, *found;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  char service[8];
+  snprintf(service, sizeof(service), "%u", port);
+  if (getaddrinfo(host, service, &hints, &found) != 0)
+    return 0;
+  this->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (this->fd >= 0 && ::connect(this->fd, found->ai_addr, found->ai_addrlen) != 0)
+    this->stop();
+  freeaddrinfo(found);
+  if (this->fd < 0)
+    return 0;
+  int on = 1;
+  setsockopt(this->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return 1;
+}
+
+int TCPClient::connect(const uint8_t *ip, uint16_t port)
+{
+  char host[16];
+  snprintf(host, sizeof(host), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  return this->connect(host, port);
+}
+
+uint8_t TCPClient::connected()
+{
+  if (this->fd < 0)
+    return 0;
+  // Bytes left to read count as connected, like on Device OS
+  uint8_t b;
+  ssize_t got = recv(this->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+  return got > 0 || (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+int TCPClient::available()
+{
+  int n = 0;
+  if (this->fd < 0 || ioctl(this->fd, FIONREAD, &n) != 0)
+    return 0;
+  return n;
+}
+
+int TCPClient::read()
+{
+  uint8_t b;
+  return this->read(&b, 1) == 1 ? b : -1;
+}
+
+int TCPClient::read(uint8_t *buf, size_t len)
+{
+  if (this->fd < 0)
+    return -1;
+  ssize_t got = recv(this->fd, buf, len, MSG_DONTWAIT);
+  return got > 0 ? (int)got : -1;
+}
+
+size_t TCPClient::write(uint8_t b)
+{
+  return this->write(&b, 1);
+}
+
+size_t TCPClient::write(const uint8_t *buf, size_t len)
+{
+  size_t sent = 0;
+  while (this->fd >= 0 && sent < len)
+  {
+    ssize_t n = send(this->fd, buf + sent, len - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+      break;
+    sent += n;
+  }
+  return sent;
+}
+
+void TCPClient::stop()
+{
+  if (this->fd >= 0)
+    close(this->fd);
+  this->fd = -1;
+}
+
+int USBSerial::printf(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  int n = vprintf(format, args);
+  va_end(args);
+  return n;
+}
+
+int os_mutex_create(os_mutex_t *mutex)
+{
+  pthread_mutex_t *m = new pthread_mutex_t;
+  pthread_mutex_init(m, NULL);
+  *mutex = m;
+  return 0;
+}
+
+int os_mutex_lock(os_mutex_t mutex)
+{
+  return pthread_mutex_lock((pthread_mutex_t *)mutex);
+}
+
+int os_mutex_unlock(os_mutex_t mutex)
+{
+  return pthread_mutex_unlock((pthread_mutex_t *)mutex);
+}
@@ -0,0 +1,171 @@
+#!/usr/bin/env python3
+
+"""A stand-in MQTT broker for the host build of the gateway's MQTT library
+
+It answers CONNECT, PUBLISH (QoS 0, 1 and 2), PUBREL, SUBSCRIBE and PINGREQ like a
+broker, without passing anything on, and misbehaves on request so the client's
+retransmits, packet parsing and keepalive can be watched:
+
+    broker_standin.py --ack-delay 300          acknowledgements come late, like on LTE
+    broker_standin.py --drop 10                every 10th PUBACK|PUBREC|PUBCOMP is lost
+    broker_standin.py --split                  answers arrive a byte at a time
+    broker_standin.py --stall-after 500        after 500 PUBLISHes the broker goes silent
+                                               with the socket left open (half open)
+
+When a client goes it prints what it sent: PUBLISHes, the ones with DUP set and the
+distinct message ids.
+
+"""
+
+import argparse
+import heapq
+import socket
+import threading
+import time
+
+CONNECT, CONNACK, PUBLISH, PUBACK, PUBREC, PUBREL, PUBCOMP = 1, 2, 3, 4, 5, 6, 7
+SUBSCRIBE, SUBACK, PINGREQ, PINGRESP, DISCONNECT = 8, 9, 12, 13, 14
+
+
+class Writer(threading.Thread):
+    """Sends the answers of a connection when they are due, in order"""
+
+    def __init__(self, conn, split):
+        super().__init__(daemon=True)
+        self.conn = conn
+        self.split = split
+        self.queue = []
+        self.count = 0
+        self.ready = threading.Condition()
+        self.closed = False
+
+    def send(self, data, delay):
+        with self.ready:
+            self.count += 1
+            heapq.heappush(self.queue, (time.monotonic() + delay, self.count, data))
+            self.ready.notify()
+
+    def close(self):
+        with self.ready:
+            self.closed = True
+            self.ready.notify()
+
+    def run(self):
+        while True:
+            with self.ready:
+                while not self.closed and (not self.queue or self.queue[0][0] > time.monotonic()):
+                    self.ready.wait(self.queue[0][0] - time.monotonic() if self.queue else None)
+                if self.closed:
+                    return
+                _, _, data = heapq.heappop(self.queue)
+            try:
+                if self.split:
+                    for b in data:
+                        self.conn.sendall(bytes([b]))
+                        time.sleep(0.005)
+                else:
+                    self.conn.sendall(data)
+            except OSError:
+                return
+
+
+def read_exactly(conn, n):
+    data = b''
+    while len(data) < n:
+        chunk = conn.recv(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def read_packet(conn):
+    """(type, flags, body) of the next packet"""
+    header = read_exactly(conn, 1)[0]
+    length, shift = 0, 0
+    while True:
+        digit = read_exactly(conn, 1)[0]
+        length |= (digit & 0x7F) << shift
+        shift += 7
+        if not digit & 0x80:
+            break
+    return header >> 4, header & 0x0F, read_exactly(conn, length)
+
+
+def serve(conn, address, args):
+    writer = Writer(conn, args.split)
+    writer.start()
+    acks = publishes = dups = 0
+    ids = set()
+
+    def answer(kind, flags, body):
+        writer.send(bytes([kind << 4 | flags, len(body)]) + body, args.ack_delay / 1000.0)
+
+    def acknowledge(kind, flags, msg_id):
+        nonlocal acks
+        acks += 1
+        if args.drop and acks % args.drop == 0:
+            return
+        answer(kind, flags, msg_id)
+
+    try:
+        while True:
+            kind, flags, body = read_packet(conn)
+            if kind == CONNECT:
+                writer.send(bytes([CONNACK << 4, 2, 0, 0]), 0)
+            elif kind == PUBLISH:
+                publishes += 1
+                if args.stall_after and publishes > args.stall_after:
+                    # Half open: nothing is read or answered any more
+                    while True:
+                        time.sleep(3600)
+                qos = (flags >> 1) & 3
+                if flags & 0x08:
+                    dups += 1
+                if qos:
+                    topic_length = body[0] << 8 | body[1]
+                    msg_id = body[2 + topic_length:4 + topic_length]
+                    ids.add(bytes(body[4 + topic_length:8 + topic_length]))
+                    acknowledge(PUBACK if qos == 1 else PUBREC, 0, msg_id)
+            elif kind == PUBREL:
+                acknowledge(PUBCOMP, 0, body[:2])
+            elif kind == SUBSCRIBE:
+                writer.send(bytes([SUBACK << 4, 3]) + body[:2] + b'\x00', 0)
+            elif kind == PINGREQ:
+                writer.send(bytes([PINGRESP << 4, 0]), 0)
+            elif kind == DISCONNECT:
+                break
+    except (EOFError, OSError):
+        pass
+    finally:
+        writer.close()
+        conn.close()
+        print('%s:%d gone: %d PUBLISHes, %d with DUP, %d distinct messages'
+              % (address[0], address[1], publishes, dups, len(ids)), flush=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--port', type=int, default=1883)
+    parser.add_argument('--ack-delay', type=int, default=0, metavar='MS',
+                        help='milliseconds before an acknowledgement is sent')
+    parser.add_argument('--drop', type=int, default=0, metavar='N',
+                        help='drop every Nth PUBACK, PUBREC or PUBCOMP')
+    parser.add_argument('--split', action='store_true', help='send answers a byte at a time')
+    parser.add_argument('--stall-after', type=int, default=0, metavar='N',
+                        help='go silent after N PUBLISHes on a connection')
+    args = parser.parse_args()
+
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind(('127.0.0.1', args.port))
+    server.listen()
+    print('Listening on 127.0.0.1:%d' % args.port, flush=True)
+    while True:
+        conn, address = server.accept()
+        conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        threading.Thread(target=serve, args=(conn, address, args), daemon=True).start()
+
+
+if __name__ == '__main__':
+    main()
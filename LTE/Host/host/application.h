@@ -0,0 +1,64 @@
+/*
+  application.h - Minimal host replacement for the parts of Device OS the
+  MQTT library uses: millis(), String, TCPClient on a POSIX socket and the
+  os_mutex calls, so the library builds and runs on Linux unchanged.
+*/
+#ifndef application_h
+#define application_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <string>
+
+unsigned long millis();
+void delay(unsigned long ms);
+
+/// Only what MQTT.cpp keeps the broker domain in
+class String
+{
+public:
+  String(const char *str = "") : str(str ? str : "") {}
+  const char *c_str() const { return this->str.c_str(); }
+
+private:
+  std::string str;
+};
+
+/// TCPClient of Device OS on a blocking socket. available(), read() and connected()
+/// never wait, like on the Boron; write() waits until the kernel took everything.
+class TCPClient
+{
+public:
+  TCPClient();
+  ~TCPClient();
+
+  int connect(const char *host, uint16_t port);
+  int connect(const uint8_t *ip, uint16_t port);
+  uint8_t connected();
+  int available();
+  int read();
+  int read(uint8_t *buf, size_t len);
+  size_t write(uint8_t b);
+  size_t write(const uint8_t *buf, size_t len);
+  void stop();
+
+private:
+  int fd;
+};
+
+/// Debug output of the library (DEBUG_MQTT_SERIAL_OUTPUT)
+class USBSerial
+{
+public:
+  int printf(const char *format, ...);
+};
+extern USBSerial Serial;
+
+typedef void *os_mutex_t;
+int os_mutex_create(os_mutex_t *mutex);
+int os_mutex_lock(os_mutex_t mutex);
+int os_mutex_unlock(os_mutex_t mutex);
+
+#endif
@@ -0,0 +1 @@
+#include "application.h"
@@ -46,6 +46,10 @@ MQTT::~MQTT() {
 
     if (buffer != NULL)
       delete[] buffer;
+    if (rxBuffer != NULL)
+      delete[] rxBuffer;
+    if (inflightBuffer != NULL)
+      delete[] inflightBuffer;
 }
 
 void MQTT::initialize(char* domain, uint8_t *ip, uint16_t port, int keepalive, int maxpacketsize, 
@@ -68,6 +72,15 @@ void MQTT::initialize(char* domain, uint8_t *ip, uint16_t port, int keepalive, i
     if (buffer != NULL)
       delete[] buffer;
     buffer = new uint8_t[this->maxpacketsize];
+    if (rxBuffer != NULL)
+      delete[] rxBuffer;
+    rxBuffer = new uint8_t[this->maxpacketsize];
+    resetPacket();
+    // sized for the packets, made on the first QoS1|2 publish
+    if (inflightBuffer != NULL)
+      delete[] inflightBuffer;
+    inflightBuffer = NULL;
+    clearInflight();
 }
 
 void MQTT::setBroker(char* domain, uint16_t port) {
@@ -113,6 +126,7 @@ bool MQTT::connect(const char *id, const char *user, const char *pass, const cha
 
         if (result) {
             nextMsgId = 1;
+            resetPacket();
             uint16_t length = 5;
 
             if (version == MQTT_V311) {
@@ -164,25 +178,34 @@ bool MQTT::connect(const char *id, const char *user, const char *pass, const cha
             write(MQTTCONNECT, buffer, length-5);
             lastInActivity = lastOutActivity = millis();
 
-            while (!_client.available()) {
+            // CONNACK, given up on after the keepalive even if only a part of it came
+            while (!readPacket()) {
                 unsigned long t = millis();
-                if (t-lastInActivity > this->keepalive*1000UL) {
+                if (!_client.connected() || t-lastInActivity > this->keepalive*1000UL) {
                     _client.stop();
+                    resetPacket();
                     return false;
                 }
             }
-            uint8_t llen;
-            uint16_t len = readPacket(&llen);
+            uint32_t len = rxLength;
+            resetPacket();
 
-            if (len == 4) {
-                if (buffer[3] == CONN_ACCEPT) {
+            if (len == 4 && (rxBuffer[0]&0xF0) == MQTTCONNACK) {
+                if (rxBuffer[3] == CONN_ACCEPT) {
                     lastInActivity = millis();
                     pingOutstanding = false;
+                    if (cleanSession) {
+                        // the server dropped the session, messages in flight are not acknowledged any more
+                        clearInflight();
+                    } else {
+                        for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++)
+                            inflight[i].sentAt = lastInActivity - MQTT_RETRY_TIMEOUT;
+                    }
                     debug_print(" Connect success\n");
                     return true;
                 } else {
                     // check EMQTT_CONNACK_RESPONSE code.
-                    debug_print(" Connect fail. code = [%d]\n", buffer[3]);
+                    debug_print(" Connect fail. code = [%d]\n", rxBuffer[3]);
                 }
             }
         }
@@ -191,54 +214,52 @@ bool MQTT::connect(const char *id, const char *user, const char *pass, const cha
     return false;
 }
 
-uint8_t MQTT::readByte() {
-    while(!_client.available()) {}
-    return _client.read();
-}
-
-uint16_t MQTT::readPacket(uint8_t* lengthLength) {
-    uint16_t len = 0;
-    buffer[len++] = readByte();
-    bool isPublish = (buffer[0]&0xF0) == MQTTPUBLISH;
-    uint32_t multiplier = 1;
-    uint16_t length = 0;
-    uint8_t digit = 0;
-    uint16_t skip = 0;
-    uint8_t start = 0;
-
-    do {
-        digit = readByte();
-        buffer[len++] = digit;
-        length += (digit & 127) * multiplier;
-        multiplier *= 128;
-    } while ((digit & 128) != 0);
-    *lengthLength = len-1;
-
-    if (isPublish) {
-        // Read in topic length to calculate bytes to skip over for Stream writing
-        buffer[len++] = readByte();
-        buffer[len++] = readByte();
-        skip = (buffer[*lengthLength+1]<<8)+buffer[*lengthLength+2];
-        start = 2;
-        if (buffer[0] & MQTTQOS1_HEADER_MASK) {
-            // skip message id
-            skip += 2;
-        }
-    }
-
-    for (uint16_t i = start;i<length;i++) {
-        digit = readByte();
-        if (len < this->maxpacketsize) {
-            buffer[len] = digit;
+void MQTT::resetPacket() {
+    rxLength = 0;
+    rxRemaining = 0;
+    rxHeaderLength = 0;
+}
+
+// Reads what has arrived of the next packet into rxBuffer without waiting for the rest,
+// true once all of it is in. The bytes over maxpacketsize are read and dropped.
+bool MQTT::readPacket() {
+    while (_client.available() > 0) {
+        if (rxHeaderLength == 0) {
+            uint8_t digit = _client.read();
+            rxBuffer[rxLength++] = digit;
+            if (rxLength == 1)
+                continue;
+            rxRemaining |= (uint32_t)(digit & 127) << (7 * (rxLength - 2));
+            if (digit & 128) {
+                if (rxLength == 5) {
+                    // the remaining length takes 4 bytes at most, the stream is lost
+                    _client.stop();
+                    resetPacket();
+                    return false;
+                }
+                continue;
+            }
+            rxHeaderLength = rxLength;
+        } else {
+            uint8_t skip[32];
+            uint8_t *to = skip;
+            uint32_t want = sizeof(skip);
+            if (rxLength < this->maxpacketsize) {
+                to = rxBuffer + rxLength;
+                want = this->maxpacketsize - rxLength;
+            }
+            if (want > rxRemaining)
+                want = rxRemaining;
+            int got = _client.read(to, want);
+            if (got <= 0)
+                return false;
+            rxLength += got;
+            rxRemaining -= got;
         }
-        len++;
-    }
-
-    if (len > this->maxpacketsize) {
-        len = 0; // This will cause the packet to be ignored.
+        if (rxRemaining == 0)
+            return true;
     }
-
-    return len;
+    return false;
 }
 
 bool MQTT::loop() {
@@ -246,6 +267,84 @@ bool MQTT::loop() {
         MutexLocker lock(this);
 
         unsigned long t = millis();
+
+        // the packets that are in, one still coming is finished on a later call
+        while (readPacket()) {
+            uint8_t llen = rxHeaderLength - 1;
+            uint32_t len = rxLength;
+            uint16_t msgId = 0;
+            uint8_t *payload;
+            resetPacket();
+            if (len > this->maxpacketsize)
+                continue;
+
+            lastInActivity = t;
+            uint8_t type = rxBuffer[0]&0xF0;
+            if (type == MQTTPUBLISH) {
+                uint16_t tl = (rxBuffer[llen+1]<<8)+rxBuffer[llen+2]; // topic length
+                uint8_t qos = rxBuffer[0]&0x06;
+                // 32 bits, a topic length near 65535 must not wrap past the check
+                uint32_t start = (uint32_t)llen+3+tl+(qos == MQTTQOS0_HEADER_MASK ? 0 : 2);
+                if (start > len)
+                    continue;
+                // msgId only present for QOS>0
+                if (qos != MQTTQOS0_HEADER_MASK)
+                    msgId = (rxBuffer[llen+3+tl]<<8)+rxBuffer[llen+3+tl+1];
+                if (callback) {
+                    char topic[tl+1];
+                    memcpy(topic, rxBuffer+llen+3, tl);
+                    topic[tl] = 0;
+                    payload = rxBuffer+start;
+                    callback(topic,payload,len-start);
+                }
+                if (qos == MQTTQOS1_HEADER_MASK)
+                    writeAck(MQTTPUBACK, msgId); // respond with PUBACK
+                else if (qos == MQTTQOS2_HEADER_MASK)
+                    writeAck(MQTTPUBREC, msgId); // respond with PUBREC
+            } else if (type == MQTTPUBACK) {
+                // QoS1 publish done
+                msgId = (rxBuffer[2]<<8)+rxBuffer[3];
+                Inflight *f = findInflight(msgId, INFLIGHT_PUBACK);
+                if (len == 4 && f != NULL) {
+                    f->state = INFLIGHT_FREE;
+                    inflightUsed--;
+                    if (qoscallback)
+                        this->qoscallback(msgId);
+                }
+            } else if (type == MQTTPUBREC) {
+                // QoS2 publish received, should return PUBREL
+                msgId = (rxBuffer[2]<<8)+rxBuffer[3];
+                Inflight *f = findInflight(msgId, INFLIGHT_PUBREC);
+                if (f != NULL) {
+                    f->state = INFLIGHT_PUBCOMP;
+                    f->sentAt = t;
+                }
+                writeAck(MQTTPUBREL | MQTTQOS1_HEADER_MASK, msgId);
+            } else if (type == MQTTPUBREL) {
+                msgId = (rxBuffer[2]<<8)+rxBuffer[3];
+                writeAck(MQTTPUBCOMP, msgId);
+            } else if (type == MQTTPUBCOMP) {
+                // QoS2 publish done
+                msgId = (rxBuffer[2]<<8)+rxBuffer[3];
+                Inflight *f = findInflight(msgId, INFLIGHT_PUBCOMP);
+                if (len == 4 && f != NULL) {
+                    f->state = INFLIGHT_FREE;
+                    inflightUsed--;
+                    if (qoscallback)
+                        this->qoscallback(msgId);
+                }
+            } else if (type == MQTTSUBACK) {
+                // if something...
+            } else if (type == MQTTPINGREQ) {
+                buffer[0] = MQTTPINGRESP;
+                buffer[1] = 0;
+                _client.write(buffer,2);
+            } else if (type == MQTTPINGRESP) {
+                pingOutstanding = false;
+            }
+        }
+
+        // a broker gone silent, or a socket half open, gets no answer to the ping
         if ((t - lastInActivity > this->keepalive*1000UL) || (t - lastOutActivity > this->keepalive*1000UL)) {
             if (pingOutstanding) {
                 _client.stop();
@@ -260,84 +359,7 @@ bool MQTT::loop() {
             }
         }
 
-        if (_client.available()) {
-            uint8_t llen;
-            uint16_t len = readPacket(&llen);
-            uint16_t msgId = 0;
-            uint8_t *payload;
-            if (len > 0) {
-                lastInActivity = t;
-                uint8_t type = buffer[0]&0xF0;
-                if (type == MQTTPUBLISH) {
-                    if (callback) {
-                        uint16_t tl = (buffer[llen+1]<<8)+buffer[llen+2]; // topic length
-                        char topic[tl+1];
-                        for (uint16_t i=0;i<tl;i++) {
-                            topic[i] = buffer[llen+3+i];
-                        }
-                        topic[tl] = 0;
-                        // msgId only present for QOS>0
-                        if ((buffer[0]&0x06) == MQTTQOS1_HEADER_MASK) { // QoS=1
-                            msgId = (buffer[llen+3+tl]<<8)+buffer[llen+3+tl+1];
-                            payload = buffer+llen+3+tl+2;
-                            callback(topic,payload,len-llen-3-tl-2);
-
-                            buffer[0] = MQTTPUBACK; // respond with PUBACK
-                            buffer[1] = 2;
-                            buffer[2] = (msgId >> 8);
-                            buffer[3] = (msgId & 0xFF);
-                            _client.write(buffer,4);
-                            lastOutActivity = t;
-                                    } else if ((buffer[0] & 0x06) == MQTTQOS2_HEADER_MASK) { // QoS=2
-                                        msgId = (buffer[llen + 3 + tl] << 8) + buffer[llen + 3 + tl + 1];
-                                        payload = buffer + llen + 3 + tl + 2;
-                                        callback(topic, payload, len - llen - 3 - tl - 2);
-
-                                        buffer[0] = MQTTPUBREC; // respond with PUBREC
-                                        buffer[1] = 2;
-                                        buffer[2] = (msgId >> 8);
-                                        buffer[3] = (msgId & 0xFF);
-                                        _client.write(buffer, 4);
-                                        lastOutActivity = t;
-                                    } else {
-                            payload = buffer+llen+3+tl;
-                            callback(topic,payload,len-llen-3-tl);
-                        }
-                    }
-                } else if (type == MQTTPUBREC) {
-                    // check for the situation that QoS2 receive PUBREC, should return PUBREL
-                    msgId = (buffer[2] << 8) + buffer[3];
-                    this->publishRelease(msgId);
-                } else if (type == MQTTPUBACK) {
-                    if (qoscallback) {
-                        // this case QOS==1
-                        if (len == 4 && (buffer[0]&0x06) == MQTTQOS0_HEADER_MASK) {
-                            msgId = (buffer[2]<<8)+buffer[3];
-                            this->qoscallback(msgId);
-                        }
-                    }
-                } else if (type == MQTTPUBREL) {
-                msgId = (buffer[2] << 8) + buffer[3];
-                this->publishComplete(msgId);
-                } else if (type == MQTTPUBCOMP) {
-                if (qoscallback) {
-                    // msgId only present for QOS==0
-                    if (len == 4 && (buffer[0]&0x06) == MQTTQOS0_HEADER_MASK) {
-                        msgId = (buffer[2]<<8)+buffer[3];
-                        this->qoscallback(msgId);
-                    }
-                }
-                } else if (type == MQTTSUBACK) {
-                    // if something...
-                } else if (type == MQTTPINGREQ) {
-                    buffer[0] = MQTTPINGRESP;
-                    buffer[1] = 0;
-                    _client.write(buffer,2);
-                } else if (type == MQTTPINGRESP) {
-                    pingOutstanding = false;
-                }
-            }
-        }
+        resendInflight(t);
         return true;
     }
     return false;
@@ -380,25 +402,38 @@ bool MQTT::publish(const char* topic, const uint8_t* payload, unsigned int pleng
 }
 
 bool MQTT::publish(const char* topic, const uint8_t* payload, unsigned int plength, bool retain, EMQTT_QOS qos, bool dup, uint16_t *messageid) {
+    if (plength > maxPayloadLength(topic, qos))
+        return false;
+
     if (isConnected()) {
         MutexLocker lock(this);
+        uint8_t *buf = buffer;
+        Inflight *f = NULL;
+        if (qos == QOS2 || qos == QOS1) {
+            // kept until it is acknowledged, so it is built in its place in the in-flight store
+            if (inflightBuffer == NULL)
+                inflightBuffer = new uint8_t[MQTT_MAX_INFLIGHT * this->maxpacketsize];
+            f = findInflight(0, INFLIGHT_FREE);
+            if (inflightBuffer == NULL || f == NULL)
+                return false;
+            buf = inflightBuffer + (f - inflight) * this->maxpacketsize;
+        }
+
         // Leave room in the buffer for header and variable length field
         uint16_t length = 5;
-        memset(buffer, 0, this->maxpacketsize);
-
-        length = writeString(topic, buffer, length);
+        length = writeString(topic, buf, length);
 
-        if (qos == QOS2 || qos == QOS1) {
-            nextMsgId += 1;
-            buffer[length++] = (nextMsgId >> 8);
-            buffer[length++] = (nextMsgId & 0xFF);
+        uint16_t msgId = 0;
+        if (f != NULL) {
+            msgId = nextMessageId();
+            buf[length++] = (msgId >> 8);
+            buf[length++] = (msgId & 0xFF);
             if (messageid != NULL)
-                *messageid = nextMsgId++;
+                *messageid = msgId;
         }
 
-        for (uint16_t i=0; i < plength && length < this->maxpacketsize; i++) {
-            buffer[length++] = payload[i];
-        }
+        memcpy(buf + length, payload, plength);
+        length += plength;
 
         uint8_t header = MQTTPUBLISH;
         if (retain) {
@@ -416,45 +451,103 @@ bool MQTT::publish(const char* topic, const uint8_t* payload, unsigned int pleng
         else
             header |= MQTTQOS0_HEADER_MASK;
 
-        return write(header, buffer, length-5);
+        // a packet cut short leaves the stream out of step with the broker,
+        // so the connection is dropped and the next connect starts clean
+        if (f == NULL) {
+            if (write(header, buf, length-5))
+                return true;
+            _client.stop();
+            return false;
+        }
+
+        uint16_t start = frame(header, buf, length-5);
+        f->packet = buf + start;
+        f->length = length - start;
+        if (_client.write(f->packet, f->length) != f->length) {
+            _client.stop();
+            return false;
+        }
+        f->msgId = msgId;
+        f->state = (qos == QOS2 ? INFLIGHT_PUBREC : INFLIGHT_PUBACK);
+        f->sentAt = lastOutActivity = millis();
+        inflightUsed++;
+        return true;
     }
     return false;
 }
 
-bool MQTT::publishRelease(uint16_t messageid) {
-    if (isConnected()) {
-        MutexLocker lock(this);
-        uint16_t length = 0;
-        // reserved bits in MQTT v3.1.1
-        buffer[length++] = MQTTPUBREL | MQTTQOS1_HEADER_MASK;
-        buffer[length++] = 2;
-        buffer[length++] = (messageid >> 8);
-        buffer[length++] = (messageid & 0xFF);
-        return _client.write(buffer, length);
-    }
-    return false;
+uint16_t MQTT::maxPayloadLength(const char* topic, EMQTT_QOS qos) {
+    // header and remaining length (5), topic length (2) and topic, message id for QoS1|2
+    uint16_t used = 5 + 2 + strlen(topic) + (qos == QOS0 ? 0 : 2);
+    return used < this->maxpacketsize ? this->maxpacketsize - used : 0;
 }
 
-bool MQTT::publishComplete(uint16_t messageid) {
-    if (isConnected()) {
-        MutexLocker lock(this);
-        uint16_t length = 0;
-        // reserved bits in MQTT v3.1.1
-        buffer[length++] = MQTTPUBCOMP | MQTTQOS1_HEADER_MASK;
-        buffer[length++] = 2;
-        buffer[length++] = (messageid >> 8);
-        buffer[length++] = (messageid & 0xFF);
-        return _client.write(buffer, length);
+uint8_t MQTT::inflightCount() {
+    return inflightUsed;
+}
+
+MQTT::Inflight *MQTT::findInflight(uint16_t msgId, uint8_t state) {
+    for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+        if (inflight[i].state == state && (state == INFLIGHT_FREE || inflight[i].msgId == msgId))
+            return &inflight[i];
+    }
+    return NULL;
+}
+
+// sends the messages in flight again that got no answer for MQTT_RETRY_TIMEOUT
+void MQTT::resendInflight(unsigned long t) {
+    for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+        Inflight &f = inflight[i];
+        if (f.state == INFLIGHT_FREE || t - f.sentAt < MQTT_RETRY_TIMEOUT)
+            continue;
+        if (f.state == INFLIGHT_PUBCOMP) {
+            writeAck(MQTTPUBREL | MQTTQOS1_HEADER_MASK, f.msgId);
+        } else {
+            f.packet[0] |= DUP_FLAG_ON_MASK;
+            lastOutActivity = t;
+            if (_client.write(f.packet, f.length) != f.length) {
+                _client.stop();
+                return;
+            }
+        }
+        f.sentAt = t;
     }
-    return false;
 }
 
-bool MQTT::write(uint8_t header, uint8_t* buf, uint16_t length) {
+void MQTT::clearInflight() {
+    for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++)
+        inflight[i].state = INFLIGHT_FREE;
+    inflightUsed = 0;
+}
+
+uint16_t MQTT::nextMessageId() {
+    // 0 is not a message id, and one still in flight is not given out again
+    bool used;
+    do {
+        nextMsgId++;
+        if (nextMsgId == 0) {
+            nextMsgId = 1;
+        }
+        used = false;
+        for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++)
+            used |= inflight[i].state != INFLIGHT_FREE && inflight[i].msgId == nextMsgId;
+    } while (used);
+    return nextMsgId;
+}
+
+bool MQTT::writeAck(uint8_t header, uint16_t msgId) {
+    uint8_t ack[4] = {header, 2, (uint8_t)(msgId >> 8), (uint8_t)(msgId & 0xFF)};
+    lastOutActivity = millis();
+    return _client.write(ack, 4) == 4;
+}
+
+// puts the header and remaining length in front of the length bytes from buf+5,
+// the packet starts at the offset returned
+uint16_t MQTT::frame(uint8_t header, uint8_t* buf, uint16_t length) {
     uint8_t lenBuf[4];
     uint8_t llen = 0;
     uint8_t digit;
     uint8_t pos = 0;
-    uint16_t rc;
     uint16_t len = length;
     do {
         digit = len % 128;
@@ -470,10 +563,15 @@ bool MQTT::write(uint8_t header, uint8_t* buf, uint16_t length) {
     for (int i = 0; i < llen; i++) {
         buf[5-llen+i] = lenBuf[i];
     }
-    rc = _client.write(buf+(4-llen), length+1+llen);
+    return 4-llen;
+}
+
+bool MQTT::write(uint8_t header, uint8_t* buf, uint16_t length) {
+    uint16_t start = frame(header, buf, length);
+    uint16_t rc = _client.write(buf+start, length+5-start);
 
     lastOutActivity = millis();
-    return (rc == 1+llen+length);
+    return (rc == length+5-start);
 }
 
 bool MQTT::subscribe(const char* topic) {
@@ -486,12 +584,9 @@ bool MQTT::subscribe(const char* topic, EMQTT_QOS qos) {
         // Leave room in the buffer for header and variable length field
         MutexLocker lock(this);
         uint16_t length = 5;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
-        }
-        buffer[length++] = (nextMsgId >> 8);
-        buffer[length++] = (nextMsgId & 0xFF);
+        uint16_t msgId = nextMessageId();
+        buffer[length++] = (msgId >> 8);
+        buffer[length++] = (msgId & 0xFF);
         length = writeString(topic, buffer,length);
         buffer[length++] = qos;
         return write(MQTTSUBSCRIBE | MQTTQOS1_HEADER_MASK,buffer,length-5);
@@ -503,12 +598,9 @@ bool MQTT::unsubscribe(const char* topic) {
     if (isConnected()) {
         MutexLocker lock(this);
         uint16_t length = 5;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
-        }
-        buffer[length++] = (nextMsgId >> 8);
-        buffer[length++] = (nextMsgId & 0xFF);
+        uint16_t msgId = nextMessageId();
+        buffer[length++] = (msgId >> 8);
+        buffer[length++] = (msgId & 0xFF);
         length = writeString(topic, buffer,length);
         return write(MQTTUNSUBSCRIBE | MQTTQOS1_HEADER_MASK,buffer,length-5);
     }
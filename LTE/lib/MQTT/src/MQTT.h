@@ -75,6 +75,16 @@ bug fixed and features pull requests
 // MQTT_KEEPALIVE : keepAlive interval in Seconds
 #define MQTT_DEFAULT_KEEPALIVE 15
 
+// MQTT_MAX_INFLIGHT : QoS1|2 messages published and not yet acknowledged, publish() refuses more.
+// A copy of every one is kept (maxpacketsize bytes each) and sent again with DUP every
+// MQTT_RETRY_TIMEOUT milliseconds until its PUBACK or PUBCOMP comes.
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 4
+#endif
+#ifndef MQTT_RETRY_TIMEOUT
+#define MQTT_RETRY_TIMEOUT 10000
+#endif
+
 #define MQTTPROTOCOLVERSION 3
 #define MQTTCONNECT     1 << 4  // Client request to connect to Server
 #define MQTTCONNACK     2 << 4  // Connect Acknowledgment
@@ -126,6 +136,21 @@ typedef enum {
 } EMQTT_CONNACK_RESPONSE;
 
 private:
+    typedef enum {
+        INFLIGHT_FREE = 0,
+        INFLIGHT_PUBACK,    // QoS1 PUBLISH sent
+        INFLIGHT_PUBREC,    // QoS2 PUBLISH sent
+        INFLIGHT_PUBCOMP    // QoS2 PUBREL sent
+    } EMQTT_INFLIGHT_STATE;
+
+    struct Inflight {
+        uint8_t state;
+        uint16_t msgId;
+        uint8_t *packet;    // in inflightBuffer
+        uint16_t length;
+        unsigned long sentAt;
+    };
+
     TCPClient _client;
     uint8_t *buffer = NULL;
     uint16_t nextMsgId;
@@ -134,9 +159,26 @@ private:
     bool pingOutstanding;
     void (*callback)(char*,uint8_t*,unsigned int);
     void (*qoscallback)(unsigned int);
-    uint16_t readPacket(uint8_t*);
-    uint8_t readByte();
+
+    // packet being received, read in as it arrives so loop() never waits for the rest of it
+    uint8_t *rxBuffer = NULL;
+    uint32_t rxLength = 0;          // bytes of the packet read, the ones over maxpacketsize are dropped
+    uint32_t rxRemaining = 0;       // bytes of the packet still to come
+    uint8_t rxHeaderLength = 0;     // header and remaining length bytes, 0 while they are read
+
+    Inflight inflight[MQTT_MAX_INFLIGHT] = {};
+    uint8_t *inflightBuffer = NULL;
+    uint8_t inflightUsed = 0;
+
+    bool readPacket();
+    void resetPacket();
+    uint16_t frame(uint8_t header, uint8_t* buf, uint16_t length);
     bool write(uint8_t header, uint8_t* buf, uint16_t length);
+    bool writeAck(uint8_t header, uint16_t msgId);
+    uint16_t nextMessageId();
+    Inflight *findInflight(uint16_t msgId, uint8_t state);
+    void resendInflight(unsigned long t);
+    void clearInflight();
     uint16_t writeString(const char* string, uint8_t* buf, uint16_t pos);
     String domain;
     uint8_t *ip = NULL;
@@ -148,8 +190,6 @@ private:
 
     void initialize(char* domain, uint8_t *ip, uint16_t port, int keepalive, int maxpacketsize, 
                 void (*callback)(char*,uint8_t*,unsigned int), bool thread = false);
-    bool publishRelease(uint16_t messageid);
-    bool publishComplete(uint16_t messageid);
 
     class MutexLocker {
         MQTT * mqtt;
@@ -211,6 +251,10 @@ public:
     bool publish(const char *topic, const uint8_t *payload, unsigned int plength, bool retain, EMQTT_QOS qos, uint16_t *messageid = NULL);
     bool publish(const char *topic, const uint8_t *payload, unsigned int plength, bool retain, EMQTT_QOS qos, bool dup, uint16_t *messageid);
     void addQosCallback(void (*qoscallback)(unsigned int));
+    // largest payload publish() takes for the topic, longer ones are refused
+    uint16_t maxPayloadLength(const char *topic, EMQTT_QOS qos);
+    // QoS1|2 messages waiting for their PUBACK|PUBCOMP, up to MQTT_MAX_INFLIGHT
+    uint8_t inflightCount();
 
     bool subscribe(const char *topic);
     bool subscribe(const char *topic, EMQTT_QOS);
@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+
+// Checksums of update images and their chunks (Arpa_Update.h).
+// The same file is in STM Code_program/Combined (nodes and bases) and LTE/src/LTE (gateway),
+// the python tools compute the same with binascii.crc_hqx(data, 0xFFFF) and zlib.crc32().
+
+/// CRC-16/CCITT-FALSE (polynomial 0x1021), pass the result back in as crc to continue it
+uint16_t Arpa_Crc16(const uint8_t *data, const uint16_t len, uint16_t crc = 0xFFFF);
+
+/// CRC-32 as in zlib, pass the result back in as crc to continue it
+uint32_t Arpa_Crc32(const uint8_t *data, const uint32_t len, uint32_t crc = 0);
@@ -0,0 +1,64 @@
+#include "Arpa_Dedup.h"
+
+Arpa_Dedup::Arpa_Dedup()
+{
+  for (uint8_t i = 0; i < ARPA_DEDUP_NODES; ++i)
+    this->entries[i].originId = -1;
+  this->duplicates = 0;
+}
+
+bool Arpa_Dedup::IsDuplicate(const uint8_t originId, const uint8_t sequence, const uint32_t now)
+{
+  Arpa_dedup_entry &entry = this->FindEntry(originId);
+  entry.lastSeen = now;
+
+  // Distance from the newest number, with the wrap around
+  int8_t ahead = (int8_t)(sequence - entry.sequence);
+
+  if (entry.originId < 0 || (sequence == 0 && entry.sequence != 0) || ahead <= -ARPA_DEDUP_WINDOW)
+  {
+    // New node, or one that started over
+    entry.originId = originId;
+    entry.sequence = sequence;
+    entry.window = 1;
+    return false;
+  }
+
+  if (ahead > 0)
+  {
+    entry.window = ahead >= ARPA_DEDUP_WINDOW ? 0 : entry.window << ahead;
+    entry.window |= 1;
+    entry.sequence = sequence;
+    return false;
+  }
+
+  uint32_t bit = 1UL << -ahead;
+  if (entry.window & bit)
+  {
+    ++this->duplicates;
+    return true;
+  }
+  entry.window |= bit;
+  return false;
+}
+
+uint32_t Arpa_Dedup::GetDuplicateCount() const
+{
+  return this->duplicates;
+}
+
+Arpa_dedup_entry &Arpa_Dedup::FindEntry(const uint8_t originId)
+{
+  Arpa_dedup_entry *oldest = &this->entries[0];
+  for (uint8_t i = 0; i < ARPA_DEDUP_NODES; ++i)
+  {
+    Arpa_dedup_entry &entry = this->entries[i];
+    if (entry.originId == originId)
+      return entry;
+    if (oldest->originId >= 0 && (entry.originId < 0 || (int32_t)(entry.lastSeen - oldest->lastSeen) < 0))
+      oldest = &entry;
+  }
+
+  oldest->originId = -1;
+  return *oldest;
+}
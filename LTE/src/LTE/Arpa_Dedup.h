@@ -0,0 +1,49 @@
+#pragma once
+#include <stdint.h>
+
+// Sequence numbers a node has sent recently, counted back from the newest
+#define ARPA_DEDUP_WINDOW 32
+// Nodes remembered, the one heard from least recently makes room for a new one
+#define ARPA_DEDUP_NODES 32
+
+// Every data message of a node carries an 8 bit sequence number (see Arpa_RF95::SendOneShot()),
+// which the node keeps when a send fails, so a message that arrived but whose ACK was lost
+// comes again with the same number.
+//
+// Arpa_Dedup tells those copies apart from new messages on the base, forwarders and the
+// LTE gateway. Per node it keeps the newest number and a bitmap of the ARPA_DEDUP_WINDOW before it.
+// A node starts at 0 after a reset, so 0 after other numbers starts the node over, as does
+// a number further back than the window. Numbers wrap around from 255 to 1.
+// The same file is in STM Code_program/Combined (nodes and bases) and LTE/src/LTE (gateway),
+// python/influx/bridge.py does the same for the database.
+struct Arpa_dedup_entry
+{
+  // -1 for a free slot
+  int16_t originId;
+  uint8_t sequence;
+  // Bit n is set if sequence - n was seen
+  uint32_t window;
+  // Clock passed to IsDuplicate() when the node was last seen
+  uint32_t lastSeen;
+};
+
+class Arpa_Dedup
+{
+public:
+  Arpa_Dedup();
+
+  /// Records the sequence number of a message.
+  /// \param now Any clock in any unit, to find the node heard from least recently
+  /// \return true if the node sent this number before, drop the message
+  bool IsDuplicate(const uint8_t originId, const uint8_t sequence, const uint32_t now);
+
+  /// Messages IsDuplicate() returned true for
+  uint32_t GetDuplicateCount() const;
+
+private:
+  Arpa_dedup_entry entries[ARPA_DEDUP_NODES];
+  uint32_t duplicates;
+
+  /// Entry of the node, the least recently seen one cleared for it if the node has none
+  Arpa_dedup_entry &FindEntry(const uint8_t originId);
+};
@@ -0,0 +1,53 @@
+#include "Arpa_LinkReceiver.h"
+
+Arpa_LinkReceiver::Arpa_LinkReceiver()
+{
+  this->port = NULL;
+  this->queue = NULL;
+  this->thread = NULL;
+}
+
+bool Arpa_LinkReceiver::Begin(USARTSerial &port)
+{
+  this->port = &port;
+  if (os_queue_create(&this->queue, sizeof(Arpa_link_frame), ARPA_LINK_QUEUE_LENGTH, NULL) != 0)
+    return false;
+  this->thread = new Thread("base_link", Arpa_LinkReceiver::Run, this, OS_THREAD_PRIORITY_DEFAULT, ARPA_LINK_THREAD_STACK);
+  return this->thread != NULL;
+}
+
+bool Arpa_LinkReceiver::Take(Arpa_link_frame &frame)
+{
+  return this->queue != NULL && os_queue_take(this->queue, &frame, 0, NULL) == 0;
+}
+
+uint32_t Arpa_LinkReceiver::GetErrorCount() const
+{
+  return this->reader.GetErrorCount();
+}
+
+os_thread_return_t Arpa_LinkReceiver::Run(void *receiver)
+{
+  Arpa_LinkReceiver *self = (Arpa_LinkReceiver *)receiver;
+  Arpa_link_frame &frame = self->incoming;
+  while (true)
+  {
+    int available = self->port->available();
+    if (available <= 0)
+    {
+      delay(1);
+      continue;
+    }
+
+    while (available-- > 0)
+    {
+      if (!self->reader.Take(self->port->read()))
+        continue;
+      frame.type = self->reader.GetType();
+      frame.node = self->reader.GetNode();
+      frame.len = self->reader.GetLength();
+      memcpy(frame.payload, self->reader.GetPayload(), frame.len);
+      os_queue_put(self->queue, &frame, CONCURRENT_WAIT_FOREVER, NULL);
+    }
+  }
+}
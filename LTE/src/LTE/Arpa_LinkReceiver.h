@@ -0,0 +1,50 @@
+#pragma once
+#include "Particle.h"
+#include "Arpa_Link.h"
+
+// Frames read from the base and not yet taken by loop()
+#define ARPA_LINK_QUEUE_LENGTH 32
+#define ARPA_LINK_THREAD_STACK 2048
+
+// A frame from the base, copied out of the Arpa_LinkReader
+struct Arpa_link_frame
+{
+  Arpa_link_type type;
+  uint8_t node;
+  uint8_t len;
+  uint8_t payload[ARPA_LINK_MAX_PAYLOAD];
+};
+
+// Reads the frames of the base (Arpa_Link.h) on a thread of its own.
+//
+// The UART driver fills the receive buffer of the port by interrupt/DMA (acquireSerial1Buffer()
+// in LTE.ino makes it large). The thread empties it in bulk every millisecond, decodes the
+// frames and puts them in a queue for loop(), which publishes them. While loop() waits for
+// the network, a flash write or the MQTT server, the thread keeps reading. When the queue
+// is full the thread waits for room, and bytes pile up in the UART buffer instead.
+class Arpa_LinkReceiver
+{
+public:
+  Arpa_LinkReceiver();
+
+  /// Starts the thread reading port, which must have been begun
+  /// \return false if the queue or the thread could not be created
+  bool Begin(USARTSerial &port);
+
+  /// Takes the oldest frame read, without waiting
+  /// \return false if none is waiting
+  bool Take(Arpa_link_frame &frame);
+
+  /// Frames dropped for a bad encoding, length or CRC, or for being too long
+  uint32_t GetErrorCount() const;
+
+private:
+  USARTSerial *port;
+  Arpa_LinkReader reader;
+  os_queue_t queue;
+  Thread *thread;
+  // Frame the thread is putting in the queue
+  Arpa_link_frame incoming;
+
+  static os_thread_return_t Run(void *receiver);
+};
@@ -0,0 +1,174 @@
+#include "Arpa_Outbox.h"
+#include "Arpa_Crc.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+static uint32_t ReadLe(const uint8_t *data, const uint8_t len)
+{
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < len; ++i)
+    value |= (uint32_t)data[i] << (8 * i);
+  return value;
+}
+
+static void WriteLe(uint8_t *data, const uint32_t value, const uint8_t len)
+{
+  for (uint8_t i = 0; i < len; ++i)
+    data[i] = (uint8_t)(value >> (8 * i));
+}
+
+// CRC of a slot, the state is left out so it can be rewritten on its own
+static uint16_t SlotCrc(const uint8_t *slot, const uint16_t len)
+{
+  uint16_t crc = Arpa_Crc16(slot + ARPA_OUTBOX_SEQUENCE_BYTE_POS, 4);
+  return Arpa_Crc16(slot + ARPA_OUTBOX_NODE_BYTE_POS, ARPA_OUTBOX_HEADER_LENGTH - ARPA_OUTBOX_NODE_BYTE_POS + len, crc);
+}
+
+Arpa_Outbox::Arpa_Outbox()
+{
+  this->fd = -1;
+  this->head = 0;
+  this->tail = 0;
+  this->dropped = 0;
+}
+
+bool Arpa_Outbox::Begin()
+{
+  this->fd = open(ARPA_OUTBOX_FILE, O_RDWR | O_CREAT, 0644);
+  if (this->fd < 0)
+    return false;
+
+  uint32_t sequences[ARPA_OUTBOX_SLOTS];
+  uint8_t states[ARPA_OUTBOX_SLOTS];
+  uint8_t buf[ARPA_OUTBOX_SLOT_LENGTH];
+  bool found = false;
+  uint32_t newest = 0;
+  for (uint16_t slot = 0; slot < ARPA_OUTBOX_SLOTS; ++slot)
+  {
+    states[slot] = ARPA_OUTBOX_STATE_SENT;
+    if (this->ReadSlot(slot, buf) < 0)
+      continue;
+    sequences[slot] = ReadLe(buf + ARPA_OUTBOX_SEQUENCE_BYTE_POS, 4);
+    states[slot] = buf[ARPA_OUTBOX_STATE_BYTE_POS];
+    if (!found || (int32_t)(sequences[slot] - newest) > 0)
+      newest = sequences[slot];
+    found = true;
+  }
+
+  // Pending messages are the ones right before the newest, back to the first one acknowledged
+  this->tail = found ? newest + 1 : 0;
+  this->head = this->tail;
+  while (this->tail - this->head < ARPA_OUTBOX_SLOTS)
+  {
+    uint16_t slot = (this->head - 1) % ARPA_OUTBOX_SLOTS;
+    if (states[slot] != ARPA_OUTBOX_STATE_PENDING || sequences[slot] != this->head - 1)
+      break;
+    --this->head;
+  }
+  return true;
+}
+
+bool Arpa_Outbox::Push(const uint8_t nodeId, const uint8_t *payload, const uint16_t len)
+{
+  if (this->fd < 0 || len > ARPA_OUTBOX_MAX_LENGTH)
+    return false;
+
+  if (this->tail - this->head >= ARPA_OUTBOX_SLOTS)
+  {
+    // The new message takes the slot of the oldest
+    ++this->head;
+    ++this->dropped;
+  }
+
+  uint8_t buf[ARPA_OUTBOX_SLOT_LENGTH];
+  WriteLe(buf + ARPA_OUTBOX_SEQUENCE_BYTE_POS, this->tail, 4);
+  buf[ARPA_OUTBOX_STATE_BYTE_POS] = ARPA_OUTBOX_STATE_PENDING;
+  buf[ARPA_OUTBOX_NODE_BYTE_POS] = nodeId;
+  WriteLe(buf + ARPA_OUTBOX_LENGTH_BYTE_POS, len, 2);
+  memcpy(buf + ARPA_OUTBOX_HEADER_LENGTH, payload, len);
+  WriteLe(buf + ARPA_OUTBOX_CRC_BYTE_POS, SlotCrc(buf, len), 2);
+
+  off_t pos = (off_t)(this->tail % ARPA_OUTBOX_SLOTS) * ARPA_OUTBOX_SLOT_LENGTH;
+  if (lseek(this->fd, pos, SEEK_SET) != pos ||
+      write(this->fd, buf, ARPA_OUTBOX_HEADER_LENGTH + len) != ARPA_OUTBOX_HEADER_LENGTH + len)
+    return false;
+  fsync(this->fd);
+  ++this->tail;
+  return true;
+}
+
+int16_t Arpa_Outbox::Peek(uint32_t &sequence, uint8_t &nodeId, uint8_t *payload)
+{
+  uint8_t buf[ARPA_OUTBOX_SLOT_LENGTH];
+  while (this->head != this->tail)
+  {
+    int16_t len = this->ReadSlot(this->head % ARPA_OUTBOX_SLOTS, buf);
+    if (len >= 0 && ReadLe(buf + ARPA_OUTBOX_SEQUENCE_BYTE_POS, 4) == this->head)
+    {
+      sequence = this->head;
+      nodeId = buf[ARPA_OUTBOX_NODE_BYTE_POS];
+      memcpy(payload, buf + ARPA_OUTBOX_HEADER_LENGTH, len);
+      return len;
+    }
+    ++this->head;
+    ++this->dropped;
+  }
+  return -1;
+}
+
+int16_t Arpa_Outbox::Read(const uint32_t sequence, uint8_t &nodeId, uint8_t *payload)
+{
+  if (sequence - this->head >= this->tail - this->head)
+    return -1;
+  uint8_t buf[ARPA_OUTBOX_SLOT_LENGTH];
+  int16_t len = this->ReadSlot(sequence % ARPA_OUTBOX_SLOTS, buf);
+  if (len < 0 || ReadLe(buf + ARPA_OUTBOX_SEQUENCE_BYTE_POS, 4) != sequence)
+    return -1;
+  nodeId = buf[ARPA_OUTBOX_NODE_BYTE_POS];
+  memcpy(payload, buf + ARPA_OUTBOX_HEADER_LENGTH, len);
+  return len;
+}
+
+void Arpa_Outbox::Pop(const uint32_t last)
+{
+  // Messages dropped since they were read are gone already
+  if (last - this->head >= this->tail - this->head)
+    return;
+  while (this->head != last + 1)
+    this->MarkSent(this->head++);
+  fsync(this->fd);
+}
+
+uint16_t Arpa_Outbox::GetCount() const
+{
+  return this->tail - this->head;
+}
+
+uint32_t Arpa_Outbox::GetDroppedCount() const
+{
+  return this->dropped;
+}
+
+int16_t Arpa_Outbox::ReadSlot(const uint16_t slot, uint8_t *buf)
+{
+  off_t pos = (off_t)slot * ARPA_OUTBOX_SLOT_LENGTH;
+  if (lseek(this->fd, pos, SEEK_SET) != pos)
+    return -1;
+  // The file ends after the last slot written, which can be short
+  int n = read(this->fd, buf, ARPA_OUTBOX_SLOT_LENGTH);
+  if (n < ARPA_OUTBOX_HEADER_LENGTH)
+    return -1;
+  uint16_t len = ReadLe(buf + ARPA_OUTBOX_LENGTH_BYTE_POS, 2);
+  if (len > n - ARPA_OUTBOX_HEADER_LENGTH || ReadLe(buf + ARPA_OUTBOX_CRC_BYTE_POS, 2) != SlotCrc(buf, len))
+    return -1;
+  return len;
+}
+
+void Arpa_Outbox::MarkSent(const uint32_t sequence)
+{
+  uint8_t state = ARPA_OUTBOX_STATE_SENT;
+  off_t pos = (off_t)(sequence % ARPA_OUTBOX_SLOTS) * ARPA_OUTBOX_SLOT_LENGTH + ARPA_OUTBOX_STATE_BYTE_POS;
+  if (lseek(this->fd, pos, SEEK_SET) == pos)
+    write(this->fd, &state, 1);
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <stdint.h>
+
+// Messages for MQTT wait in this file until the server acknowledged them
+#define ARPA_OUTBOX_FILE "/arpa_outbox.bin"
+// Messages the file holds, the oldest is dropped for a new one when it is full
+#define ARPA_OUTBOX_SLOTS 128
+#define ARPA_OUTBOX_SLOT_LENGTH 512
+// Every slot is [CRC-16 2][sequence 4][state 1][node 1][length 2][payload],
+// integers little endian, the CRC (Arpa_Crc16()) over everything but itself and the state
+#define ARPA_OUTBOX_CRC_BYTE_POS 0
+#define ARPA_OUTBOX_SEQUENCE_BYTE_POS 2
+#define ARPA_OUTBOX_STATE_BYTE_POS 6
+#define ARPA_OUTBOX_NODE_BYTE_POS 7
+#define ARPA_OUTBOX_LENGTH_BYTE_POS 8
+#define ARPA_OUTBOX_HEADER_LENGTH 10
+#define ARPA_OUTBOX_MAX_LENGTH (ARPA_OUTBOX_SLOT_LENGTH - ARPA_OUTBOX_HEADER_LENGTH)
+// The state is written on its own when a message was acknowledged
+#define ARPA_OUTBOX_STATE_PENDING 0x01
+#define ARPA_OUTBOX_STATE_SENT 0x00
+
+// Flash backed ring of the messages the gateway still has to publish.
+//
+// Messages from the base go in here as soon as they are read off the UART, and are taken
+// out oldest first once their PUBACK came back, so nothing is lost while the cellular
+// network or the MQTT server is down, and a reset of the gateway keeps them too.
+//
+// Every message gets the next sequence number and the slot sequence % ARPA_OUTBOX_SLOTS.
+// Begin() finds the newest slot and goes back over the pending ones before it, which are
+// the messages left from before the reset. A slot cut off by a reset fails its CRC and is skipped.
+class Arpa_Outbox
+{
+public:
+  Arpa_Outbox();
+
+  /// Opens ARPA_OUTBOX_FILE and finds the messages still pending in it
+  /// \return false if the file can't be opened, Push() fails then
+  bool Begin();
+
+  /// Appends a message from a node, dropping the oldest one if the outbox is full
+  /// \return false if it could not be written or is longer than ARPA_OUTBOX_MAX_LENGTH
+  bool Push(const uint8_t nodeId, const uint8_t *payload, const uint16_t len);
+
+  /// Reads the oldest message without taking it out, slots that fail their CRC are dropped
+  /// \param sequence Set to the number to give Pop() once the message is acknowledged
+  /// \param payload At least ARPA_OUTBOX_MAX_LENGTH bytes
+  /// \return Length of the message, -1 if the outbox is empty
+  int16_t Peek(uint32_t &sequence, uint8_t &nodeId, uint8_t *payload);
+
+  /// Reads a message behind the oldest one, to publish several at once
+  /// \param payload At least ARPA_OUTBOX_MAX_LENGTH bytes
+  /// \return Length of the message, -1 if it is not pending or its slot is corrupt
+  int16_t Read(const uint32_t sequence, uint8_t &nodeId, uint8_t *payload);
+
+  /// Takes out the messages up to this sequence number that are still pending
+  void Pop(const uint32_t last);
+
+  /// Messages pending
+  uint16_t GetCount() const;
+
+  /// Messages dropped since Begin() because the outbox was full or their slot was corrupt
+  uint32_t GetDroppedCount() const;
+
+private:
+  int fd;
+  // Sequence numbers of the oldest pending message and of the next one pushed
+  uint32_t head, tail;
+  uint32_t dropped;
+
+  /// Reads a slot and checks its CRC
+  /// \return Length of the payload, -1 for an empty or corrupt slot
+  int16_t ReadSlot(const uint16_t slot, uint8_t *buf);
+
+  /// Writes the state of the slot of a sequence number, fsync() is up to the caller
+  void MarkSent(const uint32_t sequence);
+};
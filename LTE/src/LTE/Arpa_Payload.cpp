@@ -0,0 +1,169 @@
+#include "Arpa_Payload.h"
+#include <string.h>
+#include <stddef.h>
+
+Arpa_PayloadWriter::Arpa_PayloadWriter(uint8_t *buf, const uint8_t size)
+{
+  this->buf = buf;
+  this->size = size;
+  this->len = 0;
+
+  if (size >= ARPA_PAYLOAD_HEADER_LENGTH)
+  {
+    this->buf[ARPA_PAYLOAD_VERSION_BYTE_POS] = ARPA_PAYLOAD_VERSION;
+    this->len = ARPA_PAYLOAD_HEADER_LENGTH;
+  }
+}
+
+bool Arpa_PayloadWriter::AddSensor(const uint8_t sensorId)
+{
+  return this->AddRecord(ARPA_TLV_SENSOR, &sensorId, 1);
+}
+
+bool Arpa_PayloadWriter::AddAge(const uint16_t seconds)
+{
+  uint8_t value[2] = {(uint8_t)seconds, (uint8_t)(seconds >> 8)};
+  return this->AddRecord(ARPA_TLV_AGE, value, 2);
+}
+
+bool Arpa_PayloadWriter::AddReading(const Arpa_tlv_type type, const int32_t value)
+{
+  // Use as few bytes as the value needs, most readings fit in one
+  uint8_t bytes[4] = {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24)};
+  uint8_t width = 4;
+  if (value >= -128 && value <= 127)
+    width = 1;
+  else if (value >= -32768 && value <= 32767)
+    width = 2;
+
+  return this->AddRecord(type, bytes, width);
+}
+
+bool Arpa_PayloadWriter::AddRecord(const Arpa_tlv_type type, const uint8_t *value, const uint8_t len)
+{
+  if (this->len == 0 || this->len + ARPA_TLV_HEADER_LENGTH + len > this->size)
+    return false;
+
+  this->buf[this->len + ARPA_TLV_TYPE_BYTE_POS] = type;
+  this->buf[this->len + ARPA_TLV_LEN_BYTE_POS] = len;
+  memcpy(this->buf + this->len + ARPA_TLV_HEADER_LENGTH, value, len);
+  this->len += ARPA_TLV_HEADER_LENGTH + len;
+  return true;
+}
+
+bool Arpa_PayloadWriter::AddRecords(const uint8_t *records, const uint8_t len)
+{
+  if (this->len == 0 || this->len + len > this->size)
+    return false;
+
+  memcpy(this->buf + this->len, records, len);
+  this->len += len;
+  return true;
+}
+
+uint8_t Arpa_PayloadWriter::GetLength() const
+{
+  return this->len;
+}
+
+Arpa_PayloadReader::Arpa_PayloadReader(const uint8_t *buf, const uint8_t len)
+{
+  this->buf = buf;
+  this->len = len;
+  this->pos = ARPA_PAYLOAD_HEADER_LENGTH;
+
+  this->context.type = ARPA_TLV_INVALID;
+  this->context.value = 0;
+  this->context.sensorId = 0;
+  this->context.age = 0;
+  this->context.time = 0;
+  this->context.baseId = -1;
+  this->context.sequence = -1;
+}
+
+bool Arpa_PayloadReader::IsBinary(const uint8_t *buf, const uint8_t len)
+{
+  return len >= ARPA_PAYLOAD_HEADER_LENGTH && buf[ARPA_PAYLOAD_VERSION_BYTE_POS] == ARPA_PAYLOAD_VERSION;
+}
+
+bool Arpa_PayloadReader::NextReading(Arpa_reading &reading)
+{
+  if (!IsBinary(this->buf, this->len))
+    return false;
+
+  while (this->pos + ARPA_TLV_HEADER_LENGTH <= this->len)
+  {
+    Arpa_tlv_type type = (Arpa_tlv_type)this->buf[this->pos + ARPA_TLV_TYPE_BYTE_POS];
+    uint8_t valueLen = this->buf[this->pos + ARPA_TLV_LEN_BYTE_POS];
+    const uint8_t *value = this->buf + this->pos + ARPA_TLV_HEADER_LENGTH;
+
+    if (this->pos + ARPA_TLV_HEADER_LENGTH + valueLen > this->len || valueLen > 4)
+    {
+      // Nothing after a broken record can be trusted
+      this->pos = this->len;
+      return false;
+    }
+    this->pos += ARPA_TLV_HEADER_LENGTH + valueLen;
+
+    switch (type)
+    {
+    case ARPA_TLV_SENSOR:
+      this->context.sensorId = (uint8_t)ReadInt(value, valueLen, false);
+      break;
+    case ARPA_TLV_AGE:
+      this->context.age = (uint16_t)ReadInt(value, valueLen, false);
+      break;
+    case ARPA_TLV_TIME:
+      this->context.time = (uint32_t)ReadInt(value, valueLen, false);
+      break;
+    case ARPA_TLV_BASE:
+      this->context.baseId = (uint8_t)ReadInt(value, valueLen, false);
+      break;
+    case ARPA_TLV_SEQ:
+      this->context.sequence = (uint8_t)ReadInt(value, valueLen, false);
+      break;
+
+    default:
+      // Skip record types from newer nodes
+      if (type < ARPA_TLV_GAS || valueLen == 0)
+        break;
+
+      reading = this->context;
+      reading.type = type;
+      reading.value = ReadInt(value, valueLen, true);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+const char *Arpa_PayloadReader::TypeName(const Arpa_tlv_type type)
+{
+  switch (type)
+  {
+  case ARPA_TLV_GAS:
+    return "gas";
+  case ARPA_TLV_TEMPERATURE:
+    return "temperature";
+  case ARPA_TLV_HUMIDITY:
+    return "humidity";
+  case ARPA_TLV_BATTERY:
+    return "battery";
+  default:
+    return NULL;
+  }
+}
+
+int32_t Arpa_PayloadReader::ReadInt(const uint8_t *value, const uint8_t len, bool isSigned)
+{
+  uint32_t result = 0;
+  for (uint8_t i = 0; i < len; ++i)
+    result |= (uint32_t)value[i] << (8 * i);
+
+  // Sign extend values shorter than 4 bytes
+  if (isSigned && len > 0 && len < 4 && (value[len - 1] & 0x80))
+    result |= 0xFFFFFFFFUL << (8 * len);
+
+  return (int32_t)result;
+}
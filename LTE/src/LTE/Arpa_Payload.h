@@ -0,0 +1,112 @@
+#pragma once
+#include <stdint.h>
+
+// Binary payload of a data message, replacing text like "gas=1".
+//
+// [ARPA_PAYLOAD_VERSION][type][len][value]...
+//
+// Every record is a type byte, a length byte and that many value bytes. Context records
+// (sensor, age, time, base) apply to the readings after them, so one payload can carry
+// readings of several sensors taken at different times. Integers are little endian,
+// readings are signed and sent in the fewest of 1, 2 or 4 bytes.
+//
+// The version byte is not printable, which tells binary payloads apart from the old text ones.
+// Commands to a node (MQTT arpa/cmd/<node>) are payloads of the same format holding command
+// records, Arpa_PayloadReader::NextReading() returns them like readings.
+// The same file is in STM Code_program/Combined (nodes and bases) and LTE/src/LTE (gateway),
+// keep both and the decoder in python/influx/bridge.py in step.
+#define ARPA_PAYLOAD_VERSION 0x01
+#define ARPA_PAYLOAD_VERSION_BYTE_POS 0
+#define ARPA_PAYLOAD_HEADER_LENGTH 1
+#define ARPA_TLV_TYPE_BYTE_POS 0
+#define ARPA_TLV_LEN_BYTE_POS 1
+#define ARPA_TLV_HEADER_LENGTH 2
+// The base adds a sequence record and the LTE gateway a base and a time record on the way
+// up, in payloads of at most 255 bytes. Nodes keep their payloads that much shorter.
+#define ARPA_PAYLOAD_ADDED_LENGTH 12
+#define ARPA_PAYLOAD_MAX_LENGTH (255 - ARPA_PAYLOAD_ADDED_LENGTH)
+
+enum Arpa_tlv_type : uint8_t
+{
+  ARPA_TLV_INVALID = 0x00,
+  // Context records
+  ARPA_TLV_SENSOR = 0x01, // uint8 sensor on the node, 0 if there is no sensor record
+  ARPA_TLV_AGE = 0x02,    // uint16 seconds between taking the reading and sending it
+  ARPA_TLV_TIME = 0x03,   // uint32 unix time the message reached the LTE gateway, added there
+  ARPA_TLV_BASE = 0x04,   // uint8 base the message came through, added by the LTE gateway
+  ARPA_TLV_SEQ = 0x05,    // uint8 sequence number of the message at its node, added by the base
+  // Readings
+  ARPA_TLV_GAS = 0x10,         // 1 when gas was detected
+  ARPA_TLV_TEMPERATURE = 0x11, // 0.01 degrees C
+  ARPA_TLV_HUMIDITY = 0x12,    // 0.01 % relative humidity
+  ARPA_TLV_BATTERY = 0x13,     // mV
+  // Commands
+  ARPA_TLV_CMD_SAMPLE_INTERVAL = 0x20, // seconds between periodic readings, 0 for none
+  ARPA_TLV_CMD_DATA_RATE = 0x21,       // any value, ask the next hop for a data rate at the next send
+  ARPA_TLV_CMD_UPDATE = 0x22           // firmware version to fetch from the base, see Arpa_Update
+};
+
+// One reading out of a payload, with the context records in front of it applied
+struct Arpa_reading
+{
+  Arpa_tlv_type type;
+  int32_t value;
+  uint8_t sensorId;
+  uint16_t age;
+  uint32_t time; // 0 if the payload has no time record
+  int16_t baseId; // -1 if the payload has no base record
+  int16_t sequence; // -1 if the payload has no sequence record
+};
+
+class Arpa_PayloadWriter
+{
+public:
+  /// Starts a payload in buf, size is the space buf has
+  Arpa_PayloadWriter(uint8_t *buf, const uint8_t size);
+
+  /// Readings added after this are from sensor sensorId of the node
+  bool AddSensor(const uint8_t sensorId);
+
+  /// Readings added after this were taken the given number of seconds before sending
+  bool AddAge(const uint16_t seconds);
+
+  /// \param type One of the reading types, ARPA_TLV_GAS and up
+  /// \return false if the payload is full
+  bool AddReading(const Arpa_tlv_type type, const int32_t value);
+
+  /// Adds a record with raw value bytes
+  bool AddRecord(const Arpa_tlv_type type, const uint8_t *value, const uint8_t len);
+
+  /// Appends records taken from another payload (without its version byte)
+  bool AddRecords(const uint8_t *records, const uint8_t len);
+
+  /// Length of the payload so far, to pass to SendOneShot() etc.
+  uint8_t GetLength() const;
+
+private:
+  uint8_t *buf;
+  uint8_t size, len;
+};
+
+class Arpa_PayloadReader
+{
+public:
+  Arpa_PayloadReader(const uint8_t *buf, const uint8_t len);
+
+  /// True if the payload starts with a version byte this code understands
+  static bool IsBinary(const uint8_t *buf, const uint8_t len);
+
+  /// Takes the next reading out of the payload.
+  /// \return false at the end of the payload or on a malformed record
+  bool NextReading(Arpa_reading &reading);
+
+  /// Name of a reading type ("gas", "temperature", ...), NULL for unknown types
+  static const char *TypeName(const Arpa_tlv_type type);
+
+private:
+  const uint8_t *buf;
+  uint8_t len, pos;
+  Arpa_reading context;
+
+  static int32_t ReadInt(const uint8_t *value, const uint8_t len, bool isSigned);
+};
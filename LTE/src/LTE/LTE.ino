@@ -7,27 +7,131 @@
 // Disable optimization for debuggin
 // #pragma GCC optimize ("O0")
 #include "MQTT.h"
+#include "Arpa_Payload.h"
+#include "Arpa_Crc.h"
+#include "Arpa_Dedup.h"
+#include "Arpa_Outbox.h"
+#include "Arpa_Link.h"
+#include "Arpa_LinkReceiver.h"
+#include <fcntl.h>
 
+// The base talks to the gateway on Serial1 in Arpa_Link.h frames
 #define BASE_UART_BAUD 57600
+// Serial1 buffers, filled and emptied by the UART driver. The receive buffer holds
+// more than half a second of the link while the thread of baseReceiver is held up.
+#define BASE_UART_RX_BUFFER 4096
+#define BASE_UART_TX_BUFFER 512
 #define TOPIC "arpa/msg/%d"
+// Commands for the nodes of this base, arpa/cmd/<node> with a binary payload (Arpa_Payload.h)
+#define CMD_TOPIC "arpa/cmd/+"
+#define CMD_TOPIC_PREFIX "arpa/cmd/"
+#define CMD_MAX_LENGTH 16   //ARPA_CMD_MAX_LENGTH on the base
+// Firmware update images for the nodes (python/ota/make_update.py), published in parts of
+// [version 2][image length 4][offset 4][bytes] and kept in FW_FILE for the base to fetch chunks of
+#define FW_TOPIC "arpa/fw"
+#define FW_FILE "/arpa_fw.bin"
+#define FW_PART_HEADER_LENGTH 10
+#define FW_PART_LENGTH 1024
+#define FW_MAX_LENGTH 65536
+// Parts are larger than the 255 bytes the MQTT library takes by default
+#define MQTT_MAX_PACKET_SIZE_FW (FW_PART_HEADER_LENGTH + FW_PART_LENGTH + 64)
+#define CHUNK_REQ_LENGTH 7       //ARPA_CHUNK_REQ_LENGTH on the base
+#define CHUNK_HEADER_LENGTH 9    //ARPA_CHUNK_HEADER_LENGTH
+#define CHUNK_MAX_LENGTH 238     //ARPA_MAX_CHUNK_LENGTH
+#define CHUNK_OK 0
+#define CHUNK_BUSY 1
+#define CHUNK_NONE 2
 #define MQTT_DEVICE_NAME "arpa_boron_1"
 #define MQTT_USER "sensor-node"
 #define MQTT_PASS "SensorNode$"
 #define MQTT_PORT 4000
 #define BASE_ID ";1"       //set up the base ID
+#define BASE_NUM 1          //the same base ID for binary payloads
+// Messages are published from the outbox (Arpa_Outbox.h) with QoS1, up to MQTT_MAX_INFLIGHT
+// PUBLISHes at a time. The MQTT library sends one that got no PUBACK again after MQTT_RETRY_TIMEOUT ms.
+// Time between tries to get the cellular network and the MQTT server back
+#define MQTT_RETRY_INTERVAL 5000
+// Messages queued within MQTT_BATCH_WINDOW ms of the first one waiting go out together in one
+// PUBLISH on BATCH_TOPIC, as [BATCH_VERSION] and [node][length 2][message] for each, up to
+// MQTT_BATCH_MAX_LENGTH bytes. A backlog goes out in full batches right away.
+// A window of 0 publishes every message on its own on TOPIC, for bridges that don't take batches.
+#define MQTT_BATCH_WINDOW 2000
+#define MQTT_BATCH_MAX_LENGTH 1024
+#define BATCH_TOPIC "arpa/batch/%d"
+#define BATCH_VERSION 0x01
+#define BATCH_RECORD_HEADER_LENGTH 3
+// Particle cloud events take this much data, longer summaries of a batch are cut
+#define CLOUD_SUMMARY_MAX_LENGTH 600
 char *MQTT_DOMAIN = "104.131.65.189";
 // char *MQTT_DOMAIN = "sensor-node.hatasaka.com";
 
 
 void callback(char *topic, uint8_t *payload, unsigned int length);
-void mqtt_connect();
-void mqtt_publish(char *topic, char *msg);
-void connect_celluar();
+bool mqtt_try_connect();
+void mqtt_publish(uint8_t nodeId, const uint8_t *payload, unsigned int len);
+void send_outbox();
+uint16_t batch_max_length();
+void cloud_summary(uint8_t nodeId, const String &summary);
+void puback(unsigned int messageId);
+void publish_binary(uint8_t nodeId, const uint8_t *records, uint8_t len);
+void take_firmware_part(const uint8_t *payload, unsigned int length);
+void send_chunk(const uint8_t *request, uint8_t len);
+uint32_t read_le(const uint8_t *data, uint8_t len);
 
 SerialLogHandler logHandler;
 int led = D7; // The on-board LED
 SystemSleepConfiguration sleepConfig;
-MQTT client(MQTT_DOMAIN, MQTT_PORT, callback);
+MQTT client(MQTT_DOMAIN, MQTT_PORT, MQTT_MAX_PACKET_SIZE_FW, callback);
+
+// Update image in FW_FILE, fwParts has a bit for every part of FW_PART_LENGTH received
+uint16_t fwVersion = 0;
+uint32_t fwLength = 0;
+uint8_t fwParts[FW_MAX_LENGTH / FW_PART_LENGTH / 8];
+
+// Sequence numbers of the node messages published, for copies that got past the base,
+// which forgets the numbers it saw when it is reset
+Arpa_Dedup dedup;
+
+// Messages not yet acknowledged by the MQTT server, kept across outages and resets
+Arpa_Outbox outbox;
+uint8_t outboxMsg[ARPA_OUTBOX_MAX_LENGTH];
+uint8_t batch[MQTT_BATCH_MAX_LENGTH];
+char batchTopic[16]; // BATCH_TOPIC of this base
+// Bytes the messages not published yet take in a batch (1 for none), and when the first of them was queued
+uint16_t batchBytes = 1;
+unsigned long batchSince = 0;
+// Readable summaries of the messages of the next batch, for the Particle cloud
+String batchSummary;
+// PUBLISHes of outbox messages waiting for their PUBACK, oldest first. Each has the messages
+// first to last, which follow the ones of the PUBLISH before it.
+struct OutboxPublish
+{
+  uint16_t id;
+  uint32_t first;
+  uint32_t last;
+  bool sent;  // on this connection
+  bool acked;
+};
+OutboxPublish inFlight[MQTT_MAX_INFLIGHT];
+uint8_t inFlightCount = 0;
+int16_t publish_outbox(uint32_t first, uint32_t end, bool dup, OutboxPublish &publish);
+unsigned long lastConnectTry = 0;
+
+// Frames from the base, read on a thread of their own and handled in loop()
+Arpa_LinkReceiver baseReceiver;
+Arpa_link_frame baseFrameIn;
+
+// Device OS calls this for the buffers of Serial1 instead of using its 64 byte ones
+hal_usart_buffer_config_t acquireSerial1Buffer()
+{
+  hal_usart_buffer_config_t config = {
+      .size = sizeof(hal_usart_buffer_config_t),
+      .rx_buffer = new (std::nothrow) uint8_t[BASE_UART_RX_BUFFER],
+      .rx_buffer_size = BASE_UART_RX_BUFFER,
+      .tx_buffer = new (std::nothrow) uint8_t[BASE_UART_TX_BUFFER],
+      .tx_buffer_size = BASE_UART_TX_BUFFER};
+  return config;
+}
 
 void setup()
 {
@@ -37,6 +141,8 @@ void setup()
   // Setup pins
   pinMode(led, OUTPUT);
   Serial1.begin(BASE_UART_BAUD);
+  if (!baseReceiver.Begin(Serial1))
+    Log.info("Could not start reading the base");
 
   // Configure sleep - keep usart on
   // so no data from the base is missed
@@ -48,86 +154,73 @@ void setup()
       .network(NETWORK_INTERFACE_CELLULAR, SystemSleepNetworkFlag::INACTIVE_STANDBY);
 
   Log.info("Starting");
-  // connect to the server
-  Log.info("Connecting to mqtt server");
-  mqtt_connect();
+  if (outbox.Begin())
+    Log.info("Outbox has %u messages to publish", outbox.GetCount());
+  else
+    Log.info("Could not open %s, messages are dropped while MQTT is down", ARPA_OUTBOX_FILE);
+  // Left from before the reset, they go right away
+  if (outbox.GetCount() > 0)
+    batchBytes = MQTT_BATCH_MAX_LENGTH;
+  sprintf(batchTopic, BATCH_TOPIC, BASE_NUM);
+  client.addQosCallback(puback);
 
-  // publish/subscribe
-  if (client.isConnected())
+  // connect to the server, one try so the base is read from the start,
+  // send_outbox() keeps trying from loop() if it fails
+  Log.info("Connecting to mqtt server");
+  lastConnectTry = millis();
+  if (Cellular.ready() && mqtt_try_connect())
   {
     Log.info("Connected to mqtt server");
     client.publish("apra/init", "apra_boron_1");
   }
+  else
+    Log.info("MQTT Couldn't connect");
 }
 
-char msg[512]; // Oversize the buffer
+char msg[ARPA_LINK_MAX_PAYLOAD + sizeof(BASE_ID)];
 char topic[16];
-uint8_t nodeId = 0;
 
-int idx = 0;
-char uart_char = '\0';
-bool start = true;
-bool publish = false;
+// Frame being written to the base
+uint8_t baseFrame[ARPA_LINK_MAX_ENCODED];
+uint32_t baseErrors = 0;
 
 void loop()
 {
-  // Read data from base (if there is any)
-  while (Serial1.available() > 0)
+  // Frames from the base (if there are any)
+  while (baseReceiver.Take(baseFrameIn))
   {
-    uart_char = Serial1.read();
-
-    Log.info("%c", uart_char);
-    if (start)
-    {
-      // very first byte is the nodeId
-      // don't put into message buffer
-      nodeId = uart_char;
-      start = false;
-    }
-    else if (uart_char == ';')
-    {
-      // Terminator to message - time to publish
-      start = true;
-      publish = true;
-      Log.info("Found serial terminator");
-    }
-    else if (idx >= 512 - 2)
-    {
-      // If no terminator has been found yet,
-      // then publish what we have but don't look
-      // for a new nodeId
-      publish = true;
-      msg[idx++] = uart_char;
-    }
+    uint8_t nodeId = baseFrameIn.node;
+    const uint8_t *payload = baseFrameIn.payload;
+    uint8_t len = baseFrameIn.len;
+    if (baseFrameIn.type == ARPA_LINK_CHUNK_REQ)
+      send_chunk(payload, len);
+    else if (baseFrameIn.type != ARPA_LINK_DATA)
+      Log.info("Frame of type %u from the base not expected, dropped", baseFrameIn.type);
+    else if (Arpa_PayloadReader::IsBinary(payload, len))
+      publish_binary(nodeId, payload + ARPA_PAYLOAD_HEADER_LENGTH, len - ARPA_PAYLOAD_HEADER_LENGTH);
     else
     {
-      msg[idx++] = uart_char;
-    }
-
-    if (publish)
-    {
-      // Null terminate then send the message
-      // Reset and get ready to receive again
-      msg[idx] = '\0';
+      // Text from the old nodes, with the base ID behind it
+      memcpy(msg, payload, len);
+      msg[len] = '\0';
       strcat(msg, BASE_ID);
 
-      sprintf(topic, TOPIC, nodeId);
-      Particle.publish(String::format(TOPIC, nodeId), String(msg));
-      mqtt_publish(topic, msg);
-
-      memset(msg, '\0', 512);
-      memset(topic, '\0', 16);
-      idx = 0;
-
-      publish = false;
+      cloud_summary(nodeId, String(msg));
+      mqtt_publish(nodeId, (uint8_t *)msg, strlen(msg));
     }
   }
+  if (baseReceiver.GetErrorCount() != baseErrors)
+  {
+    baseErrors = baseReceiver.GetErrorCount();
+    Log.info("Bad frame from the base, %lu so far", (unsigned long)baseErrors);
+  }
 
   // mqtt connection items
   if (client.isConnected())
   {
     client.loop();
   }
+  send_outbox();
 
   // Sleep if there is no serial available
   if (Serial1.available() <= 0)
@@ -139,63 +232,386 @@ void loop()
 }
 
 // recieve message
+// Commands are handed to the base in ARPA_LINK_CMD frames,
+// it queues them until the node sends something
 void callback(char *topic, uint8_t *payload, unsigned int length)
 {
+  if (strcmp(topic, FW_TOPIC) == 0)
+  {
+    take_firmware_part(payload, length);
+    return;
+  }
+
+  if (strncmp(topic, CMD_TOPIC_PREFIX, strlen(CMD_TOPIC_PREFIX)) != 0)
+    return;
+
+  int node = atoi(topic + strlen(CMD_TOPIC_PREFIX));
+  if (node <= 0 || node > 254 || length == 0 || length > CMD_MAX_LENGTH ||
+      !Arpa_PayloadReader::IsBinary(payload, length))
+  {
+    Log.info("Command on %s not as expected, dropped", topic);
+    return;
+  }
+
+  Log.info("Command of %u bytes for node %d", length, node);
+  Arpa_LinkWriter writer;
+  writer.Begin(baseFrame, ARPA_LINK_CMD, node, length);
+  writer.Add(payload, length);
+  Serial1.write(baseFrame, writer.End());
+
   digitalWrite(led, HIGH);
-  delay(250);
-  digitalWrite(led, LOW);
-  delay(250);
-  digitalWrite(led, HIGH);
-  delay(250);
+  delay(50);
   digitalWrite(led, LOW);
-  delay(250);
 }
 
-void mqtt_publish(char *topic, char *msg)
+// Writes a part of an update image into FW_FILE.
+// A part of another version or length starts the image over.
+void take_firmware_part(const uint8_t *payload, unsigned int length)
 {
-  Log.info("mqtt_publish called.");
-  connect_celluar();
-  if (!client.isConnected())
+  if (length <= FW_PART_HEADER_LENGTH)
+    return;
+  uint16_t version = read_le(payload, 2);
+  uint32_t imageLength = read_le(payload + 2, 4);
+  uint32_t offset = read_le(payload + 6, 4);
+  unsigned int partLength = length - FW_PART_HEADER_LENGTH;
+
+  if (version == 0 || imageLength > FW_MAX_LENGTH || offset % FW_PART_LENGTH != 0 ||
+      partLength > FW_PART_LENGTH || offset + partLength > imageLength)
+  {
+    Log.info("Firmware part not as expected, dropped");
+    return;
+  }
+
+  int fd;
+  if (version != fwVersion || imageLength != fwLength)
+  {
+    Log.info("Receiving firmware version %u, %lu bytes", version, (unsigned long)imageLength);
+    fwVersion = version;
+    fwLength = imageLength;
+    memset(fwParts, 0, sizeof(fwParts));
+    fd = open(FW_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+  else
+    fd = open(FW_FILE, O_WRONLY | O_CREAT, 0644);
+  if (fd < 0)
+  {
+    Log.info("Could not open %s", FW_FILE);
+    return;
+  }
+
+  bool written = lseek(fd, offset, SEEK_SET) == (off_t)offset &&
+                 write(fd, payload + FW_PART_HEADER_LENGTH, partLength) == (int)partLength;
+  close(fd);
+  if (written)
+    fwParts[offset / FW_PART_LENGTH / 8] |= 1 << (offset / FW_PART_LENGTH % 8);
+}
+
+// Answers a chunk request of the base, the reply is laid out like an ARPA_TYPE_ID_UPDATE
+// reply and goes in an ARPA_LINK_CHUNK frame
+void send_chunk(const uint8_t *request, uint8_t len)
+{
+  if (len < CHUNK_REQ_LENGTH)
+    return;
+  uint16_t version = read_le(request, 2);
+  uint32_t offset = read_le(request + 2, 4);
+  uint32_t chunkLen = min((uint32_t)request[6], (uint32_t)CHUNK_MAX_LENGTH);
+
+  uint8_t reply[CHUNK_HEADER_LENGTH + CHUNK_MAX_LENGTH];
+  uint8_t status = CHUNK_OK;
+  if (version != fwVersion || offset >= fwLength)
+    status = CHUNK_NONE;
+  else
+  {
+    chunkLen = min(chunkLen, fwLength - offset);
+    for (uint32_t part = offset / FW_PART_LENGTH; part <= (offset + chunkLen - 1) / FW_PART_LENGTH; ++part)
+    {
+      if (!(fwParts[part / 8] & (1 << (part % 8))))
+        status = CHUNK_BUSY;
+    }
+  }
+
+  if (status == CHUNK_OK)
+  {
+    int fd = open(FW_FILE, O_RDONLY);
+    if (fd < 0 || lseek(fd, offset, SEEK_SET) != (off_t)offset ||
+        read(fd, reply + CHUNK_HEADER_LENGTH, chunkLen) != (int)chunkLen)
+      status = CHUNK_BUSY;
+    if (fd >= 0)
+      close(fd);
+  }
+  if (status != CHUNK_OK)
+  {
+    Log.info("Chunk %lu of version %u not here, status %u", (unsigned long)offset, version, status);
+    chunkLen = 0;
+  }
+
+  // [status][version 2][offset 4][CRC-16 2], version and offset as asked for
+  uint16_t crc = Arpa_Crc16(reply + CHUNK_HEADER_LENGTH, chunkLen);
+  reply[0] = status;
+  memcpy(reply + 1, request, 6);
+  reply[7] = (uint8_t)crc;
+  reply[8] = (uint8_t)(crc >> 8);
+
+  Arpa_LinkWriter writer;
+  writer.Begin(baseFrame, ARPA_LINK_CHUNK, 0, CHUNK_HEADER_LENGTH + chunkLen);
+  writer.Add(reply, CHUNK_HEADER_LENGTH + chunkLen);
+  Serial1.write(baseFrame, writer.End());
+}
+
+uint32_t read_le(const uint8_t *data, uint8_t len)
+{
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < len; ++i)
+    value |= (uint32_t)data[i] << (8 * i);
+  return value;
+}
+
+// Publish a binary payload (Arpa_Payload.h) from a node.
+// The base and the time it got here are put in front of the readings, and a
+// readable summary goes to the Particle cloud.
+void publish_binary(uint8_t nodeId, const uint8_t *records, uint8_t len)
+{
+  uint8_t payload[255];
+  Arpa_PayloadWriter writer(payload, sizeof(payload));
+  uint8_t baseId = BASE_NUM;
+  writer.AddRecord(ARPA_TLV_BASE, &baseId, 1);
+  if (Time.isValid())
+  {
+    uint32_t now = Time.now();
+    uint8_t time[4] = {(uint8_t)now, (uint8_t)(now >> 8), (uint8_t)(now >> 16), (uint8_t)(now >> 24)};
+    writer.AddRecord(ARPA_TLV_TIME, time, 4);
+  }
+  if (!writer.AddRecords(records, len))
+  {
+    Log.info("Binary payload from %d too long, dropped", nodeId);
+    return;
+  }
+
+  String summary;
+  Arpa_PayloadReader reader(payload, writer.GetLength());
+  Arpa_reading reading;
+  bool first = true;
+  while (reader.NextReading(reading))
   {
-    mqtt_connect();
+    // The base puts the sequence record in front of the node's records
+    if (first && reading.sequence >= 0 && dedup.IsDuplicate(nodeId, reading.sequence, millis()))
+    {
+      Log.info("Dropping a copy from %d seq %d", nodeId, reading.sequence);
+      return;
+    }
+    first = false;
+    const char *name = Arpa_PayloadReader::TypeName(reading.type);
+    summary += String::format("%s=%ld;", name ? name : "unknown", (long)reading.value);
   }
-  Log.info("Publishing topic: %s\tmsg:%s", topic, msg);
-  client.publish(topic, msg);
+
+  cloud_summary(nodeId, summary);
+  mqtt_publish(nodeId, payload, writer.GetLength());
 }
 
-void mqtt_connect()
+// Sends a readable summary of a message to the Particle cloud, with the next batch when batching
+void cloud_summary(uint8_t nodeId, const String &summary)
 {
-  for (auto tries = 0; tries < 10; ++tries)
+  if (MQTT_BATCH_WINDOW == 0)
   {
-    if (client.connect(MQTT_DEVICE_NAME, MQTT_USER, MQTT_PASS))
+    if (Particle.connected())
+      Particle.publish(String::format(TOPIC, nodeId), summary, NO_ACK);
+    return;
+  }
+  String line = String::format("%d:", nodeId) + summary + " ";
+  if (batchSummary.length() + line.length() <= CLOUD_SUMMARY_MAX_LENGTH)
+    batchSummary += line;
+}
+
+// Queues a message of a node for arpa/msg/<node>, send_outbox() publishes it
+void mqtt_publish(uint8_t nodeId, const uint8_t *payload, unsigned int len)
+{
+  if (len > ARPA_OUTBOX_MAX_LENGTH)
+  {
+    Log.info("Message from %d too long for the outbox, cut to %u bytes", nodeId, ARPA_OUTBOX_MAX_LENGTH);
+    len = ARPA_OUTBOX_MAX_LENGTH;
+  }
+  if (batchBytes <= 1)
+  {
+    batchSince = millis();
+    batchBytes = 1;
+  }
+  batchBytes += BATCH_RECORD_HEADER_LENGTH + len;
+  uint32_t dropped = outbox.GetDroppedCount();
+  if (!outbox.Push(nodeId, payload, len))
+    Log.info("Could not queue message from %d, dropped", nodeId);
+  else if (outbox.GetDroppedCount() != dropped)
+    Log.info("Outbox full, dropped the oldest message");
+}
+
+// Publishes the messages of the outbox, getting the network and the MQTT server back first
+// without waiting for them. Up to MQTT_MAX_INFLIGHT PUBLISHes are out at once; the MQTT
+// library sends them again until their PUBACK comes, and after a reconnect they are
+// published again from the outbox.
+void send_outbox()
+{
+  if (!Cellular.ready())
+  {
+    if (!Cellular.connecting() && millis() - lastConnectTry >= MQTT_RETRY_INTERVAL)
     {
-      Log.info("MQTT Connected");
-      Particle.publish("MQTT connected");
+      lastConnectTry = millis();
+      Log.info("Cellular is down, connecting");
+      Cellular.connect();
+    }
+    return;
+  }
+  if (!client.isConnected())
+  {
+    if (millis() - lastConnectTry < MQTT_RETRY_INTERVAL)
+      return;
+    lastConnectTry = millis();
+    if (!mqtt_try_connect())
       return;
+    // The PUBACKs still to come went with the old connection
+    for (uint8_t i = 0; i < inFlightCount; ++i)
+      inFlight[i].sent = false;
+  }
+
+  // Sent before without a PUBACK, the server may have them already, so the same messages go again
+  for (uint8_t i = 0; i < inFlightCount; ++i)
+  {
+    if (!inFlight[i].sent && !inFlight[i].acked &&
+        publish_outbox(inFlight[i].first, inFlight[i].last + 1, true, inFlight[i]) < 0)
+      return;
+  }
+
+  if (inFlightCount == MQTT_MAX_INFLIGHT || client.inflightCount() == MQTT_MAX_INFLIGHT || batchBytes <= 1)
+    return;
+  // Wait for more messages to fill the batch
+  if (MQTT_BATCH_WINDOW > 0 && millis() - batchSince < MQTT_BATCH_WINDOW && batchBytes < batch_max_length())
+    return;
+
+  // The messages behind the ones in flight, from the oldest if the outbox dropped those
+  uint32_t head;
+  uint8_t nodeId;
+  if (outbox.Peek(head, nodeId, outboxMsg) < 0)
+  {
+    batchBytes = 1;
+    return;
+  }
+  uint32_t first = head;
+  if (inFlightCount > 0 && (int32_t)(inFlight[inFlightCount - 1].last + 1 - head) > 0)
+    first = inFlight[inFlightCount - 1].last + 1;
+  if (first - head >= outbox.GetCount())
+  {
+    batchBytes = 1;
+    return;
+  }
+
+  int16_t published = publish_outbox(first, head + outbox.GetCount(), false, inFlight[inFlightCount]);
+  if (published < 0)
+    return;
+  ++inFlightCount;
+  batchBytes = batchBytes > published + 1 ? batchBytes - published : 1;
+}
+
+// Largest batch, the MQTT packets are the limit too
+uint16_t batch_max_length()
+{
+  return min((uint16_t)MQTT_BATCH_MAX_LENGTH, client.maxPayloadLength(batchTopic, MQTT::QOS1));
+}
+
+// Publishes the outbox messages from first on and before end, one on TOPIC or as many as
+// fit in a batch on BATCH_TOPIC, and fills in publish with them.
+// \return Bytes the messages take in a batch, -1 if the PUBLISH could not go
+int16_t publish_outbox(uint32_t first, uint32_t end, bool dup, OutboxPublish &publish)
+{
+  uint16_t batchMax = batch_max_length();
+  uint8_t nodeId;
+  int16_t len = outbox.Read(first, nodeId, outboxMsg);
+  if (len >= 0 && (MQTT_BATCH_WINDOW == 0 || 1 + BATCH_RECORD_HEADER_LENGTH + len > batchMax))
+  {
+    sprintf(topic, TOPIC, nodeId);
+    Log.info("Publishing topic: %s\t%d bytes, %u in the outbox", topic, len, outbox.GetCount());
+    bool sent = client.publish(topic, outboxMsg, len, MQTT::QOS1, dup, &publish.id);
+    memset(topic, '\0', 16);
+    if (!sent)
+      return -1;
+    publish.first = publish.last = first;
+    publish.sent = true;
+    publish.acked = false;
+    return BATCH_RECORD_HEADER_LENGTH + len;
+  }
+
+  uint16_t batchLen = 0;
+  uint8_t count = 0;
+  uint32_t last = first;
+  batch[batchLen++] = BATCH_VERSION;
+  for (uint32_t next = first; next != end; ++next)
+  {
+    if (next != first)
+    {
+      // Without batches only a corrupt slot gets here, it is taken out with an empty one
+      if (MQTT_BATCH_WINDOW == 0)
+        break;
+      len = outbox.Read(next, nodeId, outboxMsg);
     }
-    else
+    // A corrupt slot is taken out with the batch
+    if (len < 0)
     {
-      Log.info("MQTT Couldn't connect");
-      RGB.control(true);
-      RGB.color(255, 0, 0);
-      RGB.brightness(128);
-      delay(500);
-      RGB.control(false);
-      delay(500);
+      last = next;
+      continue;
     }
+    if (batchLen + BATCH_RECORD_HEADER_LENGTH + len > batchMax)
+      break;
+    batch[batchLen++] = nodeId;
+    batch[batchLen++] = (uint8_t)len;
+    batch[batchLen++] = (uint8_t)(len >> 8);
+    memcpy(batch + batchLen, outboxMsg, len);
+    batchLen += len;
+    last = next;
+    ++count;
+  }
+
+  Log.info("Publishing topic: %s\t%u messages in %u bytes, %u in the outbox", batchTopic, count, batchLen, outbox.GetCount());
+  if (!client.publish(batchTopic, batch, batchLen, MQTT::QOS1, dup, &publish.id))
+    return -1;
+  publish.first = first;
+  publish.last = last;
+  publish.sent = true;
+  publish.acked = false;
+  if (!dup && batchSummary.length() > 0 && Particle.connected())
+  {
+    Particle.publish(batchTopic, batchSummary, NO_ACK);
+    batchSummary = "";
   }
-  Particle.publish("MQTT could not connect after 10 tries.");
+  return batchLen - 1;
 }
 
-void connect_celluar()
+// PUBACK of a message or batch. Messages leave the outbox oldest first, so the ones of a
+// PUBLISH go once the PUBLISHes before it were acknowledged too.
+void puback(unsigned int messageId)
 {
-  Log.info("Making sure celluar is connected");
-  while (!Cellular.ready())
+  for (uint8_t i = 0; i < inFlightCount; ++i)
   {
-    Cellular.connect();
-    while (Cellular.connecting())
+    if (inFlight[i].sent && !inFlight[i].acked && inFlight[i].id == messageId)
     {
-      delay(1);
+      inFlight[i].acked = true;
+      break;
     }
   }
+  uint8_t done = 0;
+  while (done < inFlightCount && inFlight[done].acked)
+    ++done;
+  if (done == 0)
+    return;
+  outbox.Pop(inFlight[done - 1].last);
+  memmove(inFlight, inFlight + done, (inFlightCount - done) * sizeof(OutboxPublish));
+  inFlightCount -= done;
+}
+
+bool mqtt_try_connect()
+{
+  if (!client.connect(MQTT_DEVICE_NAME, MQTT_USER, MQTT_PASS))
+    return false;
+  Log.info("MQTT Connected");
+  client.subscribe(CMD_TOPIC);
+  client.subscribe(FW_TOPIC);
+  if (Particle.connected())
+    Particle.publish("MQTT connected", NO_ACK);
+  return true;
 }
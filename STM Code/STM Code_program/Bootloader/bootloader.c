@@ -0,0 +1,173 @@
+/*
+ * ARPA-E Project bootloader, installs firmware updates fetched over LoRa.
+ *
+ * Microcontroller: STM32L051K8T6 (64 KB flash, 128 byte pages, one bank)
+ *
+ * Flash layout, see FIRMWARE_ADDRESS in Combined.ino:
+ *   0x08000000  4 KB   this bootloader
+ *   0x08001000  30 KB  firmware, linked at this address with VECT_TAB_OFFSET=0x1000
+ *   0x08008800  30 KB  staging area Arpa_Update builds updates in
+ *
+ * After a reset it checks the update flag the firmware sets in EEPROM
+ * (Configuration::SetEEPromUpdateReady()). If the staged firmware matches the
+ * CRC-32 next to the flag, it is copied over the firmware, checked again and the
+ * flag cleared. Power lost during the copy leaves the flag set, so the copy starts
+ * over at the next reset. A staging area that does not match is dropped and the old
+ * firmware started.
+ *
+ * Registers only, no HAL, so it fits its 4 KB:
+ *   arm-none-eabi-gcc -mcpu=cortex-m0plus -mthumb -Os -nostdlib -ffreestanding
+ *     -Wl,--section-start=.vectors=0x08000000 -Wl,-Ttext=0x08000040 -Wl,--entry=Reset
+ *     bootloader.c -o bootloader.elf
+ */
+#include <stdint.h>
+
+#define FIRMWARE_ADDRESS 0x08001000UL
+#define STAGING_ADDRESS 0x08008800UL
+#define FIRMWARE_MAX_SIZE 0x7800UL
+#define PAGE_SIZE 128UL
+#define RAM_START 0x20000000UL
+#define RAM_END 0x20002000UL
+
+// Keep in step with EEPROM_UpdateReadyOffset in Configuration.h: [flag][size 4][CRC-32 4]
+#define EEPROM_ADDRESS 0x08080000UL
+#define EEPROM_UPDATE_READY_OFFSET 16
+#define EEPROM_UPDATE_READY_FLAG 0xA5
+
+// Flash interface, RM0377 section 3.7
+#define FLASH_BASE_ADDRESS 0x40022000UL
+#define FLASH_PECR (*(volatile uint32_t *)(FLASH_BASE_ADDRESS + 0x04))
+#define FLASH_PEKEYR (*(volatile uint32_t *)(FLASH_BASE_ADDRESS + 0x0C))
+#define FLASH_PRGKEYR (*(volatile uint32_t *)(FLASH_BASE_ADDRESS + 0x10))
+#define FLASH_SR (*(volatile uint32_t *)(FLASH_BASE_ADDRESS + 0x18))
+#define FLASH_PEKEY1 0x89ABCDEFUL
+#define FLASH_PEKEY2 0x02030405UL
+#define FLASH_PRGKEY1 0x8C9DAEBFUL
+#define FLASH_PRGKEY2 0x13141516UL
+#define FLASH_PECR_PELOCK (1UL << 0)
+#define FLASH_PECR_PRGLOCK (1UL << 1)
+#define FLASH_PECR_PROG (1UL << 3)
+#define FLASH_PECR_ERASE (1UL << 9)
+#define FLASH_SR_BSY (1UL << 0)
+// WRPERR, PGAERR, SIZERR, NOTZEROERR, cleared by writing 1
+#define FLASH_SR_ERRORS ((1UL << 8) | (1UL << 9) | (1UL << 10) | (1UL << 16))
+
+#define SCB_VTOR (*(volatile uint32_t *)0xE000ED08UL)
+#define SCB_AIRCR (*(volatile uint32_t *)0xE000ED0CUL)
+#define SCB_AIRCR_RESET (0x05FA0000UL | (1UL << 2))
+
+void Reset(void);
+
+// Only the stack and reset vectors, the bootloader runs without interrupts
+__attribute__((section(".vectors"), used)) static void (*const vectors[2])(void) = {(void (*)(void))RAM_END, Reset};
+
+static uint32_t ReadEEPromWord(const uint32_t offset)
+{
+  const volatile uint8_t *eeprom = (const volatile uint8_t *)(EEPROM_ADDRESS + offset);
+  return eeprom[0] | (uint32_t)eeprom[1] << 8 | (uint32_t)eeprom[2] << 16 | (uint32_t)eeprom[3] << 24;
+}
+
+// Same as Arpa_Crc32() of the firmware
+static uint32_t Crc32(const uint8_t *data, uint32_t len)
+{
+  uint32_t crc = 0xFFFFFFFFUL;
+  while (len-- > 0)
+  {
+    crc ^= *data++;
+    for (uint8_t bit = 0; bit < 8; ++bit)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320UL : crc >> 1;
+  }
+  return ~crc;
+}
+
+static int WaitForFlash(void)
+{
+  while (FLASH_SR & FLASH_SR_BSY)
+    ;
+  if (FLASH_SR & FLASH_SR_ERRORS)
+  {
+    FLASH_SR = FLASH_SR_ERRORS;
+    return 0;
+  }
+  return 1;
+}
+
+static void Unlock(void)
+{
+  // PELOCK opens the data EEPROM too, PRGLOCK the program memory behind it
+  FLASH_PEKEYR = FLASH_PEKEY1;
+  FLASH_PEKEYR = FLASH_PEKEY2;
+  FLASH_PRGKEYR = FLASH_PRGKEY1;
+  FLASH_PRGKEYR = FLASH_PRGKEY2;
+}
+
+static void Lock(void)
+{
+  FLASH_PECR |= FLASH_PECR_PRGLOCK | FLASH_PECR_PELOCK;
+}
+
+static int ErasePage(const uint32_t address)
+{
+  FLASH_PECR |= FLASH_PECR_ERASE | FLASH_PECR_PROG;
+  *(volatile uint32_t *)address = 0;
+  int erased = WaitForFlash();
+  FLASH_PECR &= ~(FLASH_PECR_ERASE | FLASH_PECR_PROG);
+  return erased;
+}
+
+static int Copy(const uint32_t size)
+{
+  for (uint32_t offset = 0; offset < size; offset += 4)
+  {
+    if (offset % PAGE_SIZE == 0 && !ErasePage(FIRMWARE_ADDRESS + offset))
+      return 0;
+    *(volatile uint32_t *)(FIRMWARE_ADDRESS + offset) = *(const uint32_t *)(STAGING_ADDRESS + offset);
+    if (!WaitForFlash())
+      return 0;
+  }
+  return 1;
+}
+
+static void ClearUpdateFlag(void)
+{
+  *(volatile uint8_t *)(EEPROM_ADDRESS + EEPROM_UPDATE_READY_OFFSET) = 0;
+  WaitForFlash();
+}
+
+static void InstallUpdate(void)
+{
+  uint32_t size = ReadEEPromWord(EEPROM_UPDATE_READY_OFFSET + 1);
+  uint32_t crc = ReadEEPromWord(EEPROM_UPDATE_READY_OFFSET + 5);
+
+  Unlock();
+  if (size > 0 && size <= FIRMWARE_MAX_SIZE && Crc32((const uint8_t *)STAGING_ADDRESS, size) == crc)
+  {
+    // A failed copy is tried again at the next reset, the staging area is still good
+    if (!Copy(size) || Crc32((const uint8_t *)FIRMWARE_ADDRESS, size) != crc)
+    {
+      Lock();
+      SCB_AIRCR = SCB_AIRCR_RESET;
+      while (1)
+        ;
+    }
+  }
+  ClearUpdateFlag();
+  Lock();
+}
+
+void Reset(void)
+{
+  if (*(const volatile uint8_t *)(EEPROM_ADDRESS + EEPROM_UPDATE_READY_OFFSET) == EEPROM_UPDATE_READY_FLAG)
+    InstallUpdate();
+
+  // Nothing to start without a stack pointer into the RAM
+  uint32_t stack = *(const uint32_t *)FIRMWARE_ADDRESS;
+  uint32_t entry = *(const uint32_t *)(FIRMWARE_ADDRESS + 4);
+  if (stack <= RAM_START || stack > RAM_END)
+    while (1)
+      ;
+
+  SCB_VTOR = FIRMWARE_ADDRESS;
+  __asm volatile("msr msp, %0" : : "r"(stack));
+  ((void (*)(void))entry)();
+}
@@ -0,0 +1,26 @@
+#include "Arpa_Crc.h"
+
+// Bit by bit, the tables would cost 1.5 KB of the 64 KB flash of the nodes
+
+uint16_t Arpa_Crc16(const uint8_t *data, const uint16_t len, uint16_t crc)
+{
+  for (uint16_t i = 0; i < len; ++i)
+  {
+    crc ^= (uint16_t)data[i] << 8;
+    for (uint8_t bit = 0; bit < 8; ++bit)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+uint32_t Arpa_Crc32(const uint8_t *data, const uint32_t len, uint32_t crc)
+{
+  crc = ~crc;
+  for (uint32_t i = 0; i < len; ++i)
+  {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; ++bit)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320UL : crc >> 1;
+  }
+  return ~crc;
+}
@@ -0,0 +1,263 @@
+#include "Arpa_EventLog.h"
+#include "Arpa_Crc.h"
+#include <Arduino.h>
+
+Arpa_EventLog eventLog;
+
+void Arpa_EventLog::SetClock(uint32_t (*clock)())
+{
+  this->clock = clock;
+}
+
+void Arpa_EventLog::Add(const Arpa_event_id id, const uint16_t a, const uint16_t b, const uint16_t c)
+{
+  if (this->count == ARPA_EVENT_LOG_SIZE)
+  {
+    this->head = (this->head + 1) % ARPA_EVENT_LOG_SIZE;
+    --this->count;
+    if (this->lost < UINT16_MAX)
+      ++this->lost;
+  }
+
+  Arpa_event &event = this->events[(this->head + this->count) % ARPA_EVENT_LOG_SIZE];
+  event.time = this->clock ? this->clock() : millis();
+  event.args[0] = a;
+  event.args[1] = b;
+  event.args[2] = c;
+  event.id = id;
+  ++this->count;
+}
+
+uint8_t Arpa_EventLog::Drain()
+{
+  uint8_t frame[ARPA_EVENT_FRAME_LENGTH];
+  uint8_t written = 0;
+  while (Serial.availableForWrite() >= ARPA_EVENT_FRAME_LENGTH && this->Take(frame))
+  {
+    Serial.write(frame, ARPA_EVENT_FRAME_LENGTH);
+    ++written;
+  }
+  return written;
+}
+
+bool Arpa_EventLog::Take(uint8_t *frame)
+{
+  Arpa_event event;
+  if (this->lost > 0)
+  {
+    // Goes out in place of the events that were overwritten
+    event.time = this->clock ? this->clock() : millis();
+    event.args[0] = this->lost;
+    event.args[1] = event.args[2] = 0;
+    event.id = ARPA_EV_LOG_LOST;
+    this->lost = 0;
+  }
+  else if (this->count > 0)
+  {
+    event = this->events[this->head];
+    this->head = (this->head + 1) % ARPA_EVENT_LOG_SIZE;
+    --this->count;
+  }
+  else
+    return false;
+
+  frame[ARPA_EVENT_SYNC_BYTE_POS] = ARPA_EVENT_SYNC;
+  frame[ARPA_EVENT_ID_BYTE_POS] = event.id;
+  for (uint8_t i = 0; i < 4; ++i)
+    frame[ARPA_EVENT_TIME_BYTE_POS + i] = (uint8_t)(event.time >> (8 * i));
+  for (uint8_t i = 0; i < 3; ++i)
+  {
+    frame[ARPA_EVENT_ARGS_BYTE_POS + 2 * i] = (uint8_t)event.args[i];
+    frame[ARPA_EVENT_ARGS_BYTE_POS + 2 * i + 1] = (uint8_t)(event.args[i] >> 8);
+  }
+  uint16_t crc = Arpa_Crc16(frame + ARPA_EVENT_ID_BYTE_POS, ARPA_EVENT_CRC_BYTE_POS - ARPA_EVENT_ID_BYTE_POS);
+  frame[ARPA_EVENT_CRC_BYTE_POS] = (uint8_t)crc;
+  frame[ARPA_EVENT_CRC_BYTE_POS + 1] = (uint8_t)(crc >> 8);
+  return true;
+}
+
+uint8_t Arpa_EventLog::GetCount() const
+{
+  return this->count;
+}
+
+const char *Arpa_EventLog::Name(const Arpa_event_id id)
+{
+  switch (id)
+  {
+  case ARPA_EV_INVALID:
+    return "INVALID";
+  case ARPA_EV_RADIO_INIT_OK:
+    return "RADIO_INIT_OK";
+  case ARPA_EV_RADIO_INIT_FAILED:
+    return "RADIO_INIT_FAILED";
+  case ARPA_EV_RADIO_FREQ_FAILED:
+    return "RADIO_FREQ_FAILED";
+  case ARPA_EV_RADIO_CONFIG_LOST:
+    return "RADIO_CONFIG_LOST";
+  case ARPA_EV_DATA_RATE_SET:
+    return "DATA_RATE_SET";
+  case ARPA_EV_CHANNEL_BUSY:
+    return "CHANNEL_BUSY";
+  case ARPA_EV_CHANNEL_BUSY_SEND:
+    return "CHANNEL_BUSY_SEND";
+  case ARPA_EV_CHANNEL_ACTIVE:
+    return "CHANNEL_ACTIVE";
+  case ARPA_EV_SEND:
+    return "SEND";
+  case ARPA_EV_SEND_FAILED:
+    return "SEND_FAILED";
+  case ARPA_EV_SEND_TOO_LONG:
+    return "SEND_TOO_LONG";
+  case ARPA_EV_DATA_RATE_FALLBACK:
+    return "DATA_RATE_FALLBACK";
+  case ARPA_EV_ONESHOT_SEND:
+    return "ONESHOT_SEND";
+  case ARPA_EV_RECV:
+    return "RECV";
+  case ARPA_EV_RECV_MSG:
+    return "RECV_MSG";
+  case ARPA_EV_RECV_SHORT:
+    return "RECV_SHORT";
+  case ARPA_EV_RECV_TIMEOUT:
+    return "RECV_TIMEOUT";
+  case ARPA_EV_RECV_NOT_RELEASED:
+    return "RECV_NOT_RELEASED";
+  case ARPA_EV_BATCH:
+    return "BATCH";
+  case ARPA_EV_BATCH_CUT:
+    return "BATCH_CUT";
+  case ARPA_EV_ONESHOT:
+    return "ONESHOT";
+  case ARPA_EV_DUPLICATE:
+    return "DUPLICATE";
+  case ARPA_EV_SYN_SEND:
+    return "SYN_SEND";
+  case ARPA_EV_SYN_FAILED:
+    return "SYN_FAILED";
+  case ARPA_EV_SYN_NACK:
+    return "SYN_NACK";
+  case ARPA_EV_SYN_TIMEOUT:
+    return "SYN_TIMEOUT";
+  case ARPA_EV_FIN_SEND:
+    return "FIN_SEND";
+  case ARPA_EV_FIN_FAILED:
+    return "FIN_FAILED";
+  case ARPA_EV_SYN_RECV:
+    return "SYN_RECV";
+  case ARPA_EV_SYN_UNEXPECTED:
+    return "SYN_UNEXPECTED";
+  case ARPA_EV_NO_CONNECTION:
+    return "NO_CONNECTION";
+  case ARPA_EV_NOT_CONNECTED:
+    return "NOT_CONNECTED";
+  case ARPA_EV_FIN_RECV:
+    return "FIN_RECV";
+  case ARPA_EV_CONN_TIMEOUT:
+    return "CONN_TIMEOUT";
+  case ARPA_EV_CONN_INVALID:
+    return "CONN_INVALID";
+  case ARPA_EV_SESSION_FULL:
+    return "SESSION_FULL";
+  case ARPA_EV_SESSION_TIMEOUT:
+    return "SESSION_TIMEOUT";
+  case ARPA_EV_ROUTE_REQUEST:
+    return "ROUTE_REQUEST";
+  case ARPA_EV_ROUTE_NONE:
+    return "ROUTE_NONE";
+  case ARPA_EV_ROUTE_FOUND:
+    return "ROUTE_FOUND";
+  case ARPA_EV_ROUTE_TIMEOUT:
+    return "ROUTE_TIMEOUT";
+  case ARPA_EV_FORWARD_FAILED:
+    return "FORWARD_FAILED";
+  case ARPA_EV_FORWARD_TTL:
+    return "FORWARD_TTL";
+  case ARPA_EV_FORWARD_QUEUE_FULL:
+    return "FORWARD_QUEUE_FULL";
+  case ARPA_EV_NEXT_HOP_LOST:
+    return "NEXT_HOP_LOST";
+  case ARPA_EV_BEACON_WAIT:
+    return "BEACON_WAIT";
+  case ARPA_EV_SLOT_OFFSET:
+    return "SLOT_OFFSET";
+  case ARPA_EV_DATA_RATE_REQUEST:
+    return "DATA_RATE_REQUEST";
+  case ARPA_EV_DATA_RATE_TIMEOUT:
+    return "DATA_RATE_TIMEOUT";
+  case ARPA_EV_DATA_RATE_REPLY:
+    return "DATA_RATE_REPLY";
+  case ARPA_EV_CMD_QUEUE_FULL:
+    return "CMD_QUEUE_FULL";
+  case ARPA_EV_CMD_SEND:
+    return "CMD_SEND";
+  case ARPA_EV_CMD_RECV:
+    return "CMD_RECV";
+  case ARPA_EV_CHUNK_REQUEST:
+    return "CHUNK_REQUEST";
+  case ARPA_EV_CHUNK_TIMEOUT:
+    return "CHUNK_TIMEOUT";
+  case ARPA_EV_CHUNK_CORRUPT:
+    return "CHUNK_CORRUPT";
+  case ARPA_EV_LOG_LOST:
+    return "LOG_LOST";
+  case ARPA_EV_NODE_START:
+    return "NODE_START";
+  case ARPA_EV_DATA_SENT:
+    return "DATA_SENT";
+  case ARPA_EV_DATA_RETRY:
+    return "DATA_RETRY";
+  case ARPA_EV_DATA_FAILED:
+    return "DATA_FAILED";
+  case ARPA_EV_NO_BEACON:
+    return "NO_BEACON";
+  case ARPA_EV_SYNC_OK:
+    return "SYNC_OK";
+  case ARPA_EV_SYNC_FAILED:
+    return "SYNC_FAILED";
+  case ARPA_EV_DATA_NACK:
+    return "DATA_NACK";
+  case ARPA_EV_CLOSE_OK:
+    return "CLOSE_OK";
+  case ARPA_EV_CLOSE_FAILED:
+    return "CLOSE_FAILED";
+  case ARPA_EV_CMD_SAMPLE_INTERVAL:
+    return "CMD_SAMPLE_INTERVAL";
+  case ARPA_EV_CMD_DATA_RATE:
+    return "CMD_DATA_RATE";
+  case ARPA_EV_CMD_UPDATE:
+    return "CMD_UPDATE";
+  case ARPA_EV_CMD_UNKNOWN:
+    return "CMD_UNKNOWN";
+  case ARPA_EV_UPDATE_TOO_BIG:
+    return "UPDATE_TOO_BIG";
+  case ARPA_EV_UPDATE_NOT_FOUND:
+    return "UPDATE_NOT_FOUND";
+  case ARPA_EV_UPDATE_INSTALL:
+    return "UPDATE_INSTALL";
+  case ARPA_EV_UPDATE_CRC:
+    return "UPDATE_CRC";
+  case ARPA_EV_UPDATE_WRITE:
+    return "UPDATE_WRITE";
+  case ARPA_EV_FORWARDER_START:
+    return "FORWARDER_START";
+  case ARPA_EV_BASE_START:
+    return "BASE_START";
+  case ARPA_EV_BASE_SYN:
+    return "BASE_SYN";
+  case ARPA_EV_BASE_FIN:
+    return "BASE_FIN";
+  case ARPA_EV_BASE_DATA:
+    return "BASE_DATA";
+  case ARPA_EV_BASE_UNKNOWN:
+    return "BASE_UNKNOWN";
+  case ARPA_EV_LTE_CMD_QUEUED:
+    return "LTE_CMD_QUEUED";
+  case ARPA_EV_LTE_CMD_DROPPED:
+    return "LTE_CMD_DROPPED";
+  case ARPA_EV_LTE_CHUNK_CORRUPT:
+    return "LTE_CHUNK_CORRUPT";
+  default:
+    return NULL;
+  }
+}
@@ -0,0 +1,168 @@
+#pragma once
+#include <stdint.h>
+
+// Events kept until they are drained, the oldest is dropped when the log is full
+#define ARPA_EVENT_LOG_SIZE 32
+// Every event goes out as [ARPA_EVENT_SYNC][id][time 4][a 2][b 2][c 2][CRC-16 2],
+// integers little endian, the CRC (Arpa_Crc16()) over id to c
+#define ARPA_EVENT_SYNC 0xE5
+#define ARPA_EVENT_SYNC_BYTE_POS 0
+#define ARPA_EVENT_ID_BYTE_POS 1
+#define ARPA_EVENT_TIME_BYTE_POS 2
+#define ARPA_EVENT_ARGS_BYTE_POS 6
+#define ARPA_EVENT_CRC_BYTE_POS 12
+#define ARPA_EVENT_FRAME_LENGTH 14
+
+// Things the firmware reports, in place of text on the serial port.
+//
+// The text after every id is what python/eventlog/decode_events.py prints for it, with the
+// arguments of the event in place of {a}, {b} and {c} ({a:s} for a signed one).
+// The decoder reads the texts out of this file, keep one line per id.
+// Arpa_RF95 uses 0x01 to 0x7F, the sketch (Combined.ino) 0x80 and up.
+enum Arpa_event_id : uint8_t
+{
+  ARPA_EV_INVALID = 0x00,
+  // Radio
+  ARPA_EV_RADIO_INIT_OK = 0x01,     // LoRa initialized at {a} MHz
+  ARPA_EV_RADIO_INIT_FAILED = 0x02, // LoRa radio initialization failed
+  ARPA_EV_RADIO_FREQ_FAILED = 0x03, // Setting frequency {a} MHz failed
+  ARPA_EV_RADIO_CONFIG_LOST = 0x04, // Radio configuration lost, initializing
+  ARPA_EV_DATA_RATE_SET = 0x05,     // Set SF/CR/Tx power to {a}/{b}/{c:s}
+  ARPA_EV_CHANNEL_BUSY = 0x06,      // Channel busy, backing off
+  ARPA_EV_CHANNEL_BUSY_SEND = 0x07, // Channel stayed busy, sending anyway
+  ARPA_EV_CHANNEL_ACTIVE = 0x08,    // Channel active, receiving
+  // Sending
+  ARPA_EV_SEND = 0x10,               // Sending type {a} to {b}
+  ARPA_EV_SEND_FAILED = 0x11,        // Sending datagram to {a} failed
+  ARPA_EV_SEND_TOO_LONG = 0x12,      // Message of {a} bytes is too long
+  ARPA_EV_DATA_RATE_FALLBACK = 0x13, // Falling back to the default data rate
+  ARPA_EV_ONESHOT_SEND = 0x14,       // Sending one-shot of {a} bytes, seq {b}
+  // Receiving
+  ARPA_EV_RECV = 0x18,              // Received {b} bytes from {a}
+  ARPA_EV_RECV_MSG = 0x19,          // Message type {a} from origin {b}
+  ARPA_EV_RECV_SHORT = 0x1A,        // Message from {a} shorter than the header
+  ARPA_EV_RECV_TIMEOUT = 0x1B,      // Timed out or couldn't receive data
+  ARPA_EV_RECV_NOT_RELEASED = 0x1C, // Last message was not released
+  ARPA_EV_BATCH = 0x1D,             // Received a batch of {a} bytes from {b}
+  ARPA_EV_BATCH_CUT = 0x1E,         // Batch is cut short
+  ARPA_EV_ONESHOT = 0x1F,           // One-shot from {a} seq {b}
+  ARPA_EV_DUPLICATE = 0x20,         // Dropping a copy from {a} seq {b}
+  // Connections and sessions
+  ARPA_EV_SYN_SEND = 0x28,         // Sending syn to {a}
+  ARPA_EV_SYN_FAILED = 0x29,       // Syn send failed
+  ARPA_EV_SYN_NACK = 0x2A,         // Got a NACK back
+  ARPA_EV_SYN_TIMEOUT = 0x2B,      // No syn received back
+  ARPA_EV_FIN_SEND = 0x2C,         // Sending fin to {a}
+  ARPA_EV_FIN_FAILED = 0x2D,       // Fin send failed
+  ARPA_EV_SYN_RECV = 0x2E,         // Got a syn from {a}, sending one back
+  ARPA_EV_SYN_UNEXPECTED = 0x2F,   // Got type {a} instead of a syn, sending nack
+  ARPA_EV_NO_CONNECTION = 0x30,    // No current connection, current connection id {a:s}
+  ARPA_EV_NOT_CONNECTED = 0x31,    // Received message from {a}, a not connected node
+  ARPA_EV_FIN_RECV = 0x32,         // Received fin from {a}, closing connection
+  ARPA_EV_CONN_TIMEOUT = 0x33,     // Timed out waiting for a connected message
+  ARPA_EV_CONN_INVALID = 0x34,     // Wait for message returned invalid
+  ARPA_EV_SESSION_FULL = 0x35,     // No free session for {a}, sending nack
+  ARPA_EV_SESSION_TIMEOUT = 0x36,  // Session timed out: {a}
+  // Routes and forwarding
+  ARPA_EV_ROUTE_REQUEST = 0x40,      // Sending route request
+  ARPA_EV_ROUTE_NONE = 0x41,         // No route found
+  ARPA_EV_ROUTE_FOUND = 0x42,        // Next hop {a} hops {b}
+  ARPA_EV_ROUTE_TIMEOUT = 0x43,      // Route timed out
+  ARPA_EV_FORWARD_FAILED = 0x44,     // Message from {a} could not be forwarded
+  ARPA_EV_FORWARD_TTL = 0x45,        // TTL expired, dropping message from {a}
+  ARPA_EV_FORWARD_QUEUE_FULL = 0x46, // Forward queue full, dropping oldest message
+  ARPA_EV_NEXT_HOP_LOST = 0x47,      // Next hop {a} did not answer, repairing route
+  // Slots and data rate
+  ARPA_EV_BEACON_WAIT = 0x50,        // Waiting for a time beacon
+  ARPA_EV_SLOT_OFFSET = 0x51,        // Slot offset {a} ms
+  ARPA_EV_DATA_RATE_REQUEST = 0x52,  // Sending data rate request
+  ARPA_EV_DATA_RATE_TIMEOUT = 0x53,  // No data rate received back
+  ARPA_EV_DATA_RATE_REPLY = 0x54,    // SNR {a:s} => CR 4/{b} power {c:s}
+  // Commands and updates
+  ARPA_EV_CMD_QUEUE_FULL = 0x60, // Command for {a} too long or queue full
+  ARPA_EV_CMD_SEND = 0x61,       // Sending command to {a}
+  ARPA_EV_CMD_RECV = 0x62,       // Received a command of {a} bytes
+  ARPA_EV_CHUNK_REQUEST = 0x63,  // Requesting update {a} offset {b}
+  ARPA_EV_CHUNK_TIMEOUT = 0x64,  // No chunk received back
+  ARPA_EV_CHUNK_CORRUPT = 0x65,  // Chunk is corrupt
+  // The log itself
+  ARPA_EV_LOG_LOST = 0x7F, // {a} events lost, the log was full
+  // Sensor nodes
+  ARPA_EV_NODE_START = 0x80,          // SensorNode {a} starting, firmware {b}
+  ARPA_EV_DATA_SENT = 0x81,           // Data Success! {a} bytes
+  ARPA_EV_DATA_RETRY = 0x82,          // Data message failed, looking for a route
+  ARPA_EV_DATA_FAILED = 0x83,         // Data message failed :(
+  ARPA_EV_NO_BEACON = 0x84,           // No beacon, sending unslotted
+  ARPA_EV_SYNC_OK = 0x85,             // Sync Success
+  ARPA_EV_SYNC_FAILED = 0x86,         // Could not synchronize
+  ARPA_EV_DATA_NACK = 0x87,           // Data fail - not connected to base
+  ARPA_EV_CLOSE_OK = 0x88,            // Close Success
+  ARPA_EV_CLOSE_FAILED = 0x89,        // Could not close connection
+  ARPA_EV_CMD_SAMPLE_INTERVAL = 0x90, // Command: sample interval {a}
+  ARPA_EV_CMD_DATA_RATE = 0x91,       // Command: data rate check
+  ARPA_EV_CMD_UPDATE = 0x92,          // Command: update to version {a}
+  ARPA_EV_CMD_UNKNOWN = 0x93,         // Unknown command {a}
+  ARPA_EV_UPDATE_TOO_BIG = 0x98,      // Update image does not fit this node, dropped
+  ARPA_EV_UPDATE_NOT_FOUND = 0x99,    // Update not found on the base, dropped
+  ARPA_EV_UPDATE_INSTALL = 0x9A,      // Update to version {a} fetched, installing
+  ARPA_EV_UPDATE_CRC = 0x9B,          // Update does not match its CRC, dropped
+  ARPA_EV_UPDATE_WRITE = 0x9C,        // Update could not be written to the flash, dropped
+  // Forwarders and bases
+  ARPA_EV_FORWARDER_START = 0xA0, // Forwarder {a} starting
+  ARPA_EV_BASE_START = 0xA1,      // Base {a} starting
+  ARPA_EV_BASE_SYN = 0xA2,        // Got syn from {a}, open sessions: {b}
+  ARPA_EV_BASE_FIN = 0xA3,        // Closed connection with {a}
+  ARPA_EV_BASE_DATA = 0xA4,       // Got data type {a} from {b}, {c} bytes
+  ARPA_EV_BASE_UNKNOWN = 0xA5,    // Got something, type: {a}
+  ARPA_EV_LTE_CMD_QUEUED = 0xA6,  // Queued command for {a}
+  ARPA_EV_LTE_CMD_DROPPED = 0xA7, // Command queue full, dropped command for {a}
+  ARPA_EV_LTE_CHUNK_CORRUPT = 0xA8 // Update chunk from LTE is corrupt, dropped
+};
+
+struct Arpa_event
+{
+  uint32_t time; // Milliseconds on the clock of SetClock()
+  uint16_t args[3];
+  Arpa_event_id id;
+};
+
+// RAM ring buffer of events, the binary replacement of Serial.println() tracing.
+//
+// Add() only copies a few bytes, so events cost nothing while the MCU should be asleep
+// or the radio is on. Drain() sends them later in compact frames, as many as the serial
+// port takes without waiting, and python/eventlog/decode_events.py turns them back into text.
+// A frame cut off by deep sleep fails its CRC there and is skipped.
+//
+// Arpa_log_events (Arpa_RF95.h) writes Arpa_RF95's events here, eventLog is the log of the image.
+class Arpa_EventLog
+{
+public:
+  /// Clock of the event times, millis() if none is set. Nodes use the RTC, millis() stops in deep sleep.
+  void SetClock(uint32_t (*clock)());
+
+  /// Records an event, overwriting the oldest one if the log is full
+  void Add(const Arpa_event_id id, const uint16_t a = 0, const uint16_t b = 0, const uint16_t c = 0);
+
+  /// Writes the oldest events to Serial, only as many as fit into its transmit buffer
+  /// \return Events written
+  uint8_t Drain();
+
+  /// Encodes the oldest event as a frame of ARPA_EVENT_FRAME_LENGTH bytes and removes it
+  /// \return false if the log is empty
+  bool Take(uint8_t *frame);
+
+  uint8_t GetCount() const;
+
+  /// Name of an event, for text tracing (Arpa_log_serial). NULL for unknown ids.
+  static const char *Name(const Arpa_event_id id);
+
+private:
+  Arpa_event events[ARPA_EVENT_LOG_SIZE];
+  uint8_t head, count;
+  // Events overwritten since the last Take(), reported as ARPA_EV_LOG_LOST
+  uint16_t lost;
+  uint32_t (*clock)();
+};
+
+// No constructor, the log is zeroed with the other globals and can take events before setup()
+extern Arpa_EventLog eventLog;
@@ -0,0 +1,131 @@
+#include "Arpa_Link.h"
+#include "Arpa_Crc.h"
+
+bool Arpa_LinkWriter::Begin(uint8_t *out, const Arpa_link_type type, const uint8_t node, const uint8_t len)
+{
+  if (len > ARPA_LINK_MAX_PAYLOAD)
+    return false;
+  this->out = out;
+  // A 0 in front ends whatever the receiver has from before, noise or a frame cut short
+  this->out[0] = 0;
+  this->codePos = 1;
+  this->pos = 2;
+  this->crc = 0xFFFF;
+
+  uint8_t header[ARPA_LINK_HEADER_LENGTH];
+  header[ARPA_LINK_TYPE_BYTE_POS] = type;
+  header[ARPA_LINK_NODE_BYTE_POS] = node;
+  header[ARPA_LINK_LENGTH_BYTE_POS] = len;
+  this->Add(header, ARPA_LINK_HEADER_LENGTH);
+  return true;
+}
+
+void Arpa_LinkWriter::Add(const uint8_t *data, const uint8_t len)
+{
+  this->crc = Arpa_Crc16(data, len, this->crc);
+  for (uint8_t i = 0; i < len; ++i)
+    this->Put(data[i]);
+}
+
+uint16_t Arpa_LinkWriter::End()
+{
+  uint16_t crc = this->crc;
+  this->Put((uint8_t)crc);
+  this->Put((uint8_t)(crc >> 8));
+  this->out[this->codePos] = this->pos - this->codePos;
+  this->out[this->pos++] = 0;
+  return this->pos;
+}
+
+// COBS: every block starts with its length + 1 in place of the 0 that ended it,
+// 0xFF for a block of 254 without a 0 after it
+void Arpa_LinkWriter::Put(const uint8_t byte)
+{
+  if (byte == 0)
+  {
+    this->out[this->codePos] = this->pos - this->codePos;
+    this->codePos = this->pos++;
+    return;
+  }
+  this->out[this->pos++] = byte;
+  if (this->pos - this->codePos == 0xFF)
+  {
+    this->out[this->codePos] = 0xFF;
+    this->codePos = this->pos++;
+  }
+}
+
+Arpa_LinkReader::Arpa_LinkReader()
+{
+  this->len = 0;
+  this->overflow = false;
+  this->errors = 0;
+}
+
+bool Arpa_LinkReader::Take(const uint8_t byte)
+{
+  if (byte != 0)
+  {
+    if (this->len < sizeof(this->buf))
+      this->buf[this->len++] = byte;
+    else
+      this->overflow = true;
+    return false;
+  }
+
+  // The 0 in front of a frame, or one after a frame that was too long
+  bool good = this->len > 0 && !this->overflow && this->Decode() > 0;
+  if (this->len > 0 && !good)
+    ++this->errors;
+  this->len = 0;
+  this->overflow = false;
+  return good;
+}
+
+uint16_t Arpa_LinkReader::Decode()
+{
+  uint16_t in = 0, out = 0;
+  while (in < this->len)
+  {
+    uint8_t code = this->buf[in++];
+    if (in + code - 1 > this->len)
+      return 0;
+    for (uint8_t i = 1; i < code; ++i)
+      this->buf[out++] = this->buf[in++];
+    if (code != 0xFF && in < this->len)
+      this->buf[out++] = 0;
+  }
+
+  if (out < ARPA_LINK_HEADER_LENGTH + ARPA_LINK_CRC_LENGTH ||
+      this->buf[ARPA_LINK_LENGTH_BYTE_POS] != out - ARPA_LINK_HEADER_LENGTH - ARPA_LINK_CRC_LENGTH)
+    return 0;
+  uint16_t crc = this->buf[out - 2] | this->buf[out - 1] << 8;
+  if (Arpa_Crc16(this->buf, out - ARPA_LINK_CRC_LENGTH) != crc)
+    return 0;
+  return out;
+}
+
+Arpa_link_type Arpa_LinkReader::GetType() const
+{
+  return (Arpa_link_type)this->buf[ARPA_LINK_TYPE_BYTE_POS];
+}
+
+uint8_t Arpa_LinkReader::GetNode() const
+{
+  return this->buf[ARPA_LINK_NODE_BYTE_POS];
+}
+
+const uint8_t *Arpa_LinkReader::GetPayload() const
+{
+  return this->buf + ARPA_LINK_HEADER_LENGTH;
+}
+
+uint8_t Arpa_LinkReader::GetLength() const
+{
+  return this->buf[ARPA_LINK_LENGTH_BYTE_POS];
+}
+
+uint32_t Arpa_LinkReader::GetErrorCount() const
+{
+  return this->errors;
+}
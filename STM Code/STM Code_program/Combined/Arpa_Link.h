@@ -0,0 +1,88 @@
+#pragma once
+#include <stdint.h>
+
+// Longest payload of a frame: a node message with the sequence record the base puts in front,
+// or an update chunk with its header (ARPA_MAX_MSG_LENGTH + 3 in Arpa_RF95.h)
+#define ARPA_LINK_MAX_PAYLOAD 250
+// A frame is [type][node][length][payload][CRC-16 2], the CRC (Arpa_Crc16()) over type to payload,
+// little endian. It goes on the UART COBS encoded, so it holds no 0, between two 0 bytes.
+#define ARPA_LINK_TYPE_BYTE_POS 0
+#define ARPA_LINK_NODE_BYTE_POS 1
+#define ARPA_LINK_LENGTH_BYTE_POS 2
+#define ARPA_LINK_HEADER_LENGTH 3
+#define ARPA_LINK_CRC_LENGTH 2
+#define ARPA_LINK_MAX_FRAME (ARPA_LINK_HEADER_LENGTH + ARPA_LINK_MAX_PAYLOAD + ARPA_LINK_CRC_LENGTH)
+// COBS adds a byte for every 254, and the 0 before and after the frame
+#define ARPA_LINK_MAX_ENCODED (ARPA_LINK_MAX_FRAME + ARPA_LINK_MAX_FRAME / 254 + 3)
+
+enum Arpa_link_type : uint8_t
+{
+  // Base to gateway: message of the node, a binary payload (Arpa_Payload.h) or text
+  ARPA_LINK_DATA = 0x01,
+  // Base to gateway: request for an update chunk, laid out like an ARPA_TYPE_ID_UPDATE request
+  ARPA_LINK_CHUNK_REQ = 0x02,
+  // Gateway to base: command for the node (MQTT arpa/cmd/<node>)
+  ARPA_LINK_CMD = 0x03,
+  // Gateway to base: update chunk, laid out like an ARPA_TYPE_ID_UPDATE reply
+  ARPA_LINK_CHUNK = 0x04
+};
+
+// Frames on the UART between the base and the LTE gateway, both ways.
+//
+// Any byte can be in a payload, and a frame that was cut short or hit by noise fails its
+// length or CRC and is dropped. The 0 after it ends it either way, so the next frame is
+// read as before: nothing is ever parsed out of step.
+// The same file is in STM Code_program/Combined (bases) and LTE/src/LTE (gateway).
+class Arpa_LinkWriter
+{
+public:
+  /// Starts a frame in out, of at least ARPA_LINK_MAX_ENCODED bytes
+  /// \param len Length of the payload Add() is called with
+  /// \return false if len is longer than ARPA_LINK_MAX_PAYLOAD
+  bool Begin(uint8_t *out, const Arpa_link_type type, const uint8_t node, const uint8_t len);
+
+  /// Appends to the payload, in as many parts as convenient
+  void Add(const uint8_t *data, const uint8_t len);
+
+  /// Ends the frame
+  /// \return Bytes of out to write to the UART
+  uint16_t End();
+
+private:
+  uint8_t *out;
+  uint16_t pos;
+  // Byte holding the COBS code of the block being written
+  uint16_t codePos;
+  uint16_t crc;
+
+  void Put(const uint8_t byte);
+};
+
+class Arpa_LinkReader
+{
+public:
+  Arpa_LinkReader();
+
+  /// Takes the next byte from the UART
+  /// \return true if it ended a good frame, which the getters return until the next Take()
+  bool Take(const uint8_t byte);
+
+  Arpa_link_type GetType() const;
+  uint8_t GetNode() const;
+  const uint8_t *GetPayload() const;
+  uint8_t GetLength() const;
+
+  /// Frames dropped for a bad encoding, length or CRC, or for being too long
+  uint32_t GetErrorCount() const;
+
+private:
+  // Bytes since the last 0, decoded in place when the next one comes
+  uint8_t buf[ARPA_LINK_MAX_ENCODED];
+  uint16_t len;
+  bool overflow;
+  uint32_t errors;
+
+  /// Decodes buf
+  /// \return Length of the frame, 0 if it is not a good one
+  uint16_t Decode();
+};
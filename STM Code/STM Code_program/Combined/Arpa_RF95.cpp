@@ -1,4 +1,5 @@
 #include "Arpa_RF95.h"
+#include "Arpa_Crc.h"
 #include <RHReliableDatagram.h>
 #include <RH_RF95.h>
 #include <SPI.h>
@@ -7,19 +8,12 @@
 #define DEBUG false
 #endif
 
-#if DEBUG == true
-#define LOG(msg) (Serial.print(msg))
-#define LOG_LN(msg) (Serial.println(msg))
-#define LOG_F(msg) (Serial.print(F(msg)))
-#define LOG_LN_F(msg) (Serial.println(F(msg)))
-#else
-#define LOG(msg)
-#define LOG_LN(msg)
-#define LOG_F(msg)
-#define LOG_LN_F(msg)
-#endif
+// Events go to the log policy, see Arpa_log_events and Arpa_EventLog.h.
+// LOG(ARPA_EV_..., a, b, c), the arguments are optional.
+#define LOG(...) (Log::Event(__VA_ARGS__))
 
-Arpa_RF95::Arpa_RF95(RH_RF95 *_driver, uint8_t _rst, float _freq, int8_t _power, uint8_t _en, uint8_t _nodeId)
+template <class Profile, class Role, class Header, class Log>
+Arpa_RF95_T<Profile, Role, Header, Log>::Arpa_RF95_T(RH_RF95 *_driver, uint8_t _rst, float _freq, int8_t _power, uint8_t _en, uint8_t _nodeId)
     : manager(*_driver, _nodeId)
 {
   // Set member variables
@@ -31,13 +25,69 @@ Arpa_RF95::Arpa_RF95(RH_RF95 *_driver, uint8_t _rst, float _freq, int8_t _power,
   this->nodeId = _nodeId;
   this->fromId = 0;
   this->originId = 0;
-  this->recvTimeout = ARPA_RECV_TIMEOUT;
-  this->failureDelay = ARPA_FAIL_DELAY;
+  this->recvTimeout = Profile::recvTimeout;
+  this->failureDelay = Profile::failDelay;
   this->currentConnectionId = -1;       // -1 for no connection
   this->currentConnectionOriginId = -1; // -1 for no connection
   this->sleepState = false;
-  this->lastReceivedDatagramLen = 0;
+  this->configChecksum = 0;
+  this->lastFrame = this->lastReceivedDatagram;
+  this->lastFrameLen = 0;
+  this->receivedAt = 0;
+  this->batchPos = 0;
+  this->batchEnd = 0;
+  this->forwardQueueLen = 0;
+  this->forwardQueueSince = 0;
+  this->forwardRetryAt = 0;
+  this->forwardRetryDelay = 0;
+  this->forwardDropped = 0;
   this->numFailedDelays = 0;
+  this->spreadingFactor = Profile::sf;
+  this->codingRate = Profile::cr;
+  this->txPower = _power;
+  this->adrFailures = 0;
+  this->adrSends = 0;
+  this->adrDue = true;
+  this->slotted = false;
+  this->slotSync = false;
+  this->beaconing = false;
+  this->slotOffset = 0;
+  this->frameSlots = 0;
+  this->slotSyncAt = 0;
+  this->slotClock = NULL;
+  this->slotLength = ARPA_SLOT_LENGTH;
+  this->lastBeacon = 0;
+  this->channelBusyCount = 0;
+  this->routeValid = false;
+  this->relaying = false;
+  this->discovering = false;
+  this->routeHops = 0;
+  this->routeFailures = 0;
+  this->routeRssi = 0;
+  this->routeHeard = 0;
+  this->lastRouteAdvert = 0;
+  this->lastDiscovery = 0;
+  this->oldRouteValid = false;
+  this->oldRouteNextHop = 0;
+  this->oldRouteHops = 0;
+  this->routeReplyDue = false;
+  this->routeReplyAt = 0;
+  this->messageHandler = NULL;
+  this->commandCount = 0;
+  this->commandHandler = NULL;
+  this->updateSource = NULL;
+  this->messageHeld = false;
+  this->listenInterval = 0;
+  this->sniffListening = false;
+  this->sniffAt = 0;
+  for (uint8_t i = 0; i < Role::routes; ++i)
+    this->routes[i].destId = -1;
+  this->sequence = 0;
+  this->sequenceUnconfirmed = false;
+  this->lastOneShotOriginId = 0;
+  this->lastSequence = 0;
+  for (uint8_t i = 0; i < Role::sessions; ++i)
+    this->CloseSession(&this->sessions[i]);
 
   // Seed with current node id
   randomSeed(this->nodeId);
@@ -47,18 +97,13 @@ Arpa_RF95::Arpa_RF95(RH_RF95 *_driver, uint8_t _rst, float _freq, int8_t _power,
 
   digitalWrite(this->en, HIGH);
 
-#if DEBUG == true
-  if (!Serial)
-    Serial.begin(9600);
-#endif
+  Log::Begin();
 }
 
-bool Arpa_RF95::InitModule()
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::InitModule()
 {
-  LOG_LN_F("Starting LoRa");
-
   // Manually reset module (required for Teensy)
-  LOG_LN_F("Resetting module");
   digitalWrite(this->rst, LOW);
   delay(10);
   digitalWrite(this->rst, HIGH);
@@ -67,178 +112,471 @@ bool Arpa_RF95::InitModule()
   // Serial.println("Initializing module");
   while (!this->manager.init())
   {
-    LOG_LN_F("LoRa radio initialization failed");
+    LOG(ARPA_EV_RADIO_INIT_FAILED);
     return false;
   }
-  LOG_LN_F("LoRa initialization OK");
   if (!this->driver->setFrequency(this->freq))
   {
-    LOG_LN_F("Setting frequency FAILED!");
+    LOG(ARPA_EV_RADIO_FREQ_FAILED, (uint16_t)this->freq);
     return false;
   }
 
-  LOG("Set Freq. to: ");
-  LOG_LN(this->freq);
+  LOG(ARPA_EV_RADIO_INIT_OK, (uint16_t)this->freq);
 
   /* SX1276 Datasheet page 27 explains more on these parameters
    * the spreading factor and coding rate should be matched between
    * sensor node and gateway.
   */
-  this->driver->setSpreadingFactor(12);
-  this->driver->setCodingRate4(8);
-  this->driver->setTxPower(this->power, false);
-  LOG_F("Set Tx power to: ");
-  LOG_LN(this->power);
+  this->ApplyDataRate();
 
-  this->manager.setTimeout(ARPA_TRAN_TIMEOUT);
-  this->manager.setRetries(ARPA_NUM_RETRIES);
+  this->manager.setTimeout(Profile::tranTimeout);
+  this->manager.setRetries(Profile::retries);
 
   return true;
 }
 
-void Arpa_RF95::SetReceiveTimeout(const uint16_t timeout)
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SetReceiveTimeout(const uint16_t timeout)
 {
   this->recvTimeout = timeout;
 }
 
-void Arpa_RF95::ResetReceiveTimeout()
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::ResetReceiveTimeout()
 {
-  this->recvTimeout = ARPA_RECV_TIMEOUT;
+  this->recvTimeout = Profile::recvTimeout;
 }
 
-void Arpa_RF95::SetTransmitTimeout(const uint16_t timeout)
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SetTransmitTimeout(const uint16_t timeout)
 {
   this->tranTimeout = timeout;
 }
 
-void Arpa_RF95::ResetTransmitTimeout()
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::ResetTransmitTimeout()
 {
-  this->tranTimeout = ARPA_RECV_TIMEOUT;
+  this->tranTimeout = Profile::recvTimeout;
 }
 
-bool Arpa_RF95::SendMessage(const uint8_t sendToId, const Arpa_msg_type type, const char *data)
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::SendMessage(const uint8_t sendToId, const Arpa_msg_type type, const char *data)
 {
-  LOG_LN_F("Arpa_RF95::SendMessage(const uint8_t, const Arpa_msg_type, const char *)");
   return SendMessage(sendToId, type, data, strlen(data));
 }
 
-bool Arpa_RF95::SendMessage(const uint8_t sendToId, const Arpa_msg_type type, const char *data, const uint8_t len)
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::SendMessage(const uint8_t sendToId, const Arpa_msg_type type, const char *data, const uint8_t len)
+{
+  if (len > RH_RF95_MAX_MESSAGE_LEN - Header::length)
+  {
+    LOG(ARPA_EV_SEND_TOO_LONG, len);
+    return false;
+  }
+
+  // Use the full length member buffer, place the header at beginning and copy the data to the rest of the buffer
+  uint8_t buf[RH_RF95_MAX_MESSAGE_LEN];
+  this->WriteHeader(buf, type);
+
+  memcpy(buf + Header::length, data, len);
+
+  return this->SendDatagram(sendToId, buf, len + Header::length);
+}
+
+template <class Profile, class Role, class Header, class Log>
+Arpa_msg_type Arpa_RF95_T<Profile, Role, Header, Log>::SendConnectedMessage(const uint8_t sendToId, const Arpa_msg_type type, const char *data)
+{
+  return SendConnectedMessage(sendToId, type, data, strlen(data));
+}
+
+template <class Profile, class Role, class Header, class Log>
+Arpa_msg_type Arpa_RF95_T<Profile, Role, Header, Log>::SendConnectedMessage(const uint8_t sendToId, const Arpa_msg_type type, const char *data, const uint8_t len)
+{
+  Arpa_msg_view reply;
+  bool sent;
+  if (type == ARPA_TYPE_ID_DATA)
+  {
+    // Data goes behind our sequence number, like a one-shot
+    if (len > RH_RF95_MAX_MESSAGE_LEN - Header::length - ARPA_SEQ_LENGTH)
+    {
+      LOG(ARPA_EV_SEND_TOO_LONG, len);
+      return ARPA_TYPE_ID_INVALID;
+    }
+    uint8_t buf[RH_RF95_MAX_MESSAGE_LEN - Header::length];
+    buf[0] = this->sequence;
+    memcpy(buf + ARPA_SEQ_LENGTH, data, len);
+    sent = SendMessage(sendToId, type, (const char *)buf, len + ARPA_SEQ_LENGTH);
+  }
+  else
+    sent = SendMessage(sendToId, type, data, len);
+
+  // Send data
+  if (sent)
+  {
+    // Success sending, wait for response and return it.
+    // The base puts a command for us in the data of its ack.
+    Arpa_msg_type msgType = WaitForMessage(reply);
+    if (msgType == ARPA_TYPE_ID_ACK && reply.len > 0 && this->commandHandler != NULL)
+      this->commandHandler(reply.data, reply.len);
+    this->ReleaseMessage();
+    if (type == ARPA_TYPE_ID_DATA)
+    {
+      // A nack means the base took nothing
+      if (msgType == ARPA_TYPE_ID_ACK)
+        this->NextSequence();
+      else if (msgType != ARPA_TYPE_ID_NACK)
+        this->sequenceUnconfirmed = true;
+    }
+    return msgType;
+  }
+  if (type == ARPA_TYPE_ID_DATA)
+    this->sequenceUnconfirmed = true;
+  return ARPA_TYPE_ID_INVALID;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::SendOneShot(const char *data)
+{
+  return SendOneShot(data, strlen(data));
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::SendOneShot(const char *data, const uint8_t len)
 {
-  LOG_LN_F("Arpa_RF95::SendMessage(const uint8_t, const Arpa_msg_type, const char *, const uint8_t)");
+  LOG(ARPA_EV_ONESHOT_SEND, len, this->sequence);
 
-  if (len > ARPA_MAX_MSG_LENGTH)
+  if (len > RH_RF95_MAX_MESSAGE_LEN - Header::length - ARPA_SEQ_LENGTH)
   {
-    LOG_LN_F("Arpa_RF95::SendMessage(const uint8_t, const Arpa_msg_type, const char *, const uint8_t) failed: len to large");
+    LOG(ARPA_EV_SEND_TOO_LONG, len);
     return false;
   }
 
-  // Use the full length member buffer, place id byte at beginning and copy the data to the rest of the buffer
   uint8_t buf[RH_RF95_MAX_MESSAGE_LEN];
-  buf[ARPA_ID_BYTE_POS] = (uint8_t)type;
+  this->WriteHeader(buf, ARPA_TYPE_ID_DATA_ONESHOT);
+  buf[Header::length] = this->sequence;
+  memcpy(buf + Header::length + ARPA_SEQ_LENGTH, data, len);
+
+  // No reply from the base, the link layer ACK is enough.
+  // Without it the number is kept for the data to be sent again.
+  if (!this->SendDatagram(this->baseId, buf, len + Header::length + ARPA_SEQ_LENGTH))
+  {
+    this->sequenceUnconfirmed = true;
+    return false;
+  }
+
+  this->NextSequence();
+  this->WaitForCommand();
+  return true;
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint8_t Arpa_RF95_T<Profile, Role, Header, Log>::WriteHeader(uint8_t *buf, const Arpa_msg_type type)
+{
+  buf[Header::idPos] = (uint8_t)type;
 
   // For the base, always put the originId from the node that sent it
   // rather than the base id
-  if (this->nodeId == this->baseId)
-    buf[ARPA_ADDR_BYTE_POS] = this->originId;
+  if (this->IsBase())
+    buf[Header::addrPos] = this->originId;
   else
-    buf[ARPA_ADDR_BYTE_POS] = this->nodeId;
+    buf[Header::addrPos] = this->nodeId;
+
+  buf[Header::hopsPos] = 0;
+  buf[Header::ttlPos] = ARPA_DEFAULT_TTL;
+  return Header::length;
+}
 
-  memcpy(buf + ARPA_HEADER_LENGTH, data, len);
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::TakeOneShot(uint8_t *buf, uint8_t *len)
+{
+  if (!this->TakeSequence(buf, len))
+    return false;
 
-  // LOG_LN(buf[ARPA_ID_BYTE_POS]);
-  // LOG_LN(buf[ARPA_ADDR_BYTE_POS]);
-  // LOG_LN(sendToId);
+  this->lastOneShotOriginId = this->originId;
 
-  return this->SendDatagram(sendToId, buf, len + ARPA_HEADER_LENGTH);
+  LOG(ARPA_EV_ONESHOT, this->lastOneShotOriginId, this->lastSequence);
+  return true;
 }
 
-Arpa_msg_type Arpa_RF95::SendConnectedMessage(const uint8_t sendToId, const Arpa_msg_type type, const char *data)
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::TakeOneShot(Arpa_msg_view &view)
 {
-  return SendConnectedMessage(sendToId, type, data, strlen(data));
+  if (!this->TakeSequence(view))
+    return false;
+
+  this->lastOneShotOriginId = view.originId;
+
+  LOG(ARPA_EV_ONESHOT, this->lastOneShotOriginId, this->lastSequence);
+  return true;
 }
 
-Arpa_msg_type Arpa_RF95::SendConnectedMessage(const uint8_t sendToId, const Arpa_msg_type type, const char *data, const uint8_t len)
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::TakeSequence(uint8_t *buf, uint8_t *len)
 {
-  uint8_t receiveBuf[RH_RF95_MAX_MESSAGE_LEN];
-  uint8_t receiveLen = RH_RF95_MAX_MESSAGE_LEN;
-  // Send data
-  if (SendMessage(sendToId, type, data, len))
-  {
-    // Success sending, wait for response and return it
-    return WaitForMessage(receiveBuf, &receiveLen);
-  }
-  return ARPA_TYPE_ID_INVALID;
+  // WaitForMessage() already removed the header, the sequence number is first
+  if (*len < ARPA_SEQ_LENGTH)
+    return false;
+
+  this->lastSequence = buf[0];
+  *len = *len - ARPA_SEQ_LENGTH;
+  memmove(buf, buf + ARPA_SEQ_LENGTH, *len);
+  return true;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::TakeSequence(Arpa_msg_view &view)
+{
+  // Step over the sequence number instead of moving the data
+  if (view.len < ARPA_SEQ_LENGTH)
+    return false;
+
+  this->lastSequence = view.data[0];
+  view.data += ARPA_SEQ_LENGTH;
+  view.len -= ARPA_SEQ_LENGTH;
+  return true;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::IsDuplicate(const uint8_t originId)
+{
+  if (!this->dedup.IsDuplicate(originId, this->lastSequence, millis()))
+    return false;
+
+  LOG(ARPA_EV_DUPLICATE, originId, this->lastSequence);
+  return true;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::DataUnconfirmed() const
+{
+  return this->sequenceUnconfirmed;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SkipSequence()
+{
+  if (this->sequenceUnconfirmed)
+    this->NextSequence();
 }
 
-bool Arpa_RF95::SendDatagram(uint8_t sendToId, const uint8_t *data, const uint8_t len)
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::NextSequence()
 {
-  LOG_LN_F("Arpa_RF95: SendDatagram(uint8_t, const char *, const uint8_t) Sending datagram");
+  if (++this->sequence == 0)
+    this->sequence = 1;
+  this->sequenceUnconfirmed = false;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::SendDatagram(uint8_t sendToId, const uint8_t *data, const uint8_t len)
+{
+  LOG(ARPA_EV_SEND, data[Header::idPos], sendToId);
 
   // Check if module is awake
   if (this->sleepState) // Sleep state true mean the module is asleep
     this->SetSleepState(false);
 
-  if (this->manager.sendtoWait((uint8_t *)data, len, sendToId))
+  // The peer of a reply is listening for it right now, backing off would only make it time out
+  bool reply = sendToId == this->fromId && millis() - this->receivedAt < ARPA_LBT_REPLY_WINDOW;
+  if (!reply && !this->WaitForClearChannel())
+    LOG(ARPA_EV_CHANNEL_BUSY_SEND);
+
+  // Retries go out with the same preamble, the link ACK back has the short one
+  bool wakeup = this->NeedsWakeupPreamble(sendToId, data, len);
+  if (wakeup)
+    this->driver->setPreambleLength((uint32_t)this->listenInterval * 1000 / this->SymbolMicros() + ARPA_LPL_PREAMBLE_MARGIN);
+  bool sent = this->manager.sendtoWait((uint8_t *)data, len, sendToId);
+  if (wakeup)
+    this->driver->setPreambleLength(ARPA_PREAMBLE_LENGTH);
+
+  if (sent)
+  {
+    // The link ACK shows the next hop is still there
+    if (sendToId == this->baseId)
+      this->routeHeard = millis();
+    this->adrFailures = 0;
+    if (++this->adrSends >= ARPA_ADR_INTERVAL)
+      this->adrDue = true;
     return true;
+  }
+
+  LOG(ARPA_EV_SEND_FAILED, sendToId);
 
-  LOG_LN_F("Arpa_RF95: SendDatagram(uint8_t, const char *, const uint8_t) Sending datagram failed");
+  // The link may have got worse than the current data rate allows
+  if (++this->adrFailures >= ARPA_ADR_MAX_FAILURES && !this->IsBase())
+  {
+    LOG(ARPA_EV_DATA_RATE_FALLBACK);
+    this->adrFailures = 0;
+    if (this->spreadingFactor != Profile::sf || this->codingRate != Profile::cr || this->txPower != (int8_t)this->power)
+    {
+      this->ResetDataRate();
+      this->adrDue = true;
+    }
+  }
   return false;
 }
 
-Arpa_msg_type Arpa_RF95::WaitForMessage(uint8_t *buf, uint8_t *len)
+template <class Profile, class Role, class Header, class Log>
+Arpa_msg_type Arpa_RF95_T<Profile, Role, Header, Log>::WaitForMessage(uint8_t *buf, uint8_t *len)
+{
+  Arpa_msg_view view;
+  Arpa_msg_type msgType = this->WaitForMessage(view);
+  if (msgType == ARPA_TYPE_ID_INVALID)
+    return msgType;
+
+  // Copy the received data (wihtout the header) to the provided buffer
+  if (*len > view.len)
+    *len = view.len;
+  memcpy(buf, view.data, *len);
+  this->ReleaseMessage();
+  return msgType;
+}
+
+template <class Profile, class Role, class Header, class Log>
+Arpa_msg_type Arpa_RF95_T<Profile, Role, Header, Log>::WaitForMessage(Arpa_msg_view &view)
 {
-  // Reset our buffer
-  memset(this->lastReceivedDatagram, '\0', RH_RF95_MAX_MESSAGE_LEN);
+  unsigned long start = millis();
+  unsigned long elapsed;
 
-  LOG_LN_F("Arpa_RF95::WaitForMessage(uint8_t *, uint8_t *) Waiting for data");
-  if (this->manager.recvfromAckTimeout(this->lastReceivedDatagram, len, this->recvTimeout, &(this->fromId)))
+  if (this->messageHeld)
   {
-    LOG_LN_F("Arpa_RF95: WaitForMessage(uint8_t *, uint8_t *) Received valid data from module");
-    LOG_LN_F("\tfromId:len:message");
-    LOG_F("\t");
-    LOG(this->fromId);
-    LOG_F(":");
-    LOG(*len);
-    LOG_F(":");
-#if DEBUG == true
-    if (*len < RH_RF95_MAX_MESSAGE_LEN)
-      this->lastReceivedDatagram[*len] = '\0'; // Null terminate for printing
-#endif
-    LOG_LN((char *)(this->lastReceivedDatagram + ARPA_HEADER_LENGTH)); // Remove id and addr byte
+    LOG(ARPA_EV_RECV_NOT_RELEASED);
+    return ARPA_TYPE_ID_INVALID;
+  }
 
-    // Get the message type out of the id byte
-    Arpa_msg_type msgType = (Arpa_msg_type)this->lastReceivedDatagram[ARPA_ID_BYTE_POS];
-    // Get the address out of the header
-    this->originId = (uint8_t)this->lastReceivedDatagram[ARPA_ADDR_BYTE_POS];
+  // Beacons are handled by ReceiveMessage(), keep waiting for the rest of the timeout after one
+  while (true)
+  {
+    Arpa_msg_type msgType = this->ReceiveMessage(view);
+    if (msgType != ARPA_TYPE_ID_INVALID)
+      return msgType;
+
+    // Route requests are answered after a random delay, the requester only listens for a while
+    if (this->routeReplyDue)
+      this->SendRouteAdvertIfDue();
+
+    if ((elapsed = millis() - start) >= this->recvTimeout)
+      break;
+    uint32_t wait = this->recvTimeout - elapsed;
+    if (this->routeReplyDue)
+      wait = min(wait, MillisUntil(this->routeReplyAt));
+    this->manager.waitAvailableTimeout(wait);
+  }
+
+  LOG(ARPA_EV_RECV_TIMEOUT);
+  return ARPA_TYPE_ID_INVALID;
+}
+
+template <class Profile, class Role, class Header, class Log>
+Arpa_msg_type Arpa_RF95_T<Profile, Role, Header, Log>::ReceiveMessage(Arpa_msg_view &view)
+{
+  // The buffer is still lent out, the next frame waits in the driver meanwhile
+  if (this->messageHeld)
+    return ARPA_TYPE_ID_INVALID;
+
+  // Frames that are not for the caller are handled here, go on with the next one
+  while (true)
+  {
+    uint8_t *frame;
+    uint8_t frameLen;
+
+    if (this->batchPos < this->batchEnd)
+    {
+      // Hand out the next message of a batch before receiving again
+      // A length running past the end of the batch would point outside the buffer
+      frameLen = this->lastReceivedDatagram[this->batchPos];
+      if ((uint16_t)frameLen + 1 > (uint16_t)(this->batchEnd - this->batchPos))
+      {
+        LOG(ARPA_EV_BATCH_CUT);
+        this->batchPos = this->batchEnd;
+        continue;
+      }
+      frame = this->lastReceivedDatagram + this->batchPos + 1;
+      this->batchPos += 1 + frameLen;
+    }
+    else
+    {
+      frameLen = RH_RF95_MAX_MESSAGE_LEN;
+
+      // The driver took the frame off the radio in its DIO0 interrupt, this never waits
+      if (!this->manager.recvfromAck(this->lastReceivedDatagram, &frameLen, &(this->fromId)))
+        break;
+      frame = this->lastReceivedDatagram;
+
+      if (frameLen >= Header::length && frame[Header::idPos] == ARPA_TYPE_ID_BATCH)
+      {
+        LOG(ARPA_EV_BATCH, frameLen, this->fromId);
+        this->batchPos = Header::length;
+        this->batchEnd = frameLen;
+        if (this->fromId == this->baseId)
+          this->routeHeard = millis();
+        continue;
+      }
+    }
 
-    LOG_F("\tTypeId: ");
-    LOG_LN(msgType);
+    LOG(ARPA_EV_RECV, this->fromId, frameLen);
 
-    LOG_F("\tOriginId: ");
-    LOG_LN(this->originId);
+    if (frameLen < Header::length)
+    {
+      LOG(ARPA_EV_RECV_SHORT, this->fromId);
+      continue;
+    }
 
-    this->lastReceivedDatagramLen = *len;
+    // Get the message type out of the id byte
+    Arpa_msg_type msgType = (Arpa_msg_type)frame[Header::idPos];
+    if (msgType == ARPA_TYPE_ID_TIME)
+    {
+      // Only nodes send in slots
+      if (Role::node)
+        this->TakeBeacon(frame + Header::length, frameLen - Header::length);
+      continue;
+    }
+    if (msgType == ARPA_TYPE_ID_ROUTE)
+    {
+      this->TakeRouteMessage(frame + Header::length, frameLen - Header::length);
+      continue;
+    }
 
-    // Adjust length to account for id byte and original node address
-    *len = *len - ARPA_HEADER_LENGTH;
-    // Copy the received data (wihtout id byte and address) to the provided buffer
-    memcpy(buf, this->lastReceivedDatagram + ARPA_HEADER_LENGTH, *len);
+    if (this->fromId == this->baseId)
+      this->routeHeard = millis();
 
+    // Get the address out of the header
+    this->originId = (uint8_t)frame[Header::addrPos];
+
+    LOG(ARPA_EV_RECV_MSG, msgType, this->originId);
+
+    // Lend the frame out where it is, until ReleaseMessage()
+    this->lastFrame = frame;
+    this->lastFrameLen = frameLen;
+    this->messageHeld = true;
+    this->receivedAt = millis();
+
+    view.type = msgType;
+    view.fromId = this->fromId;
+    view.originId = this->originId;
+    view.frame = frame;
+    view.frameLen = frameLen;
+    view.data = frame + Header::length;
+    view.len = frameLen - Header::length;
     return msgType;
   }
 
-  LOG_LN_F("Arpa_RF95::WaitForMessage(uint8_t *, uint8_t *) Timed out or couldn't receive data");
   return ARPA_TYPE_ID_INVALID;
 }
 
-Arpa_msg_type Arpa_RF95::WaitForConnectedMessage(uint8_t *buf, uint8_t *len)
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::ReleaseMessage()
+{
+  this->messageHeld = false;
+}
+
+template <class Profile, class Role, class Header, class Log>
+Arpa_msg_type Arpa_RF95_T<Profile, Role, Header, Log>::WaitForConnectedMessage(uint8_t *buf, uint8_t *len)
 {
 
   if (this->currentConnectionId < 0)
   {
-    LOG_LN_F("Arpa_RF95::WaitForConnectedMessage(uint8_t *, uint8_t *) No current connection");
-    LOG_F("Arpa_RF95::WaitForConnectedMessage(uint8_t *, uint8_t *) Current connection id: ");
-    LOG_LN(this->currentConnectionId);
+    LOG(ARPA_EV_NO_CONNECTION, this->currentConnectionId);
     return ARPA_TYPE_ID_INVALID;
   }
 
@@ -246,22 +584,33 @@ Arpa_msg_type Arpa_RF95::WaitForConnectedMessage(uint8_t *buf, uint8_t *len)
   Arpa_msg_type msgType;
 
   unsigned long currentTime;
-  LOG_LN_F("Arpa_RF95::WaitForConnectedMessage(uint8_t *, uint8_t *) Waiting for data");
   // Calculating if it's been more than the timeout period since the last activity from the connected node
-  while ((currentTime = millis()) - this->timeSinceConnectionActivity < APRA_CONNECTION_TIMEOUT && currentTime >= this->timeSinceConnectionActivity) // Check that millis hasn't overflowed
+  while ((currentTime = millis()) - this->timeSinceConnectionActivity < Profile::connectionTimeout && currentTime >= this->timeSinceConnectionActivity) // Check that millis hasn't overflowed
   {
     *len = bufLen;
     msgType = this->WaitForMessage(buf, len);
     if (msgType == ARPA_TYPE_ID_INVALID)
     {
-      LOG_LN_F("Arpa_RF95::WaitForConnectedMessage(uint8_t *, uint8_t *) Wait for message returned invalid");
+      LOG(ARPA_EV_CONN_INVALID);
+      continue;
+    }
+
+    // One-shot messages need no connection, hand them to the caller from any node
+    if (msgType == ARPA_TYPE_ID_DATA_ONESHOT)
+    {
+      bool valid = this->TakeOneShot(buf, len) && !this->IsDuplicate(this->originId);
+
+      // Reset current originId
+      this->originId = this->currentConnectionOriginId;
+      if (valid)
+        return msgType;
       continue;
     }
 
     // send nack if we get a message from a node not currently connected
     if (this->originId != this->currentConnectionOriginId)
     {
-      LOG_LN_F("Arpa_RF95::WaitForConnectedMessage(uint8_t *, uint8_t *) Received message from a not connected node");
+      LOG(ARPA_EV_NOT_CONNECTED, this->originId);
       // Send back nack
       this->SendMessage(this->fromId, ARPA_TYPE_ID_NACK, "", 0);
 
@@ -273,7 +622,7 @@ Arpa_msg_type Arpa_RF95::WaitForConnectedMessage(uint8_t *buf, uint8_t *len)
     switch (msgType)
     {
     case ARPA_TYPE_ID_FIN:
-      LOG_LN_F("Arpa_RF95::WaitForConnectedMessage(uint8_t *, uint8_t *) Received fin, closing connection");
+      LOG(ARPA_EV_FIN_RECV, this->originId);
       currentConnectionId = -1;
       currentConnectionOriginId = -1;
       return msgType;
@@ -284,6 +633,9 @@ Arpa_msg_type Arpa_RF95::WaitForConnectedMessage(uint8_t *buf, uint8_t *len)
       break;
 
     default: // Return any other type of message back to the caller
+      if (msgType == ARPA_TYPE_ID_DATA && !this->TakeSequence(buf, len))
+        continue;
+
       // Reply with an ack
       if (!this->SendMessage(this->currentConnectionId, ARPA_TYPE_ID_ACK, "", 0))
       {
@@ -293,207 +645,1573 @@ Arpa_msg_type Arpa_RF95::WaitForConnectedMessage(uint8_t *buf, uint8_t *len)
         return ARPA_TYPE_ID_FIN;
       }
 
-      // Reset timer and return with the data in buf
+      // Reset timer and return with the data in buf, a copy of data we have is only acked again
       this->timeSinceConnectionActivity = millis();
+      if (msgType == ARPA_TYPE_ID_DATA && this->IsDuplicate(this->originId))
+        continue;
       return msgType;
       break;
     }
   }
 
   // Timed out
-  LOG_LN_F("Arpa_RF95::WaitForConnectedMessage(uint8_t *, uint8_t *) Time out");
+  LOG(ARPA_EV_CONN_TIMEOUT);
   this->currentConnectionId = -1;
   this->currentConnectionOriginId = -1;
   return ARPA_TYPE_ID_FIN;
 }
 
-void Arpa_RF95::HandleMessageForwarding()
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::HandleMessageForwarding()
 {
-  uint8_t buf[ARPA_MAX_MSG_LENGTH];
-  uint8_t len = ARPA_MAX_MSG_LENGTH;
-  uint16_t sendId = this->baseId;
+  this->StartForwarding();
 
   while (true)
   {
-    switch (WaitForMessage(buf, &len))
-    {
-    case ARPA_TYPE_ID_INVALID:
-      break;
-
-    default: // If we got a message
-      // Check if the message is from the base
-      if (this->fromId == this->baseId) // Message base => node
-        sendId = this->originId;
-      else // Message from node => base
-        sendId = this->baseId;
+    if (this->Poll())
+      continue;
+    if (this->Sniff())
+      this->manager.waitAvailableTimeout(this->GetPollTimeout());
+    else
+      delay(this->GetPollTimeout());
+  }
+}
 
-      // send entire message to base without modification
-      if (!SendDatagram(sendId, this->lastReceivedDatagram, this->lastReceivedDatagramLen))
-      {
-        // TODO If the message couldn't be sent to the base, maybe tell the node somehow?
-      }
-      break;
-    }
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::StartForwarding()
+{
+  // Answer route requests from now on
+  this->relaying = true;
+  this->StartRouteDiscovery();
+}
 
-    // Have to reset this as it is used as an input for WaitForMessage
-    len = ARPA_MAX_MSG_LENGTH;
-  }
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SetMessageHandler(Arpa_message_handler handler)
+{
+  this->messageHandler = handler;
 }
 
-bool Arpa_RF95::SetSleepState(const bool state)
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::Poll()
 {
-  // Put device to sleep by setting the drive to sleep
-  if (state)
-  {
-    this->driver->sleep();
-  }
-  // Wake up and re-init
+  Arpa_msg_view view;
+
+  this->ServiceTimers();
+
+  // Receiving turns the radio on, a duty cycled forwarder leaves that to Sniff()
+  if (!this->IsReceiverOn() && this->batchPos >= this->batchEnd)
+    return false;
+
+  Arpa_msg_type msgType = this->ReceiveMessage(view);
+  if (msgType == ARPA_TYPE_ID_INVALID)
+    return false;
+
+  if (this->IsRelaying())
+    this->TakeForwardMessage(view);
   else
   {
-    digitalWrite(this->en, HIGH);
-    // Delays to make sure the module wakes up
-    delay(50);
-    if (!this->InitModule())
-      return false;
-
-    delay(50);
+    if (this->IsBase())
+      msgType = this->TakeSessionMessage(view);
+    if (msgType != ARPA_TYPE_ID_INVALID && this->messageHandler != NULL)
+      this->messageHandler(msgType, view.originId, view.data, view.len);
   }
-  this->sleepState = state;
 
+  this->ReleaseMessage();
   return true;
 }
 
-bool Arpa_RF95::GetSleepState() const
+template <class Profile, class Role, class Header, class Log>
+uint32_t Arpa_RF95_T<Profile, Role, Header, Log>::GetPollTimeout() const
 {
-  return this->sleepState;
-}
+  // Nothing to do but wait for the radio, a caller that sleeps this long misses nothing
+  uint32_t timeout = Profile::recvTimeout;
+  if (this->batchPos < this->batchEnd)
+    return 0;
 
-uint8_t Arpa_RF95::GetFromId() const
-{
-  return this->fromId;
-}
+  if (this->IsBase())
+  {
+    if (this->beaconing)
+      timeout = min(timeout, MillisUntil(this->lastBeacon + ARPA_BEACON_INTERVAL));
+    for (uint8_t i = 0; i < Role::sessions; ++i)
+    {
+      if (this->sessions[i].connectionId >= 0)
+        timeout = min(timeout, MillisUntil(this->sessions[i].lastActivity + Profile::connectionTimeout));
+    }
+  }
 
-int16_t Arpa_RF95::GetCurrentConnectionOriginId() const
-{
-  return this->currentConnectionOriginId;
-}
+  if (this->IsRelaying())
+  {
+    if (this->discovering)
+      timeout = min(timeout, MillisUntil(this->lastDiscovery + ARPA_ROUTE_DISCOVERY_TIMEOUT));
+    else if (!this->routeValid)
+      timeout = min(timeout, MillisUntil(this->lastDiscovery + ARPA_ROUTE_RETRY_INTERVAL));
+    else
+      timeout = min(timeout, MillisUntil(this->routeHeard + ARPA_ROUTE_TIMEOUT));
+    if (this->forwardQueueLen > 0 && !this->discovering)
+      timeout = min(timeout, MillisUntil(this->ForwardQueueDue()));
+  }
 
-void Arpa_RF95::SetBaseId(const uint8_t id)
-{
-  this->baseId = id;
+  if (this->IsBase() || (this->IsRelaying() && this->routeValid))
+    timeout = min(timeout, MillisUntil(this->lastRouteAdvert + ARPA_ROUTE_ADVERT_INTERVAL));
+  if (this->routeReplyDue)
+    timeout = min(timeout, MillisUntil(this->routeReplyAt));
+  if (this->IsRelaying() && this->listenInterval > 0)
+    timeout = min(timeout, MillisUntil(this->sniffAt));
+
+  return timeout;
 }
 
-void Arpa_RF95::SetNodeId(const uint8_t id)
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SetListenInterval(const uint16_t interval)
 {
-  this->nodeId = id;
+  this->listenInterval = interval;
+  this->sniffListening = false;
+  this->sniffAt = millis();
 }
 
-uint8_t Arpa_RF95::GetBaseId() const
+template <class Profile, class Role, class Header, class Log>
+uint16_t Arpa_RF95_T<Profile, Role, Header, Log>::GetListenInterval() const
 {
-  return this->baseId;
+  return this->listenInterval;
 }
 
-// Protocol implementations
-bool Arpa_RF95::Synchronize()
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::Sniff()
 {
-  LOG_LN_F("Arpa_RF95: Synchronize() Building message, sending syn...");
-  uint8_t buf[RH_RF95_MAX_MESSAGE_LEN];
-  uint8_t len = RH_RF95_MAX_MESSAGE_LEN;
+  // Only forwarders duty cycle their receiver
+  if (this->listenInterval == 0 || !this->IsRelaying())
+    return true;
 
-  // Send a synchronize message
-  if (!this->SendMessage(this->baseId, ARPA_TYPE_ID_SYN, "", 0))
+  if (this->sniffListening)
   {
-    LOG_LN_F("Arpa_RF95: Synchronize() Syn send failed");
-    // TODO: handle resending syn according to protocol somehome (either in here or in the caller)
-    return false;
-  }
+    if (MillisUntil(this->sniffAt) > 0)
+      return true;
 
-  // Wait for a syn back
-  switch (this->WaitForMessage(buf, &len))
-  {
-  case ARPA_TYPE_ID_SYN:
-    return true;
-    break;
+    // Keep receiving while the modem follows a preamble or frame, Poll() takes the frame
+    // when it is done. A CAD set off by the end of a frame or by noise finds nothing.
+    if (this->IsReceivingSignal())
+    {
+      this->sniffAt = millis() + ARPA_LPL_CHECK_SYMBOLS * this->SymbolMicros() / 1000;
+      return true;
+    }
 
-  case ARPA_TYPE_ID_NACK:
-    LOG_LN_F("Arpa_RF95: Synchronize() Got a NACK back");
-    // TODO: handle resending syn according to protocol somehome (either in here or in the caller)
-    return false;
-    break;
+    this->sniffListening = false;
+    this->sniffAt = millis() + this->listenInterval;
+  }
 
-  case ARPA_TYPE_ID_INVALID:
-  default:
-    LOG_LN_F("Arpa_RF95: Synchronize() No syn received back");
+  if (MillisUntil(this->sniffAt) > 0)
+  {
+    // Sends and route discovery leave the radio on
+    if (this->driver->mode() != RH_RF95::RHModeSleep)
+      this->driver->sleep();
     return false;
-    break;
   }
-}
 
-bool Arpa_RF95::Close()
-{
-  LOG_LN_F("Arpa_RF95: Close() Sending fin...");
+  // Stay on the interval grid, unless sending kept us busy past the next check
+  this->sniffAt += this->listenInterval;
+  if (MillisUntil(this->sniffAt) == 0)
+    this->sniffAt = millis() + this->listenInterval;
 
-  // Send a close message
-  if (!this->SendMessage(this->baseId, ARPA_TYPE_ID_FIN, "", 0))
+  this->driver->setModeIdle();
+  if (!this->driver->isChannelActive())
   {
-    LOG_LN_F("Arpa_RF95: Synchronize() Fin send failed");
+    this->driver->sleep();
     return false;
   }
 
+  LOG(ARPA_EV_CHANNEL_ACTIVE);
+  this->sniffListening = true;
+  this->sniffAt = millis() + ARPA_LPL_CHECK_SYMBOLS * this->SymbolMicros() / 1000;
+  this->driver->setModeRx();
   return true;
 }
 
-int8_t Arpa_RF95::WaitForSyn()
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::IsReceiverOn() const
 {
-  LOG_LN_F("Arpa_RF95: WaitForSyn() waiting for syn...");
+  return this->listenInterval == 0 || !this->IsRelaying() || this->sniffListening;
+}
 
-  Arpa_msg_type msgType;
-  uint8_t buf[RH_RF95_MAX_MESSAGE_LEN];
-  this->currentConnectionId = -1;
-  this->currentConnectionOriginId = -1;
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::NeedsWakeupPreamble(const uint8_t sendToId, const uint8_t *data, const uint8_t len) const
+{
+  if (this->listenInterval == 0 || len < Header::length)
+    return false;
 
-  // Wait forever for a syn message
-  while (true)
-  {
-    uint8_t len = RH_RF95_MAX_MESSAGE_LEN; // The len variable is used as an input and must be set every loop
+  // Route requests and periodic adverts are for every neighbor, sleeping ones included.
+  // An advert answering a request goes to a node that listens for it.
+  if (sendToId == RH_BROADCAST_ADDRESS)
+    return data[Header::idPos] == ARPA_TYPE_ID_ROUTE && !this->routeReplyDue;
 
-    msgType = this->WaitForMessage(buf, &len);
-    if (msgType == ARPA_TYPE_ID_INVALID)
-      continue;
+  // Up the route the next hop is a forwarder unless it is a base
+  if (!this->IsBase() && sendToId == this->baseId)
+    return !this->routeValid || this->routeHops > 1;
 
-    // Send back syn if we received a syn
-    LOG_F("Got a message, type:");
-    LOG_LN(msgType);
-    if (msgType == ARPA_TYPE_ID_SYN)
-    {
-      LOG_LN_F("Arpa_RF95: WaitForSyn() Got a syn, sending one back");
+  // Down a route a hop that is not the destination is a forwarder,
+  // the destination itself is waiting for the reply
+  uint8_t addr = data[Header::addrPos];
+  return addr != sendToId && addr != this->nodeId;
+}
 
-      if (this->SendMessage(this->fromId, ARPA_TYPE_ID_SYN, "", 0))
-      {
-        this->currentConnectionId = this->fromId;
-        this->currentConnectionOriginId = this->originId;
-        this->timeSinceConnectionActivity = millis();
-        break;
-      }
-    }
-    else if (msgType == ARPA_TYPE_ID_CHECK)
-    {
-      this->SendMessage(this->fromId, ARPA_TYPE_ID_CHECK, "", 0);
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::IsReceivingSignal()
+{
+  return this->driver->mode() == RH_RF95::RHModeRx &&
+         (this->driver->spiRead(RH_RF95_REG_18_MODEM_STAT) & RH_RF95_MODEM_STATUS_SIGNAL_DETECTED);
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint32_t Arpa_RF95_T<Profile, Role, Header, Log>::SymbolMicros() const
+{
+  return (1UL << this->spreadingFactor) * 1000000UL / 125000;
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint32_t Arpa_RF95_T<Profile, Role, Header, Log>::MillisUntil(const uint32_t due)
+{
+  // Unsigned difference so this stays correct when millis() overflows
+  uint32_t left = due - millis();
+  return left >= 0x80000000UL ? 0 : left;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::ServiceTimers()
+{
+  if (this->IsBase())
+  {
+    this->ExpireSessions();
+    this->SendBeaconIfDue();
+  }
+
+  if (this->IsRelaying())
+  {
+    if (this->discovering)
+    {
+      if (millis() - this->lastDiscovery >= ARPA_ROUTE_DISCOVERY_TIMEOUT)
+        this->FinishRouteDiscovery();
+    }
+    else
+    {
+      if (this->routeValid && millis() - this->routeHeard >= ARPA_ROUTE_TIMEOUT)
+      {
+        LOG(ARPA_EV_ROUTE_TIMEOUT);
+        this->routeValid = false;
+      }
+      if (!this->routeValid && millis() - this->lastDiscovery >= ARPA_ROUTE_RETRY_INTERVAL)
+        this->StartRouteDiscovery();
+    }
+
+    // Held back while looking for a route, the next hop may be gone
+    if (!this->discovering)
+      this->FlushForwardQueueIfDue();
+  }
+
+  this->SendRouteAdvertIfDue();
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::TakeForwardMessage(const Arpa_msg_view &view)
+{
+  if (view.type == ARPA_TYPE_ID_ADR)
+  {
+    // Data rate is per link, so a forwarder answers for the node => forwarder hop itself
+    if (view.fromId != this->baseId)
+      this->ReplyDataRate(view.data, view.len);
+    return;
+  }
+
+  if (view.type == ARPA_TYPE_ID_UPDATE)
+  {
+    // Images are not relayed, a chunk would hold the forwarder up for seconds,
+    // without an update source the request is answered with ARPA_CHUNK_NONE
+    if (view.fromId != this->baseId)
+      this->ReplyUpdateChunk(view.data, view.len);
+    return;
+  }
+
+  // A one-shot resent because its ACK got lost is queued once. Connected data is left
+  // to the base, its node waits for the ack of the base.
+  if (view.type == ARPA_TYPE_ID_DATA_ONESHOT && view.fromId != this->baseId && view.len >= ARPA_SEQ_LENGTH)
+  {
+    this->lastSequence = view.data[0];
+    if (this->IsDuplicate(view.originId))
+      return;
+  }
+
+  if (!this->ForwardDatagram())
+    LOG(ARPA_EV_FORWARD_FAILED, view.originId);
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::ForwardDatagram()
+{
+  // Changed where it is, the frame is ours until it is released
+  uint8_t *frame = this->lastFrame;
+  uint8_t frameLen = this->lastFrameLen;
+
+  if (frame[Header::ttlPos] <= 1)
+  {
+    LOG(ARPA_EV_FORWARD_TTL, frame[Header::addrPos]);
+    return false;
+  }
+  --frame[Header::ttlPos];
+  ++frame[Header::hopsPos];
+
+  // Messages from our next hop to the base go down to the node in the address byte,
+  // everything else goes up. Remember where uplink messages came from to find the way back.
+  uint8_t addr = frame[Header::addrPos];
+  if (this->fromId == this->baseId)
+    return this->SendDatagram(this->LookupRoute(addr), frame, frameLen);
+
+  // Uplink messages are queued and sent to the base in batches
+  this->AddRoute(addr, this->fromId);
+  return this->EnqueueForward(frame, frameLen);
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::EnqueueForward(const uint8_t *frame, const uint8_t frameLen)
+{
+  // Drop the oldest messages to make room, the node already got its link ACK
+  while (this->forwardQueueLen > 0 && this->forwardQueueLen + 1 + frameLen > Role::forwardQueueBytes)
+  {
+    LOG(ARPA_EV_FORWARD_QUEUE_FULL);
+    this->DequeueForward(1);
+    ++this->forwardDropped;
+  }
+
+  if (this->forwardQueueLen == 0)
+    this->forwardQueueSince = millis();
+
+  this->forwardQueue[this->forwardQueueLen] = frameLen;
+  memcpy(this->forwardQueue + this->forwardQueueLen + 1, frame, frameLen);
+  this->forwardQueueLen += 1 + frameLen;
+  return true;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::DequeueForward(uint8_t count)
+{
+  uint16_t pos = 0;
+  while (count-- > 0 && pos < this->forwardQueueLen)
+    pos += 1 + this->forwardQueue[pos];
+
+  this->forwardQueueLen -= pos;
+  memmove(this->forwardQueue, this->forwardQueue + pos, this->forwardQueueLen);
+  // What is left was queued before now, but not long enough ago to matter
+  this->forwardQueueSince = millis();
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint32_t Arpa_RF95_T<Profile, Role, Header, Log>::ForwardQueueDue() const
+{
+  if (this->forwardQueueLen >= ARPA_FORWARD_BATCH_BYTES)
+    return millis();
+
+  uint32_t due = this->forwardQueueSince + ARPA_FORWARD_BATCH_DELAY;
+  // Unsigned difference so this stays correct when millis() overflows
+  if (this->forwardRetryDelay > 0 && this->forwardRetryAt - due < 0x80000000UL)
+    due = this->forwardRetryAt;
+  return due;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::FlushForwardQueueIfDue()
+{
+  if (this->forwardQueueLen == 0 || millis() - this->ForwardQueueDue() >= 0x80000000UL)
+    return false;
+
+  // Pack queued messages into one batch up to ARPA_FORWARD_BATCH_BYTES: [length][message with its header]...
+  // A first message too long for a batch of its own is sent alone below
+  uint8_t batch[ARPA_FORWARD_BATCH_BYTES];
+  uint16_t batchLen = this->WriteHeader(batch, ARPA_TYPE_ID_BATCH);
+  uint16_t pos = 0;
+  uint8_t count = 0;
+  while (pos < this->forwardQueueLen)
+  {
+    uint8_t entryLen = this->forwardQueue[pos];
+    if (batchLen + 1 + entryLen > ARPA_FORWARD_BATCH_BYTES)
+      break;
+    memcpy(batch + batchLen, this->forwardQueue + pos, 1 + entryLen);
+    batchLen += 1 + entryLen;
+    pos += 1 + entryLen;
+    ++count;
+  }
+
+  // A single message goes as it is, without the batch overhead
+  bool sent;
+  if (count <= 1)
+  {
+    count = 1;
+    sent = this->SendDatagram(this->baseId, this->forwardQueue + 1, this->forwardQueue[0]);
+  }
+  else
+    sent = this->SendDatagram(this->baseId, batch, batchLen);
+
+  if (sent)
+  {
+    this->DequeueForward(count);
+    this->forwardRetryDelay = 0;
+    this->routeFailures = 0;
+    return true;
+  }
+
+  // Try again later with a growing random backoff, the messages stay queued
+  this->forwardRetryDelay = this->forwardRetryDelay == 0 ? ARPA_FORWARD_RETRY_DELAY : this->forwardRetryDelay * 2;
+  if (this->forwardRetryDelay > ARPA_FORWARD_RETRY_MAX)
+    this->forwardRetryDelay = ARPA_FORWARD_RETRY_MAX;
+  this->forwardRetryAt = millis() + random(this->forwardRetryDelay / 2, this->forwardRetryDelay);
+
+  // A busy next hop misses the odd frame, after a few in a row it is probably gone,
+  // so find another way to the base
+  if (++this->routeFailures >= ARPA_ROUTE_MAX_FAILURES)
+  {
+    LOG(ARPA_EV_NEXT_HOP_LOST, this->baseId);
+    this->routeFailures = 0;
+    // The next hop may well have got them and only its ACKs were lost, resending
+    // them for ever would fill the channel with copies
+    this->DequeueForward(count);
+    this->forwardDropped += count;
+    this->StartRouteDiscovery();
+  }
+  return false;
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint32_t Arpa_RF95_T<Profile, Role, Header, Log>::GetForwardDropCount() const
+{
+  return this->forwardDropped;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::AddRoute(const uint8_t destId, const uint8_t nextHopId)
+{
+  // Reuse the entry for the node, else a free one, else the least recently used
+  uint32_t now = millis();
+  Arpa_route *route = &this->routes[0];
+  for (uint8_t i = 0; i < Role::routes; ++i)
+  {
+    Arpa_route *r = &this->routes[i];
+    if (r->destId == destId)
+    {
+      route = r;
+      break;
+    }
+    if (route->destId < 0)
+      continue;
+    if (r->destId < 0 || now - r->lastUsed > now - route->lastUsed)
+      route = r;
+  }
+
+  route->destId = destId;
+  route->nextHopId = nextHopId;
+  route->lastUsed = millis();
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint8_t Arpa_RF95_T<Profile, Role, Header, Log>::LookupRoute(const uint8_t destId) const
+{
+  for (uint8_t i = 0; i < Role::routes; ++i)
+  {
+    if (this->routes[i].destId == destId)
+      return this->routes[i].nextHopId;
+  }
+  // Not relayed through anyone else, it must be a neighbor
+  return destId;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::DiscoverRoute()
+{
+  Arpa_msg_view view;
+
+  if (this->IsBase())
+    return true;
+  if (!this->StartRouteDiscovery())
+    return false;
+
+  // WaitForMessage() takes the adverts that come back and keeps the best one
+  uint16_t timeout = this->recvTimeout;
+  while (millis() - this->lastDiscovery < ARPA_ROUTE_DISCOVERY_TIMEOUT)
+  {
+    this->recvTimeout = ARPA_ROUTE_DISCOVERY_TIMEOUT - (millis() - this->lastDiscovery);
+    Arpa_msg_type msgType = this->WaitForMessage(view);
+
+    // A forwarder keeps relaying meanwhile, uplink messages just wait in the queue
+    if (this->IsRelaying() && msgType != ARPA_TYPE_ID_INVALID && msgType != ARPA_TYPE_ID_ADR)
+      this->ForwardDatagram();
+    this->ReleaseMessage();
+  }
+  this->recvTimeout = timeout;
+
+  return this->FinishRouteDiscovery();
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::StartRouteDiscovery()
+{
+  LOG(ARPA_EV_ROUTE_REQUEST);
+
+  // Kept if nobody answers, the route timeout drops it if the next hop is really gone
+  this->oldRouteValid = this->routeValid;
+  this->oldRouteNextHop = this->baseId;
+  this->oldRouteHops = this->routeHops;
+
+  this->routeValid = false;
+  this->discovering = true;
+  bool sent = this->SendMessage(RH_BROADCAST_ADDRESS, ARPA_TYPE_ID_ROUTE, "", 0);
+  // Adverts are collected for ARPA_ROUTE_DISCOVERY_TIMEOUT from here
+  this->lastDiscovery = millis();
+  if (!sent)
+  {
+    this->discovering = false;
+    this->routeValid = this->oldRouteValid;
+    return false;
+  }
+  return true;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::FinishRouteDiscovery()
+{
+  this->discovering = false;
+
+  if (!this->routeValid)
+  {
+    LOG(ARPA_EV_ROUTE_NONE);
+    this->routeValid = this->oldRouteValid;
+    this->baseId = this->oldRouteNextHop;
+    this->routeHops = this->oldRouteHops;
+    return false;
+  }
+
+  LOG(ARPA_EV_ROUTE_FOUND, this->baseId, this->routeHops);
+
+  // Queued messages waited for the route, send them now
+  if (this->forwardRetryDelay > 0)
+    this->forwardRetryAt = millis();
+  return true;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::TakeRouteMessage(const uint8_t *data, const uint8_t len)
+{
+  // A request: neighbors that can reach a base answer it
+  if (len < ARPA_ROUTE_LENGTH)
+  {
+    if (this->IsBase() || (this->IsRelaying() && this->routeValid))
+    {
+      // Our next hop lost its route, so did we, and answering it would make a loop
+      if (!this->IsBase() && this->fromId == this->baseId)
+      {
+        this->routeValid = false;
+        return;
+      }
+      // Broadcast rather than answer the requester, so the answer needs no link ACKs
+      // and the other neighbors learn from it as well. SendRouteAdvertIfDue() sends it.
+      if (!this->routeReplyDue)
+      {
+        this->routeReplyDue = true;
+        this->routeReplyAt = millis() + random(0, ARPA_ROUTE_REPLY_JITTER);
+      }
+    }
+    return;
+  }
+
+  // An advert, bases are the root and have no next hop
+  uint8_t hops = data[ARPA_ROUTE_HOPS_BYTE_POS] + 1;
+  int16_t rssi = this->driver->lastRssi();
+  if (this->IsBase() || hops > ARPA_DEFAULT_TTL)
+    return;
+
+  if (this->routeValid && this->fromId == this->baseId)
+  {
+    // Our next hop, its hop count may have changed
+    this->routeHops = hops;
+    this->routeRssi = rssi;
+    this->routeHeard = millis();
+    return;
+  }
+
+  // Take a shorter route, or while discovering an equally short but stronger one
+  if (!this->routeValid || hops < this->routeHops ||
+      (this->discovering && hops == this->routeHops && rssi > this->routeRssi))
+  {
+    this->baseId = this->fromId;
+    this->routeHops = hops;
+    this->routeRssi = rssi;
+    this->routeHeard = millis();
+    this->routeValid = true;
+  }
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SendRouteAdvert()
+{
+  char advert[ARPA_ROUTE_LENGTH];
+  advert[ARPA_ROUTE_HOPS_BYTE_POS] = this->IsBase() ? 0 : this->routeHops;
+  advert[ARPA_ROUTE_ROOT_BYTE_POS] = this->IsBase() ? this->nodeId : this->baseId;
+  // Broadcasts are not acknowledged
+  this->SendMessage(RH_BROADCAST_ADDRESS, ARPA_TYPE_ID_ROUTE, advert, ARPA_ROUTE_LENGTH);
+  this->lastRouteAdvert = millis();
+  this->routeReplyDue = false;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SendRouteAdvertIfDue()
+{
+  if (!this->IsBase() && !(this->IsRelaying() && this->routeValid))
+  {
+    this->routeReplyDue = false;
+    return;
+  }
+  if (millis() - this->lastRouteAdvert < ARPA_ROUTE_ADVERT_INTERVAL &&
+      !(this->routeReplyDue && MillisUntil(this->routeReplyAt) == 0))
+    return;
+
+  this->SendRouteAdvert();
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint8_t Arpa_RF95_T<Profile, Role, Header, Log>::GetRouteHops() const
+{
+  return this->IsBase() ? 0 : this->routeHops;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::HasRoute() const
+{
+  return this->IsBase() || this->routeValid;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::IsBase() const
+{
+  return Role::base && this->nodeId == this->baseId;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::IsRelaying() const
+{
+  return Role::forwarder && this->relaying;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::SetSleepState(const bool state)
+{
+  // Put device to sleep by setting the drive to sleep
+  if (state)
+  {
+    this->driver->sleep();
+    // millis() does not run while the MCU sleeps, the slot timing is lost without another clock
+    if (this->slotClock == NULL)
+      this->slotSync = false;
+  }
+  // Wake up, registers are kept in sleep mode so standby is enough
+  else
+  {
+    this->driver->setModeIdle();
+
+    // Re-init only if the configuration was lost
+    if (this->ReadConfigChecksum() != this->configChecksum)
+    {
+      LOG(ARPA_EV_RADIO_CONFIG_LOST);
+      digitalWrite(this->en, HIGH);
+      // Delays to make sure the module wakes up
+      delay(50);
+      if (!this->InitModule())
+        return false;
+
+      delay(50);
+    }
+  }
+  this->sleepState = state;
+
+  return true;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::GetSleepState() const
+{
+  return this->sleepState;
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint8_t Arpa_RF95_T<Profile, Role, Header, Log>::GetFromId() const
+{
+  return this->fromId;
+}
+
+template <class Profile, class Role, class Header, class Log>
+int16_t Arpa_RF95_T<Profile, Role, Header, Log>::GetCurrentConnectionOriginId() const
+{
+  return this->currentConnectionOriginId;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SetBaseId(const uint8_t id)
+{
+  this->baseId = id;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SetNodeId(const uint8_t id)
+{
+  this->nodeId = id;
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint8_t Arpa_RF95_T<Profile, Role, Header, Log>::GetBaseId() const
+{
+  return this->baseId;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SetDataRate(const uint8_t sf, const uint8_t cr, const int8_t power)
+{
+  this->spreadingFactor = constrain(sf, 7, 12);
+  this->codingRate = constrain(cr, 5, 8);
+  this->txPower = constrain(power, ARPA_ADR_MIN_POWER, (int8_t)this->power);
+
+  if (!this->sleepState)
+    this->ApplyDataRate();
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::ResetDataRate()
+{
+  this->SetDataRate(Profile::sf, Profile::cr, this->power);
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint8_t Arpa_RF95_T<Profile, Role, Header, Log>::GetSpreadingFactor() const
+{
+  return this->spreadingFactor;
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint8_t Arpa_RF95_T<Profile, Role, Header, Log>::GetCodingRate() const
+{
+  return this->codingRate;
+}
+
+template <class Profile, class Role, class Header, class Log>
+int8_t Arpa_RF95_T<Profile, Role, Header, Log>::GetTxPower() const
+{
+  return this->txPower;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::ApplyDataRate()
+{
+  /* SX1276 Datasheet page 27 explains more on these parameters
+   * the spreading factor should be matched between sensor node and gateway.
+   * The coding rate is sent in the explicit LoRa header, so it can differ per node.
+  */
+  this->driver->setSpreadingFactor(this->spreadingFactor);
+  this->driver->setCodingRate4(this->codingRate);
+  this->driver->setTxPower(this->txPower, false);
+  LOG(ARPA_EV_DATA_RATE_SET, this->spreadingFactor, this->codingRate, this->txPower);
+
+  // Every configuration change ends here, remember it for waking up
+  this->configChecksum = this->ReadConfigChecksum();
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint16_t Arpa_RF95_T<Profile, Role, Header, Log>::ReadConfigChecksum()
+{
+  static const uint8_t registers[] = {
+      RH_RF95_REG_06_FRF_MSB, RH_RF95_REG_07_FRF_MID, RH_RF95_REG_08_FRF_LSB,
+      RH_RF95_REG_09_PA_CONFIG, RH_RF95_REG_1D_MODEM_CONFIG1, RH_RF95_REG_1E_MODEM_CONFIG2,
+      RH_RF95_REG_20_PREAMBLE_MSB, RH_RF95_REG_21_PREAMBLE_LSB, RH_RF95_REG_26_MODEM_CONFIG3,
+      RH_RF95_REG_4D_PA_DAC};
+
+  // Only the LoRa bit of the mode register, the mode itself changes all the time
+  uint16_t checksum = this->driver->spiRead(RH_RF95_REG_01_OP_MODE) & 0x80;
+  for (uint8_t i = 0; i < sizeof(registers); ++i)
+    checksum = (uint16_t)((checksum << 3) | (checksum >> 13)) ^ this->driver->spiRead(registers[i]);
+
+  return checksum;
+}
+
+// Protocol implementations
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::Synchronize()
+{
+  LOG(ARPA_EV_SYN_SEND, this->baseId);
+  Arpa_msg_view reply;
+
+  // Send a synchronize message
+  if (!this->SendMessage(this->baseId, ARPA_TYPE_ID_SYN, "", 0))
+  {
+    LOG(ARPA_EV_SYN_FAILED);
+    // TODO: handle resending syn according to protocol somehome (either in here or in the caller)
+    return false;
+  }
+
+  // Wait for a syn back, only its type matters
+  Arpa_msg_type msgType = this->WaitForMessage(reply);
+  this->ReleaseMessage();
+  switch (msgType)
+  {
+  case ARPA_TYPE_ID_SYN:
+    return true;
+    break;
+
+  case ARPA_TYPE_ID_NACK:
+    LOG(ARPA_EV_SYN_NACK);
+    // TODO: handle resending syn according to protocol somehome (either in here or in the caller)
+    return false;
+    break;
+
+  case ARPA_TYPE_ID_INVALID:
+  default:
+    LOG(ARPA_EV_SYN_TIMEOUT);
+    return false;
+    break;
+  }
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::Close()
+{
+  LOG(ARPA_EV_FIN_SEND, this->baseId);
+
+  // Send a close message
+  if (!this->SendMessage(this->baseId, ARPA_TYPE_ID_FIN, "", 0))
+  {
+    LOG(ARPA_EV_FIN_FAILED);
+    return false;
+  }
+
+  return true;
+}
+
+template <class Profile, class Role, class Header, class Log>
+int8_t Arpa_RF95_T<Profile, Role, Header, Log>::WaitForSyn()
+{
+  uint8_t buf[RH_RF95_MAX_MESSAGE_LEN];
+
+  // One-shot messages are dropped
+  while (true)
+  {
+    uint8_t len = RH_RF95_MAX_MESSAGE_LEN; // The len variable is used as an input and must be set every loop
+    if (this->WaitForSynOrOneShot(buf, &len) == ARPA_TYPE_ID_SYN)
+      break;
+  }
+
+  return currentConnectionOriginId;
+}
+
+template <class Profile, class Role, class Header, class Log>
+Arpa_msg_type Arpa_RF95_T<Profile, Role, Header, Log>::WaitForSynOrOneShot(uint8_t *buf, uint8_t *len)
+{
+  Arpa_msg_type msgType;
+  uint8_t bufLen = *len;
+  this->currentConnectionId = -1;
+  this->currentConnectionOriginId = -1;
+
+  // Wait forever for a syn or one-shot message
+  while (true)
+  {
+    *len = bufLen; // The len variable is used as an input and must be set every loop
+
+    msgType = this->WaitForMessage(buf, len);
+    if (msgType == ARPA_TYPE_ID_INVALID)
+      continue;
+
+    // Send back syn if we received a syn
+    if (msgType == ARPA_TYPE_ID_SYN)
+    {
+      LOG(ARPA_EV_SYN_RECV, this->originId);
+
+      if (this->SendMessage(this->fromId, ARPA_TYPE_ID_SYN, "", 0))
+      {
+        this->currentConnectionId = this->fromId;
+        this->currentConnectionOriginId = this->originId;
+        this->timeSinceConnectionActivity = millis();
+        return msgType;
+      }
+    }
+    else if (msgType == ARPA_TYPE_ID_DATA_ONESHOT)
+    {
+      // Already acknowledged by the link layer, nothing to send back
+      if (this->TakeOneShot(buf, len) && !this->IsDuplicate(this->originId))
+        return msgType;
+    }
+    else if (msgType == ARPA_TYPE_ID_CHECK)
+    {
+      this->SendMessage(this->fromId, ARPA_TYPE_ID_CHECK, "", 0);
+    }
+    else if (msgType == ARPA_TYPE_ID_ADR)
+    {
+      this->ReplyDataRate(buf, *len);
+    }
+    else if (msgType == ARPA_TYPE_ID_UPDATE)
+    {
+      this->ReplyUpdateChunk(buf, *len);
     }
     else
     {
       // Send back nack if a node tries to send something other than a syn or check
       this->SendMessage(this->fromId, ARPA_TYPE_ID_NACK, "", 0);
-      LOG_LN_F("Arpa_RF95: WaitForSyn() Timed out or got no syn");
+      LOG(ARPA_EV_SYN_UNEXPECTED, msgType);
     }
   }
+}
 
-  return currentConnectionOriginId;
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SetSlottedAccess(const bool enabled)
+{
+  this->slotted = enabled;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SetBeaconing(const bool enabled)
+{
+  this->beaconing = enabled;
+  // Send the first beacon right away
+  this->lastBeacon = millis() - ARPA_BEACON_INTERVAL;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SetFrameSlots(const uint8_t slots)
+{
+  this->frameSlots = slots;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SetSlotClock(uint32_t (*clock)())
+{
+  this->slotClock = clock;
+  this->slotSync = false;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::HasSlotSync() const
+{
+  return this->slotSync && this->SlotMillis() - this->slotSyncAt < ARPA_SLOT_SYNC_LIFETIME;
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint32_t Arpa_RF95_T<Profile, Role, Header, Log>::MillisUntilOwnSlot() const
+{
+  if (this->frameSlots == 0 || !this->HasSlotSync())
+    return 0;
+
+  uint32_t frameLength = (uint32_t)this->frameSlots * this->slotLength;
+  uint32_t slotStart = (uint32_t)(this->nodeId % this->frameSlots) * this->slotLength + ARPA_SLOT_GUARD;
+  uint32_t intoFrame = (this->SlotMillis() + this->slotOffset) % frameLength;
+  uint32_t wait = (slotStart + frameLength - intoFrame) % frameLength;
+
+  // Just past the start there is still room for the frame
+  return wait > frameLength - ARPA_SLOT_GUARD ? 0 : wait;
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint32_t Arpa_RF95_T<Profile, Role, Header, Log>::SlotMillis() const
+{
+  return this->slotClock != NULL ? this->slotClock() : millis();
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint32_t Arpa_RF95_T<Profile, Role, Header, Log>::GetChannelBusyCount() const
+{
+  return this->channelBusyCount;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::WaitForBeacon()
+{
+  LOG(ARPA_EV_BEACON_WAIT);
+  Arpa_msg_view view;
+
+  if (this->sleepState)
+    this->SetSleepState(false);
+
+  // WaitForMessage() takes the beacon and keeps going, stop as soon as we are synchronized
+  unsigned long start = millis();
+  uint16_t timeout = this->recvTimeout;
+  this->slotSync = false;
+  while (!this->slotSync && millis() - start < ARPA_BEACON_INTERVAL + ARPA_SLOT_LENGTH)
+  {
+    this->recvTimeout = ARPA_SLOT_LENGTH;
+    this->WaitForMessage(view);
+    this->ReleaseMessage();
+  }
+  this->recvTimeout = timeout;
+  return this->slotSync;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::WaitForClearChannel()
+{
+  // Waiting for our own slot is not backoff, the budget starts after it
+  uint32_t start = millis();
+  uint32_t budget = Profile::recvTimeout / 2;
+
+  for (uint8_t attempt = 0; attempt < ARPA_LBT_MAX_ATTEMPTS; ++attempt)
+  {
+    // Nodes woken by the same beacon or event would all pick the next slot,
+    // so every attempt goes into a random one of the next few. With assigned slots
+    // the first goes into our own, it is only busy if another node shares it.
+    bool synced = this->slotted && this->HasSlotSync();
+    if (synced && attempt == 0 && this->frameSlots > 0)
+    {
+      delay(this->MillisUntilOwnSlot());
+      start = millis();
+    }
+    else if (synced)
+    {
+      uint32_t backoff = (uint32_t)random(0, ARPA_LBT_BACKOFF_SLOTS) * this->slotLength;
+      if (millis() - start + backoff + this->slotLength > budget)
+        return false;
+      delay(backoff);
+      this->WaitForSlot();
+    }
+
+    if (!this->driver->isChannelActive())
+      return true;
+
+    ++this->channelBusyCount;
+    LOG(ARPA_EV_CHANNEL_BUSY);
+    if (!synced)
+    {
+      uint32_t backoff = random(ARPA_LBT_BACKOFF_MIN, ARPA_LBT_BACKOFF_MAX);
+      if (millis() - start + backoff > budget)
+        return false;
+      delay(backoff);
+    }
+  }
+  return false;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::WaitForSlot()
+{
+  uint32_t baseTime = this->SlotMillis() + this->slotOffset;
+  uint32_t intoSlot = baseTime % this->slotLength;
+  if (intoSlot != 0)
+    delay(this->slotLength - intoSlot);
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SendBeaconIfDue()
+{
+  if (!this->beaconing || millis() - this->lastBeacon < ARPA_BEACON_INTERVAL)
+    return;
+
+  uint32_t now = millis();
+  this->lastBeacon = now;
+
+  char beacon[ARPA_TIME_LENGTH];
+  for (uint8_t i = 0; i < 4; ++i)
+    beacon[ARPA_TIME_MILLIS_BYTE_POS + i] = (now >> (8 * i)) & 0xFF;
+  beacon[ARPA_TIME_SLOT_BYTE_POS] = this->slotLength & 0xFF;
+  beacon[ARPA_TIME_SLOT_BYTE_POS + 1] = this->slotLength >> 8;
+  beacon[ARPA_TIME_FRAME_BYTE_POS] = this->frameSlots;
+
+  // Broadcasts are not acknowledged
+  this->SendMessage(RH_BROADCAST_ADDRESS, ARPA_TYPE_ID_TIME, beacon, ARPA_TIME_LENGTH);
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::TakeBeacon(const uint8_t *data, const uint8_t len)
+{
+  // Only the base we send to sets our slots
+  if (len < ARPA_TIME_FRAME_BYTE_POS || this->fromId != this->baseId || this->IsBase())
+    return;
+
+  uint32_t baseTime = 0;
+  for (uint8_t i = 0; i < 4; ++i)
+    baseTime |= (uint32_t)data[ARPA_TIME_MILLIS_BYTE_POS + i] << (8 * i);
+  uint16_t slotLength = data[ARPA_TIME_SLOT_BYTE_POS] | (data[ARPA_TIME_SLOT_BYTE_POS + 1] << 8);
+  if (slotLength == 0)
+    return;
+
+  // The beacon was stamped when the base started sending it, the on air time
+  // is well inside a slot so it is not corrected for
+  this->slotSyncAt = this->SlotMillis();
+  this->slotOffset = baseTime - this->slotSyncAt;
+  this->slotLength = slotLength;
+  this->frameSlots = len > ARPA_TIME_FRAME_BYTE_POS ? data[ARPA_TIME_FRAME_BYTE_POS] : 0;
+  this->slotSync = true;
+
+  LOG(ARPA_EV_SLOT_OFFSET, this->slotOffset);
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::DataRateRequestDue() const
+{
+  return this->adrDue;
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::RequestDataRate()
+{
+  LOG(ARPA_EV_DATA_RATE_REQUEST);
+  Arpa_msg_view reply;
+
+  // The next hop needs our power to know how much of it can be dropped
+  char request = (char)this->txPower;
+  if (!this->SendMessage(this->baseId, ARPA_TYPE_ID_ADR, &request, 1))
+    return false;
+
+  // Reply comes right after the link ACK, don't stay awake for the full receive timeout
+  uint16_t timeout = this->recvTimeout;
+  this->recvTimeout = ARPA_ADR_REPLY_TIMEOUT;
+  Arpa_msg_type msgType = this->WaitForMessage(reply);
+  this->recvTimeout = timeout;
+
+  if (msgType != ARPA_TYPE_ID_ADR || reply.len < ARPA_ADR_LENGTH)
+  {
+    LOG(ARPA_EV_DATA_RATE_TIMEOUT);
+    this->ReleaseMessage();
+    return false;
+  }
+
+  this->adrDue = false;
+  this->adrSends = 0;
+
+  uint8_t sf = this->spreadingFactor, cr = this->codingRate;
+  int8_t power = this->txPower;
+  this->SetDataRate(reply.data[ARPA_ADR_SF_BYTE_POS], reply.data[ARPA_ADR_CR_BYTE_POS], (int8_t)reply.data[ARPA_ADR_POWER_BYTE_POS]);
+  this->ReleaseMessage();
+  return sf != this->spreadingFactor || cr != this->codingRate || power != this->txPower;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::ReplyDataRate(const uint8_t *buf, const uint8_t len)
+{
+  if (len < 1)
+    return;
+  int16_t power = (int8_t)buf[0];
+
+  // The SNR reading saturates around +10 dB, above 0 dB the RSSI over the noise floor is more accurate
+  int16_t snr = this->driver->lastSNR();
+  if (snr > 0)
+    snr = max(snr, (int16_t)(this->driver->lastRssi() - ARPA_ADR_NOISE_FLOOR));
+
+  // SX1276 datasheet table 13: -20 dB at SF12, 2.5 dB less per spreading factor step
+  int16_t demodFloor = -(10 + 5 * (this->spreadingFactor - 6)) / 2;
+  int16_t margin = snr - demodFloor - ARPA_ADR_MARGIN;
+
+  // Spend the first dB of spare margin on a lighter coding rate, the rest on lower TX power.
+  // Short of margin, e.g. the link faded after a step down, the node goes back to the most
+  // robust coding rate and makes up the missing dB with TX power, up to the profile maximum.
+  uint8_t cr = Profile::cr;
+  if (margin < 0)
+    cr = 8;
+  while (cr > 5 && margin > 0)
+  {
+    --cr;
+    --margin;
+  }
+  power -= margin;
+
+  char reply[ARPA_ADR_LENGTH];
+  reply[ARPA_ADR_SF_BYTE_POS] = this->spreadingFactor;
+  reply[ARPA_ADR_CR_BYTE_POS] = cr;
+  reply[ARPA_ADR_POWER_BYTE_POS] = constrain(power, ARPA_ADR_MIN_POWER, Profile::maxPower);
+
+  LOG(ARPA_EV_DATA_RATE_REPLY, snr, cr, reply[ARPA_ADR_POWER_BYTE_POS]);
+
+  this->SendMessage(this->fromId, ARPA_TYPE_ID_ADR, reply, ARPA_ADR_LENGTH);
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint8_t Arpa_RF95_T<Profile, Role, Header, Log>::GetOneShotOriginId() const
+{
+  return this->lastOneShotOriginId;
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint8_t Arpa_RF95_T<Profile, Role, Header, Log>::GetSequence() const
+{
+  return this->lastSequence;
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint32_t Arpa_RF95_T<Profile, Role, Header, Log>::GetDuplicateCount() const
+{
+  return this->dedup.GetDuplicateCount();
+}
+
+template <class Profile, class Role, class Header, class Log>
+Arpa_msg_type Arpa_RF95_T<Profile, Role, Header, Log>::WaitForSessionMessage(uint8_t *buf, uint8_t *len)
+{
+  this->ServiceTimers();
+  this->currentConnectionId = -1;
+  this->currentConnectionOriginId = -1;
+
+  // Only wait until the timers are due again
+  Arpa_msg_view view;
+  uint16_t timeout = this->recvTimeout;
+  this->recvTimeout = max(min(this->GetPollTimeout(), (uint32_t)this->recvTimeout), (uint32_t)1);
+  Arpa_msg_type msgType = this->WaitForMessage(view);
+  this->recvTimeout = timeout;
+  if (msgType == ARPA_TYPE_ID_INVALID)
+  {
+    this->currentConnectionId = -1;
+    this->currentConnectionOriginId = -1;
+    return msgType;
+  }
+
+  msgType = this->TakeSessionMessage(view);
+  if (*len > view.len)
+    *len = view.len;
+  memcpy(buf, view.data, *len);
+  this->ReleaseMessage();
+  return msgType;
+}
+
+template <class Profile, class Role, class Header, class Log>
+Arpa_msg_type Arpa_RF95_T<Profile, Role, Header, Log>::TakeSessionMessage(Arpa_msg_view &view)
+{
+  Arpa_msg_type msgType = view.type;
+
+  this->currentConnectionId = this->fromId;
+  this->currentConnectionOriginId = this->originId;
+  Arpa_session *session = this->FindSession(this->originId);
+
+  switch (msgType)
+  {
+  case ARPA_TYPE_ID_DATA_ONESHOT:
+    // Already acknowledged by the link layer, only a command is sent back.
+    // Also for a copy, its node listens for one all the same.
+    if (!this->TakeOneShot(view))
+      return ARPA_TYPE_ID_INVALID;
+    this->SendQueuedCommand();
+    if (this->IsDuplicate(view.originId))
+      return ARPA_TYPE_ID_INVALID;
+    return msgType;
+
+  case ARPA_TYPE_ID_CHECK:
+    this->SendMessage(this->fromId, ARPA_TYPE_ID_CHECK, "", 0);
+    return ARPA_TYPE_ID_INVALID;
+
+  case ARPA_TYPE_ID_ADR:
+    this->ReplyDataRate(view.data, view.len);
+    return ARPA_TYPE_ID_INVALID;
+
+  case ARPA_TYPE_ID_UPDATE:
+    this->ReplyUpdateChunk(view.data, view.len);
+    return ARPA_TYPE_ID_INVALID;
+
+  case ARPA_TYPE_ID_SYN:
+    // A node that resends its syn because our reply was lost keeps its session
+    session = this->OpenSession(this->originId, this->fromId);
+    if (session == NULL)
+    {
+      LOG(ARPA_EV_SESSION_FULL, this->originId);
+      this->SendMessage(this->fromId, ARPA_TYPE_ID_NACK, "", 0);
+      return ARPA_TYPE_ID_INVALID;
+    }
+
+    if (!this->SendMessage(this->fromId, ARPA_TYPE_ID_SYN, "", 0))
+    {
+      this->CloseSession(session);
+      return ARPA_TYPE_ID_INVALID;
+    }
+    return msgType;
+
+  case ARPA_TYPE_ID_FIN:
+    if (session == NULL)
+      return ARPA_TYPE_ID_INVALID;
+
+    LOG(ARPA_EV_FIN_RECV, this->originId);
+    this->CloseSession(session);
+    return msgType;
+
+  default:
+    // send nack if we get a message from a node without a session
+    if (session == NULL)
+    {
+      LOG(ARPA_EV_NOT_CONNECTED, this->originId);
+      this->SendMessage(this->fromId, ARPA_TYPE_ID_NACK, "", 0);
+      return ARPA_TYPE_ID_INVALID;
+    }
+    if (msgType == ARPA_TYPE_ID_DATA && !this->TakeSequence(view))
+      return ARPA_TYPE_ID_INVALID;
+
+    // Reply with an ack carrying the next command for the node, if we cannot send it back, close the session
+    int8_t command = this->FindCommand(this->originId);
+    if (command >= 0)
+    {
+      if (!this->SendMessage(session->connectionId, ARPA_TYPE_ID_ACK, (const char *)this->commands[command].data, this->commands[command].len))
+      {
+        this->CloseSession(session);
+        return ARPA_TYPE_ID_FIN;
+      }
+      this->RemoveCommand(command);
+    }
+    else if (!this->SendMessage(session->connectionId, ARPA_TYPE_ID_ACK, "", 0))
+    {
+      this->CloseSession(session);
+      return ARPA_TYPE_ID_FIN;
+    }
+
+    // A copy of data we have is only acked again
+    session->lastActivity = millis();
+    if (msgType == ARPA_TYPE_ID_DATA && this->IsDuplicate(view.originId))
+      return ARPA_TYPE_ID_INVALID;
+    ++session->messageCount;
+    return msgType;
+  }
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::QueueCommand(const uint8_t nodeId, const uint8_t *data, const uint8_t len)
+{
+  if (len > ARPA_CMD_MAX_LENGTH || this->commandCount >= Role::commands)
+  {
+    LOG(ARPA_EV_CMD_QUEUE_FULL, nodeId);
+    return false;
+  }
+
+  Arpa_command &command = this->commands[this->commandCount++];
+  command.nodeId = nodeId;
+  command.len = len;
+  memcpy(command.data, data, len);
+  return true;
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint8_t Arpa_RF95_T<Profile, Role, Header, Log>::GetQueuedCommandCount() const
+{
+  return this->commandCount;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SetCommandHandler(Arpa_command_handler handler)
+{
+  this->commandHandler = handler;
+}
+
+template <class Profile, class Role, class Header, class Log>
+int8_t Arpa_RF95_T<Profile, Role, Header, Log>::FindCommand(const uint8_t nodeId) const
+{
+  for (uint8_t i = 0; i < this->commandCount; ++i)
+  {
+    if (this->commands[i].nodeId == nodeId)
+      return i;
+  }
+  return -1;
 }
 
-bool Arpa_RF95::FailureToSendDelay()
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::RemoveCommand(const uint8_t index)
 {
-  if (this->numFailedDelays > APRA_FAIL_DELAYS_MAX)
+  --this->commandCount;
+  memmove(this->commands + index, this->commands + index + 1, (this->commandCount - index) * sizeof(Arpa_command));
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SendQueuedCommand()
+{
+  // A node behind a forwarder is not listening by the time its one-shot gets here
+  if (this->fromId != this->originId)
+    return;
+
+  int8_t command = this->FindCommand(this->originId);
+  if (command < 0)
+    return;
+
+  LOG(ARPA_EV_CMD_SEND, this->originId);
+
+  // Kept for the next one-shot if the node did not hear it
+  if (this->SendMessage(this->fromId, ARPA_TYPE_ID_CMD, (const char *)this->commands[command].data, this->commands[command].len))
+    this->RemoveCommand(command);
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::WaitForCommand()
+{
+  if (this->commandHandler == NULL)
+    return;
+
+  // Only stay on for the whole frame if its preamble started in the window
+  uint32_t window = ARPA_CMD_WINDOW_SYMBOLS * this->SymbolMicros() / 1000 + ARPA_CMD_WINDOW_MARGIN;
+  if (!this->manager.waitAvailableTimeout(window) && !this->IsReceivingSignal())
+    return;
+
+  Arpa_msg_view command;
+  uint16_t timeout = this->recvTimeout;
+  this->recvTimeout = ARPA_ADR_REPLY_TIMEOUT;
+  Arpa_msg_type msgType = this->WaitForMessage(command);
+  this->recvTimeout = timeout;
+
+  if (msgType == ARPA_TYPE_ID_CMD && command.fromId == this->baseId)
+  {
+    LOG(ARPA_EV_CMD_RECV, command.len);
+    this->commandHandler(command.data, command.len);
+  }
+  this->ReleaseMessage();
+}
+
+template <class Profile, class Role, class Header, class Log>
+Arpa_chunk_status Arpa_RF95_T<Profile, Role, Header, Log>::RequestUpdateChunk(const uint16_t version, const uint32_t offset, uint8_t *buf, uint8_t &len)
+{
+  LOG(ARPA_EV_CHUNK_REQUEST, version, (uint16_t)offset);
+  Arpa_msg_view reply;
+
+  char request[ARPA_CHUNK_REQ_LENGTH];
+  request[ARPA_CHUNK_REQ_VERSION_BYTE_POS] = (char)version;
+  request[ARPA_CHUNK_REQ_VERSION_BYTE_POS + 1] = (char)(version >> 8);
+  for (uint8_t i = 0; i < 4; ++i)
+    request[ARPA_CHUNK_REQ_OFFSET_BYTE_POS + i] = (char)(offset >> (8 * i));
+  request[ARPA_CHUNK_REQ_LENGTH_BYTE_POS] = min(len, (uint8_t)ARPA_MAX_CHUNK_LENGTH);
+  if (!this->SendMessage(this->baseId, ARPA_TYPE_ID_UPDATE, request, ARPA_CHUNK_REQ_LENGTH))
+    return ARPA_CHUNK_BUSY;
+
+  uint16_t timeout = this->recvTimeout;
+  this->recvTimeout = ARPA_CHUNK_REPLY_TIMEOUT;
+  Arpa_msg_type msgType = this->WaitForMessage(reply);
+  this->recvTimeout = timeout;
+
+  // A reply to an older request that came in late is for another offset
+  if (msgType != ARPA_TYPE_ID_UPDATE || reply.len < ARPA_CHUNK_HEADER_LENGTH ||
+      (reply.data[ARPA_CHUNK_VERSION_BYTE_POS] | reply.data[ARPA_CHUNK_VERSION_BYTE_POS + 1] << 8) != version ||
+      (reply.data[ARPA_CHUNK_OFFSET_BYTE_POS] | reply.data[ARPA_CHUNK_OFFSET_BYTE_POS + 1] << 8 |
+       (uint32_t)reply.data[ARPA_CHUNK_OFFSET_BYTE_POS + 2] << 16 | (uint32_t)reply.data[ARPA_CHUNK_OFFSET_BYTE_POS + 3] << 24) != offset)
+  {
+    LOG(ARPA_EV_CHUNK_TIMEOUT);
+    this->ReleaseMessage();
+    return ARPA_CHUNK_BUSY;
+  }
+
+  Arpa_chunk_status status = (Arpa_chunk_status)reply.data[ARPA_CHUNK_STATUS_BYTE_POS];
+  if (status == ARPA_CHUNK_OK)
+  {
+    uint8_t chunkLen = reply.len - ARPA_CHUNK_HEADER_LENGTH;
+    const uint8_t *chunk = reply.data + ARPA_CHUNK_HEADER_LENGTH;
+    uint16_t crc = reply.data[ARPA_CHUNK_CRC_BYTE_POS] | reply.data[ARPA_CHUNK_CRC_BYTE_POS + 1] << 8;
+    if (chunkLen > len || Arpa_Crc16(chunk, chunkLen) != crc)
+    {
+      LOG(ARPA_EV_CHUNK_CORRUPT);
+      status = ARPA_CHUNK_BUSY;
+    }
+    else
+    {
+      memcpy(buf, chunk, chunkLen);
+      len = chunkLen;
+    }
+  }
+  else if (status != ARPA_CHUNK_NONE)
+    status = ARPA_CHUNK_BUSY;
+
+  this->ReleaseMessage();
+  return status;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::SetUpdateSource(Arpa_chunk_source source)
+{
+  this->updateSource = source;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::ReplyUpdateChunk(const uint8_t *buf, const uint8_t len)
+{
+  if (len < ARPA_CHUNK_REQ_LENGTH)
+    return;
+
+  uint16_t version = buf[ARPA_CHUNK_REQ_VERSION_BYTE_POS] | buf[ARPA_CHUNK_REQ_VERSION_BYTE_POS + 1] << 8;
+  uint32_t offset = 0;
+  for (uint8_t i = 0; i < 4; ++i)
+    offset |= (uint32_t)buf[ARPA_CHUNK_REQ_OFFSET_BYTE_POS + i] << (8 * i);
+  uint8_t chunkLen = min(buf[ARPA_CHUNK_REQ_LENGTH_BYTE_POS], (uint8_t)ARPA_MAX_CHUNK_LENGTH);
+
+  uint8_t reply[RH_RF95_MAX_MESSAGE_LEN - Header::length];
+  Arpa_chunk_status status = ARPA_CHUNK_NONE;
+  if (this->updateSource != NULL)
+    status = this->updateSource(version, offset, reply + ARPA_CHUNK_HEADER_LENGTH, chunkLen);
+  if (status != ARPA_CHUNK_OK)
+    chunkLen = 0;
+
+  uint16_t crc = Arpa_Crc16(reply + ARPA_CHUNK_HEADER_LENGTH, chunkLen);
+  reply[ARPA_CHUNK_STATUS_BYTE_POS] = status;
+  reply[ARPA_CHUNK_VERSION_BYTE_POS] = buf[ARPA_CHUNK_REQ_VERSION_BYTE_POS];
+  reply[ARPA_CHUNK_VERSION_BYTE_POS + 1] = buf[ARPA_CHUNK_REQ_VERSION_BYTE_POS + 1];
+  memcpy(reply + ARPA_CHUNK_OFFSET_BYTE_POS, buf + ARPA_CHUNK_REQ_OFFSET_BYTE_POS, 4);
+  reply[ARPA_CHUNK_CRC_BYTE_POS] = (uint8_t)crc;
+  reply[ARPA_CHUNK_CRC_BYTE_POS + 1] = (uint8_t)(crc >> 8);
+
+  // Sent once, the node asks again for a chunk that got lost. Retries of a frame this long
+  // would keep the base deaf to every other node for half a minute.
+  this->manager.setRetries(0);
+  this->SendMessage(this->fromId, ARPA_TYPE_ID_UPDATE, (const char *)reply, ARPA_CHUNK_HEADER_LENGTH + chunkLen);
+  this->manager.setRetries(Profile::retries);
+}
+
+template <class Profile, class Role, class Header, class Log>
+uint8_t Arpa_RF95_T<Profile, Role, Header, Log>::GetOpenSessionCount() const
+{
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < Role::sessions; ++i)
+  {
+    if (this->sessions[i].connectionId >= 0)
+      ++count;
+  }
+  return count;
+}
+
+template <class Profile, class Role, class Header, class Log>
+Arpa_session *Arpa_RF95_T<Profile, Role, Header, Log>::FindSession(const uint8_t originId)
+{
+  for (uint8_t i = 0; i < Role::sessions; ++i)
+  {
+    if (this->sessions[i].connectionId >= 0 && this->sessions[i].originId == originId)
+      return &this->sessions[i];
+  }
+  return NULL;
+}
+
+template <class Profile, class Role, class Header, class Log>
+Arpa_session *Arpa_RF95_T<Profile, Role, Header, Log>::OpenSession(const uint8_t originId, const uint8_t connectionId)
+{
+  Arpa_session *session = this->FindSession(originId);
+  for (uint8_t i = 0; session == NULL && i < Role::sessions; ++i)
+  {
+    if (this->sessions[i].connectionId < 0)
+      session = &this->sessions[i];
+  }
+  if (session == NULL)
+    return NULL;
+
+  session->connectionId = connectionId;
+  session->originId = originId;
+  session->lastActivity = millis();
+  session->messageCount = 0;
+  return session;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::CloseSession(Arpa_session *session)
+{
+  session->connectionId = -1; // -1 for a free slot
+  session->originId = -1;
+  session->messageCount = 0;
+}
+
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::ExpireSessions()
+{
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < Role::sessions; ++i)
+  {
+    // Unsigned difference so this stays correct when millis() overflows
+    if (this->sessions[i].connectionId >= 0 && now - this->sessions[i].lastActivity >= Profile::connectionTimeout)
+    {
+      LOG(ARPA_EV_SESSION_TIMEOUT, this->sessions[i].originId);
+      this->CloseSession(&this->sessions[i]);
+    }
+  }
+}
+
+template <class Profile, class Role, class Header, class Log>
+bool Arpa_RF95_T<Profile, Role, Header, Log>::FailureToSendDelay()
+{
+  if (this->numFailedDelays > Profile::failDelaysMax)
     return false;
 
   // Delay according to protocol (random val between the faiureDelay and failureDelay-5)
@@ -508,7 +2226,11 @@ bool Arpa_RF95::FailureToSendDelay()
   return true;
 }
 
-void Arpa_RF95::ResetFailureToSendDelay()
+template <class Profile, class Role, class Header, class Log>
+void Arpa_RF95_T<Profile, Role, Header, Log>::ResetFailureToSendDelay()
 {
-  this->failureDelay = ARPA_FAIL_DELAY;
+  this->failureDelay = Profile::failDelay;
 }
+
+// Compiled for the policies of this build only, see ARPA_ROLE
+template class Arpa_RF95_T<ARPA_PROFILE, ARPA_ROLE, ARPA_HEADER, ARPA_LOG>;
@@ -10,6 +10,8 @@
 #define Arpa_RF95_h
 #include "RHReliableDatagram.h"
 #include "RH_RF95.h"
+#include "Arpa_Dedup.h"
+#include "Arpa_EventLog.h"
 
 #define ARPA_BASE_ID 0
 
@@ -20,13 +22,151 @@
 #define APRA_CONNECTION_TIMEOUT 30000
 #define APRA_FAIL_DELAYS_MAX 3
 
-// Account for id byte and address byte
-#define ARPA_HEADER_LENGTH 2
-// 249 bytes
+// Connections the base can hold open at the same time, see WaitForSessionMessage()
+#define ARPA_MAX_SESSIONS 16
+
+// Data rate a node starts with and falls back to, see RequestDataRate()
+#define ARPA_DEFAULT_SF 12
+#define ARPA_DEFAULT_CR 8
+// Link margin in dB kept above the demodulation floor when picking a data rate
+#define ARPA_ADR_MARGIN 10
+// Lowest TX power in dBm the RFM95 PA_BOOST output supports
+#define ARPA_ADR_MIN_POWER 5
+// Highest TX power in dBm the RFM95 PA_BOOST output supports
+#define ARPA_ADR_MAX_POWER 20
+// Successful sends between data rate requests
+#define ARPA_ADR_INTERVAL 32
+// Failed sends in a row before a node falls back to the default data rate
+#define ARPA_ADR_MAX_FAILURES 3
+#define ARPA_ADR_REPLY_TIMEOUT 5000
+// SX1276 noise floor at 125 kHz: -174 dBm/Hz + 51 dB bandwidth + 6 dB noise figure
+#define ARPA_ADR_NOISE_FLOOR -117
+
+// Byte positions in the data of an ARPA_TYPE_ID_ADR reply.
+// A request carries only the TX power it was sent with.
+#define ARPA_ADR_SF_BYTE_POS 0
+#define ARPA_ADR_CR_BYTE_POS 1
+#define ARPA_ADR_POWER_BYTE_POS 2
+#define ARPA_ADR_LENGTH 3
+
+// Listen before talk: random backoff between CAD attempts, the frame is sent
+// anyway after ARPA_LBT_MAX_ATTEMPTS busy channels so alarms are never held back
+#define ARPA_LBT_BACKOFF_MIN 100
+#define ARPA_LBT_BACKOFF_MAX 1000
+#define ARPA_LBT_MAX_ATTEMPTS 8
+// A frame to the node we handed a message from less than this many ms ago is a reply
+// its sender is waiting for (ACK, data rate, chunk, command), it skips listen before talk
+#define ARPA_LBT_REPLY_WINDOW 1000
+
+// Slotted access: the base broadcasts a time beacon every ARPA_BEACON_INTERVAL,
+// nodes that heard one start frames on slot boundaries of the base clock.
+// A slot fits an SF12 frame and its link ACK.
+#define ARPA_BEACON_INTERVAL 60000
+#define ARPA_SLOT_LENGTH 3000
+// Busy channels back off a random number of slots up to this
+#define ARPA_LBT_BACKOFF_SLOTS 4
+// Assigned slots: a base with frame slots (SetFrameSlots()) divides its clock into frames
+// of that many slots, node n sends in slot n % slots of every frame. Nodes then start
+// ARPA_SLOT_GUARD into their slot, so clocks that drifted apart either way stay inside it.
+#define ARPA_SLOT_GUARD 100
+// A node with a slot clock that runs in deep sleep (SetSlotClock()) stays synchronized
+// this long after a beacon, 50 ppm crystals drift 90 ms apart in that time
+#define ARPA_SLOT_SYNC_LIFETIME 1800000
+
+// Byte positions in the data of an ARPA_TYPE_ID_TIME beacon (little endian).
+// Beacons of older bases end before the frame byte.
+#define ARPA_TIME_MILLIS_BYTE_POS 0
+#define ARPA_TIME_SLOT_BYTE_POS 4
+#define ARPA_TIME_FRAME_BYTE_POS 6
+#define ARPA_TIME_LENGTH 7
+
+// Multi-hop routing: forwarders and bases advertise their hop count to a base,
+// every node sends to the neighbor with the fewest hops (see DiscoverRoute())
+#define ARPA_DEFAULT_TTL 8
+#define ARPA_ROUTE_ADVERT_INTERVAL 300000
+// A route whose next hop was not heard from for this long is dropped
+#define ARPA_ROUTE_TIMEOUT (3UL * ARPA_ROUTE_ADVERT_INTERVAL)
+#define ARPA_ROUTE_DISCOVERY_TIMEOUT 8000
+// Neighbors answer a route request after a random delay up to this, so they don't collide
+#define ARPA_ROUTE_REPLY_JITTER 3000
+// How often a forwarder without a route looks for one
+#define ARPA_ROUTE_RETRY_INTERVAL 60000
+// Forwards that fail in a row before a forwarder looks for another next hop
+#define ARPA_ROUTE_MAX_FAILURES 3
+// Downlink routes (node => next hop) a forwarder remembers
+#define ARPA_MAX_ROUTES 32
+
+// Store and forward: forwarders queue uplink messages and send them to the base
+// as one ARPA_TYPE_ID_BATCH frame when ARPA_FORWARD_BATCH_BYTES are queued or the
+// oldest waited ARPA_FORWARD_BATCH_DELAY. A failed batch is retried after a random
+// backoff starting at ARPA_FORWARD_RETRY_DELAY, doubling up to ARPA_FORWARD_RETRY_MAX,
+// and dropped after ARPA_ROUTE_MAX_FAILURES attempts.
+#define ARPA_FORWARD_QUEUE_BYTES 1024
+#define ARPA_FORWARD_BATCH_BYTES 160
+#define ARPA_FORWARD_BATCH_DELAY 5000
+#define ARPA_FORWARD_RETRY_DELAY 2000
+#define ARPA_FORWARD_RETRY_MAX 30000
+
+// Low power listening: a forwarder with a listen interval (SetListenInterval()) keeps its
+// radio asleep and wakes it every interval for a CAD, staying in RX only while a frame comes in.
+// Frames to a forwarder then carry a preamble as long as the interval plus
+// ARPA_LPL_PREAMBLE_MARGIN symbols, so a CAD always falls into it with time left to lock on.
+#define ARPA_LPL_PREAMBLE_MARGIN 16
+// Symbols between checks of the modem status while the receiver is on after a CAD
+#define ARPA_LPL_CHECK_SYMBOLS 8
+// Preamble of frames to neighbors that listen all the time, the RadioHead default
+#define ARPA_PREAMBLE_LENGTH 8
+
+// Downlink commands the base keeps for nodes (QueueCommand()) until their next uplink
+#define ARPA_CMD_QUEUE_SIZE 16
+#define ARPA_CMD_MAX_LENGTH 16
+// A node waits this long after the link ACK of a one-shot for the preamble of a command,
+// the base sends it after a CAD. Only a node that hears one stays on to receive it.
+#define ARPA_CMD_WINDOW_SYMBOLS 16
+#define ARPA_CMD_WINDOW_MARGIN 20
+
+// Firmware updates: a node fetches an update image (see Arpa_Update) from the base one
+// chunk at a time with RequestUpdateChunk(), whenever it is awake. The reply of an SF12
+// base takes seconds to come back, so it is waited for longer than a data rate.
+#define ARPA_CHUNK_REPLY_TIMEOUT 10000
+
+// Byte positions in the data of an ARPA_TYPE_ID_UPDATE request (little endian)
+#define ARPA_CHUNK_REQ_VERSION_BYTE_POS 0
+#define ARPA_CHUNK_REQ_OFFSET_BYTE_POS 2
+#define ARPA_CHUNK_REQ_LENGTH_BYTE_POS 6
+#define ARPA_CHUNK_REQ_LENGTH 7
+// and in the reply, the chunk follows the header. The CRC-16 is over the chunk.
+#define ARPA_CHUNK_STATUS_BYTE_POS 0
+#define ARPA_CHUNK_VERSION_BYTE_POS 1
+#define ARPA_CHUNK_OFFSET_BYTE_POS 3
+#define ARPA_CHUNK_CRC_BYTE_POS 7
+#define ARPA_CHUNK_HEADER_LENGTH 9
+// 238 bytes
+#define ARPA_MAX_CHUNK_LENGTH (ARPA_MAX_MSG_LENGTH - ARPA_CHUNK_HEADER_LENGTH)
+
+// Byte positions in the data of an ARPA_TYPE_ID_ROUTE advert.
+// A route request has no data.
+#define ARPA_ROUTE_HOPS_BYTE_POS 0
+#define ARPA_ROUTE_ROOT_BYTE_POS 1
+#define ARPA_ROUTE_LENGTH 2
+
+// Account for id byte, address byte, hop count and time to live
+#define ARPA_HEADER_LENGTH 4
+// 247 bytes
 #define ARPA_MAX_MSG_LENGTH RH_RF95_MAX_MESSAGE_LEN - ARPA_HEADER_LENGTH
 
 #define ARPA_ID_BYTE_POS 0
 #define ARPA_ADDR_BYTE_POS 1
+#define ARPA_HOPS_BYTE_POS 2
+#define ARPA_TTL_BYTE_POS 3
+
+// Data messages, one-shot and connected, carry the sequence number of their node
+// after the header, so copies can be dropped (see Arpa_Dedup)
+#define ARPA_SEQ_LENGTH 1
+#define ARPA_ONESHOT_SEQ_BYTE_POS ARPA_HEADER_LENGTH
+#define ARPA_ONESHOT_HEADER_LENGTH (ARPA_HEADER_LENGTH + ARPA_SEQ_LENGTH)
+// 246 bytes, also for connected data
+#define ARPA_MAX_ONESHOT_LENGTH (RH_RF95_MAX_MESSAGE_LEN - ARPA_ONESHOT_HEADER_LENGTH)
 
 enum Arpa_msg_type : uint8_t
 {
@@ -36,16 +176,264 @@ enum Arpa_msg_type : uint8_t
   ARPA_TYPE_ID_ACK = 0x3,
   ARPA_TYPE_ID_NACK = 0x4,
   ARPA_TYPE_ID_CHECK = 0x5,
+  // Data is a command from the base, sent to a node right after its one-shot
+  ARPA_TYPE_ID_CMD = 0x6,
+  // Request for a chunk of a firmware update, and the reply with the chunk
+  ARPA_TYPE_ID_UPDATE = 0x7,
   ARPA_TYPE_ID_DATA = 0xA,
-  ARPA_TYPE_ID_TIME = 0xB
+  ARPA_TYPE_ID_TIME = 0xB,
+  ARPA_TYPE_ID_DATA_ONESHOT = 0xC,
+  ARPA_TYPE_ID_ADR = 0xD,
+  ARPA_TYPE_ID_ROUTE = 0xE,
+  // Data is [length][message with its header] for every message in the batch
+  ARPA_TYPE_ID_BATCH = 0xF
+};
+
+// One open connection on the base
+struct Arpa_session
+{
+  // Node replies are sent to (the forwarder for relayed nodes), -1 for a free slot
+  int16_t connectionId;
+  int16_t originId;
+  // millis() of the last message from the node
+  uint32_t lastActivity;
+  // Messages accepted from the node since the syn
+  uint8_t messageCount;
+};
+
+// Command queued on the base for a node
+struct Arpa_command
+{
+  uint8_t nodeId;
+  uint8_t len;
+  uint8_t data[ARPA_CMD_MAX_LENGTH];
+};
+
+// Next hop towards a node, for messages from the base to the node
+struct Arpa_route
+{
+  // -1 for a free slot
+  int16_t destId;
+  uint8_t nextHopId;
+  // millis() of the last message from the node through nextHopId
+  uint32_t lastUsed;
+};
+
+// A received message, lent out of the receive buffer of Arpa_RF95 without copying.
+// The pointers stay valid until Arpa_RF95::ReleaseMessage(), no other message is
+// received meanwhile.
+struct Arpa_msg_view
+{
+  Arpa_msg_type type;
+  // Hop the frame came from and the node that sent the message
+  uint8_t fromId;
+  uint8_t originId;
+  // The message with its header
+  uint8_t *frame;
+  uint8_t frameLen;
+  // The message without its header
+  uint8_t *data;
+  uint8_t len;
+};
+
+// Called by Arpa_RF95::Poll() for every message it hands to the application.
+// originId is the node the message came from, data holds the message without its header.
+typedef void (*Arpa_message_handler)(const Arpa_msg_type type, const uint8_t originId, uint8_t *data, const uint8_t len);
+
+// Called on a node for every command the base sent down, see Arpa_RF95::SetCommandHandler()
+typedef void (*Arpa_command_handler)(const uint8_t *data, const uint8_t len);
+
+enum Arpa_chunk_status : uint8_t
+{
+  ARPA_CHUNK_OK = 0,
+  // The base does not have the chunk yet (or no reply came), ask again later
+  ARPA_CHUNK_BUSY = 1,
+  // There is no such version, or the offset is past its end
+  ARPA_CHUNK_NONE = 2
+};
+
+// Called on the base for every chunk a node asks for, see Arpa_RF95::SetUpdateSource().
+// Copies up to len bytes of the image at offset into buf and sets len to the bytes copied.
+typedef Arpa_chunk_status (*Arpa_chunk_source)(const uint16_t version, const uint32_t offset, uint8_t *buf, uint8_t &len);
+
+// Policies Arpa_RF95_T is built with, chosen at compile time so an image only carries
+// the code and tables it uses. The #defines above are the values of the default policies.
+
+// Radio profile: data rate, timeouts and retries of the protocol, and the base to start with
+struct Arpa_profile_default
+{
+  static const uint8_t sf = ARPA_DEFAULT_SF;
+  static const uint8_t cr = ARPA_DEFAULT_CR;
+  static const int8_t maxPower = ARPA_ADR_MAX_POWER;
+  static const uint16_t recvTimeout = ARPA_RECV_TIMEOUT;
+  static const uint16_t tranTimeout = ARPA_TRAN_TIMEOUT;
+  static const uint8_t retries = ARPA_NUM_RETRIES;
+  static const uint16_t failDelay = ARPA_FAIL_DELAY;
+  static const uint8_t failDelaysMax = APRA_FAIL_DELAYS_MAX;
+  static const uint16_t connectionTimeout = APRA_CONNECTION_TIMEOUT;
+  static const uint8_t baseId = ARPA_BASE_ID;
+};
+
+// Roles: which parts of the protocol the image runs. Poll(), the timers and the receive
+// path only reach the base and forwarder code of the roles that are compiled in, the rest
+// is dropped with the tables of those roles. Tables a role does not use keep 1 entry,
+// arrays cannot be empty.
+struct Arpa_role_all
+{
+  static const bool node = true;
+  static const bool forwarder = true;
+  static const bool base = true;
+  static const uint8_t sessions = ARPA_MAX_SESSIONS;
+  static const uint8_t commands = ARPA_CMD_QUEUE_SIZE;
+  static const uint8_t routes = ARPA_MAX_ROUTES;
+  static const uint16_t forwardQueueBytes = ARPA_FORWARD_QUEUE_BYTES;
+};
+
+struct Arpa_role_node
+{
+  static const bool node = true;
+  static const bool forwarder = false;
+  static const bool base = false;
+  static const uint8_t sessions = 1;
+  static const uint8_t commands = 1;
+  static const uint8_t routes = 1;
+  static const uint16_t forwardQueueBytes = 1;
+};
+
+struct Arpa_role_forwarder
+{
+  static const bool node = false;
+  static const bool forwarder = true;
+  static const bool base = false;
+  static const uint8_t sessions = 1;
+  static const uint8_t commands = 1;
+  static const uint8_t routes = ARPA_MAX_ROUTES;
+  static const uint16_t forwardQueueBytes = ARPA_FORWARD_QUEUE_BYTES;
+};
+
+struct Arpa_role_base
+{
+  static const bool node = false;
+  static const bool forwarder = false;
+  static const bool base = true;
+  static const uint8_t sessions = ARPA_MAX_SESSIONS;
+  static const uint8_t commands = ARPA_CMD_QUEUE_SIZE;
+  static const uint8_t routes = 1;
+  static const uint16_t forwardQueueBytes = 1;
+};
+
+// Header format: byte positions in the header every message starts with
+struct Arpa_header_default
+{
+  static const uint8_t length = ARPA_HEADER_LENGTH;
+  static const uint8_t idPos = ARPA_ID_BYTE_POS;
+  static const uint8_t addrPos = ARPA_ADDR_BYTE_POS;
+  static const uint8_t hopsPos = ARPA_HOPS_BYTE_POS;
+  static const uint8_t ttlPos = ARPA_TTL_BYTE_POS;
+};
+
+// Logging: where the LOG() events of Arpa_RF95.cpp go (Arpa_EventLog.h).
+// Arpa_log_events keeps them in eventLog, Arpa_log_serial prints them at once as text
+// for debugging, Arpa_log_none compiles them out.
+struct Arpa_log_none
+{
+  static void Begin() {}
+  static void Event(const Arpa_event_id, const uint16_t = 0, const uint16_t = 0, const uint16_t = 0) {}
+};
+
+struct Arpa_log_events
+{
+  static void Begin() {}
+  static void Event(const Arpa_event_id id, const uint16_t a = 0, const uint16_t b = 0, const uint16_t c = 0)
+  {
+    eventLog.Add(id, a, b, c);
+  }
+};
+
+struct Arpa_log_serial
+{
+  static void Begin()
+  {
+    if (!Serial)
+      Serial.begin(9600);
+  }
+  static void Event(const Arpa_event_id id, const uint16_t a = 0, const uint16_t b = 0, const uint16_t c = 0)
+  {
+    const char *name = Arpa_EventLog::Name(id);
+    Serial.print(name ? name : "EVENT");
+    Serial.print(' ');
+    Serial.print(a);
+    Serial.print(' ');
+    Serial.print(b);
+    Serial.print(' ');
+    Serial.println(c);
+  }
+};
+
+// Sequence numbers are only kept by the roles that receive data, see Arpa_Dedup
+struct Arpa_no_dedup
+{
+  bool IsDuplicate(const uint8_t, const uint8_t, const uint32_t) { return false; }
+  uint32_t GetDuplicateCount() const { return 0; }
+};
+
+template <bool Condition, class IfTrue, class IfFalse>
+struct Arpa_select
+{
+  typedef IfTrue type;
 };
 
-class Arpa_RF95
+template <class IfTrue, class IfFalse>
+struct Arpa_select<false, IfTrue, IfFalse>
+{
+  typedef IfFalse type;
+};
+
+// Firmware images Combined.ino can be built as, picked with -DARPA_IMAGE=ARPA_IMAGE_NODE etc.
+// (see Combined/build_images.sh). A role image only carries the loop and tables of that role,
+// the combined image picks its role from the node type in EEPROM.
+#define ARPA_IMAGE_COMBINED 0
+#define ARPA_IMAGE_NODE 1
+#define ARPA_IMAGE_FORWARDER 2
+#define ARPA_IMAGE_BASE 3
+#ifndef ARPA_IMAGE
+#define ARPA_IMAGE ARPA_IMAGE_COMBINED
+#endif
+
+// The policies of this build, e.g. -DARPA_ROLE=Arpa_role_node for a sensor node image.
+// Arpa_RF95.cpp is compiled for these only.
+#ifndef ARPA_PROFILE
+#define ARPA_PROFILE Arpa_profile_default
+#endif
+#ifndef ARPA_ROLE
+#if ARPA_IMAGE == ARPA_IMAGE_NODE
+#define ARPA_ROLE Arpa_role_node
+#elif ARPA_IMAGE == ARPA_IMAGE_FORWARDER
+#define ARPA_ROLE Arpa_role_forwarder
+#elif ARPA_IMAGE == ARPA_IMAGE_BASE
+#define ARPA_ROLE Arpa_role_base
+#else
+#define ARPA_ROLE Arpa_role_all
+#endif
+#endif
+#ifndef ARPA_HEADER
+#define ARPA_HEADER Arpa_header_default
+#endif
+#ifndef ARPA_LOG
+#if DEBUG == true
+#define ARPA_LOG Arpa_log_serial
+#else
+#define ARPA_LOG Arpa_log_events
+#endif
+#endif
+
+template <class Profile, class Role, class Header, class Log>
+class Arpa_RF95_T
 {
 public:
-  uint8_t baseId = ARPA_BASE_ID;
+  uint8_t baseId = Profile::baseId;
 
-  Arpa_RF95(RH_RF95 *driver, uint8_t _rst, float _freq, int8_t _power, uint8_t _en, uint8_t _nodeId);
+  Arpa_RF95_T(RH_RF95 *driver, uint8_t _rst, float _freq, int8_t _power, uint8_t _en, uint8_t _nodeId);
 
   /// Initializes the module with the correct settings and prepares it to receive and send
   /// data.
@@ -73,6 +461,8 @@ public:
   /// Use to send a message from a node to the base after a connection has been made.
   /// The main difference between this function and SendMessage() is that this function
   /// will wait for a reply from the base station.
+  /// ARPA_TYPE_ID_DATA messages get a sequence number like SendOneShot(), which only moves on
+  /// with the ack, see DataUnconfirmed().
   ///
   /// If the module is asleep, it will be awoken and reinitialized before sending
   ///
@@ -83,10 +473,39 @@ public:
 
   Arpa_msg_type SendConnectedMessage(const uint8_t sendToId, const Arpa_msg_type type, const char *data, const uint8_t len);
 
+  /// Sends data to the base in a single frame without opening a connection.
+  /// The frame carries this node's id and a sequence number. The link layer ACK from the
+  /// next hop is the only reply, so this replaces the Synchronize(), SendConnectedMessage()
+  /// and Close() exchange for short readings.
+  /// MAXIMUM ARPA_MAX_ONESHOT_LENGTH characters (246 bytes).
+  ///
+  /// The sequence number only moves on when the frame was ACKed. A frame that failed may still
+  /// have arrived, so while DataUnconfirmed() send the same data (or part of it) next:
+  /// the base drops it if it did.
+  ///
+  /// If the module is asleep, it will be awoken and reinitialized before sending
+  ///
+  /// \return bool - true if the next hop acknowledged the frame, else false
+  bool SendOneShot(const char *data);
+
+  bool SendOneShot(const char *data, const uint8_t len);
+
+  /// True if a data message went out but no ACK came back, so it may have arrived.
+  /// The next data message keeps its sequence number and has to carry the same data.
+  /// False again once one is ACKed.
+  bool DataUnconfirmed() const;
+  /// Moves on to a new sequence number although the last data message was not confirmed,
+  /// for data that cannot wait behind it. If that message did arrive, the next one is not
+  /// taken for a copy of it.
+  void SkipSequence();
+
   /// Sends data through the module with no additional information or formatting.
   /// Must call "SetSendToId()" first to set the reciving node id.
   /// MAXIMUM RH_RF95_MAX_MESSAGE_LEN characters (251 byte).
   ///
+  /// Listens before talking: the frame waits for a clear channel (CAD) with a random
+  /// backoff, aligned to the base's slots if slotted access is on and synchronized.
+  ///
   /// If the module is asleep, it will be awoken and reinitialized before sending
   ///
   /// \param[in] char* data - the character array to send over LoRa
@@ -101,6 +520,9 @@ public:
   void ResetTransmitTimeout();
 
   /// Block until data is available or until the timeout is reached.
+  /// Time beacons from the base are taken in here and never returned.
+  /// The messages in a batch from a forwarder are returned one per call, all with the
+  /// forwarder as the from id.
   /// When data is available, the message is copied into buf and true is returned.
   /// Certain message type may have no data sent with them (such as a syn). In this
   /// case, no data will be copied to the input buffer
@@ -111,6 +533,21 @@ public:
   /// \return Arpa_msg_type* type - set to the type of message - invalid if no valid message was copied into buf
   Arpa_msg_type WaitForMessage(uint8_t *buf, uint8_t *len);
 
+  /// Same as WaitForMessage(uint8_t *, uint8_t *), but the message is not copied, view points
+  /// into the receive buffer instead. Call ReleaseMessage() when done with it.
+  /// Returns ARPA_TYPE_ID_INVALID at once while the last message is not released.
+  Arpa_msg_type WaitForMessage(Arpa_msg_view &view);
+
+  /// Takes one received frame, or the next message of a batch, without waiting.
+  /// Beacons and route messages are handled here and never returned.
+  /// Same as WaitForMessage(Arpa_msg_view &) otherwise.
+  Arpa_msg_type ReceiveMessage(Arpa_msg_view &view);
+
+  /// Hands the receive buffer back after WaitForMessage() or ReceiveMessage() returned a view
+  void ReleaseMessage();
+
+  /// One-shot messages from any node are returned as ARPA_TYPE_ID_DATA_ONESHOT without
+  /// affecting the open connection, see WaitForSynOrOneShot().
   ///
   /// \return Arpa_msg_type* type - set to the type of message if a valid message was copied into buf,
   ///     invalid if there was an error, and ARPA_TYPE_ID_FIN if the connection was closed
@@ -118,9 +555,38 @@ public:
 
   /// Sets up this node to constantly wait and forward messages received from nodes to the base.
   /// Also forwards nodes from the base back to the node based on the message origin id.
-  /// Only 1 intermediate node is supported.
+  /// Any number of forwarders can be chained: uplink messages go to the next hop of the route
+  /// to the base, downlink messages to the neighbor the node's messages came through.
+  /// The hop count is incremented and the TTL decremented on every hop.
+  /// The route is found and repaired automatically, the base id is only a starting point.
+  ///
+  /// Uplink messages are queued (up to ARPA_FORWARD_QUEUE_BYTES) and sent in batches,
+  /// so a busy base or next hop delays them instead of losing them. When the queue is full
+  /// the oldest messages are dropped, so are messages the next hop never ACKed.
+  /// One-shots the forwarder took before (see Arpa_Dedup) are not queued again.
+  ///
+  /// Never returns, it is StartForwarding() and a Poll() loop.
   void HandleMessageForwarding();
 
+  /// Makes Poll() forward messages the way HandleMessageForwarding() does,
+  /// and starts looking for a route to the base.
+  void StartForwarding();
+
+  /// Uplink messages a forwarder dropped, because its queue was full or the next hop did not ACK them
+  uint32_t GetForwardDropCount() const;
+
+  /// Broadcasts a route request and switches to the neighbor with the fewest hops to a base
+  /// (the strongest one if several are equal). Sets the base id to that neighbor.
+  /// Messages other than route adverts received meanwhile are dropped, except on a forwarder
+  /// which queues them as usual.
+  ///
+  /// \return bool - true if a route was found
+  bool DiscoverRoute();
+
+  /// Hops to the base through the current route, 0 for a base
+  uint8_t GetRouteHops() const;
+  bool HasRoute() const;
+
   /// Delays according to the Failure To Send portion of the protocol.
   /// Internally stores the window size until it is reset.
   bool FailureToSendDelay();
@@ -134,11 +600,23 @@ public:
 
   uint8_t GetBaseId() const;
 
+  /// Set the spreading factor, coding rate denominator and TX power used from now on.
+  /// Applied to the radio right away if it is awake, else on the next InitModule().
+  /// A base keeps its spreading factor for all nodes, as the SX1276 can only
+  /// receive one spreading factor at a time.
+  void SetDataRate(const uint8_t sf, const uint8_t cr, const int8_t power);
+  /// Go back to the profile's spreading factor and coding rate and the power given to the constructor
+  void ResetDataRate();
+
+  uint8_t GetSpreadingFactor() const;
+  uint8_t GetCodingRate() const;
+  int8_t GetTxPower() const;
+
   /// Set the sleep state of the module. True will sleep it, false will wake it up.
   ///
-  /// This function completely disables the module rather than using the
-  /// RFM96W sleep. This means the module is reinitialized after waking and will take
-  /// multiple seconds to wake and be ready to send data.
+  /// Sleeping puts the SX1276 in its sleep mode, which keeps the registers, so waking
+  /// only switches it to standby. The module is reset and initialized again only if its
+  /// configuration no longer matches what InitModule() wrote, e.g. after a brown-out.
   /// All send methods will wake the module before sending data
   ///
   /// Returns false if the module could not be woken (initialized)
@@ -163,14 +641,182 @@ public:
   /// \return bool - false if the close failed.
   bool Close();
 
+  /// Waits forever for a syn and opens a connection with the node that sent it.
+  /// One-shot messages received while waiting are dropped, use WaitForSynOrOneShot()
+  /// on bases that accept them.
+  ///
+  /// \return int8_t - the origin id of the connected node
   int8_t WaitForSyn();
 
+  /// Waits forever for either a syn or a one-shot data message.
+  /// A syn opens a connection the same way as WaitForSyn().
+  /// For a one-shot message the data (without the sequence number) is copied into buf,
+  /// and the sender is available from GetOneShotOriginId() and GetSequence().
+  /// Copies of a one-shot received before are dropped.
+  ///
+  /// \param[in, out] uint8_t* buf - the buffer to store a one-shot message in
+  /// \param[in, out] uint8_t* len - size of the buffer, set to the length of the message after it is copied
+  /// \return Arpa_msg_type - ARPA_TYPE_ID_SYN if a connection was opened,
+  ///   ARPA_TYPE_ID_DATA_ONESHOT if buf holds a one-shot message
+  Arpa_msg_type WaitForSynOrOneShot(uint8_t *buf, uint8_t *len);
+
+  /// Origin id of the last one-shot message received
+  uint8_t GetOneShotOriginId() const;
+  /// Sequence number of the last data message received, one-shot or connected
+  uint8_t GetSequence() const;
+
+  /// Data messages dropped on a base or forwarder because their sequence number was seen before
+  uint32_t GetDuplicateCount() const;
+
+  // Channel access
+
+  /// Turn on slotted access for this node. Sends wait for the next slot of the
+  /// base clock once a beacon was heard, see WaitForBeacon().
+  void SetSlottedAccess(const bool enabled);
+
+  /// Turn the time beacon broadcast on the base on or off. The beacon is sent
+  /// from WaitForSessionMessage().
+  void SetBeaconing(const bool enabled);
+
+  /// Number of slots in a frame, sent in the beacons of the base. Every node then sends
+  /// in its own slot (its node id modulo slots), only nodes sharing one contend for it.
+  /// 0 (the default) lets nodes pick a random slot for every send.
+  void SetFrameSlots(const uint8_t slots);
+
+  /// Clock the slot timing runs on, in milliseconds, millis() if NULL (the default).
+  /// millis() stops while the MCU is in deep sleep, so the slot timing is dropped when the
+  /// module is put to sleep. A clock that keeps running (the RTC) keeps the node synchronized
+  /// for ARPA_SLOT_SYNC_LIFETIME after the beacon, sleep included.
+  void SetSlotClock(uint32_t (*clock)());
+
+  /// Listen up to ARPA_BEACON_INTERVAL for a time beacon from the base.
+  /// A node must call this before a slotted send whenever HasSlotSync() is false.
+  ///
+  /// \return bool - true if the node is synchronized to the base slots
+  bool WaitForBeacon();
+  bool HasSlotSync() const;
+
+  /// Milliseconds until the node's own slot starts (plus ARPA_SLOT_GUARD), so the
+  /// caller can sleep until then. 0 if the base assigns no slots or there is no sync.
+  uint32_t MillisUntilOwnSlot() const;
+
+  /// CAD attempts that found the channel busy since the start
+  uint32_t GetChannelBusyCount() const;
+
+  // Adaptive data rate
+
+  /// True if the node should call RequestDataRate(): after every ARPA_ADR_INTERVAL
+  /// successful sends, and after starting or falling back to the default data rate.
+  bool DataRateRequestDue() const;
+
+  /// Asks the next hop (base or forwarder) for the fastest data rate that keeps
+  /// ARPA_ADR_MARGIN dB of link margin, and switches to it.
+  /// The next hop picks it from the SNR and RSSI of the request.
+  /// After ARPA_ADR_MAX_FAILURES failed sends in a row the node falls back to the default
+  /// data rate on its own.
+  ///
+  /// \return bool - true if the data rate changed, so the caller can persist it
+  bool RequestDataRate();
+
+  /// Base loop that serves up to ARPA_MAX_SESSIONS connections at once.
+  /// Unlike WaitForSyn() and WaitForConnectedMessage(), a syn from a second node opens
+  /// another session instead of being NACKed, so messages from many nodes can be interleaved.
+  /// Copies of data messages received before are ACKed again but not returned.
+  /// Each session closes on a fin or after APRA_CONNECTION_TIMEOUT without activity.
+  /// Blocks for at most the receive timeout, less if a beacon or session timeout is due sooner.
+  /// See Poll() for the same without blocking.
+  ///
+  /// After a return, GetCurrentConnectionOriginId() is the node the message came from.
+  ///
+  /// \param[in, out] uint8_t* buf - the buffer to store the message in
+  /// \param[in, out] uint8_t* len - size of the buffer, set to the length of the message after it is copied
+  /// \return Arpa_msg_type - ARPA_TYPE_ID_SYN if a session was opened, ARPA_TYPE_ID_FIN if one was closed,
+  ///   ARPA_TYPE_ID_DATA_ONESHOT for a one-shot message, the message type for data accepted (and ACKed)
+  ///   on a session, or invalid if nothing was received
+  Arpa_msg_type WaitForSessionMessage(uint8_t *buf, uint8_t *len);
+
+  /// Number of sessions currently open on the base
+  uint8_t GetOpenSessionCount() const;
+
+  // Event loop
+
+  /// Sets the function Poll() hands messages to. On a base these are the messages
+  /// WaitForSessionMessage() returns, the handler can send replies from the call.
+  void SetMessageHandler(Arpa_message_handler handler);
+
+  /// Services the radio without waiting, so one loop can also serve the UART and other timers.
+  /// The driver takes frames off the radio in its DIO0 interrupt, Poll() handles at most one
+  /// of them: a base answers syns, fins and session data and passes messages to the handler,
+  /// a forwarder (see StartForwarding()) queues and forwards them. Beacons, route adverts,
+  /// session timeouts, route repair and forwarding batches are also done here when due.
+  /// Replies and forwarded frames are still sent with link ACKs, which takes their round trip.
+  ///
+  /// \return bool - true if a frame was taken, call again before going idle
+  bool Poll();
+
+  // Low power listening
+
+  /// Sets how often duty cycled forwarders check the channel, 0 (the default) keeps them
+  /// listening all the time. Every node of a network needs the same value: on a forwarder it
+  /// makes Sniff() duty cycle the receiver, on every node it gives frames to a forwarder a
+  /// preamble long enough to be caught. Frames to a base, and replies to a node that is
+  /// waiting for them, keep the short preamble.
+  void SetListenInterval(const uint16_t interval);
+  uint16_t GetListenInterval() const;
+
+  /// Duty cycled receive on a forwarder with a listen interval, call it when Poll() returned false.
+  /// Puts the radio to sleep until the next check is due, then runs a CAD and keeps the
+  /// receiver on only while the modem follows a frame, Poll() takes the frame from there.
+  /// Nodes that listen all the time keep their receiver on.
+  ///
+  /// \return bool - true while the receiver is on, wait for the radio interrupt (at most
+  ///   GetPollTimeout()). False if the radio sleeps, nothing can come in before GetPollTimeout().
+  bool Sniff();
+
+  /// Milliseconds until Poll() has something to do when no frame comes in,
+  /// at most ARPA_RECV_TIMEOUT. The caller can sleep this long or until the radio interrupts.
+  uint32_t GetPollTimeout() const;
+
+  // Downlink commands
+
+  /// Queues a command for a node on the base, it goes down with the next uplink of the node:
+  /// in the ARPA_TYPE_ID_ACK to connected data, or as an ARPA_TYPE_ID_CMD right after the
+  /// link ACK to a one-shot. One-shots relayed by a forwarder get no command, the forwarder
+  /// batches them, so their node stopped listening long before.
+  /// Commands for the same node go down in the order they were queued, one per uplink.
+  ///
+  /// \return bool - false if the command is longer than ARPA_CMD_MAX_LENGTH or the queue is full
+  bool QueueCommand(const uint8_t nodeId, const uint8_t *data, const uint8_t len);
+  uint8_t GetQueuedCommandCount() const;
+
+  /// Sets the function commands from the base are handed to on a node.
+  /// With a handler set, the node listens for ARPA_CMD_WINDOW_SYMBOLS after every one-shot
+  /// that was sent, NULL (the default) saves that receive time.
+  void SetCommandHandler(Arpa_command_handler handler);
+
+  // Firmware updates
+
+  /// Asks the base for a chunk of an update image and waits for it. Chunks come with a
+  /// CRC-16, a chunk that does not match it or the request is dropped.
+  /// Nodes behind a forwarder get ARPA_CHUNK_NONE, forwarders do not relay images.
+  ///
+  /// \param[in, out] uint8_t &len - bytes wanted, at most ARPA_MAX_CHUNK_LENGTH, set to the bytes received.
+  ///   Less than wanted only at the end of the image.
+  /// \return Arpa_chunk_status - ARPA_CHUNK_BUSY also if nothing valid came back
+  Arpa_chunk_status RequestUpdateChunk(const uint16_t version, const uint32_t offset, uint8_t *buf, uint8_t &len);
+
+  /// Sets the function chunks of update images are taken from on the base,
+  /// without one (the default) nodes are told there is no update.
+  void SetUpdateSource(Arpa_chunk_source source);
+
 private:
   /// The underlying rf95 object from the RadioHead library
   RHReliableDatagram manager;
   RH_RF95 *driver;
 
   bool sleepState;
+  // ReadConfigChecksum() after the module was last configured
+  uint16_t configChecksum;
   // signed 16 bit ints for Ids even though tye go from 0-255,
   // -1 is returned for invalid connections
   int16_t currentConnectionId;
@@ -179,13 +825,185 @@ private:
   // originId is the original node the message was sent from
   // fromId is the last node the message was sent from and only used to send back messages
   uint8_t rst, en, power, nodeId, fromId, originId;
+  // Current data rate, power above is the maximum allowed
+  uint8_t spreadingFactor, codingRate;
+  int8_t txPower;
+  uint8_t adrFailures, adrSends;
+  bool adrDue;
+
+  // Channel access
+  bool slotted, slotSync, beaconing;
+  // Base millis() minus the slot clock, valid when slotSync is set
+  uint32_t slotOffset;
+  uint16_t slotLength;
+  uint8_t frameSlots;
+  // Slot clock reading when the last beacon was taken
+  uint32_t slotSyncAt;
+  uint32_t (*slotClock)();
+  uint32_t lastBeacon, channelBusyCount;
   uint16_t numFailedDelays;
   uint32_t failureDelay, timeSinceConnectionActivity;
   float freq;
   uint16_t recvTimeout, tranTimeout;
 
   uint8_t lastReceivedDatagram[RH_RF95_MAX_MESSAGE_LEN];
-  uint16_t lastReceivedDatagramLen;
+  // Last message returned by WaitForMessage(), with its header. Points into
+  // lastReceivedDatagram, past the start for a message taken from a batch.
+  uint8_t *lastFrame;
+  uint8_t lastFrameLen;
+  // millis() when lastFrame was handed out, see ARPA_LBT_REPLY_WINDOW
+  uint32_t receivedAt;
+  // lastFrame is lent out as a view, until ReleaseMessage()
+  bool messageHeld;
+  // Messages of a batch in lastReceivedDatagram not handed out yet
+  uint8_t batchPos, batchEnd;
+
+  // Store and forward queue on forwarders, [length][message with its header]...
+  uint8_t forwardQueue[Role::forwardQueueBytes];
+  uint16_t forwardQueueLen;
+  uint32_t forwardQueueSince, forwardRetryAt, forwardRetryDelay, forwardDropped;
+
+  // Sequence number of the next data message sent by this node,
+  // and whether a message with it went out without an ACK
+  uint8_t sequence;
+  bool sequenceUnconfirmed;
+  // Sender of the last one-shot message received by the base
+  uint8_t lastOneShotOriginId;
+  // Sequence number of the last data message received
+  uint8_t lastSequence;
+  // Sequence numbers seen on a base or forwarder
+  typename Arpa_select<Role::base || Role::forwarder, Arpa_Dedup, Arpa_no_dedup>::type dedup;
+
+  // Route to the base, the next hop is baseId
+  bool routeValid, relaying, discovering;
+  uint8_t routeHops, routeFailures;
+  int16_t routeRssi;
+  uint32_t routeHeard, lastRouteAdvert, lastDiscovery;
+  // Downlink routes on forwarders
+  Arpa_route routes[Role::routes];
+
+  // Route kept while looking for a new one, see StartRouteDiscovery()
+  bool oldRouteValid;
+  uint8_t oldRouteNextHop, oldRouteHops;
+  // Route advert answering a request, sent at routeReplyAt so neighbors don't collide
+  bool routeReplyDue;
+  uint32_t routeReplyAt;
+
+  Arpa_message_handler messageHandler;
+
+  // Commands waiting for their node on the base, oldest first
+  Arpa_command commands[Role::commands];
+  uint8_t commandCount;
+  Arpa_command_handler commandHandler;
+  Arpa_chunk_source updateSource;
+
+  // Low power listening, see Sniff(). The receiver is on after a CAD found a preamble,
+  // sniffAt is the next CAD while it is off and the next modem status check while it is on.
+  uint16_t listenInterval;
+  bool sniffListening;
+  uint32_t sniffAt;
+
+  /// Sends beacons, route adverts and forwarding batches that are due,
+  /// expires sessions and repairs the route of a forwarder
+  void ServiceTimers();
+  /// Milliseconds until millis() reaches due, 0 if it passed
+  static uint32_t MillisUntil(const uint32_t due);
+  /// False while a duty cycled forwarder has its radio asleep
+  bool IsReceiverOn() const;
+  /// True if a frame to sendToId may find it asleep, so it needs the long preamble of SetListenInterval()
+  bool NeedsWakeupPreamble(const uint8_t sendToId, const uint8_t *data, const uint8_t len) const;
+  /// Length of a LoRa symbol at the current spreading factor and 125 kHz
+  uint32_t SymbolMicros() const;
+  /// True while the receiver follows a preamble or frame
+  bool IsReceivingSignal();
+  /// Index of the oldest command queued for the node, -1 if there is none
+  int8_t FindCommand(const uint8_t nodeId) const;
+  void RemoveCommand(const uint8_t index);
+  /// Sends the oldest command for the node a one-shot came from, if it is in range
+  void SendQueuedCommand();
+  /// Listens for a command after a one-shot, see SetCommandHandler()
+  void WaitForCommand();
+  /// Forwards a message that ReceiveMessage() returned on a forwarder
+  void TakeForwardMessage(const Arpa_msg_view &view);
+  /// Answers a message that ReceiveMessage() returned on a base and updates its session.
+  /// Returns what WaitForSessionMessage() does for the message.
+  Arpa_msg_type TakeSessionMessage(Arpa_msg_view &view);
+  /// Broadcasts a route request, the adverts coming back are taken by ReceiveMessage()
+  bool StartRouteDiscovery();
+  /// Ends a discovery after ARPA_ROUTE_DISCOVERY_TIMEOUT, goes back to the old route
+  /// if no advert came. Returns true if a route was found.
+  bool FinishRouteDiscovery();
+
+  /// Fills in the header for a new message, returns its length
+  uint8_t WriteHeader(uint8_t *buf, const Arpa_msg_type type);
+  /// Handles a route advert or request that WaitForMessage() received
+  void TakeRouteMessage(const uint8_t *data, const uint8_t len);
+  /// Broadcasts our hop count to the base
+  void SendRouteAdvert();
+  void SendRouteAdvertIfDue();
+  /// Forwards the last received datagram down the route, or queues it to go up
+  bool ForwardDatagram();
+  bool EnqueueForward(const uint8_t *frame, const uint8_t frameLen);
+  /// Removes the first count messages from the queue
+  void DequeueForward(uint8_t count);
+  /// millis() when the queue should be sent
+  uint32_t ForwardQueueDue() const;
+  /// Sends queued messages to the next hop if they are due, returns true if any were sent
+  bool FlushForwardQueueIfDue();
+  void AddRoute(const uint8_t destId, const uint8_t nextHopId);
+  /// Next hop towards destId, destId itself if no route is known
+  uint8_t LookupRoute(const uint8_t destId) const;
+  /// Only true for roles with base code compiled in
+  bool IsBase() const;
+  /// True on a forwarder after StartForwarding(), only for roles with forwarder code compiled in
+  bool IsRelaying() const;
+
+  // Open connections on the base, used by WaitForSessionMessage()
+  Arpa_session sessions[Role::sessions];
+
+  /// Returns the session of the node or NULL if it has none open
+  Arpa_session *FindSession(const uint8_t originId);
+  /// Returns the session of the node, opening one in a free slot if needed.
+  /// Returns NULL if all sessions are in use.
+  Arpa_session *OpenSession(const uint8_t originId, const uint8_t connectionId);
+  void CloseSession(Arpa_session *session);
+  /// Closes sessions that had no activity for APRA_CONNECTION_TIMEOUT
+  void ExpireSessions();
+
+  /// Waits for a clear channel (and slot) before a transmission. The backoff stops
+  /// after half of recvTimeout, so a peer waiting for the frame does not give up first.
+  /// Returns false if the channel stayed busy, the frame is sent regardless.
+  bool WaitForClearChannel();
+  /// Delays until the start of the next slot of the base clock
+  void WaitForSlot();
+  /// Reading of the slot clock, see SetSlotClock()
+  uint32_t SlotMillis() const;
+  /// Broadcasts a time beacon if beaconing and ARPA_BEACON_INTERVAL passed
+  void SendBeaconIfDue();
+  /// Takes the base clock from a beacon that WaitForMessage() received
+  void TakeBeacon(const uint8_t *data, const uint8_t len);
+
+  /// Applies the current data rate to the radio
+  void ApplyDataRate();
+  /// Checksum of the configuration registers of the radio
+  uint16_t ReadConfigChecksum();
+  /// Answers an ARPA_TYPE_ID_ADR request that WaitForMessage() copied into buf
+  void ReplyDataRate(const uint8_t *buf, const uint8_t len);
+  /// Answers an ARPA_TYPE_ID_UPDATE request with a chunk from the update source
+  void ReplyUpdateChunk(const uint8_t *buf, const uint8_t len);
+
+  /// Strips the sequence number from a one-shot message that WaitForMessage() copied into buf
+  /// and records its origin. Returns false if the message is too short to be valid.
+  bool TakeOneShot(uint8_t *buf, uint8_t *len);
+  /// Same for a view, data and len are moved past the sequence number
+  bool TakeOneShot(Arpa_msg_view &view);
+  /// Strips the sequence number from a data message into lastSequence, see TakeOneShot()
+  bool TakeSequence(uint8_t *buf, uint8_t *len);
+  bool TakeSequence(Arpa_msg_view &view);
+  /// True if lastSequence was seen from the node before
+  bool IsDuplicate(const uint8_t originId);
+  /// Moves on to the sequence number of the next data message, 0 is only sent after a reset
+  void NextSequence();
 
   // const uint8_t ID_SYN = 0x1;
   // const uint8_t ID_FIN = 0x2;
@@ -195,4 +1013,6 @@ private:
   // const uint8_t ID_TIME = 0xB;
 };
 
+typedef Arpa_RF95_T<ARPA_PROFILE, ARPA_ROLE, ARPA_HEADER, ARPA_LOG> Arpa_RF95;
+
 #endif
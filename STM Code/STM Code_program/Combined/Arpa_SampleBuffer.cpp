@@ -0,0 +1,127 @@
+#include "Arpa_SampleBuffer.h"
+
+Arpa_SampleBuffer::Arpa_SampleBuffer()
+{
+  this->head = 0;
+  this->count = 0;
+  this->held = 0;
+  this->alarm = false;
+  this->alarmPending = false;
+  this->dropped = 0;
+}
+
+void Arpa_SampleBuffer::Add(const Arpa_tlv_type type, const int32_t value, const uint8_t sensorId, const uint32_t now, const bool alarm)
+{
+  if (this->count == ARPA_SAMPLE_BUFFER_SIZE)
+  {
+    this->Remove(1);
+    ++this->dropped;
+  }
+
+  Arpa_sample &sample = this->samples[(this->head + this->count) % ARPA_SAMPLE_BUFFER_SIZE];
+  sample.takenAt = now;
+  sample.value = value;
+  sample.type = type;
+  sample.sensorId = sensorId;
+  ++this->count;
+
+  // An alarm does not wait behind held readings
+  if (alarm)
+  {
+    this->alarm = true;
+    this->alarmPending = true;
+    this->held = 0;
+  }
+}
+
+bool Arpa_SampleBuffer::FlushDue(const uint32_t now) const
+{
+  return this->SecondsUntilDue(now) == 0;
+}
+
+bool Arpa_SampleBuffer::AlarmPending() const
+{
+  return this->alarmPending;
+}
+
+void Arpa_SampleBuffer::SendFailed()
+{
+  this->alarmPending = false;
+}
+
+uint32_t Arpa_SampleBuffer::SecondsUntilDue(const uint32_t now) const
+{
+  if (this->count == 0)
+    return UINT32_MAX;
+  if (this->alarm || this->count >= ARPA_SAMPLE_FLUSH_COUNT)
+    return 0;
+
+  uint32_t waited = now - this->samples[this->head].takenAt;
+  return waited >= ARPA_SAMPLE_MAX_LATENCY ? 0 : ARPA_SAMPLE_MAX_LATENCY - waited;
+}
+
+uint8_t Arpa_SampleBuffer::Encode(uint8_t *buf, const uint8_t size, const uint32_t now, uint8_t &count) const
+{
+  Arpa_PayloadWriter payload(buf, size);
+  uint8_t sensorId = 0;
+  uint16_t age = 0;
+
+  uint8_t available = this->held > 0 ? this->held : this->count;
+  for (count = 0; count < available; ++count)
+  {
+    const Arpa_sample &sample = this->samples[(this->head + count) % ARPA_SAMPLE_BUFFER_SIZE];
+    uint32_t sampleAge = now - sample.takenAt;
+    if (sampleAge > UINT16_MAX)
+      sampleAge = UINT16_MAX;
+
+    // Context records only when they change, readings taken together share them.
+    // Stop before a reading whose records do not all fit.
+    uint8_t needed = ARPA_TLV_HEADER_LENGTH + 4;
+    if (sample.sensorId != sensorId)
+      needed += ARPA_TLV_HEADER_LENGTH + 1;
+    if (sampleAge != age)
+      needed += ARPA_TLV_HEADER_LENGTH + 2;
+    if (payload.GetLength() + needed > size)
+      break;
+
+    if (sample.sensorId != sensorId)
+      payload.AddSensor(sensorId = sample.sensorId);
+    if (sampleAge != age)
+      payload.AddAge(age = sampleAge);
+    payload.AddReading(sample.type, sample.value);
+  }
+
+  return payload.GetLength();
+}
+
+void Arpa_SampleBuffer::Remove(uint8_t count)
+{
+  if (count > this->count)
+    count = this->count;
+
+  this->head = (this->head + count) % ARPA_SAMPLE_BUFFER_SIZE;
+  this->count -= count;
+  this->held = this->held > count ? this->held - count : 0;
+  if (this->count == 0)
+    this->alarm = this->alarmPending = false;
+}
+
+void Arpa_SampleBuffer::Hold(const uint8_t count)
+{
+  this->held = count < this->count ? count : this->count;
+}
+
+bool Arpa_SampleBuffer::IsHeld() const
+{
+  return this->held > 0;
+}
+
+uint8_t Arpa_SampleBuffer::GetCount() const
+{
+  return this->count;
+}
+
+uint32_t Arpa_SampleBuffer::GetDropCount() const
+{
+  return this->dropped;
+}
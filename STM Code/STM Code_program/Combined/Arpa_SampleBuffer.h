@@ -0,0 +1,80 @@
+#pragma once
+#include "Arpa_Payload.h"
+
+// Readings a sensor node keeps between radio wakeups
+#define ARPA_SAMPLE_BUFFER_SIZE 32
+// Send once this many readings wait
+#define ARPA_SAMPLE_FLUSH_COUNT 12
+// Send once the oldest reading waited this many seconds
+#define ARPA_SAMPLE_MAX_LATENCY 3600
+
+struct Arpa_sample
+{
+  uint32_t takenAt; // Seconds, on the clock passed to Add()
+  int32_t value;
+  Arpa_tlv_type type;
+  uint8_t sensorId;
+};
+
+// Ring buffer of readings on a sensor node.
+//
+// Readings are collected while the radio sleeps and sent together, as many as fit
+// in each frame, so the radio is woken and a frame sent once for many readings.
+// The buffer is due to be sent when ARPA_SAMPLE_FLUSH_COUNT readings wait, the oldest
+// waited ARPA_SAMPLE_MAX_LATENCY seconds, or an alarm reading was added.
+//
+// Times are seconds on a clock that keeps running in deep sleep (the RTC), millis() stops there.
+class Arpa_SampleBuffer
+{
+public:
+  Arpa_SampleBuffer();
+
+  /// Adds a reading. When the buffer is full the oldest reading is overwritten.
+  /// \param alarm Makes the buffer due at once, for readings that should not wait
+  void Add(const Arpa_tlv_type type, const int32_t value, const uint8_t sensorId, const uint32_t now, const bool alarm = false);
+
+  /// True if the readings should be sent now
+  bool FlushDue(const uint32_t now) const;
+
+  /// True while an alarm reading added since the last failed send waits.
+  /// It goes out at once, a retry backoff of the caller is only for resending it.
+  bool AlarmPending() const;
+
+  /// Sending the readings failed, a pending alarm was tried and waits for the retry like the rest
+  void SendFailed();
+
+  /// Seconds until the oldest reading reaches ARPA_SAMPLE_MAX_LATENCY,
+  /// 0 if the buffer is due already, UINT32_MAX if it is empty
+  uint32_t SecondsUntilDue(const uint32_t now) const;
+
+  /// Encodes as many of the oldest readings as fit into one payload.
+  /// The readings stay in the buffer until Remove() is called, so nothing is lost if sending fails.
+  /// \param count Set to the number of readings encoded
+  /// \return Length of the payload
+  uint8_t Encode(uint8_t *buf, const uint8_t size, const uint32_t now, uint8_t &count) const;
+
+  /// Removes the oldest count readings, after they were sent
+  void Remove(uint8_t count);
+
+  /// Keeps Encode() to the oldest count readings until they are removed. For readings whose
+  /// frame failed: it may have arrived anyway, so they go out again under the same sequence
+  /// number (see Arpa_RF95::SendOneShot()) and no reading added since may go with them.
+  void Hold(const uint8_t count);
+  /// False once the held readings were removed, or an alarm released them
+  bool IsHeld() const;
+
+  uint8_t GetCount() const;
+
+  /// Readings overwritten because the buffer was full
+  uint32_t GetDropCount() const;
+
+private:
+  Arpa_sample samples[ARPA_SAMPLE_BUFFER_SIZE];
+  uint8_t head, count;
+  // Readings of a failed frame at the head, see Hold()
+  uint8_t held;
+  bool alarm;
+  // An alarm not tried yet, see AlarmPending()
+  bool alarmPending;
+  uint32_t dropped;
+};
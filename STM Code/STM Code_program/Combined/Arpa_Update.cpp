@@ -0,0 +1,272 @@
+#include "Arpa_Update.h"
+#include "Arpa_Crc.h"
+#include <string.h>
+
+// Bytes read from the flash at a time, to copy or check it
+#define ARPA_UPDATE_BLOCK_LENGTH 32
+
+Arpa_Update::Arpa_Update(Arpa_flash_read readFirmware, Arpa_flash_read readStaging, Arpa_flash_write writeStaging,
+                         const uint16_t currentVersion, const uint32_t maxSize)
+{
+  this->readFirmware = readFirmware;
+  this->readStaging = readStaging;
+  this->writeStaging = writeStaging;
+  this->currentVersion = currentVersion;
+  this->maxSize = maxSize;
+  this->Abandon();
+}
+
+void Arpa_Update::Start(const uint16_t version)
+{
+  memset(&this->state, 0, sizeof(this->state));
+  this->state.version = version;
+  this->writeFailed = false;
+}
+
+void Arpa_Update::Resume(const Arpa_update_state &state)
+{
+  this->state = state;
+  this->writeFailed = false;
+}
+
+void Arpa_Update::Abandon()
+{
+  this->Start(0);
+}
+
+bool Arpa_Update::InProgress() const
+{
+  return this->state.version != 0;
+}
+
+uint16_t Arpa_Update::GetVersion() const
+{
+  return this->state.version;
+}
+
+uint32_t Arpa_Update::GetImageOffset() const
+{
+  return this->state.imageOffset;
+}
+
+const Arpa_update_state &Arpa_Update::GetState() const
+{
+  return this->state;
+}
+
+bool Arpa_Update::Take(const uint8_t *data, const uint8_t len)
+{
+  this->writeFailed = false;
+  if (!this->InProgress() || this->IsComplete())
+    return false;
+
+  uint8_t pos = 0;
+  if (this->state.imageOffset < ARPA_UPDATE_HEADER_LENGTH)
+  {
+    // The header may be split over chunks too
+    pos = ARPA_UPDATE_HEADER_LENGTH - this->state.imageOffset;
+    if (pos > len)
+      pos = len;
+    memcpy(this->state.header + this->state.imageOffset, data, pos);
+    this->state.imageOffset += pos;
+
+    if (this->state.imageOffset == ARPA_UPDATE_HEADER_LENGTH && !this->TakeHeader())
+      return false;
+  }
+
+  if (pos < len)
+  {
+    bool taken = this->state.header[ARPA_UPDATE_FORMAT_BYTE_POS] == ARPA_UPDATE_DELTA
+                     ? this->TakeDelta(data + pos, len - pos)
+                     : this->Emit(data + pos, len - pos);
+    if (!taken)
+      return false;
+    this->state.imageOffset += len - pos;
+  }
+
+  return true;
+}
+
+bool Arpa_Update::WriteFailed() const
+{
+  return this->writeFailed;
+}
+
+bool Arpa_Update::IsComplete() const
+{
+  return this->state.imageOffset >= ARPA_UPDATE_HEADER_LENGTH && this->state.written == this->GetSize();
+}
+
+bool Arpa_Update::Verify() const
+{
+  if (!this->IsComplete())
+    return false;
+
+  uint8_t block[ARPA_UPDATE_BLOCK_LENGTH];
+  uint32_t crc = 0;
+  for (uint32_t offset = 0; offset < this->state.written; offset += ARPA_UPDATE_BLOCK_LENGTH)
+  {
+    uint16_t blockLen = this->state.written - offset < ARPA_UPDATE_BLOCK_LENGTH ? this->state.written - offset : ARPA_UPDATE_BLOCK_LENGTH;
+    this->readStaging(offset, block, blockLen);
+    crc = Arpa_Crc32(block, blockLen, crc);
+  }
+
+  return crc == this->GetCrc();
+}
+
+uint32_t Arpa_Update::GetSize() const
+{
+  return ReadInt(this->state.header + ARPA_UPDATE_SIZE_BYTE_POS, 4);
+}
+
+uint32_t Arpa_Update::GetCrc() const
+{
+  return ReadInt(this->state.header + ARPA_UPDATE_CRC_BYTE_POS, 4);
+}
+
+bool Arpa_Update::TakeHeader()
+{
+  const uint8_t *header = this->state.header;
+  uint32_t size = this->GetSize();
+
+  if (ReadInt(header + ARPA_UPDATE_MAGIC_BYTE_POS, 2) != ARPA_UPDATE_MAGIC ||
+      ReadInt(header + ARPA_UPDATE_VERSION_BYTE_POS, 2) != this->state.version ||
+      size == 0 || size > this->maxSize)
+    return false;
+
+  switch (header[ARPA_UPDATE_FORMAT_BYTE_POS])
+  {
+  case ARPA_UPDATE_FULL:
+    return true;
+  case ARPA_UPDATE_DELTA:
+    // Copies out of another firmware would build garbage
+    return ReadInt(header + ARPA_UPDATE_BASE_VERSION_BYTE_POS, 2) == this->currentVersion;
+  default:
+    return false;
+  }
+}
+
+bool Arpa_Update::TakeDelta(const uint8_t *data, uint8_t len)
+{
+  while (len > 0)
+  {
+    if (this->state.remaining > 0)
+    {
+      // Bytes of an insert command
+      uint8_t count = this->state.remaining < len ? this->state.remaining : len;
+      if (!this->Emit(data, count))
+        return false;
+      this->state.remaining -= count;
+      data += count;
+      len -= count;
+      continue;
+    }
+
+    // Collect the command, it may be split over chunks
+    this->state.command[this->state.commandLen++] = *data++;
+    --len;
+
+    uint8_t commandLen;
+    switch (this->state.command[0])
+    {
+    case ARPA_DELTA_COPY:
+      commandLen = ARPA_DELTA_COPY_LENGTH;
+      break;
+    case ARPA_DELTA_INSERT:
+      commandLen = ARPA_DELTA_INSERT_LENGTH;
+      break;
+    default:
+      return false;
+    }
+    if (this->state.commandLen < commandLen)
+      continue;
+    this->state.commandLen = 0;
+
+    if (this->state.command[0] == ARPA_DELTA_COPY)
+    {
+      this->state.copyFrom = ReadInt(this->state.command + 1, 4);
+      if (!this->EmitCopy(ReadInt(this->state.command + 5, 2)))
+        return false;
+    }
+    else
+      this->state.remaining = ReadInt(this->state.command + 1, 2);
+  }
+
+  return true;
+}
+
+bool Arpa_Update::Emit(const uint8_t *data, uint16_t len)
+{
+  uint32_t size = this->GetSize();
+  if (this->state.written + len > size)
+    return false;
+
+  // Complete the word started by the last chunk
+  while (len > 0 && this->state.written % 4 != 0)
+  {
+    this->state.pending[this->state.written++ % 4] = *data++;
+    --len;
+    if (this->state.written % 4 == 0 && !this->Write(this->state.written - 4, this->state.pending, 4))
+      return false;
+  }
+
+  // Whole words straight from the chunk
+  uint16_t words = len & ~3;
+  if (words > 0)
+  {
+    if (!this->Write(this->state.written, data, words))
+      return false;
+    this->state.written += words;
+    data += words;
+    len -= words;
+  }
+
+  // Keep the rest for the next chunk
+  memcpy(this->state.pending, data, len);
+  this->state.written += len;
+
+  // The firmware need not end on a word
+  if (this->state.written == size && size % 4 != 0)
+  {
+    memset(this->state.pending + size % 4, 0xFF, 4 - size % 4);
+    return this->Write(size - size % 4, this->state.pending, 4);
+  }
+
+  return true;
+}
+
+bool Arpa_Update::Write(const uint32_t offset, const uint8_t *data, const uint16_t len)
+{
+  if (this->writeStaging(offset, data, len))
+    return true;
+  this->writeFailed = true;
+  return false;
+}
+
+bool Arpa_Update::EmitCopy(uint16_t len)
+{
+  uint8_t block[ARPA_UPDATE_BLOCK_LENGTH];
+
+  if (this->state.copyFrom + len > this->maxSize)
+    return false;
+
+  while (len > 0)
+  {
+    uint8_t blockLen = len < ARPA_UPDATE_BLOCK_LENGTH ? len : ARPA_UPDATE_BLOCK_LENGTH;
+    this->readFirmware(this->state.copyFrom, block, blockLen);
+    if (!this->Emit(block, blockLen))
+      return false;
+    this->state.copyFrom += blockLen;
+    len -= blockLen;
+  }
+
+  return true;
+}
+
+uint32_t Arpa_Update::ReadInt(const uint8_t *data, const uint8_t len)
+{
+  uint32_t result = 0;
+  for (uint8_t i = 0; i < len; ++i)
+    result |= (uint32_t)data[i] << (8 * i);
+  return result;
+}
@@ -0,0 +1,119 @@
+#pragma once
+#include <stdint.h>
+
+// Firmware update images, fetched from the base a chunk at a time
+// (Arpa_RF95::RequestUpdateChunk()) and built into a staging area of the flash.
+//
+// [header][body], integers little endian. The body of a full image is the new firmware,
+// the body of a delta is a list of commands building it out of the running firmware:
+//   ARPA_DELTA_COPY [offset 4][length 2]   copies bytes of the running firmware
+//   ARPA_DELTA_INSERT [length 2][bytes]    new bytes
+// python/ota/make_update.py builds both. The bootloader copies the staging area over
+// the firmware once the whole image was checked against the CRC in the header.
+#define ARPA_UPDATE_MAGIC 0x5541 // "AU"
+#define ARPA_UPDATE_MAGIC_BYTE_POS 0
+#define ARPA_UPDATE_FORMAT_BYTE_POS 2
+#define ARPA_UPDATE_VERSION_BYTE_POS 4
+// Version a delta applies to, 0 for full images
+#define ARPA_UPDATE_BASE_VERSION_BYTE_POS 6
+// Size and CRC-32 of the new firmware
+#define ARPA_UPDATE_SIZE_BYTE_POS 8
+#define ARPA_UPDATE_CRC_BYTE_POS 12
+#define ARPA_UPDATE_HEADER_LENGTH 16
+
+#define ARPA_DELTA_COPY 0x00
+#define ARPA_DELTA_INSERT 0x01
+#define ARPA_DELTA_COPY_LENGTH 7
+#define ARPA_DELTA_INSERT_LENGTH 3
+
+enum Arpa_update_format : uint8_t
+{
+  ARPA_UPDATE_FULL = 0,
+  ARPA_UPDATE_DELTA = 1
+};
+
+// Progress of an update, kept in EEPROM after every chunk so a reset resumes it
+struct Arpa_update_state
+{
+  // Version being fetched, 0 if there is no update
+  uint16_t version;
+  // Bytes of the image taken, the offset of the next chunk
+  uint32_t imageOffset;
+  // Bytes of the new firmware built, the last written % 4 of them are in pending
+  uint32_t written;
+  uint8_t header[ARPA_UPDATE_HEADER_LENGTH];
+  // Delta command being read, and what is left of it once it was
+  uint8_t command[ARPA_DELTA_COPY_LENGTH];
+  uint8_t commandLen;
+  uint32_t copyFrom;
+  uint16_t remaining;
+  // The staging area is written a word at a time
+  uint8_t pending[4];
+};
+
+// Reads len bytes at offset of the running firmware or of the staging area
+typedef void (*Arpa_flash_read)(const uint32_t offset, uint8_t *buf, const uint16_t len);
+// Writes whole words to the staging area, in increasing offsets. Erasing is up to it.
+typedef bool (*Arpa_flash_write)(const uint32_t offset, const uint8_t *data, const uint16_t len);
+
+// Builds the new firmware out of the chunks of an update image, as they come in.
+//
+// Chunks are taken in order, GetImageOffset() is where the next one starts. Nothing
+// but the state (GetState()) is needed to go on with an update after a reset.
+class Arpa_Update
+{
+public:
+  /// \param currentVersion Version of the running firmware, deltas must apply to it
+  /// \param maxSize Size of the staging area
+  Arpa_Update(Arpa_flash_read readFirmware, Arpa_flash_read readStaging, Arpa_flash_write writeStaging,
+              const uint16_t currentVersion, const uint32_t maxSize);
+
+  /// Starts fetching an update, dropping the one in progress
+  void Start(const uint16_t version);
+  /// Goes on with an update from a saved state
+  void Resume(const Arpa_update_state &state);
+  /// Drops the update in progress
+  void Abandon();
+
+  bool InProgress() const;
+  uint16_t GetVersion() const;
+  uint32_t GetImageOffset() const;
+  const Arpa_update_state &GetState() const;
+
+  /// Takes the chunk of the image at GetImageOffset()
+  /// \return false if the image cannot be used: a broken header, another version,
+  ///   a delta to a version we are not running, too large or a failed write
+  bool Take(const uint8_t *data, const uint8_t len);
+  /// True if the last Take() failed writing the staging area
+  bool WriteFailed() const;
+
+  /// True once the whole new firmware was built
+  bool IsComplete() const;
+
+  /// Checks the staged firmware against the CRC of the header
+  bool Verify() const;
+
+  /// Size and CRC-32 of the new firmware, valid once the header was taken
+  uint32_t GetSize() const;
+  uint32_t GetCrc() const;
+
+private:
+  Arpa_flash_read readFirmware, readStaging;
+  Arpa_flash_write writeStaging;
+  uint16_t currentVersion;
+  uint32_t maxSize;
+  Arpa_update_state state;
+  bool writeFailed;
+
+  /// Checks the header once it is complete
+  bool TakeHeader();
+  /// Runs the body through the delta commands
+  bool TakeDelta(const uint8_t *data, uint8_t len);
+  /// Appends bytes of the new firmware
+  bool Emit(const uint8_t *data, uint16_t len);
+  /// Writes words to the staging area, noting a failure for WriteFailed()
+  bool Write(const uint32_t offset, const uint8_t *data, const uint16_t len);
+  /// Copies bytes of the running firmware to the new one
+  bool EmitCopy(uint16_t len);
+  static uint32_t ReadInt(const uint8_t *data, const uint8_t len);
+};
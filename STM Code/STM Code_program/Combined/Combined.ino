@@ -17,6 +17,12 @@
  */
 
 #include "Arpa_RF95.h"
+#include "Arpa_Payload.h"
+#include "Arpa_SampleBuffer.h"
+#include "Arpa_Update.h"
+#include "Arpa_Crc.h"
+#include "Arpa_EventLog.h"
+#include "Arpa_Link.h"
 #include "Configuration.h"
 #include "stm32yyxx_ll_exti.h"
 
@@ -41,18 +47,96 @@
 
 #define RFM95_POWER 20
 #define RFM95_FREQ 915.0
+// The base talks to the LTE module on Serial in Arpa_Link.h frames
 #define LTE_UART_BAUD 57600
 
-bool SendLoraMessage(char *data);
+// Slotted channel access: the base broadcasts time beacons and nodes listen for one
+// after waking, then start frames on slot boundaries. Costs node RX time per event.
+#define SLOTTED_ACCESS false
+// Slots per frame the base assigns with SLOTTED_ACCESS, node n sends in slot n % FRAME_SLOTS
+// and sleeps until then. 0 lets nodes pick random slots. Only the base's value is used.
+#define FRAME_SLOTS 16
+
+// Milliseconds between channel checks of battery powered forwarders, 0 keeps them listening all
+// the time. Every node must use the same value, frames to a forwarder get a preamble this long
+// (see Arpa_RF95::SetListenInterval()). Each hop through a forwarder adds up to this much delay.
+#define LISTEN_INTERVAL 0
+
+// Seconds between readings of the gas sensor level, 0 to only report gas interrupts.
+// Readings are buffered and sent together (Arpa_SampleBuffer.h), a gas interrupt sends at once.
+// A command from the cloud (ARPA_TLV_CMD_SAMPLE_INTERVAL) replaces it and is kept in EEPROM.
+#define SAMPLE_INTERVAL 600
+// Mean seconds before trying again when sending buffered readings failed,
+// doubled after every failure up to SAMPLE_RETRY_MAX so a busy base is not swamped
+#define SAMPLE_RETRY_INTERVAL 300
+#define SAMPLE_RETRY_MAX 3600
+
+// Nodes listen briefly after every one-shot for a command the base has for them
+// (MQTT arpa/cmd/<node>, see Arpa_RF95::QueueCommand()). false saves that receive time.
+#define DOWNLINK_COMMANDS true
+
+// Version of this firmware, an update command (ARPA_TLV_CMD_UPDATE) names the version to fetch.
+// Above 0, raise it for every image given to python/ota/make_update.py.
+#define FIRMWARE_VERSION 1
+// Flash layout with the bootloader (Bootloader/bootloader.c): it takes the first 4 KB,
+// this firmware is linked behind it and updates are staged in the upper half
+#define FIRMWARE_ADDRESS 0x08001000
+#define STAGING_ADDRESS 0x08008800
+#define FIRMWARE_MAX_SIZE 0x7800
+// A node fetches this many chunks of an update per wake, every UPDATE_FETCH_INTERVAL seconds,
+// so the radio is never on for long. A 30 KB image takes about an hour.
+#define UPDATE_CHUNK_LENGTH 128
+#define UPDATE_CHUNKS_PER_WAKE 8
+#define UPDATE_FETCH_INTERVAL 120
+// The base fetches chunks from the LTE module when asked, ask again after this many milliseconds
+#define UPDATE_BUSY_DELAY 500
+#define UPDATE_BUSY_RETRIES 4
+// Chunks the base keeps from the LTE module: the one asked for and the one after it
+#define LTE_CHUNK_CACHE_SIZE 2
+
+// Events of the sketch go through the same log policy as those of Arpa_RF95 (ARPA_LOG),
+// into eventLog unless DEBUG prints them as text. Sensor nodes and forwarders send them on
+// the serial port while they are awake anyway (Arpa_EventLog::Drain()). On the base that
+// port is the LTE link, so its events stay in RAM.
+#define LOG(...) (ARPA_LOG::Event(__VA_ARGS__))
+
+// Roles this image runs, ARPA_IMAGE in Arpa_RF95.h. Build role images with build_images.sh,
+// the code and RAM of the other roles are left out of them.
+#define IMAGE_HAS_NODE (ARPA_IMAGE == ARPA_IMAGE_COMBINED || ARPA_IMAGE == ARPA_IMAGE_NODE)
+#define IMAGE_HAS_FORWARDER (ARPA_IMAGE == ARPA_IMAGE_COMBINED || ARPA_IMAGE == ARPA_IMAGE_FORWARDER)
+#define IMAGE_HAS_BASE (ARPA_IMAGE == ARPA_IMAGE_COMBINED || ARPA_IMAGE == ARPA_IMAGE_BASE)
+
+#if IMAGE_HAS_NODE
 void SetupNode();
 void NodeLoop();
+bool SendLoraMessage(char *data, uint8_t dataLen);
+bool FlushSamples(uint32_t now);
+bool SendLoraMessageConnected(char *data, uint8_t dataLen);
+void UpdateDataRate();
+void HandleCommand(const uint8_t *data, const uint8_t len);
+void FetchUpdate();
+void ReadFirmware(const uint32_t offset, uint8_t *buf, const uint16_t len);
+void ReadStaging(const uint32_t offset, uint8_t *buf, const uint16_t len);
+bool WriteStaging(const uint32_t offset, const uint8_t *data, const uint16_t len);
+void Sleep(uint32_t seconds);
+void SetupLowPower();
+void GasPinInt();
+uint32_t RtcMillis();
+#endif
+#if IMAGE_HAS_FORWARDER
 void SetupForwarder();
+void ForwarderLoop();
+#endif
+#if IMAGE_HAS_BASE
 void SetupBase();
 void BaseLoop();
-void Sleep();
-void SetupLowPower();
-void GasPinInt();
-
+void HandleBaseMessage(const Arpa_msg_type type, const uint8_t originId, uint8_t *data, const uint8_t len);
+void SendToLTE(int16_t originId, char *msg, uint8_t msgLen, uint8_t sequence);
+void ReadLTECommands();
+Arpa_chunk_status UpdateChunkSource(const uint16_t version, const uint32_t offset, uint8_t *buf, uint8_t &len);
+void RequestLTEChunk(const uint16_t version, const uint32_t offset, const uint8_t len);
+void TakeLTEChunk(const uint8_t *data, const uint8_t len);
+#endif
 
 // Singleton instance of the radio driver
 RH_RF95 driver(RFM95_CS, RFM95_INT);
@@ -88,27 +172,34 @@ void setup()
 
   Serial.begin(9600);
 
+  // A role image still checks the node type, so it does not run on a device set up for another role
   auto nt = configuration.GetEEPromNodeType();
   switch (nt)
   {
+#if IMAGE_HAS_NODE
   case Configuration::sensor:
     SetupNode();
     NodeLoop();
     break;
+#endif
+#if IMAGE_HAS_FORWARDER
   case Configuration::forwarder:
     SetupForwarder();
-    lora.HandleMessageForwarding();
+    ForwarderLoop();
     break;
+#endif
+#if IMAGE_HAS_BASE
   case Configuration::base:
     SetupBase();
     BaseLoop();
     break;
+#endif
   case Configuration::invalid:
   default:
     while (true)
     {
       Serial.begin(9600);
-      Serial.print("Unrecognized Node type: ");
+      Serial.print(ARPA_IMAGE == ARPA_IMAGE_COMBINED ? "Unrecognized Node type: " : "Node type not in this image: ");
       Serial.println(configuration.GetEEPromNodeType());
       delay(1000);
     }
@@ -120,212 +211,678 @@ void loop()
 {
 }
 
+#if IMAGE_HAS_NODE
 // Node stuff
 char buf[ARPA_MAX_MSG_LENGTH];
 uint8_t len = ARPA_MAX_MSG_LENGTH;
 Arpa_msg_type msgType = ARPA_TYPE_ID_SYN;
 bool hexanalDetected = false;
-
+Arpa_SampleBuffer samples;
+STM32RTC &rtc = STM32RTC::getInstance();
+uint32_t sampleInterval = SAMPLE_INTERVAL;
+// Set by an ARPA_TLV_CMD_DATA_RATE command
+bool dataRateCommanded = false;
+// Firmware update being fetched, see FetchUpdate()
+Arpa_Update update(ReadFirmware, ReadStaging, WriteStaging, FIRMWARE_VERSION, FIRMWARE_MAX_SIZE);
+#endif
+
+#if IMAGE_HAS_BASE
 // Base stuff
 int16_t currentConnectionId;
-
+// Chunks of update images from the LTE module, see UpdateChunkSource()
+struct LTEChunk
+{
+  Arpa_chunk_status status;
+  uint16_t version;
+  uint32_t offset;
+  uint8_t len;
+  uint8_t data[ARPA_MAX_CHUNK_LENGTH];
+} lteChunks[LTE_CHUNK_CACHE_SIZE];
+uint8_t nextLTEChunk = 0;
+// Frames to and from the LTE module
+Arpa_LinkReader lteReader;
+uint8_t lteFrame[ARPA_LINK_MAX_ENCODED];
+#endif
+
+#if IMAGE_HAS_NODE
 void SetupNode()
 {
   SetupLowPower();
+  eventLog.SetClock(RtcMillis);
 
   Serial.begin(9600);
-  
-  Serial.println();
-  Serial.print("SensorNode ");
-  Serial.print(configuration.GetEEPromNodeId());
-  Serial.println(" starting");
+  LOG(ARPA_EV_NODE_START, configuration.GetEEPromNodeId(), FIRMWARE_VERSION);
 
   lora.SetNodeId(configuration.GetEEPromNodeId());
   lora.SetBaseId(configuration.GetEEPromBaseId());
 
+  // Start from the data rate the base picked last time, it is checked again on the first send
+  uint8_t sf, cr;
+  int8_t power;
+  if (configuration.GetEEPromDataRate(sf, cr, power))
+    lora.SetDataRate(sf, cr, power);
+  uint16_t interval;
+  if (configuration.GetEEPromSampleInterval(interval))
+    sampleInterval = interval;
+  // Go on with an update where the last reset left it
+  Arpa_update_state updateState;
+  if (configuration.GetEEPromUpdate(updateState) && updateState.version != FIRMWARE_VERSION)
+    update.Resume(updateState);
+#if DOWNLINK_COMMANDS == true
+  lora.SetCommandHandler(HandleCommand);
+#endif
+  lora.SetSlottedAccess(SLOTTED_ACCESS);
+  lora.SetSlotClock(RtcMillis);
+  lora.SetListenInterval(LISTEN_INTERVAL);
+
   while (!lora.InitModule())
   {
-    Serial.println("LoRa couldn't be initialized");
+    eventLog.Drain();
     delay(5000); // If loRa can't be initialized, keep trying every 5 seconds
   }
 
-  Serial.println("LoRa initialized successfully");
-  Serial.println();
+  // The configured base id is kept if no forwarder or base answers
+  lora.DiscoverRoute();
 }
 
 // This node loop will just sleep immediately.
-// When it wakes up, if the hexanalDetected flag is set,
-// then it will send a message over lora "gas=1"
+// It wakes up when the gas pin goes high and every sampleInterval seconds to read the gas pin.
+// Readings are buffered, and sent when the buffer is due (see Arpa_SampleBuffer.h).
+// A gas interrupt is an alarm reading, so it is sent at once together with everything buffered.
+// While an update is fetched it also wakes every UPDATE_FETCH_INTERVAL seconds for the next chunks.
 void NodeLoop()
 {
+  // Nodes switched on together should not all read and send in step
+  uint32_t nextSample = rtc.getEpoch() + 1 + random(sampleInterval);
+  uint32_t nextFlush = 0;
+  uint32_t nextFetch = 0;
+  uint32_t retryInterval = SAMPLE_RETRY_INTERVAL;
   while (1)
   {
-    //Serial.println("SensorNode is asleep");
-    Sleep();
-    //delay(10000);
-
+    // Sleep until the next reading or until the buffer is due, whatever comes first
+    uint32_t now = rtc.getEpoch();
+    uint32_t seconds = samples.SecondsUntilDue(now);
+    if ((int32_t)(nextFlush - now) > 0 && !samples.AlarmPending())
+      seconds = max(seconds, nextFlush - now);
+    if (sampleInterval > 0)
+      seconds = min(seconds, (int32_t)(nextSample - now) > 0 ? nextSample - now : 0);
+    if (update.InProgress())
+      seconds = min(seconds, (int32_t)(nextFetch - now) > 0 ? nextFetch - now : 0);
+    Sleep(seconds);
+    // Goes out while the radio works, before the MCU sleeps again
+    eventLog.Drain();
+
+    now = rtc.getEpoch();
     if (hexanalDetected)
     {
-      sprintf(buf, "gas=1");
-      lora.SetSleepState(false); //wake up the LoRa module
-      //Serial.println("SensorNode is awake");
-      //delay(10000);
+      samples.Add(ARPA_TLV_GAS, 1, 0, now, true);
+      hexanalDetected = false;
+    }
+    if (sampleInterval > 0 && (int32_t)(now - nextSample) >= 0)
+    {
+      samples.Add(ARPA_TLV_GAS, digitalRead(GAS_INT), 0, now);
+      nextSample = now + sampleInterval;
+    }
 
-      // Send the message and make sure it sent
-      SendLoraMessage(buf);
+    // A new alarm does not wait for the retry backoff
+    if (samples.FlushDue(now) && ((int32_t)(now - nextFlush) >= 0 || samples.AlarmPending()))
+    {
+      // Don't keep the radio busy with a base that isn't answering
+      if (FlushSamples(now))
+      {
+        retryInterval = SAMPLE_RETRY_INTERVAL;
+        nextFlush = now;
+      }
+      else
+      {
+        samples.SendFailed();
+        nextFlush = rtc.getEpoch() + retryInterval / 2 + random(retryInterval);
+        retryInterval = min(retryInterval * 2, (uint32_t)SAMPLE_RETRY_MAX);
+      }
+    }
 
-      hexanalDetected = false;
+    // An update command may have come with the readings
+    if (update.InProgress() && (int32_t)(now - nextFetch) >= 0)
+    {
+      FetchUpdate();
+      nextFetch = rtc.getEpoch() + UPDATE_FETCH_INTERVAL;
+    }
+  }
+}
+
+// Sends every buffered reading, as many per frame as fit.
+// Readings that could not be sent stay buffered.
+bool FlushSamples(uint32_t now)
+{
+  lora.SetSleepState(false); //wake up the LoRa module
+#if SLOTTED_ACCESS == true
+  // The slot timing runs on the RTC, a beacon is only needed every ARPA_SLOT_SYNC_LIFETIME
+  if (!lora.HasSlotSync() && !lora.WaitForBeacon())
+    LOG(ARPA_EV_NO_BEACON);
+
+  // Sleep through the slots of the other nodes
+  uint32_t slotWait = lora.MillisUntilOwnSlot();
+  if (slotWait > 0)
+  {
+    lora.SetSleepState(true);
+    LowPower.deepSleep(slotWait);
+    lora.SetSleepState(false);
+  }
+#endif
+
+  // An alarm released the held readings, it goes out under a new sequence number
+  if (lora.DataUnconfirmed() && !samples.IsHeld())
+    lora.SkipSequence();
+
+  bool sent = true;
+  while (samples.GetCount() > 0)
+  {
+    // Binary payload, see Arpa_Payload.h
+    uint8_t count;
+    uint8_t payloadLen = samples.Encode((uint8_t *)buf, ARPA_PAYLOAD_MAX_LENGTH, now, count);
+
+    // Send the message and make sure it sent. If it may have arrived anyway,
+    // the same readings go again under its sequence number next time.
+    if (!SendLoraMessage(buf, payloadLen))
+    {
+      if (lora.DataUnconfirmed())
+        samples.Hold(count);
+      sent = false;
+      break;
+    }
+    samples.Remove(count);
+  }
+
+  UpdateDataRate();
+  return sent;
+}
+
+// Sends a reading to the base in one frame.
+// The base needs no connection for this, the link layer ACK confirms delivery.
+bool SendLoraMessage(char *data, uint8_t dataLen)
+{
+  if (lora.SendOneShot(data, dataLen))
+  {
+    LOG(ARPA_EV_DATA_SENT, dataLen);
+    return true;
+  }
+
+  // The next hop may be gone, look for another one and try once more
+  LOG(ARPA_EV_DATA_RETRY);
+  if (lora.DiscoverRoute() && lora.SendOneShot(data, dataLen))
+  {
+    LOG(ARPA_EV_DATA_SENT, dataLen);
+    return true;
+  }
+
+  LOG(ARPA_EV_DATA_FAILED);
+  return false;
+}
+
+// Asks the base for a faster data rate now and then, and keeps it across resets
+void UpdateDataRate()
+{
+  if (!lora.DataRateRequestDue() && !dataRateCommanded)
+    return;
+  dataRateCommanded = false;
+
+  // A new data rate is logged as ARPA_EV_DATA_RATE_SET
+  lora.RequestDataRate();
+  configuration.SetEEPromDataRate(lora.GetSpreadingFactor(), lora.GetCodingRate(), lora.GetTxPower());
+}
+
+// Commands from the cloud, a payload of command records (Arpa_Payload.h)
+// the base sent down after one of our messages
+void HandleCommand(const uint8_t *data, const uint8_t len)
+{
+  Arpa_PayloadReader payload(data, len);
+  Arpa_reading command;
+  while (payload.NextReading(command))
+  {
+    switch (command.type)
+    {
+    case ARPA_TLV_CMD_SAMPLE_INTERVAL:
+      sampleInterval = constrain(command.value, 0, 0xFFFD);
+      configuration.SetEEPromSampleInterval(sampleInterval);
+      LOG(ARPA_EV_CMD_SAMPLE_INTERVAL, sampleInterval);
+      break;
+
+    case ARPA_TLV_CMD_DATA_RATE:
+      dataRateCommanded = true;
+      LOG(ARPA_EV_CMD_DATA_RATE);
+      break;
+
+    case ARPA_TLV_CMD_UPDATE:
+      // The command may come again while the update is fetched or after it was installed
+      if ((uint16_t)command.value == FIRMWARE_VERSION || (uint16_t)command.value == update.GetVersion())
+        break;
+      update.Start((uint16_t)command.value);
+      configuration.SetEEPromUpdate(update.GetState());
+      LOG(ARPA_EV_CMD_UPDATE, update.GetVersion());
+      break;
+
+    default:
+      LOG(ARPA_EV_CMD_UNKNOWN, command.type);
+      break;
+    }
+  }
+}
+
+// Fetches the next chunks of the update image from the base, and installs the update
+// once the whole firmware is staged. The progress is kept in EEPROM after every chunk,
+// a reset goes on from there.
+void FetchUpdate()
+{
+  lora.SetSleepState(false);
+  uint8_t chunks = 0, busy = 0;
+  while (update.InProgress() && !update.IsComplete() && chunks < UPDATE_CHUNKS_PER_WAKE && busy <= UPDATE_BUSY_RETRIES)
+  {
+    uint8_t chunkLen = UPDATE_CHUNK_LENGTH;
+    switch (lora.RequestUpdateChunk(update.GetVersion(), update.GetImageOffset(), (uint8_t *)buf, chunkLen))
+    {
+    case ARPA_CHUNK_OK:
+      if (!update.Take((uint8_t *)buf, chunkLen))
+      {
+        LOG(update.WriteFailed() ? ARPA_EV_UPDATE_WRITE : ARPA_EV_UPDATE_TOO_BIG);
+        update.Abandon();
+      }
+      configuration.SetEEPromUpdate(update.GetState());
+      ++chunks;
+      busy = 0;
+      break;
+
+    case ARPA_CHUNK_BUSY:
+      // The base fetches the chunk meanwhile
+      if (++busy <= UPDATE_BUSY_RETRIES)
+        delay(UPDATE_BUSY_DELAY);
+      break;
+
+    case ARPA_CHUNK_NONE:
+    default:
+      LOG(ARPA_EV_UPDATE_NOT_FOUND);
+      update.Abandon();
+      break;
+    }
+  }
+  lora.SetSleepState(true);
+
+  if (update.IsComplete())
+  {
+    if (update.Verify())
+    {
+      // The bootloader copies the staged firmware over this one
+      LOG(ARPA_EV_UPDATE_INSTALL, update.GetVersion());
+      configuration.SetEEPromUpdateReady(update.GetSize(), update.GetCrc());
+      update.Abandon();
+      configuration.SetEEPromUpdate(update.GetState());
+      // The events are lost with the reset
+      eventLog.Drain();
+      Serial.flush();
+      NVIC_SystemReset();
     }
+    LOG(ARPA_EV_UPDATE_CRC);
+    update.Abandon();
   }
+  configuration.SetEEPromUpdate(update.GetState());
 }
 
-bool SendLoraMessage(char *data)
+// Storage of Arpa_Update in the flash, see FIRMWARE_ADDRESS
+void ReadFirmware(const uint32_t offset, uint8_t *buf, const uint16_t len)
+{
+  memcpy(buf, (const uint8_t *)(FIRMWARE_ADDRESS + offset), len);
+}
+
+void ReadStaging(const uint32_t offset, uint8_t *buf, const uint16_t len)
+{
+  memcpy(buf, (const uint8_t *)(STAGING_ADDRESS + offset), len);
+}
+
+bool WriteStaging(const uint32_t offset, const uint8_t *data, const uint16_t len)
+{
+  bool written = true;
+  HAL_FLASH_Unlock();
+  for (uint16_t i = 0; i < len && written; i += 4)
+  {
+    uint32_t address = STAGING_ADDRESS + offset + i;
+
+    // Pages are erased as the update reaches them
+    if (address % FLASH_PAGE_SIZE == 0)
+    {
+      FLASH_EraseInitTypeDef erase;
+      uint32_t error;
+      erase.TypeErase = FLASH_TYPEERASE_PAGES;
+      erase.PageAddress = address;
+      erase.NbPages = 1;
+      written = HAL_FLASHEx_Erase(&erase, &error) == HAL_OK;
+    }
+
+    // A reset between writing a chunk and saving the state goes on from the chunk before,
+    // its words are in the flash already and cannot be programmed again without an erase
+    uint32_t word;
+    memcpy(&word, data + i, 4);
+    if (written && *(volatile const uint32_t *)address != word)
+      written = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address, word) == HAL_OK;
+  }
+  HAL_FLASH_Lock();
+  return written;
+}
+
+// Sends a reading to the base over a connection (syn, data, fin).
+// Kept for messages that need a reply from the base.
+bool SendLoraMessageConnected(char *data, uint8_t dataLen)
 {
-  Serial.println();
-  Serial.println("Calling Synchronize()");
   if (lora.Synchronize())
   {
-    Serial.println("===== Sync Success =====");
+    LOG(ARPA_EV_SYNC_OK);
 
-    Serial.println("===== Calling SendMessage() and sending a data type message =====");
-    switch (lora.SendConnectedMessage(lora.GetBaseId(), ARPA_TYPE_ID_DATA, data))
+    switch (lora.SendConnectedMessage(lora.GetBaseId(), ARPA_TYPE_ID_DATA, data, dataLen))
     {
     case ARPA_TYPE_ID_ACK:
       // Got a good response from the base
-      Serial.println("===== Data Success! =====");
+      LOG(ARPA_EV_DATA_SENT, dataLen);
 
-      Serial.println("===== Calling lora.Close() =====");
-      
       if (lora.Close())
       {
-        Serial.println("===== Close Success =====");
+        LOG(ARPA_EV_CLOSE_OK);
         return true;
       }
       else
-        Serial.println("===== Could not close connection =====");
+        LOG(ARPA_EV_CLOSE_FAILED);
       break;
 
     case ARPA_TYPE_ID_NACK:
       // Got a nack - we don't have a current connection with the base
-      Serial.println("===== Data fail - not connected to base =====");
+      LOG(ARPA_EV_DATA_NACK);
       return false;
       break;
 
     case ARPA_TYPE_ID_INVALID:
     default:
-      Serial.println("===== Data message failed :( =====");
-      Serial.println();
-      Serial.println();
+      LOG(ARPA_EV_DATA_FAILED);
       return false;
       break;
     }
   }
   else
   {
-    Serial.println("===== Could not synchronize =====");
-    Serial.println();
-    Serial.println();
+    LOG(ARPA_EV_SYNC_FAILED);
     return false;
   }
   return true;
 }
+#endif
 
+#if IMAGE_HAS_FORWARDER
 void SetupForwarder()
 {
   Serial.begin(9600);
   delay(2000); // Wait for Serial but don't require it
+  LOG(ARPA_EV_FORWARDER_START, configuration.GetEEPromNodeId());
 
-  if (!lora.InitModule())
-    Serial.println("LoRa couldn't be initialized");
+  // Logged as ARPA_EV_RADIO_INIT_FAILED
+  lora.InitModule();
 
   lora.SetNodeId(configuration.GetEEPromNodeId());
   lora.SetBaseId(configuration.GetEEPromBaseId());
+  lora.SetListenInterval(LISTEN_INTERVAL);
+}
+
+// Relays messages between nodes and the base, see Arpa_RF95::HandleMessageForwarding().
+// With LISTEN_INTERVAL set the radio sleeps between CADs (Arpa_RF95::Sniff()) and the MCU with it.
+// millis() has to keep running for the forwarding timers, so the MCU only idles (__WFI)
+// instead of going into stop mode.
+void ForwarderLoop()
+{
+  lora.StartForwarding();
+  while (true)
+  {
+    eventLog.Drain();
+    if (lora.Poll())
+      continue;
+
+    // Receiver on: sleep until the next interrupt (radio DIO0 or the 1 ms tick)
+    if (lora.Sniff())
+    {
+      __WFI();
+      continue;
+    }
+
+    // Radio asleep: nothing comes in before the next CAD or timer
+    uint32_t idle = lora.GetPollTimeout();
+    uint32_t start = millis();
+    while (millis() - start < idle)
+      __WFI();
+  }
 }
+#endif
 
+#if IMAGE_HAS_BASE
 void SetupBase()
 {
-  if (!Serial)
-    Serial.begin(9600);
-  // Serial1.begin(LTE_UART_BAUD);
+  Serial.begin(LTE_UART_BAUD);
+
+  LOG(ARPA_EV_BASE_START, configuration.GetEEPromNodeId());
 
+  // Logged as ARPA_EV_RADIO_INIT_FAILED
   if (!lora.InitModule())
   {
     while (true)
-    {
-      Serial.println("LoRa couldn't be initialized");
       delay(1000);
-    }
   }
 
-  Serial.println("LoRa Initialized sucessfully");
-
+  // A base is its own base, it is the root of the routes
   lora.SetNodeId(configuration.GetEEPromNodeId());
+  lora.SetBaseId(configuration.GetEEPromNodeId());
+  lora.SetBeaconing(SLOTTED_ACCESS);
+  lora.SetFrameSlots(FRAME_SLOTS);
+  lora.SetListenInterval(LISTEN_INTERVAL);
+  lora.SetUpdateSource(UpdateChunkSource);
+  for (uint8_t i = 0; i < LTE_CHUNK_CACHE_SIZE; ++i)
+    lteChunks[i].version = 0;
 }
 
+// Serves every node through the session table in Arpa_RF95,
+// so a syn from one node does not make the others wait for its fin.
+//
+// lora.Poll() never waits for the radio, messages come in through HandleBaseMessage().
+// Other work of the base (LTE UART, watchdog) can go in this loop, as long as it doesn't block either.
 void BaseLoop()
 {
+  lora.SetMessageHandler(HandleBaseMessage);
   while (true)
   {
-    Serial.println("===== Waiting for syn =====");
-    Serial.println("");
-    currentConnectionId = lora.WaitForSyn();
+    ReadLTECommands();
 
-    if (currentConnectionId >= 0)
-    {
-      Serial.print("===== Got syn from:  ");
-      Serial.println(currentConnectionId);
+    // Nothing came in, sleep until the next interrupt (radio DIO0, UART or the 1 ms tick)
+    if (!lora.Poll())
+      __WFI();
+  }
+}
 
-      // Time to wait for messages
-      // Serial.println("===== Waiting for data =====");
-      while (lora.GetCurrentConnectionOriginId() >= 0)
-      {
-        Serial.print("===== Current connection id: ");
-        Serial.println(lora.GetCurrentConnectionOriginId());
-        // The len variable is used as a input in the WaitForMessage func and must be set every call
-        len = ARPA_MAX_MSG_LENGTH;
-        msgType = lora.WaitForConnectedMessage((uint8_t *)buf, &len);
-        if (msgType == ARPA_TYPE_ID_INVALID)
-        {
-          Serial.println("===== WaitForConnectedMessage returned invalid =====");
-          continue;
-        }
-
-        Serial.println("===== Got something =====");
-        Serial.print("Type:");
-        Serial.println(msgType);
-        Serial.print("Message:");
-        buf[len] = '\0';
-        Serial.println((char *)buf);
-
-        if (msgType == ARPA_TYPE_ID_DATA)
-        {
-          // Send to LTE module
-          Serial.print(currentConnectionId);
-          Serial.print((char *)buf);
-          Serial.print(';');
-        }
-      }
+// Queues commands the LTE module got for nodes (MQTT arpa/cmd/<node>), ARPA_LINK_CMD frames
+// with the payload starting with ARPA_PAYLOAD_VERSION.
+// Update chunks come in ARPA_LINK_CHUNK frames, the payload is an ARPA_TYPE_ID_UPDATE reply.
+void ReadLTECommands()
+{
+  while (Serial.available() > 0)
+  {
+    if (!lteReader.Take(Serial.read()))
+      continue;
+
+    const uint8_t *payload = lteReader.GetPayload();
+    uint8_t len = lteReader.GetLength();
+    if (lteReader.GetType() == ARPA_LINK_CHUNK)
+    {
+      if (len <= ARPA_MAX_MSG_LENGTH)
+        TakeLTEChunk(payload, len);
+      continue;
     }
+    if (lteReader.GetType() != ARPA_LINK_CMD || len > ARPA_CMD_MAX_LENGTH ||
+        !Arpa_PayloadReader::IsBinary(payload, len))
+      continue;
+
+    if (lora.QueueCommand(lteReader.GetNode(), payload, len))
+      LOG(ARPA_EV_LTE_CMD_QUEUED, lteReader.GetNode());
+    else
+      LOG(ARPA_EV_LTE_CMD_DROPPED, lteReader.GetNode());
+  }
+}
+
+void HandleBaseMessage(const Arpa_msg_type type, const uint8_t originId, uint8_t *data, const uint8_t len)
+{
+  currentConnectionId = originId;
+
+  switch (type)
+  {
+  case ARPA_TYPE_ID_SYN:
+    LOG(ARPA_EV_BASE_SYN, currentConnectionId, lora.GetOpenSessionCount());
+    break;
+
+  case ARPA_TYPE_ID_FIN:
+    LOG(ARPA_EV_BASE_FIN, currentConnectionId);
+    break;
+
+  case ARPA_TYPE_ID_DATA_ONESHOT:
+    LOG(ARPA_EV_BASE_DATA, type, originId, len);
+    SendToLTE(originId, (char *)data, len, lora.GetSequence());
+    break;
+
+  case ARPA_TYPE_ID_DATA:
+    LOG(ARPA_EV_BASE_DATA, type, currentConnectionId, len);
+    SendToLTE(currentConnectionId, (char *)data, len, lora.GetSequence());
+    break;
+
+  default:
+    LOG(ARPA_EV_BASE_UNKNOWN, type);
+    break;
+  }
+}
+
+// Send a received message to the LTE module, in an ARPA_LINK_DATA frame.
+//
+// A binary payload (Arpa_Payload.h) gets a sequence record in front of its records,
+// so the LTE module and the database can drop copies. Text goes as it is.
+void SendToLTE(int16_t originId, char *msg, uint8_t msgLen, uint8_t sequence)
+{
+  Arpa_LinkWriter writer;
+  if (Arpa_PayloadReader::IsBinary((uint8_t *)msg, msgLen))
+  {
+    uint8_t seq[ARPA_TLV_HEADER_LENGTH + 1] = {ARPA_TLV_SEQ, 1, sequence};
+    writer.Begin(lteFrame, ARPA_LINK_DATA, originId, sizeof(seq) + msgLen);
+    writer.Add((uint8_t *)msg, ARPA_PAYLOAD_HEADER_LENGTH);
+    writer.Add(seq, sizeof(seq));
+    writer.Add((uint8_t *)msg + ARPA_PAYLOAD_HEADER_LENGTH, msgLen - ARPA_PAYLOAD_HEADER_LENGTH);
+  }
+  else
+  {
+    writer.Begin(lteFrame, ARPA_LINK_DATA, originId, msgLen);
+    writer.Add((uint8_t *)msg, msgLen);
   }
+  Serial.write(lteFrame, writer.End());
+}
+
+// Chunks of update images for Arpa_RF95::RequestUpdateChunk(), from the LTE module.
+// The LTE module keeps the images (MQTT arpa/fw), the base only keeps the chunk asked for
+// and the one after it. A chunk it does not have is asked for and the node asks again.
+Arpa_chunk_status UpdateChunkSource(const uint16_t version, const uint32_t offset, uint8_t *buf, uint8_t &len)
+{
+  for (uint8_t i = 0; i < LTE_CHUNK_CACHE_SIZE; ++i)
+  {
+    LTEChunk &chunk = lteChunks[i];
+    if (chunk.version != version || chunk.offset != offset)
+      continue;
+    if (chunk.status != ARPA_CHUNK_OK)
+      return chunk.status;
+
+    len = min(len, chunk.len);
+    memcpy(buf, chunk.data, len);
+    // Fetched while the node takes this one
+    RequestLTEChunk(version, offset + len, len);
+    return ARPA_CHUNK_OK;
+  }
+
+  RequestLTEChunk(version, offset, len);
+  return ARPA_CHUNK_BUSY;
+}
+
+// Sent in an ARPA_LINK_CHUNK_REQ frame, the LTE module answers with an ARPA_LINK_CHUNK one
+void RequestLTEChunk(const uint16_t version, const uint32_t offset, const uint8_t len)
+{
+  uint8_t request[ARPA_CHUNK_REQ_LENGTH];
+  request[ARPA_CHUNK_REQ_VERSION_BYTE_POS] = (uint8_t)version;
+  request[ARPA_CHUNK_REQ_VERSION_BYTE_POS + 1] = (uint8_t)(version >> 8);
+  for (uint8_t i = 0; i < 4; ++i)
+    request[ARPA_CHUNK_REQ_OFFSET_BYTE_POS + i] = (uint8_t)(offset >> (8 * i));
+  request[ARPA_CHUNK_REQ_LENGTH_BYTE_POS] = len;
+
+  Arpa_LinkWriter writer;
+  writer.Begin(lteFrame, ARPA_LINK_CHUNK_REQ, 0, ARPA_CHUNK_REQ_LENGTH);
+  writer.Add(request, ARPA_CHUNK_REQ_LENGTH);
+  Serial.write(lteFrame, writer.End());
 }
 
-// Set the MCU to sleep.
+// A chunk the LTE module sent, laid out like an ARPA_TYPE_ID_UPDATE reply
+void TakeLTEChunk(const uint8_t *data, const uint8_t len)
+{
+  if (len < ARPA_CHUNK_HEADER_LENGTH)
+    return;
+
+  uint8_t chunkLen = len - ARPA_CHUNK_HEADER_LENGTH;
+  uint16_t crc = data[ARPA_CHUNK_CRC_BYTE_POS] | data[ARPA_CHUNK_CRC_BYTE_POS + 1] << 8;
+  if (Arpa_Crc16(data + ARPA_CHUNK_HEADER_LENGTH, chunkLen) != crc)
+  {
+    LOG(ARPA_EV_LTE_CHUNK_CORRUPT);
+    return;
+  }
+  // The LTE module is missing a part of the image, the node asks again later
+  if (data[ARPA_CHUNK_STATUS_BYTE_POS] == ARPA_CHUNK_BUSY)
+    return;
+
+  LTEChunk &chunk = lteChunks[nextLTEChunk];
+  nextLTEChunk = (nextLTEChunk + 1) % LTE_CHUNK_CACHE_SIZE;
+  chunk.status = (Arpa_chunk_status)data[ARPA_CHUNK_STATUS_BYTE_POS];
+  chunk.version = data[ARPA_CHUNK_VERSION_BYTE_POS] | data[ARPA_CHUNK_VERSION_BYTE_POS + 1] << 8;
+  chunk.offset = 0;
+  for (uint8_t i = 0; i < 4; ++i)
+    chunk.offset |= (uint32_t)data[ARPA_CHUNK_OFFSET_BYTE_POS + i] << (8 * i);
+  chunk.len = chunkLen;
+  memcpy(chunk.data, data + ARPA_CHUNK_HEADER_LENGTH, chunkLen);
+}
+#endif
+
+#if IMAGE_HAS_NODE
+// Set the MCU to sleep for the given number of seconds, UINT32_MAX to sleep until the gas pin.
 // When the gas pin goes high (RISING EDGE), it will wake up,
 // and the GasPinInt() function is called.
 //
 // https://github.com/stm32duino/STM32LowPower for more details
-void Sleep()
+void Sleep(uint32_t seconds)
 {
   lora.SetSleepState(true);   //Set LoRa module to sleep mode
+  if (seconds == 0)
+    return;
   LowPower.attachInterruptWakeup(GAS_INT, GasPinInt, RISING, DEEP_SLEEP_MODE);
   //ready to set the MCU to sleep mode
-  LowPower.deepSleep();
+  if (seconds == UINT32_MAX)
+    LowPower.deepSleep();
+  else
+    LowPower.deepSleep(min(seconds, UINT32_MAX / 1000) * 1000);
   //GasPinInt() is called one time after the interrupt is triggered
 }
 
+// Milliseconds on the RTC, the slot clock of Arpa_RF95 as it keeps running in deep sleep
+uint32_t RtcMillis()
+{
+  uint32_t subSeconds;
+  uint32_t seconds = rtc.getEpoch(&subSeconds);
+  return seconds * 1000 + subSeconds;
+}
+
 void SetupLowPower()
 {
   pinMode(GAS_INT, INPUT);
+  // The RTC keeps the time of buffered readings, millis() stops in deep sleep
+  rtc.begin();
   LowPower.begin();
 }
 
@@ -343,3 +900,4 @@ void GasPinInt()
 
   hexanalDetected = true;
 }
+#endif
@@ -1,4 +1,5 @@
 #include "Configuration.h"
+#include "Arpa_Crc.h"
 #include <string.h>
 #include <EEPROM.h>
 
@@ -196,3 +197,58 @@ Configuration::NodeType Configuration::GetEEPromNodeType()
 {
     return static_cast<NodeType>(EEPROM.read(EEPROM_NodeTypeOffset));
 }
+
+bool Configuration::GetEEPromDataRate(uint8_t &sf, uint8_t &cr, int8_t &power)
+{
+    sf = EEPROM.read(EEPROM_SpreadingFactorOffset);
+    cr = EEPROM.read(EEPROM_CodingRateOffset);
+    power = static_cast<int8_t>(EEPROM.read(EEPROM_TxPowerOffset));
+
+    // Erased EEPROM reads 0xFF (or 0 on a fresh part)
+    return sf >= 7 && sf <= 12 && cr >= 5 && cr <= 8;
+}
+void Configuration::SetEEPromDataRate(uint8_t sf, uint8_t cr, int8_t power)
+{
+    // update() only writes bytes that changed, saving EEPROM wear
+    EEPROM.update(EEPROM_SpreadingFactorOffset, sf);
+    EEPROM.update(EEPROM_CodingRateOffset, cr);
+    EEPROM.update(EEPROM_TxPowerOffset, static_cast<uint8_t>(power));
+}
+bool Configuration::GetEEPromSampleInterval(uint16_t &seconds)
+{
+    uint16_t stored = EEPROM.read(EEPROM_SampleIntervalOffset) | (EEPROM.read(EEPROM_SampleIntervalOffset + 1) << 8);
+
+    // Stored plus one, so neither erased value (0xFFFF or 0 on a fresh part) reads as an interval
+    if (stored == 0 || stored == 0xFFFF)
+        return false;
+    seconds = stored - 1;
+    return true;
+}
+void Configuration::SetEEPromSampleInterval(uint16_t seconds)
+{
+    uint16_t stored = min(seconds, (uint16_t)0xFFFD) + 1;
+    EEPROM.update(EEPROM_SampleIntervalOffset, stored & 0xFF);
+    EEPROM.update(EEPROM_SampleIntervalOffset + 1, stored >> 8);
+}
+bool Configuration::GetEEPromUpdate(Arpa_update_state &state)
+{
+    uint16_t crc;
+    EEPROM.get(EEPROM_UpdateStateOffset, state);
+    EEPROM.get(EEPROM_UpdateStateOffset + sizeof(state), crc);
+
+    // A reset while the state was written leaves it broken, start the update over then
+    return crc == Arpa_Crc16(reinterpret_cast<const uint8_t *>(&state), sizeof(state)) && state.version != 0;
+}
+void Configuration::SetEEPromUpdate(const Arpa_update_state &state)
+{
+    uint16_t crc = Arpa_Crc16(reinterpret_cast<const uint8_t *>(&state), sizeof(state));
+    EEPROM.put(EEPROM_UpdateStateOffset, state);
+    EEPROM.put(EEPROM_UpdateStateOffset + sizeof(state), crc);
+}
+void Configuration::SetEEPromUpdateReady(uint32_t size, uint32_t crc)
+{
+    // Flag last, the bootloader must not see it before the size and CRC
+    EEPROM.put(EEPROM_UpdateReadyOffset + 1, size);
+    EEPROM.put(EEPROM_UpdateReadyOffset + 5, crc);
+    EEPROM.update(EEPROM_UpdateReadyOffset, EEPROM_UpdateReadyFlag);
+}
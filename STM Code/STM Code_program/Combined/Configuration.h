@@ -1,5 +1,6 @@
 #pragma once
 #include <Arduino.h>
+#include "Arpa_Update.h"
 
 class Configuration
 {
@@ -18,6 +19,20 @@ uint8_t GetEEPromNodeId();
 uint8_t GetEEPromBaseId();
 NodeType GetEEPromNodeType();
 
+// Data rate picked by the adaptive data rate, false if none was stored yet
+bool GetEEPromDataRate(uint8_t &sf, uint8_t &cr, int8_t &power);
+void SetEEPromDataRate(uint8_t sf, uint8_t cr, int8_t power);
+
+// Sample interval sent by a command, false if none was stored yet
+bool GetEEPromSampleInterval(uint16_t &seconds);
+void SetEEPromSampleInterval(uint16_t seconds);
+
+// Firmware update being fetched, false if there is none
+bool GetEEPromUpdate(Arpa_update_state &state);
+void SetEEPromUpdate(const Arpa_update_state &state);
+// Tells the bootloader to install the staged firmware at the next reset
+void SetEEPromUpdateReady(uint32_t size, uint32_t crc);
+
 private:
 void ReadSerial();
 
@@ -47,6 +62,14 @@ static const int bufSize = 32;
 static const int EEPROM_NodeIdOffset = 1;
 static const int EEPROM_BaseIdOffset = 2;
 static const int EEPROM_NodeTypeOffset = 3;
+static const int EEPROM_SpreadingFactorOffset = 4;
+static const int EEPROM_CodingRateOffset = 5;
+static const int EEPROM_TxPowerOffset = 6;
+static const int EEPROM_SampleIntervalOffset = 7; // 2 bytes, little endian
+// Read by the bootloader, keep in step with Bootloader/bootloader.c
+static const int EEPROM_UpdateReadyOffset = 16; // flag, size and CRC-32 of the staged firmware
+static const uint8_t EEPROM_UpdateReadyFlag = 0xA5;
+static const int EEPROM_UpdateStateOffset = 32; // Arpa_update_state and its CRC-16
 static const int baud = 9600;
 char serialCommandBuffer[bufSize];
 struct Node
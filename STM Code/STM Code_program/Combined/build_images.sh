@@ -0,0 +1,43 @@
+#!/bin/sh
+# Builds the role images of Combined.ino with arduino-cli, each in build/<role>:
+#
+#   build/node/Combined.ino.bin       sensor nodes, the image to give python/ota/make_update.py
+#   build/forwarder/Combined.ino.bin  forwarders
+#   build/base/Combined.ino.bin       bases
+#   build/combined/Combined.ino.bin   any role, picked from the node type in EEPROM
+#
+# A role image only carries the code and RAM of its role (ARPA_IMAGE in Arpa_RF95.h).
+# Images are linked behind the bootloader (Bootloader/bootloader.c), at FIRMWARE_ADDRESS.
+#
+#   ./build_images.sh              all four
+#   ./build_images.sh node base    only these
+#
+# FQBN picks the board, the STM32L051K8 by default. Extra arguments for arduino-cli
+# (--libraries etc.) can be given in ARDUINO_CLI_FLAGS.
+set -e
+
+cd "$(dirname "$0")"
+FQBN=${FQBN:-STMicroelectronics:stm32:GenL0:pnum=GENERIC_L051K8TX}
+# FIRMWARE_ADDRESS - 0x08000000
+FLASH_OFFSET=0x1000
+
+roles=${*:-node forwarder base combined}
+for role in $roles; do
+  case $role in
+  node) image=ARPA_IMAGE_NODE ;;
+  forwarder) image=ARPA_IMAGE_FORWARDER ;;
+  base) image=ARPA_IMAGE_BASE ;;
+  combined) image=ARPA_IMAGE_COMBINED ;;
+  *)
+    echo "Unknown role $role, expected node, forwarder, base or combined" >&2
+    exit 1
+    ;;
+  esac
+
+  echo "===== $role image"
+  # shellcheck disable=SC2086
+  arduino-cli compile --fqbn "$FQBN" \
+    --build-property "build.flash_offset=$FLASH_OFFSET" \
+    --build-property "compiler.cpp.extra_flags=-DARPA_IMAGE=$image" \
+    --output-dir "build/$role" $ARDUINO_CLI_FLAGS .
+done
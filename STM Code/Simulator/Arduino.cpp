@@ -0,0 +1,212 @@
+#include "Arduino.h"
+#include "Scheduler.h"
+#include "Simulator.h"
+#include <stdio.h>
+
+using sim::Fiber;
+using sim::Scheduler;
+
+HardwareSerial Serial;
+
+// Used when random() is called outside of a simulated device
+static uint32_t globalRngState = 1;
+
+static uint32_t *RngState()
+{
+  Fiber *fiber = Scheduler::Instance().Current();
+  return fiber ? &fiber->rngState : &globalRngState;
+}
+
+unsigned long millis()
+{
+  return (unsigned long)(uint32_t)(Scheduler::Instance().Now() / 1000);
+}
+
+unsigned long micros()
+{
+  return (unsigned long)(uint32_t)Scheduler::Instance().Now();
+}
+
+void delay(unsigned long ms)
+{
+  Scheduler &scheduler = Scheduler::Instance();
+  scheduler.SleepUntil(scheduler.Now() + (sim::usec_t)ms * 1000);
+}
+
+void yield()
+{
+}
+
+void randomSeed(unsigned long seed)
+{
+  if (seed != 0)
+    *RngState() = (uint32_t)seed;
+}
+
+// Same generator as newlib's rand() with a per device state, so every
+// simulated device draws the sequence it would draw on its own MCU
+static long NextRandom()
+{
+  uint32_t *state = RngState();
+  *state = *state * 1103515245 + 12345;
+  return (*state >> 16) & 0x7fff;
+}
+
+long random(long howbig)
+{
+  if (howbig == 0)
+    return 0;
+  return ((NextRandom() << 15) | NextRandom()) % howbig;
+}
+
+long random(long howsmall, long howbig)
+{
+  if (howsmall >= howbig)
+    return howsmall;
+  return random(howbig - howsmall) + howsmall;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  (void)pin;
+  (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+  (void)pin;
+  (void)val;
+}
+
+int digitalRead(uint8_t pin)
+{
+  (void)pin;
+  return LOW;
+}
+
+// ===== Serial =====
+// Output is only shown with tracing on, prefixed with the virtual time and device
+
+static bool atLineStart = true;
+
+void HardwareSerial::begin(unsigned long baud)
+{
+  (void)baud;
+}
+
+HardwareSerial::operator bool() const
+{
+  return true;
+}
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t len)
+{
+  if (!sim::traceEnabled)
+    return len;
+
+  for (size_t i = 0; i < len; ++i)
+  {
+    if (atLineStart)
+    {
+      Fiber *fiber = Scheduler::Instance().Current();
+      fprintf(stderr, "%10.3f %-8s ", Scheduler::Instance().Now() / 1000000.0,
+              fiber ? sim::DeviceName(fiber->user) : "sim");
+      atLineStart = false;
+    }
+    fputc(buf[i], stderr);
+    if (buf[i] == '\n')
+      atLineStart = true;
+  }
+  return len;
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  return this->write(&c, 1);
+}
+
+int HardwareSerial::availableForWrite()
+{
+  return 64;
+}
+
+size_t HardwareSerial::print(const char *str)
+{
+  return this->write((const uint8_t *)str, strlen(str));
+}
+
+size_t HardwareSerial::print(char c)
+{
+  return this->write((uint8_t)c);
+}
+
+size_t HardwareSerial::print(int num)
+{
+  return this->print((long)num);
+}
+
+size_t HardwareSerial::print(unsigned int num)
+{
+  return this->print((unsigned long)num);
+}
+
+size_t HardwareSerial::print(long num)
+{
+  char buf[24];
+  snprintf(buf, sizeof(buf), "%ld", num);
+  return this->print(buf);
+}
+
+size_t HardwareSerial::print(unsigned long num)
+{
+  char buf[24];
+  snprintf(buf, sizeof(buf), "%lu", num);
+  return this->print(buf);
+}
+
+size_t HardwareSerial::print(double num)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.2f", num);
+  return this->print(buf);
+}
+
+size_t HardwareSerial::println()
+{
+  return this->print("\n");
+}
+
+size_t HardwareSerial::println(const char *str)
+{
+  return this->print(str) + this->println();
+}
+
+size_t HardwareSerial::println(char c)
+{
+  return this->print(c) + this->println();
+}
+
+size_t HardwareSerial::println(int num)
+{
+  return this->print(num) + this->println();
+}
+
+size_t HardwareSerial::println(unsigned int num)
+{
+  return this->print(num) + this->println();
+}
+
+size_t HardwareSerial::println(long num)
+{
+  return this->print(num) + this->println();
+}
+
+size_t HardwareSerial::println(unsigned long num)
+{
+  return this->print(num) + this->println();
+}
+
+size_t HardwareSerial::println(double num)
+{
+  return this->print(num) + this->println();
+}
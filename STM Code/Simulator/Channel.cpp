@@ -0,0 +1,246 @@
+#include "Channel.h"
+#include <math.h>
+#include <algorithm>
+
+namespace sim
+{
+
+// Strongest transmitter the firmware uses (RFM95 PA_BOOST) and the most
+// sensitive setting (SF12 at 62.5 kHz), radios further apart can never hear each other
+static const double maxTxPower = 23.0;
+static const double minBandwidth = 62500.0;
+
+Channel &Channel::Instance()
+{
+  static Channel instance;
+  return instance;
+}
+
+Channel::Channel()
+    : referenceLoss(40.0), pathLossExponent(3.5), noiseFigure(6.0), captureThreshold(6.0),
+      lockSymbols(5), fade(0.0), fadeAt(0), linksBuilt(false)
+{
+}
+
+void Channel::Attach(RH_RF95 *radio)
+{
+  this->radios.push_back(radio);
+  this->linksBuilt = false;
+}
+
+usec_t Channel::SymbolTime(uint8_t sf, long bw)
+{
+  return (usec_t)((1000000.0 * (1 << sf)) / bw);
+}
+
+usec_t Channel::AirTime(uint8_t len, uint8_t sf, long bw, uint8_t cr, uint16_t preamble)
+{
+  double tSym = (double)(1 << sf) / bw;
+  // Low data rate optimization is mandated above 16 ms symbols (SF11 and SF12 at 125 kHz)
+  int de = tSym > 0.016 ? 1 : 0;
+  double tPreamble = (preamble + 4.25) * tSym;
+
+  // Explicit header, CRC on
+  double num = 8.0 * len - 4.0 * sf + 28 + 16;
+  double den = 4.0 * (sf - 2 * de);
+  double payloadSymbols = 8 + std::max(ceil(num / den) * cr, 0.0);
+
+  return (usec_t)((tPreamble + payloadSymbols * tSym) * 1000000.0);
+}
+
+double Channel::DemodulationFloor(uint8_t sf)
+{
+  // SX1276 datasheet table 13, 2.5 dB per spreading factor step
+  if (sf < 6)
+    sf = 6;
+  return -5.0 - 2.5 * (sf - 6);
+}
+
+double Channel::NoiseFloor(long bw) const
+{
+  return -174.0 + 10.0 * log10((double)bw) + this->noiseFigure;
+}
+
+double Channel::Loss(const RH_RF95 *a, const RH_RF95 *b) const
+{
+  double dx = a->x - b->x;
+  double dy = a->y - b->y;
+  double d = sqrt(dx * dx + dy * dy);
+  if (d < 1.0)
+    d = 1.0;
+  return this->referenceLoss + 10.0 * this->pathLossExponent * log10(d);
+}
+
+double Channel::Fade() const
+{
+  return Scheduler::Instance().Now() >= this->fadeAt ? this->fade : 0.0;
+}
+
+void Channel::BuildLinks()
+{
+  double maxLoss = maxTxPower - this->NoiseFloor((long)minBandwidth) - DemodulationFloor(12);
+
+  this->links.clear();
+  for (RH_RF95 *from : this->radios)
+  {
+    std::vector<Link> &out = this->links[from];
+    for (RH_RF95 *to : this->radios)
+    {
+      if (to == from)
+        continue;
+      double loss = this->Loss(from, to);
+      if (loss <= maxLoss)
+        out.push_back({to, loss});
+    }
+  }
+  this->linksBuilt = true;
+}
+
+bool Channel::Hears(const RH_RF95 *radio, const Frame &frame, double rssi) const
+{
+  // Different frequencies do not interact, different spreading factors
+  // are treated as orthogonal
+  if (fabs(radio->_freq - frame.freq) * 1000000.0 >= frame.bw)
+    return false;
+  if (radio->_sf != frame.sf || radio->_bw != frame.bw)
+    return false;
+  return rssi - this->NoiseFloor(frame.bw) >= DemodulationFloor(frame.sf);
+}
+
+bool Channel::Interfered(const RH_RF95 *radio, const Frame &frame, double rssi) const
+{
+  for (const std::shared_ptr<Frame> &other : this->onAir)
+  {
+    if (other.get() == &frame || other->sender == radio)
+      continue;
+    double otherRssi = other->power - this->Loss(other->sender, radio) - this->Fade();
+    if (this->Hears(radio, *other, otherRssi) && rssi - otherRssi < this->captureThreshold)
+      return true;
+  }
+  return false;
+}
+
+usec_t Channel::Transmit(RH_RF95 *sender, const uint8_t *data, uint8_t len)
+{
+  if (!this->linksBuilt)
+    this->BuildLinks();
+
+  Scheduler &scheduler = Scheduler::Instance();
+  std::shared_ptr<Frame> frame = std::make_shared<Frame>();
+  frame->sender = sender;
+  memcpy(frame->data, data, len);
+  frame->len = len;
+  frame->freq = sender->_freq;
+  frame->sf = sender->_sf;
+  frame->bw = sender->_bw;
+  frame->preamble = sender->_preamble;
+  frame->power = sender->_power;
+  frame->start = scheduler.Now();
+  frame->end = frame->start + AirTime(len, sender->_sf, sender->_bw, sender->_cr, sender->_preamble);
+
+  for (const Link &link : this->links[sender])
+  {
+    RH_RF95 *radio = link.radio;
+    double rssi = frame->power - link.loss - this->Fade();
+    if (!this->Hears(radio, *frame, rssi))
+      continue;
+
+    if (radio->lock)
+    {
+      // Already demodulating a frame, it only survives if it is clearly stronger
+      if (radio->lockRssi - rssi < this->captureThreshold)
+        radio->lockCorrupt = true;
+    }
+    else if (radio->_mode == RH_RF95::RHModeRx)
+    {
+      radio->lock = frame;
+      radio->lockRssi = rssi;
+      radio->lockCorrupt = this->Interfered(radio, *frame, rssi);
+    }
+  }
+
+  this->onAir.push_back(frame);
+  if (this->onTransmit)
+    this->onTransmit(*sender, data, len);
+
+  scheduler.At(frame->end, [this, frame]() { this->EndFrame(frame); });
+  return frame->end;
+}
+
+void Channel::EndFrame(std::shared_ptr<Frame> frame)
+{
+  this->onAir.erase(std::find(this->onAir.begin(), this->onAir.end(), frame));
+
+  // TX done, RadioHead drops the radio to idle from the interrupt
+  RH_RF95 *sender = frame->sender;
+  ++sender->_txGood;
+  if (sender->_mode == RH_RF95::RHModeTx)
+    sender->SetMode(RH_RF95::RHModeIdle);
+  Scheduler::Instance().Wake(sender->waiter);
+
+  for (const Link &link : this->links[sender])
+  {
+    RH_RF95 *radio = link.radio;
+    if (radio->lock != frame)
+      continue;
+
+    radio->lock.reset();
+    if (radio->lockCorrupt)
+    {
+      ++radio->_rxBad;
+      continue;
+    }
+
+    double snr = radio->lockRssi - this->NoiseFloor(frame->bw);
+    radio->Deliver(frame->data, frame->len, radio->lockRssi, snr);
+  }
+}
+
+void Channel::StartListening(RH_RF95 *radio)
+{
+  if (radio->lock)
+    return;
+
+  usec_t now = Scheduler::Instance().Now();
+  std::shared_ptr<Frame> best;
+  double bestRssi = 0;
+  for (const std::shared_ptr<Frame> &frame : this->onAir)
+  {
+    if (frame->sender == radio)
+      continue;
+
+    // Too late if fewer than lockSymbols of the preamble are left
+    uint16_t lockable = frame->preamble > this->lockSymbols ? frame->preamble - this->lockSymbols : 0;
+    if (now > frame->start + lockable * SymbolTime(frame->sf, frame->bw))
+      continue;
+
+    double rssi = frame->power - this->Loss(frame->sender, radio) - this->Fade();
+    if (this->Hears(radio, *frame, rssi) && (!best || rssi > bestRssi))
+    {
+      best = frame;
+      bestRssi = rssi;
+    }
+  }
+
+  if (best)
+  {
+    radio->lock = best;
+    radio->lockRssi = bestRssi;
+    radio->lockCorrupt = this->Interfered(radio, *best, bestRssi);
+  }
+}
+
+bool Channel::Busy(const RH_RF95 *listener) const
+{
+  for (const std::shared_ptr<Frame> &frame : this->onAir)
+  {
+    if (frame->sender == listener)
+      continue;
+    double rssi = frame->power - this->Loss(frame->sender, listener) - this->Fade();
+    if (this->Hears(listener, *frame, rssi))
+      return true;
+  }
+  return false;
+}
+
+} // namespace sim
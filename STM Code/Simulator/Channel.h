@@ -0,0 +1,109 @@
+/*
+  Channel.h - Shared LoRa medium for the host-side Arpa_RF95 simulator.
+
+  Models what matters for protocol sizing rather than RF accuracy:
+    - time on air from the Semtech LoRa airtime formula (AN1200.13)
+    - log-distance path loss and the per spreading factor demodulation floor
+    - half duplex radios that only receive frames whose preamble they caught in RX
+    - collisions between overlapping frames on the same frequency and spreading
+      factor, with a capture threshold for the stronger frame
+*/
+#ifndef Sim_Channel_h
+#define Sim_Channel_h
+
+#include "Scheduler.h"
+#include "RH_RF95.h"
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace sim
+{
+
+struct Frame
+{
+  RH_RF95 *sender;
+  uint8_t data[RH_RF95_MAX_PAYLOAD_LEN];
+  uint8_t len;
+  float freq;
+  uint8_t sf;
+  long bw;
+  uint16_t preamble;
+  double power;
+  usec_t start, end;
+};
+
+class Channel
+{
+public:
+  static Channel &Instance();
+
+  /// Radios attach themselves on construction
+  void Attach(RH_RF95 *radio);
+
+  /// Put a frame on air from the sender. The sender must already be in TX mode.
+  /// At the end of the frame the sender drops to idle and every radio that
+  /// demodulated it cleanly gets it delivered.
+  ///
+  /// \return usec_t - the virtual time the frame ends
+  usec_t Transmit(RH_RF95 *sender, const uint8_t *data, uint8_t len);
+
+  /// Called when a radio enters RX. A receiver that starts listening while
+  /// enough of a frame's preamble is left can still lock onto it.
+  void StartListening(RH_RF95 *radio);
+
+  /// True if a frame that the listener could demodulate is on air right now
+  bool Busy(const RH_RF95 *listener) const;
+
+  /// Time on air of a frame of len bytes (including the RadioHead header),
+  /// cr is the coding rate denominator (5 to 8)
+  static usec_t AirTime(uint8_t len, uint8_t sf, long bw, uint8_t cr, uint16_t preamble);
+
+  /// Symbol time in microseconds
+  static usec_t SymbolTime(uint8_t sf, long bw);
+
+  /// Minimum SNR needed to demodulate at the given spreading factor
+  static double DemodulationFloor(uint8_t sf);
+
+  /// Path loss between two radios in dB
+  double Loss(const RH_RF95 *a, const RH_RF95 *b) const;
+
+  /// Thermal noise floor plus receiver noise figure in dBm
+  double NoiseFloor(long bw) const;
+
+  // Propagation model, set before the simulation starts
+  double referenceLoss;     // dB at 1 m
+  double pathLossExponent;  // log-distance exponent
+  double noiseFigure;       // dB
+  double captureThreshold;  // dB a frame must beat an overlapping one by to survive
+  uint16_t lockSymbols;     // Preamble symbols a receiver needs to lock onto a frame
+  double fade;              // dB of extra loss on every link from fadeAt on
+  usec_t fadeAt;
+
+  /// Called for every frame put on air, used by the simulator for statistics
+  std::function<void(RH_RF95 &sender, const uint8_t *data, uint8_t len)> onTransmit;
+
+private:
+  struct Link
+  {
+    RH_RF95 *radio;
+    double loss;
+  };
+
+  Channel();
+  void BuildLinks();
+  void EndFrame(std::shared_ptr<Frame> frame);
+  bool Hears(const RH_RF95 *radio, const Frame &frame, double rssi) const;
+  bool Interfered(const RH_RF95 *radio, const Frame &frame, double rssi) const;
+  double Fade() const;
+
+  std::vector<RH_RF95 *> radios;
+  std::unordered_map<const RH_RF95 *, std::vector<Link>> links;
+  std::vector<std::shared_ptr<Frame>> onAir;
+  bool linksBuilt;
+};
+
+} // namespace sim
+
+#endif
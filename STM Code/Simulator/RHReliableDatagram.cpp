@@ -0,0 +1,196 @@
+#include "RHReliableDatagram.h"
+
+RHReliableDatagram::RHReliableDatagram(RH_RF95 &driver, uint8_t thisAddress)
+    : _driver(driver), _thisAddress(thisAddress), _timeout(RH_DEFAULT_TIMEOUT), _retries(RH_DEFAULT_RETRIES),
+      _lastSequenceNumber(0), _retransmissions(0)
+{
+  memset(this->_seenIds, 0, sizeof(this->_seenIds));
+}
+
+bool RHReliableDatagram::init()
+{
+  bool ret = this->_driver.init();
+  if (ret)
+    this->setThisAddress(this->_thisAddress);
+  return ret;
+}
+
+void RHReliableDatagram::setThisAddress(uint8_t thisAddress)
+{
+  this->_driver.setThisAddress(thisAddress);
+  this->_driver.setHeaderFrom(thisAddress);
+  this->_thisAddress = thisAddress;
+}
+
+void RHReliableDatagram::setTimeout(uint16_t timeout)
+{
+  this->_timeout = timeout;
+}
+
+void RHReliableDatagram::setRetries(uint8_t retries)
+{
+  this->_retries = retries;
+}
+
+uint8_t RHReliableDatagram::retries()
+{
+  return this->_retries;
+}
+
+uint8_t RHReliableDatagram::thisAddress()
+{
+  return this->_thisAddress;
+}
+
+uint32_t RHReliableDatagram::retransmissions()
+{
+  return this->_retransmissions;
+}
+
+void RHReliableDatagram::resetRetransmissions()
+{
+  this->_retransmissions = 0;
+}
+
+bool RHReliableDatagram::available()
+{
+  return this->_driver.available();
+}
+
+bool RHReliableDatagram::waitAvailableTimeout(uint16_t timeout)
+{
+  return this->_driver.waitAvailableTimeout(timeout);
+}
+
+bool RHReliableDatagram::waitPacketSent()
+{
+  return this->_driver.waitPacketSent();
+}
+
+bool RHReliableDatagram::sendto(uint8_t *buf, uint8_t len, uint8_t address)
+{
+  this->_driver.setHeaderTo(address);
+  return this->_driver.send(buf, len);
+}
+
+bool RHReliableDatagram::recvfrom(uint8_t *buf, uint8_t *len, uint8_t *from, uint8_t *to, uint8_t *id, uint8_t *flags)
+{
+  if (this->_driver.recv(buf, len))
+  {
+    if (from)
+      *from = this->_driver.headerFrom();
+    if (to)
+      *to = this->_driver.headerTo();
+    if (id)
+      *id = this->_driver.headerId();
+    if (flags)
+      *flags = this->_driver.headerFlags();
+    return true;
+  }
+  return false;
+}
+
+bool RHReliableDatagram::sendtoWait(uint8_t *buf, uint8_t len, uint8_t address)
+{
+  uint8_t thisSequenceNumber = ++this->_lastSequenceNumber;
+  uint8_t retries = 0;
+  while (retries++ <= this->_retries)
+  {
+    this->_driver.setHeaderId(thisSequenceNumber);
+
+    // The RETRY flag marks every transmission after the first one
+    uint8_t headerFlagsToSet = RH_FLAGS_NONE;
+    uint8_t headerFlagsToClear = RH_FLAGS_ACK;
+    if (retries == 1)
+      headerFlagsToClear |= RH_FLAGS_RETRY;
+    else
+      headerFlagsToSet = RH_FLAGS_RETRY;
+    this->_driver.setHeaderFlags(headerFlagsToSet, headerFlagsToClear);
+
+    this->sendto(buf, len, address);
+    this->waitPacketSent();
+
+    // Never wait for ACKs to broadcasts
+    if (address == RH_BROADCAST_ADDRESS)
+      return true;
+
+    if (retries > 1)
+      ++this->_retransmissions;
+
+    // Random timeout between _timeout and _timeout * 2 so two nodes that collided do not collide again
+    unsigned long thisSendTime = millis();
+    uint16_t timeout = this->_timeout + (this->_timeout * random(0, 256) / 256);
+    int32_t timeLeft;
+    while ((timeLeft = timeout - (millis() - thisSendTime)) > 0)
+    {
+      if (this->waitAvailableTimeout(timeLeft))
+      {
+        uint8_t from, to, id, flags;
+        if (this->recvfrom(0, 0, &from, &to, &id, &flags)) // Discards the message
+        {
+          if (from == address && to == this->_thisAddress && (flags & RH_FLAGS_ACK) && id == thisSequenceNumber)
+            return true;
+          else if (!(flags & RH_FLAGS_ACK) && id == this->_seenIds[from])
+            this->acknowledge(id, from); // A request we already received, ACK it again
+        }
+      }
+    }
+  }
+  return false;
+}
+
+bool RHReliableDatagram::recvfromAck(uint8_t *buf, uint8_t *len, uint8_t *from, uint8_t *to, uint8_t *id, uint8_t *flags)
+{
+  uint8_t _from, _to, _id, _flags;
+  if (this->available() && this->recvfrom(buf, len, &_from, &_to, &_id, &_flags))
+  {
+    // Never ACK an ACK
+    if (!(_flags & RH_FLAGS_ACK))
+    {
+      if (_to == this->_thisAddress)
+        this->acknowledge(_id, _from);
+
+      // Only pass on messages that have not been seen before, duplicates are just re-ACKed
+      if (_id != this->_seenIds[_from])
+      {
+        if (from)
+          *from = _from;
+        if (to)
+          *to = _to;
+        if (id)
+          *id = _id;
+        if (flags)
+          *flags = _flags;
+        this->_seenIds[_from] = _id;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool RHReliableDatagram::recvfromAckTimeout(uint8_t *buf, uint8_t *len, uint16_t timeout, uint8_t *from, uint8_t *to, uint8_t *id, uint8_t *flags)
+{
+  unsigned long starttime = millis();
+  int32_t timeLeft;
+  while ((timeLeft = timeout - (millis() - starttime)) > 0)
+  {
+    if (this->waitAvailableTimeout(timeLeft))
+    {
+      if (this->recvfromAck(buf, len, from, to, id, flags))
+        return true;
+    }
+  }
+  return false;
+}
+
+void RHReliableDatagram::acknowledge(uint8_t id, uint8_t from)
+{
+  this->_driver.setHeaderId(id);
+  this->_driver.setHeaderFlags(RH_FLAGS_ACK);
+
+  // RadioHead sends a 1 octet ACK rather than an empty one
+  uint8_t ack = '!';
+  this->sendto(&ack, sizeof(ack), from);
+  this->waitPacketSent();
+}
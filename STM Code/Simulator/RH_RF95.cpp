@@ -0,0 +1,436 @@
+#include "RH_RF95.h"
+#include "Channel.h"
+#include "Scheduler.h"
+
+using sim::Channel;
+using sim::Scheduler;
+
+RH_RF95::RH_RF95(uint8_t slaveSelectPin, uint8_t interruptPin)
+    : user(NULL),
+      _mode(RHModeInitialising), _freq(434.0), _sf(7), _cr(5), _bw(125000), _preamble(8), _power(13),
+      _cad_timeout(0), _thisAddress(RH_BROADCAST_ADDRESS), _promiscuous(false),
+      _txHeaderTo(RH_BROADCAST_ADDRESS), _txHeaderFrom(RH_BROADCAST_ADDRESS), _txHeaderId(0), _txHeaderFlags(0),
+      _rxHeaderTo(0), _rxHeaderFrom(0), _rxHeaderId(0), _rxHeaderFlags(0),
+      _bufLen(0), _rxBufValid(false), _lastRssi(0), _lastSNR(0), _rxBad(0), _rxGood(0), _txGood(0),
+      x(0), y(0), modeSince(0), waiter(NULL), lockCorrupt(false), lockRssi(0)
+{
+  (void)slaveSelectPin;
+  (void)interruptPin;
+  memset(this->modeTime, 0, sizeof(this->modeTime));
+  Channel::Instance().Attach(this);
+}
+
+bool RH_RF95::init()
+{
+  // Same power on defaults as the RadioHead driver
+  this->_freq = 434.0;
+  this->_sf = 7;
+  this->_bw = 125000;
+  this->_cr = 5;
+  this->_preamble = 8;
+  this->_power = 13;
+  this->_rxBufValid = false;
+  this->SetMode(RHModeIdle);
+  return true;
+}
+
+void RH_RF95::SetMode(RHMode mode)
+{
+  uint64_t now = Scheduler::Instance().Now();
+  this->modeTime[this->_mode] += now - this->modeSince;
+  this->modeSince = now;
+
+  // Leaving RX loses whatever frame was being demodulated
+  if (mode != RHModeRx)
+    this->lock.reset();
+  this->_mode = mode;
+
+  if (mode == RHModeRx)
+    Channel::Instance().StartListening(this);
+}
+
+uint64_t RH_RF95::GetModeTime(RHMode mode) const
+{
+  uint64_t total = this->modeTime[mode];
+  if (this->_mode == mode)
+    total += Scheduler::Instance().Now() - this->modeSince;
+  return total;
+}
+
+void RH_RF95::Deliver(const uint8_t *data, uint8_t len, double rssi, double snr)
+{
+  if (len < RH_RF95_HEADER_LEN)
+  {
+    ++this->_rxBad;
+    return;
+  }
+
+  // Not addressed to us, keep listening
+  uint8_t to = data[RH_RF95_TO_POS];
+  if (!this->_promiscuous && to != this->_thisAddress && to != RH_BROADCAST_ADDRESS)
+    return;
+
+  memcpy(this->_buf, data, len);
+  this->_bufLen = len;
+  this->_rxHeaderTo = data[RH_RF95_TO_POS];
+  this->_rxHeaderFrom = data[RH_RF95_FROM_POS];
+  this->_rxHeaderId = data[RH_RF95_ID_POS];
+  this->_rxHeaderFlags = data[RH_RF95_FLAGS_POS];
+  this->_lastRssi = (int16_t)lround(rssi);
+  this->_lastSNR = (int)lround(snr);
+  this->_rxBufValid = true;
+  ++this->_rxGood;
+
+  // RX done, the driver idles the radio until the message is read
+  this->SetMode(RHModeIdle);
+  Scheduler::Instance().Wake(this->waiter);
+}
+
+bool RH_RF95::available()
+{
+  if (this->_mode == RHModeTx)
+    return false;
+  this->setModeRx();
+  return this->_rxBufValid;
+}
+
+bool RH_RF95::recv(uint8_t *buf, uint8_t *len)
+{
+  if (!this->available())
+    return false;
+
+  if (buf && len)
+  {
+    uint8_t msgLen = this->_bufLen - RH_RF95_HEADER_LEN;
+    if (*len > msgLen)
+      *len = msgLen;
+    memcpy(buf, this->_buf + RH_RF95_HEADER_LEN, *len);
+  }
+  this->_rxBufValid = false;
+  return true;
+}
+
+bool RH_RF95::send(const uint8_t *data, uint8_t len)
+{
+  if (len > RH_RF95_MAX_MESSAGE_LEN)
+    return false;
+
+  this->waitPacketSent();
+  this->setModeIdle();
+
+  // Same listen before talk as RHGenericDriver::waitCAD()
+  if (this->_cad_timeout)
+  {
+    unsigned long start = millis();
+    while (this->isChannelActive())
+    {
+      if (millis() - start > this->_cad_timeout)
+        return false;
+      delay(random(1, 10) * 100);
+    }
+  }
+
+  uint8_t frame[RH_RF95_MAX_PAYLOAD_LEN];
+  frame[RH_RF95_TO_POS] = this->_txHeaderTo;
+  frame[RH_RF95_FROM_POS] = this->_txHeaderFrom;
+  frame[RH_RF95_ID_POS] = this->_txHeaderId;
+  frame[RH_RF95_FLAGS_POS] = this->_txHeaderFlags;
+  memcpy(frame + RH_RF95_HEADER_LEN, data, len);
+
+  this->SetMode(RHModeTx);
+  Channel::Instance().Transmit(this, frame, len + RH_RF95_HEADER_LEN);
+  return true;
+}
+
+bool RH_RF95::WaitWhileTransmitting()
+{
+  Scheduler &scheduler = Scheduler::Instance();
+  while (this->_mode == RHModeTx)
+  {
+    this->waiter = scheduler.Current();
+    scheduler.WaitUntil(UINT64_MAX);
+    this->waiter = NULL;
+  }
+  return true;
+}
+
+bool RH_RF95::waitPacketSent()
+{
+  return this->WaitWhileTransmitting();
+}
+
+bool RH_RF95::waitAvailableTimeout(uint16_t timeout)
+{
+  Scheduler &scheduler = Scheduler::Instance();
+  uint64_t deadline = scheduler.Now() + (uint64_t)timeout * 1000;
+
+  while (!this->available())
+  {
+    if (scheduler.Now() >= deadline)
+      return false;
+
+    this->waiter = scheduler.Current();
+    scheduler.WaitUntil(deadline);
+    this->waiter = NULL;
+  }
+  return true;
+}
+
+uint8_t RH_RF95::maxMessageLength()
+{
+  return RH_RF95_MAX_MESSAGE_LEN;
+}
+
+bool RH_RF95::setFrequency(float centre)
+{
+  this->_freq = centre;
+  return true;
+}
+
+void RH_RF95::setTxPower(int8_t power, bool useRFO)
+{
+  (void)useRFO;
+  if (power > 23)
+    power = 23;
+  if (power < 5)
+    power = 5;
+  this->_power = power;
+}
+
+void RH_RF95::setSpreadingFactor(uint8_t sf)
+{
+  if (sf < 6)
+    sf = 6;
+  else if (sf > 12)
+    sf = 12;
+  this->_sf = sf;
+}
+
+void RH_RF95::setSignalBandwidth(long sbw)
+{
+  this->_bw = sbw;
+}
+
+void RH_RF95::setCodingRate4(uint8_t denominator)
+{
+  if (denominator < 5)
+    denominator = 5;
+  else if (denominator > 8)
+    denominator = 8;
+  this->_cr = denominator;
+}
+
+void RH_RF95::setPreambleLength(uint16_t bytes)
+{
+  this->_preamble = bytes;
+}
+
+void RH_RF95::setCADTimeout(unsigned long cad_timeout)
+{
+  this->_cad_timeout = cad_timeout;
+}
+
+void RH_RF95::setModeIdle()
+{
+  if (this->_mode != RHModeIdle)
+    this->SetMode(RHModeIdle);
+}
+
+void RH_RF95::setModeRx()
+{
+  if (this->_mode != RHModeRx)
+    this->SetMode(RHModeRx);
+}
+
+void RH_RF95::setModeTx()
+{
+  if (this->_mode != RHModeTx)
+    this->SetMode(RHModeTx);
+}
+
+bool RH_RF95::sleep()
+{
+  if (this->_mode != RHModeSleep)
+    this->SetMode(RHModeSleep);
+  return true;
+}
+
+RH_RF95::RHMode RH_RF95::mode()
+{
+  return this->_mode;
+}
+
+bool RH_RF95::isChannelActive()
+{
+  if (this->_mode == RHModeCad)
+    return true;
+
+  // A CAD takes roughly two symbols, the result reflects what was on air when it finished
+  this->SetMode(RHModeCad);
+  Scheduler &scheduler = Scheduler::Instance();
+  scheduler.SleepUntil(scheduler.Now() + 2 * Channel::SymbolTime(this->_sf, this->_bw));
+  bool active = Channel::Instance().Busy(this);
+  this->SetMode(RHModeIdle);
+  return active;
+}
+
+uint8_t RH_RF95::spiRead(uint8_t reg)
+{
+  uint32_t frf = (uint32_t)(this->_freq * 1000000.0 / RH_RF95_FSTEP);
+  // PA_BOOST output, the top 3 dB come from the high power DAC
+  int8_t power = this->_power > 20 ? this->_power - 3 : this->_power;
+  uint8_t bw;
+  switch (this->_bw)
+  {
+  case 62500: bw = 6; break;
+  case 250000: bw = 8; break;
+  case 500000: bw = 9; break;
+  default: bw = 7; break;
+  }
+
+  switch (reg)
+  {
+  case RH_RF95_REG_01_OP_MODE:
+  {
+    static const uint8_t modes[] = {0x00, 0x00, 0x01, 0x03, 0x05, 0x07};
+    return 0x80 | modes[this->_mode];
+  }
+  case RH_RF95_REG_06_FRF_MSB: return (uint8_t)(frf >> 16);
+  case RH_RF95_REG_07_FRF_MID: return (uint8_t)(frf >> 8);
+  case RH_RF95_REG_08_FRF_LSB: return (uint8_t)frf;
+  case RH_RF95_REG_09_PA_CONFIG: return 0x80 | (uint8_t)(power - 5);
+  case RH_RF95_REG_1D_MODEM_CONFIG1: return (uint8_t)(bw << 4 | (this->_cr - 4) << 1);
+  case RH_RF95_REG_1E_MODEM_CONFIG2: return (uint8_t)(this->_sf << 4 | 0x04);
+  case RH_RF95_REG_20_PREAMBLE_MSB: return (uint8_t)(this->_preamble >> 8);
+  case RH_RF95_REG_21_PREAMBLE_LSB: return (uint8_t)this->_preamble;
+  case RH_RF95_REG_26_MODEM_CONFIG3: return Channel::SymbolTime(this->_sf, this->_bw) > 16000 ? 0x0c : 0x04;
+  case RH_RF95_REG_4D_PA_DAC: return this->_power > 20 ? 0x07 : 0x04;
+  case RH_RF95_REG_18_MODEM_STAT:
+    if (!this->lock)
+      return RH_RF95_MODEM_STATUS_CLEAR;
+    return RH_RF95_MODEM_STATUS_SIGNAL_DETECTED | RH_RF95_MODEM_STATUS_SIGNAL_SYNCHRONIZED | RH_RF95_MODEM_STATUS_RX_ONGOING;
+  default: return 0;
+  }
+}
+
+int16_t RH_RF95::lastRssi()
+{
+  return this->_lastRssi;
+}
+
+int RH_RF95::lastSNR()
+{
+  return this->_lastSNR;
+}
+
+void RH_RF95::setThisAddress(uint8_t thisAddress)
+{
+  this->_thisAddress = thisAddress;
+}
+
+void RH_RF95::setHeaderTo(uint8_t to)
+{
+  this->_txHeaderTo = to;
+}
+
+void RH_RF95::setHeaderFrom(uint8_t from)
+{
+  this->_txHeaderFrom = from;
+}
+
+void RH_RF95::setHeaderId(uint8_t id)
+{
+  this->_txHeaderId = id;
+}
+
+void RH_RF95::setHeaderFlags(uint8_t set, uint8_t clear)
+{
+  this->_txHeaderFlags &= ~clear;
+  this->_txHeaderFlags |= set;
+}
+
+void RH_RF95::setPromiscuous(bool promiscuous)
+{
+  this->_promiscuous = promiscuous;
+}
+
+uint8_t RH_RF95::headerTo()
+{
+  return this->_rxHeaderTo;
+}
+
+uint8_t RH_RF95::headerFrom()
+{
+  return this->_rxHeaderFrom;
+}
+
+uint8_t RH_RF95::headerId()
+{
+  return this->_rxHeaderId;
+}
+
+uint8_t RH_RF95::headerFlags()
+{
+  return this->_rxHeaderFlags;
+}
+
+uint16_t RH_RF95::rxBad()
+{
+  return this->_rxBad;
+}
+
+uint16_t RH_RF95::rxGood()
+{
+  return this->_rxGood;
+}
+
+uint16_t RH_RF95::txGood()
+{
+  return this->_txGood;
+}
+
+void RH_RF95::SetPosition(double x, double y)
+{
+  this->x = x;
+  this->y = y;
+}
+
+double RH_RF95::GetX() const
+{
+  return this->x;
+}
+
+double RH_RF95::GetY() const
+{
+  return this->y;
+}
+
+float RH_RF95::GetFrequency() const
+{
+  return this->_freq;
+}
+
+uint8_t RH_RF95::GetSpreadingFactor() const
+{
+  return this->_sf;
+}
+
+long RH_RF95::GetBandwidth() const
+{
+  return this->_bw;
+}
+
+uint8_t RH_RF95::GetCodingRate() const
+{
+  return this->_cr;
+}
+
+uint16_t RH_RF95::GetPreambleLength() const
+{
+  return this->_preamble;
+}
+
+int8_t RH_RF95::GetTxPower() const
+{
+  return this->_power;
+}
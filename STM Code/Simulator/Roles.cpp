@@ -0,0 +1,482 @@
+/*
+ * Role loops of the simulated devices.
+ *
+ * These follow SetupNode()/NodeLoop(), SetupForwarder() and SetupBase()/BaseLoop()
+ * in STM Code_program/Combined/Combined.ino. Keep them in step with the firmware
+ * so the simulator measures the protocol that is actually deployed.
+ */
+
+#include "Arpa_RF95.h"
+#include "Arpa_Payload.h"
+#include "Arpa_SampleBuffer.h"
+#include "Arpa_Update.h"
+#include "Arpa_Crc.h"
+#include "Simulator.h"
+
+#define RFM95_RST 1
+#define RFM95_EN 3
+#define RFM95_POWER 20
+#define SAMPLE_RETRY_INTERVAL 300
+#define SAMPLE_RETRY_MAX 3600
+#define FIRMWARE_VERSION 1
+#define FIRMWARE_MAX_SIZE 0x7800
+#define UPDATE_CHUNK_LENGTH 128
+#define UPDATE_CHUNKS_PER_WAKE 8
+#define UPDATE_FETCH_INTERVAL 120
+#define UPDATE_BUSY_DELAY 500
+#define UPDATE_BUSY_RETRIES 4
+// Version of the update the bases hand out, a full image of random bytes
+#define SIM_UPDATE_VERSION 2
+// A base tells its sensors to update one at a time, the next once the last one has
+// installed it or this many seconds passed. At SF12 a 30 KB update keeps the channel
+// busy for hours, sensors fetching at the same time would only collide.
+#define SIM_UPDATE_ROLLOUT_TIMEOUT 21600
+// Events of the roles, like those of Arpa_RF95, see Combined.ino
+#define LOG(...) (ARPA_LOG::Event(__VA_ARGS__))
+
+namespace sim
+{
+
+static bool SendLoraMessage(Arpa_RF95 &lora, char *data, uint8_t dataLen)
+{
+  if (lora.SendOneShot(data, dataLen))
+  {
+    LOG(ARPA_EV_DATA_SENT, dataLen);
+    return true;
+  }
+
+  LOG(ARPA_EV_DATA_RETRY);
+  if (lora.DiscoverRoute() && lora.SendOneShot(data, dataLen))
+  {
+    LOG(ARPA_EV_DATA_SENT, dataLen);
+    return true;
+  }
+
+  LOG(ARPA_EV_DATA_FAILED);
+  return false;
+}
+
+static void UpdateDataRate(Arpa_RF95 &lora)
+{
+  if (lora.DataRateRequestDue())
+    lora.RequestDataRate();
+}
+
+static bool SendLoraMessageConnected(Arpa_RF95 &lora, char *data, uint8_t dataLen)
+{
+  if (!lora.Synchronize())
+  {
+    LOG(ARPA_EV_SYNC_FAILED);
+    return false;
+  }
+
+  LOG(ARPA_EV_SYNC_OK);
+  switch (lora.SendConnectedMessage(lora.GetBaseId(), ARPA_TYPE_ID_DATA, data, dataLen))
+  {
+  case ARPA_TYPE_ID_ACK:
+    LOG(ARPA_EV_DATA_SENT, dataLen);
+    if (lora.Close())
+    {
+      LOG(ARPA_EV_CLOSE_OK);
+      return true;
+    }
+    LOG(ARPA_EV_CLOSE_FAILED);
+    break;
+
+  case ARPA_TYPE_ID_NACK:
+    LOG(ARPA_EV_DATA_NACK);
+    return false;
+
+  case ARPA_TYPE_ID_INVALID:
+  default:
+    LOG(ARPA_EV_DATA_FAILED);
+    return false;
+  }
+  return true;
+}
+
+// RtcMillis() of Combined.ino, the scheduler clock keeps running while the device sleeps
+static uint32_t RtcMillis()
+{
+  return Scheduler::Instance().Now() / 1000;
+}
+
+static Device &CurrentDevice()
+{
+  return *static_cast<Device *>(Scheduler::Instance().Current()->user);
+}
+
+// HandleCommand(), the bases send a sample interval or an update here.
+// The update is started by the sensor loop, which owns the Arpa_Update.
+static void HandleCommand(const uint8_t *data, const uint8_t len)
+{
+  Device &dev = CurrentDevice();
+  Arpa_PayloadReader payload(data, len);
+  Arpa_reading command;
+  while (payload.NextReading(command))
+  {
+    if (command.type == ARPA_TLV_CMD_UPDATE)
+    {
+      dev.updateVersion = (uint16_t)command.value;
+      continue;
+    }
+    if (command.type != ARPA_TLV_CMD_SAMPLE_INTERVAL)
+      continue;
+
+    dev.sampleInterval = constrain(command.value, 0, 0xFFFD);
+    ++dev.stats.commandsDelivered;
+    if (!dev.commandTimes.empty())
+    {
+      dev.stats.commandLatency += Scheduler::Instance().Now() - dev.commandTimes.front();
+      dev.commandTimes.pop_front();
+    }
+  }
+}
+
+// Flash of Combined.ino in RAM. The bases only send full images, so the
+// running firmware is never read.
+static void ReadFirmware(const uint32_t offset, uint8_t *buf, const uint16_t len)
+{
+  memset(buf, 0, len);
+}
+
+static void ReadStaging(const uint32_t offset, uint8_t *buf, const uint16_t len)
+{
+  memcpy(buf, &CurrentDevice().staging[offset], len);
+}
+
+static bool WriteStaging(const uint32_t offset, const uint8_t *data, const uint16_t len)
+{
+  memcpy(&CurrentDevice().staging[offset], data, len);
+  return true;
+}
+
+// FetchUpdate(), installing is counted instead of resetting into the bootloader
+static void FetchUpdate(Device &dev, Arpa_RF95 &lora, Arpa_Update &update, uint16_t &firmwareVersion)
+{
+  char buf[ARPA_MAX_CHUNK_LENGTH];
+  lora.SetSleepState(false);
+  uint8_t chunks = 0, busy = 0;
+  while (update.InProgress() && !update.IsComplete() && chunks < UPDATE_CHUNKS_PER_WAKE && busy <= UPDATE_BUSY_RETRIES)
+  {
+    uint8_t chunkLen = UPDATE_CHUNK_LENGTH;
+    switch (lora.RequestUpdateChunk(update.GetVersion(), update.GetImageOffset(), (uint8_t *)buf, chunkLen))
+    {
+    case ARPA_CHUNK_OK:
+      if (!update.Take((uint8_t *)buf, chunkLen))
+      {
+        LOG(update.WriteFailed() ? ARPA_EV_UPDATE_WRITE : ARPA_EV_UPDATE_TOO_BIG);
+        update.Abandon();
+      }
+      ++chunks;
+      busy = 0;
+      break;
+
+    case ARPA_CHUNK_BUSY:
+      if (++busy <= UPDATE_BUSY_RETRIES)
+        delay(UPDATE_BUSY_DELAY);
+      break;
+
+    case ARPA_CHUNK_NONE:
+    default:
+      LOG(ARPA_EV_UPDATE_NOT_FOUND);
+      update.Abandon();
+      break;
+    }
+  }
+  lora.SetSleepState(true);
+
+  if (update.IsComplete())
+  {
+    if (update.Verify())
+    {
+      LOG(ARPA_EV_UPDATE_INSTALL, update.GetVersion());
+      firmwareVersion = update.GetVersion();
+      ++dev.stats.updated;
+      dev.stats.updateTime += Scheduler::Instance().Now() - dev.updateQueuedAt;
+    }
+    else
+      LOG(ARPA_EV_UPDATE_CRC);
+    update.Abandon();
+  }
+}
+
+void RunSensor(Device &dev, const Config &config)
+{
+  Scheduler &scheduler = Scheduler::Instance();
+  Arpa_RF95 lora(&dev.driver, RFM95_RST, dev.freq, RFM95_POWER, RFM95_EN, dev.nodeId);
+  std::exponential_distribution<double> nextEvent(config.eventsPerHour / 3600.0);
+
+  // SetupNode()
+  lora.SetNodeId(dev.nodeId);
+  lora.SetBaseId(dev.baseId);
+  dev.sampleInterval = config.sampleInterval;
+  if (config.commandsPerHour > 0 || config.updateBytes > 0)
+    lora.SetCommandHandler(HandleCommand);
+  uint16_t firmwareVersion = FIRMWARE_VERSION;
+  Arpa_Update update(ReadFirmware, ReadStaging, WriteStaging, FIRMWARE_VERSION, FIRMWARE_MAX_SIZE);
+  if (config.updateBytes > 0)
+    dev.staging.resize(FIRMWARE_MAX_SIZE);
+  lora.SetSlottedAccess(config.slotted);
+  lora.SetSlotClock(RtcMillis);
+  lora.SetListenInterval(config.listenInterval);
+  while (!lora.InitModule())
+    delay(5000);
+  lora.DiscoverRoute();
+
+  // NodeLoop(), the RTC is the scheduler clock in seconds
+  char buf[ARPA_MAX_MSG_LENGTH];
+  Arpa_SampleBuffer samples;
+  usec_t nextEventAt = config.eventsPerHour > 0 ? (usec_t)(nextEvent(dev.rng) * 1000000.0) : UINT64_MAX;
+  uint32_t nextSample = scheduler.Now() / 1000000 + 1 + random(dev.sampleInterval);
+  uint32_t nextFlush = 0;
+  uint32_t nextFetch = 0;
+  uint32_t retryInterval = SAMPLE_RETRY_INTERVAL;
+  bool eventPending = false;
+  while (true)
+  {
+    // Sleep() until the gas interrupt fires, the next reading or the buffer is due
+    uint32_t now = scheduler.Now() / 1000000;
+    uint32_t seconds = samples.SecondsUntilDue(now);
+    if ((int32_t)(nextFlush - now) > 0 && !samples.AlarmPending())
+      seconds = max(seconds, nextFlush - now);
+    if (dev.sampleInterval > 0)
+      seconds = min(seconds, (int32_t)(nextSample - now) > 0 ? nextSample - now : 0);
+    if (update.InProgress())
+      seconds = min(seconds, (int32_t)(nextFetch - now) > 0 ? nextFetch - now : 0);
+    lora.SetSleepState(true);
+    usec_t wake = seconds == UINT32_MAX ? UINT64_MAX : (usec_t)(now + seconds) * 1000000;
+    scheduler.SleepUntil(min(wake, nextEventAt));
+
+    now = scheduler.Now() / 1000000;
+    if (scheduler.Now() >= nextEventAt)
+    {
+      ++dev.stats.events;
+      ++dev.stats.readings;
+      dev.eventTime = scheduler.Now();
+      dev.eventDelivered = false;
+      eventPending = true;
+      samples.Add(ARPA_TLV_GAS, 1, 0, now, true);
+      nextEventAt = scheduler.Now() + (usec_t)(nextEvent(dev.rng) * 1000000.0);
+    }
+    if (dev.sampleInterval > 0 && (int32_t)(now - nextSample) >= 0)
+    {
+      ++dev.stats.readings;
+      samples.Add(ARPA_TLV_GAS, 0, 0, now);
+      nextSample = now + dev.sampleInterval;
+    }
+
+    // HandleCommand() of the firmware starts the update right away
+    if (dev.updateVersion != 0 && dev.updateVersion != firmwareVersion && dev.updateVersion != update.GetVersion())
+      update.Start(dev.updateVersion);
+    if (update.InProgress() && (int32_t)(now - nextFetch) >= 0)
+    {
+      FetchUpdate(dev, lora, update, firmwareVersion);
+      nextFetch = scheduler.Now() / 1000000 + UPDATE_FETCH_INTERVAL;
+    }
+
+    if (!samples.FlushDue(now) || ((int32_t)(now - nextFlush) < 0 && !samples.AlarmPending()))
+      continue;
+
+    // FlushSamples()
+    lora.SetSleepState(false);
+    if (config.slotted && !lora.HasSlotSync() && !lora.WaitForBeacon())
+      LOG(ARPA_EV_NO_BEACON);
+    uint32_t slotWait = config.slotted ? lora.MillisUntilOwnSlot() : 0;
+    if (slotWait > 0)
+    {
+      lora.SetSleepState(true);
+      scheduler.SleepUntil(scheduler.Now() + (usec_t)slotWait * 1000);
+      lora.SetSleepState(false);
+    }
+    // An alarm released the held readings, it goes out under a new sequence number
+    bool sent = true;
+    if (lora.DataUnconfirmed() && !samples.IsHeld())
+      lora.SkipSequence();
+    while (samples.GetCount() > 0)
+    {
+      uint8_t count;
+      uint8_t payloadLen = samples.Encode((uint8_t *)buf, ARPA_PAYLOAD_MAX_LENGTH, now, count);
+      if (!(config.handshake ? SendLoraMessageConnected(lora, buf, payloadLen) : SendLoraMessage(lora, buf, payloadLen)))
+      {
+        if (lora.DataUnconfirmed())
+          samples.Hold(count);
+        sent = false;
+        break;
+      }
+      samples.Remove(count);
+    }
+    if (sent && eventPending)
+      ++dev.stats.acked;
+    if (sent)
+    {
+      eventPending = false;
+      retryInterval = SAMPLE_RETRY_INTERVAL;
+      nextFlush = now;
+    }
+    else
+    {
+      samples.SendFailed();
+      nextFlush = scheduler.Now() / 1000000 + retryInterval / 2 + random(retryInterval);
+      retryInterval = min(retryInterval * 2, (uint32_t)SAMPLE_RETRY_MAX);
+    }
+    if (config.adr)
+      UpdateDataRate(lora);
+    dev.stats.channelBusy = lora.GetChannelBusyCount();
+  }
+}
+
+void RunForwarder(Device &dev, const Config &config)
+{
+  Arpa_RF95 lora(&dev.driver, RFM95_RST, dev.freq, RFM95_POWER, RFM95_EN, dev.nodeId);
+
+  // SetupForwarder()
+  delay(2000);
+  lora.InitModule();
+  lora.SetNodeId(dev.nodeId);
+  lora.SetBaseId(dev.baseId);
+  lora.SetListenInterval(config.listenInterval);
+
+  // ForwarderLoop(), the MCU sleeping until the next interrupt or CAD is a wait in virtual time
+  lora.StartForwarding();
+  while (true)
+  {
+    bool busy = lora.Poll();
+    dev.stats.duplicatesDropped = lora.GetDuplicateCount();
+    if (busy)
+      continue;
+    if (lora.Sniff())
+      dev.driver.waitAvailableTimeout(lora.GetPollTimeout());
+    else
+      delay(lora.GetPollTimeout());
+  }
+}
+
+// Image the bases hand out with --update, as the LTE module would keep it
+static std::vector<uint8_t> updateImage;
+
+static void BuildUpdateImage(const Config &config)
+{
+  if (!updateImage.empty())
+    return;
+
+  std::mt19937 rng(config.seed);
+  std::vector<uint8_t> firmware(min(config.updateBytes, (uint32_t)FIRMWARE_MAX_SIZE));
+  for (uint8_t &b : firmware)
+    b = rng();
+  uint32_t size = firmware.size(), crc = Arpa_Crc32(firmware.data(), size);
+
+  updateImage.assign(ARPA_UPDATE_HEADER_LENGTH, 0);
+  updateImage[ARPA_UPDATE_MAGIC_BYTE_POS] = (uint8_t)ARPA_UPDATE_MAGIC;
+  updateImage[ARPA_UPDATE_MAGIC_BYTE_POS + 1] = (uint8_t)(ARPA_UPDATE_MAGIC >> 8);
+  updateImage[ARPA_UPDATE_FORMAT_BYTE_POS] = ARPA_UPDATE_FULL;
+  updateImage[ARPA_UPDATE_VERSION_BYTE_POS] = SIM_UPDATE_VERSION;
+  for (uint8_t i = 0; i < 4; ++i)
+  {
+    updateImage[ARPA_UPDATE_SIZE_BYTE_POS + i] = (uint8_t)(size >> (8 * i));
+    updateImage[ARPA_UPDATE_CRC_BYTE_POS + i] = (uint8_t)(crc >> (8 * i));
+  }
+  updateImage.insert(updateImage.end(), firmware.begin(), firmware.end());
+}
+
+// UpdateChunkSource(), the image is at hand instead of fetched from the LTE module
+static Arpa_chunk_status UpdateChunkSource(const uint16_t version, const uint32_t offset, uint8_t *buf, uint8_t &len)
+{
+  if (version != SIM_UPDATE_VERSION || offset >= updateImage.size())
+    return ARPA_CHUNK_NONE;
+  len = min((uint32_t)len, (uint32_t)(updateImage.size() - offset));
+  memcpy(buf, &updateImage[offset], len);
+  return ARPA_CHUNK_OK;
+}
+
+// HandleBaseMessage(), data is handed to the LTE module on the real base
+static void HandleBaseMessage(const Arpa_msg_type type, const uint8_t originId, uint8_t *data, const uint8_t len)
+{
+  Device &dev = *static_cast<Device *>(Scheduler::Instance().Current()->user);
+  if (type == ARPA_TYPE_ID_DATA || type == ARPA_TYPE_ID_DATA_ONESHOT)
+    RecordDelivery(dev, originId, data, len);
+}
+
+void RunBase(Device &dev, const Config &config)
+{
+  Scheduler &scheduler = Scheduler::Instance();
+  Arpa_RF95 lora(&dev.driver, RFM95_RST, dev.freq, RFM95_POWER, RFM95_EN, dev.nodeId);
+
+  // SetupBase()
+  while (!lora.InitModule())
+    delay(1000);
+  lora.SetNodeId(dev.nodeId);
+  lora.SetBaseId(dev.nodeId);
+  lora.SetBeaconing(config.slotted);
+  lora.SetFrameSlots(config.frameSlots);
+  lora.SetListenInterval(config.listenInterval);
+  if (config.updateBytes > 0)
+  {
+    BuildUpdateImage(config);
+    lora.SetUpdateSource(UpdateChunkSource);
+  }
+
+  // Commands come from the cloud through the LTE module, for random sensors in range.
+  // They set the sample interval the sensors already have.
+  std::vector<Device *> targets = DirectSensors(dev);
+  std::exponential_distribution<double> nextCommand(config.commandsPerHour * targets.size() / 3600.0);
+  usec_t nextCommandAt = config.commandsPerHour > 0 && !targets.empty() ? (usec_t)(nextCommand(dev.rng) * 1000000.0) : UINT64_MAX;
+  uint8_t command[ARPA_CMD_MAX_LENGTH];
+  Arpa_PayloadWriter writer(command, sizeof(command));
+  writer.AddReading(ARPA_TLV_CMD_SAMPLE_INTERVAL, config.sampleInterval);
+
+  // With --update the sensors in range are told to fetch it one after the other
+  std::vector<Device *> updateTargets;
+  if (config.updateBytes > 0)
+    updateTargets = targets;
+  size_t nextUpdateTarget = 0;
+  usec_t nextUpdateAt = 0;
+  Device *updating = NULL;
+  uint8_t updateCommand[ARPA_CMD_MAX_LENGTH];
+  Arpa_PayloadWriter updateWriter(updateCommand, sizeof(updateCommand));
+  updateWriter.AddReading(ARPA_TLV_CMD_UPDATE, SIM_UPDATE_VERSION);
+
+  // BaseLoop(), waiting for the radio stands in for the idle MCU waking on an interrupt
+  lora.SetMessageHandler(HandleBaseMessage);
+  while (true)
+  {
+    // ReadLTECommands()
+    if (scheduler.Now() >= nextCommandAt)
+    {
+      Device &target = *targets[random(targets.size())];
+      ++target.stats.commands;
+      if (lora.QueueCommand(target.nodeId, command, writer.GetLength()))
+        target.commandTimes.push_back(scheduler.Now());
+      else
+        ++dev.stats.commandsDropped;
+      nextCommandAt = scheduler.Now() + (usec_t)(nextCommand(dev.rng) * 1000000.0);
+    }
+    if (nextUpdateTarget < updateTargets.size() && (scheduler.Now() >= nextUpdateAt || updating->stats.updated > 0))
+    {
+      updating = updateTargets[nextUpdateTarget++];
+      ++updating->stats.updatesCommanded;
+      if (lora.QueueCommand(updating->nodeId, updateCommand, updateWriter.GetLength()))
+        updating->updateQueuedAt = scheduler.Now();
+      else
+        ++dev.stats.commandsDropped;
+      nextUpdateAt = scheduler.Now() + (usec_t)SIM_UPDATE_ROLLOUT_TIMEOUT * 1000000;
+    }
+
+    if (!lora.Poll())
+    {
+      uint32_t timeout = lora.GetPollTimeout();
+      if (nextCommandAt != UINT64_MAX)
+        timeout = min(timeout, (uint32_t)((max(nextCommandAt, scheduler.Now()) - scheduler.Now() + 999) / 1000));
+      if (nextUpdateTarget < updateTargets.size())
+        timeout = min(timeout, (uint32_t)((max(nextUpdateAt, scheduler.Now()) - scheduler.Now() + 999) / 1000));
+      // and the sensor updating may finish meanwhile
+      if (updating != NULL && updating->stats.updated == 0)
+        timeout = min(timeout, (uint32_t)(UPDATE_FETCH_INTERVAL * 1000));
+      dev.driver.waitAvailableTimeout(timeout);
+    }
+    dev.stats.channelBusy = lora.GetChannelBusyCount();
+    dev.stats.duplicatesDropped = lora.GetDuplicateCount();
+  }
+}
+
+} // namespace sim
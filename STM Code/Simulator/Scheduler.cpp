@@ -0,0 +1,160 @@
+#include "Scheduler.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace sim
+{
+
+Scheduler &Scheduler::Instance()
+{
+  static Scheduler instance;
+  return instance;
+}
+
+Scheduler::Scheduler()
+    : now(0), nextSeq(0), current(NULL)
+{
+}
+
+usec_t Scheduler::Now() const
+{
+  return this->now;
+}
+
+void Scheduler::At(usec_t when, std::function<void()> fn)
+{
+  // Never schedule into the past
+  if (when < this->now)
+    when = this->now;
+
+  Event ev;
+  ev.time = when;
+  ev.seq = this->nextSeq++;
+  ev.fn = fn;
+  this->events.push(ev);
+}
+
+Fiber *Scheduler::Spawn(std::function<void()> body, void *user)
+{
+  Fiber *fiber = new Fiber();
+  fiber->body = body;
+  fiber->user = user;
+  fiber->waitToken = 0;
+  fiber->waiting = true; // Waiting for its first resume
+  fiber->wakeable = false;
+  fiber->woken = false;
+  fiber->finished = false;
+  fiber->rngState = 1;
+
+  // malloc rather than a zero-filled container so untouched stack pages are never committed
+  fiber->stack = malloc(stackSize);
+  if (fiber->stack == NULL)
+  {
+    fprintf(stderr, "Scheduler: out of memory allocating fiber stack\n");
+    exit(1);
+  }
+
+  getcontext(&fiber->context);
+  fiber->context.uc_stack.ss_sp = fiber->stack;
+  fiber->context.uc_stack.ss_size = stackSize;
+  fiber->context.uc_link = NULL;
+  makecontext(&fiber->context, &Scheduler::Entry, 0);
+
+  this->fibers.push_back(fiber);
+
+  uint32_t token = fiber->waitToken;
+  this->At(this->now, [this, fiber, token]() { this->Resume(fiber, token); });
+  return fiber;
+}
+
+Fiber *Scheduler::Current() const
+{
+  return this->current;
+}
+
+void Scheduler::SleepUntil(usec_t when)
+{
+  this->Block(when, false);
+}
+
+bool Scheduler::WaitUntil(usec_t deadline)
+{
+  this->Block(deadline, true);
+  return this->current->woken;
+}
+
+void Scheduler::Wake(Fiber *fiber)
+{
+  if (fiber == NULL || !fiber->waiting || !fiber->wakeable || fiber->woken)
+    return;
+
+  fiber->woken = true;
+  uint32_t token = fiber->waitToken;
+  this->At(this->now, [this, fiber, token]() { this->Resume(fiber, token); });
+}
+
+void Scheduler::Run(usec_t end)
+{
+  while (!this->events.empty())
+  {
+    if (this->events.top().time > end)
+      break;
+
+    // Copy out before popping, the callback may schedule new events
+    Event ev = this->events.top();
+    this->events.pop();
+    this->now = ev.time;
+    ev.fn();
+  }
+
+  if (this->now < end)
+    this->now = end;
+}
+
+void Scheduler::Block(usec_t deadline, bool wakeable)
+{
+  Fiber *self = this->current;
+  if (self == NULL)
+  {
+    fprintf(stderr, "Scheduler: blocking call made outside of a simulated device\n");
+    exit(1);
+  }
+
+  uint32_t token = ++self->waitToken;
+  self->waiting = true;
+  self->wakeable = wakeable;
+  self->woken = false;
+  this->At(deadline, [this, self, token]() { this->Resume(self, token); });
+
+  // Hand control back to the scheduler until resumed
+  this->current = NULL;
+  swapcontext(&self->context, &this->schedulerContext);
+  this->current = self;
+}
+
+void Scheduler::Resume(Fiber *fiber, uint32_t token)
+{
+  // A resume event that lost the race against another one is stale
+  if (fiber->finished || !fiber->waiting || fiber->waitToken != token)
+    return;
+
+  fiber->waiting = false;
+  this->current = fiber;
+  swapcontext(&this->schedulerContext, &fiber->context);
+  this->current = NULL;
+}
+
+void Scheduler::Entry()
+{
+  Scheduler &scheduler = Instance();
+  Fiber *self = scheduler.current;
+
+  self->body();
+
+  // Firmware loops normally never return, but a finished fiber must not be resumed again
+  self->finished = true;
+  scheduler.current = NULL;
+  swapcontext(&self->context, &scheduler.schedulerContext);
+}
+
+} // namespace sim
@@ -0,0 +1,108 @@
+/*
+  Scheduler.h - Virtual time and cooperative fibers for the host-side
+  Arpa_RF95 simulator.
+
+  Every simulated device runs its firmware loop on its own fiber. Arduino
+  calls that would block on the real hardware (delay(), waiting on the radio)
+  suspend the fiber and let virtual time advance instead, so thousands of
+  devices can run in one process.
+*/
+#ifndef Sim_Scheduler_h
+#define Sim_Scheduler_h
+
+#include <stdint.h>
+#include <ucontext.h>
+#include <functional>
+#include <queue>
+#include <vector>
+
+namespace sim
+{
+
+// Virtual time in microseconds since the start of the simulation
+typedef uint64_t usec_t;
+
+struct Fiber
+{
+  ucontext_t context;
+  void *stack;
+  std::function<void()> body;
+
+  // Incremented every time the fiber blocks so stale resume events are ignored
+  uint32_t waitToken;
+  bool waiting, wakeable, woken, finished;
+
+  // State for the Arduino random()/randomSeed() of this device
+  uint32_t rngState;
+
+  // Owner of the fiber (the simulated device)
+  void *user;
+};
+
+class Scheduler
+{
+public:
+  static Scheduler &Instance();
+
+  usec_t Now() const;
+
+  /// Run fn from the scheduler context once virtual time reaches "when".
+  /// Events with the same time run in the order they were added.
+  void At(usec_t when, std::function<void()> fn);
+
+  /// Create a fiber that starts running body at the current virtual time.
+  Fiber *Spawn(std::function<void()> body, void *user);
+
+  /// The fiber currently running, or NULL when called from the scheduler context.
+  Fiber *Current() const;
+
+  /// Suspend the current fiber until virtual time "when". Wake() has no effect.
+  void SleepUntil(usec_t when);
+
+  /// Suspend the current fiber until Wake() is called on it or the deadline passes.
+  ///
+  /// \return bool - true if the fiber was woken before the deadline
+  bool WaitUntil(usec_t deadline);
+
+  /// Resume a fiber that is blocked in WaitUntil(). Safe to call at any time
+  /// and from any context, the fiber is resumed from the scheduler.
+  void Wake(Fiber *fiber);
+
+  /// Process events in time order until there are none left or until
+  /// virtual time would pass "end".
+  void Run(usec_t end);
+
+private:
+  struct Event
+  {
+    usec_t time;
+    uint64_t seq;
+    std::function<void()> fn;
+  };
+
+  struct Later
+  {
+    bool operator()(const Event &a, const Event &b) const
+    {
+      return a.time != b.time ? a.time > b.time : a.seq > b.seq;
+    }
+  };
+
+  Scheduler();
+  void Block(usec_t deadline, bool wakeable);
+  void Resume(Fiber *fiber, uint32_t token);
+  static void Entry();
+
+  static const size_t stackSize = 64 * 1024;
+
+  usec_t now;
+  uint64_t nextSeq;
+  Fiber *current;
+  ucontext_t schedulerContext;
+  std::priority_queue<Event, std::vector<Event>, Later> events;
+  std::vector<Fiber *> fibers;
+};
+
+} // namespace sim
+
+#endif
@@ -0,0 +1,583 @@
+/*
+ * Host-side discrete-event simulator for the Arpa_RF95 protocol.
+ *
+ * Runs a fleet of sensor nodes, forwarders and bases in virtual time against
+ * a shared LoRa channel model and reports delivered messages per hour,
+ * protocol frame counts and airtime per device. See README.txt.
+ */
+
+#include "Arpa_RF95.h"
+#include "Arpa_Payload.h"
+#include "Channel.h"
+#include "Simulator.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+
+#define RFM95_FREQ 915.0
+// Spacing between simulated frequency channels in MHz
+#define CHANNEL_SPACING 0.2
+// Link margin in dB a sensor wants at SF12 before it talks to a base directly
+// rather than going through a forwarder
+#define DIRECT_LINK_MARGIN 6.0
+
+namespace sim
+{
+
+bool traceEnabled = false;
+
+static std::vector<std::unique_ptr<Device>> devices;
+// Device by channel and address, for attributing deliveries to sensors
+static std::vector<std::vector<Device *>> addressBook;
+
+const char *DeviceName(void *user)
+{
+  return user ? static_cast<Device *>(user)->name : "sim";
+}
+
+void RecordDelivery(Device &base, uint8_t originId, const uint8_t *payload, uint8_t len)
+{
+  ++base.stats.delivered;
+
+  Device *origin = addressBook[base.channel][originId];
+  if (origin == NULL || origin->role != sensor)
+    return;
+
+  // Gas readings taken before the current event are of an older one, held back
+  // by a failed send (Arpa_SampleBuffer::Hold())
+  usec_t sinceEvent = Scheduler::Instance().Now() - origin->eventTime;
+  Arpa_PayloadReader reader(payload, len);
+  Arpa_reading reading;
+  bool event = false;
+  while (reader.NextReading(reading))
+  {
+    ++origin->stats.readingsDelivered;
+    if (reading.type == ARPA_TLV_GAS && reading.value == 1 && reading.age <= (sinceEvent + 999999) / 1000000)
+      event = true;
+  }
+  if (!event)
+    return;
+
+  if (origin->eventDelivered)
+  {
+    ++origin->stats.duplicates;
+    return;
+  }
+  origin->eventDelivered = true;
+  ++origin->stats.delivered;
+  origin->stats.latency += Scheduler::Instance().Now() - origin->eventTime;
+}
+
+static void CountFrame(RH_RF95 &sender, const uint8_t *data, uint8_t len)
+{
+  Device *dev = static_cast<Device *>(sender.user);
+  Stats &stats = dev->stats;
+  ++stats.frames;
+
+  uint8_t flags = data[RH_RF95_FLAGS_POS];
+  if (traceEnabled)
+    fprintf(stderr, "%10.3f %-8s >> to %u id %u flags 0x%02x len %u type %d\n",
+            Scheduler::Instance().Now() / 1000000.0, dev->name, data[RH_RF95_TO_POS], data[RH_RF95_ID_POS],
+            flags, len, len > RH_RF95_HEADER_LEN ? data[RH_RF95_HEADER_LEN] : -1);
+
+  if (flags & RH_FLAGS_ACK)
+  {
+    ++stats.linkAcks;
+    return;
+  }
+  if (flags & RH_FLAGS_RETRY)
+  {
+    ++stats.retries;
+    return;
+  }
+  if (len > RH_RF95_HEADER_LEN + ARPA_ID_BYTE_POS)
+    ++stats.byType[data[RH_RF95_HEADER_LEN + ARPA_ID_BYTE_POS] & ARPA_TYPE_ID_BATCH];
+}
+
+std::vector<Device *> DirectSensors(const Device &base)
+{
+  std::vector<Device *> sensors;
+  for (const std::unique_ptr<Device> &dev : devices)
+  {
+    if (dev->role == sensor && dev->reachable && dev->channel == base.channel && dev->baseId == base.nodeId)
+      sensors.push_back(dev.get());
+  }
+  return sensors;
+}
+
+// ===== Topology =====
+
+static double LinkMargin(const Device &a, const Device &b)
+{
+  Channel &channel = Channel::Instance();
+  double rssi = 20.0 - channel.Loss(&a.driver, &b.driver);
+  return rssi - channel.NoiseFloor(125000) - Channel::DemodulationFloor(12);
+}
+
+static Device *AddDevice(Role role, const char *prefix, uint32_t n, double x, double y)
+{
+  Device *dev = new Device();
+  dev->index = devices.size();
+  dev->role = role;
+  dev->reachable = true;
+  snprintf(dev->name, sizeof(dev->name), "%s%u", prefix, n);
+  dev->driver.SetPosition(x, y);
+  dev->driver.user = dev;
+  devices.push_back(std::unique_ptr<Device>(dev));
+  return dev;
+}
+
+static Device *BestOf(const Device &from, Role role, bool sameChannelOnly)
+{
+  Device *best = NULL;
+  double bestMargin = -1e9;
+  for (const std::unique_ptr<Device> &dev : devices)
+  {
+    if (dev->role != role || dev.get() == &from)
+      continue;
+    if (sameChannelOnly && dev->channel != from.channel)
+      continue;
+    double margin = LinkMargin(from, *dev);
+    if (margin > bestMargin)
+    {
+      bestMargin = margin;
+      best = dev.get();
+    }
+  }
+  return best;
+}
+
+static bool BuildFleet(const Config &config)
+{
+  std::mt19937 rng(config.seed);
+  std::uniform_real_distribution<double> pos(0.0, config.area);
+
+  // Bases on a regular grid, round robin over the frequency channels
+  uint32_t cols = (uint32_t)ceil(sqrt((double)config.bases));
+  uint32_t rows = (config.bases + cols - 1) / cols;
+  for (uint32_t i = 0; i < config.bases; ++i)
+  {
+    double x = ((i % cols) + 0.5) * config.area / cols;
+    double y = ((i / cols) + 0.5) * config.area / rows;
+    Device *dev = AddDevice(base, "base", i, x, y);
+    dev->channel = i % config.channels;
+  }
+
+  // Forwarders relay to the base they hear best
+  for (uint32_t i = 0; i < config.forwarders; ++i)
+  {
+    Device *dev = AddDevice(forwarder, "fwd", i, pos(rng), pos(rng));
+    Device *target = BestOf(*dev, base, false);
+    dev->channel = target->channel;
+    dev->reachable = LinkMargin(*dev, *target) >= 0;
+  }
+
+  // Forwarders route through each other, so a forwarder out of range of every base
+  // is still reachable through a chain of forwarders on its channel
+  for (bool changed = true; changed;)
+  {
+    changed = false;
+    for (const std::unique_ptr<Device> &dev : devices)
+    {
+      if (dev->role != forwarder || dev->reachable)
+        continue;
+      for (const std::unique_ptr<Device> &relay : devices)
+      {
+        if (relay->role == forwarder && relay->reachable && relay->channel == dev->channel &&
+            LinkMargin(*dev, *relay) >= 0)
+        {
+          dev->reachable = true;
+          changed = true;
+          break;
+        }
+      }
+    }
+  }
+
+  // Sensors go straight to a base if the link is good enough, else through a forwarder
+  for (uint32_t i = 0; i < config.sensors; ++i)
+  {
+    Device *dev = AddDevice(sensor, "node", i, pos(rng), pos(rng));
+    Device *target = BestOf(*dev, base, false);
+    if (LinkMargin(*dev, *target) < DIRECT_LINK_MARGIN)
+    {
+      Device *relay = BestOf(*dev, forwarder, false);
+      if (relay != NULL && relay->reachable && LinkMargin(*dev, *relay) > LinkMargin(*dev, *target))
+        target = relay;
+    }
+    dev->channel = target->channel;
+    dev->reachable = target->reachable && LinkMargin(*dev, *target) >= 0;
+  }
+
+  // Addresses are per channel, bases first so the first base on each channel
+  // keeps ARPA_BASE_ID
+  std::vector<uint32_t> nextAddress(config.channels, ARPA_BASE_ID);
+  addressBook.assign(config.channels, std::vector<Device *>(256, (Device *)NULL));
+  for (const std::unique_ptr<Device> &dev : devices)
+  {
+    uint32_t &next = nextAddress[dev->channel];
+    if (next >= RH_BROADCAST_ADDRESS)
+    {
+      fprintf(stderr, "More than %d devices on channel %u, use more --channels\n", RH_BROADCAST_ADDRESS, dev->channel);
+      return false;
+    }
+    dev->nodeId = (uint8_t)next++;
+    dev->freq = RFM95_FREQ + CHANNEL_SPACING * dev->channel;
+    addressBook[dev->channel][dev->nodeId] = dev.get();
+  }
+
+  // Now that addresses are known, point everything at its next hop
+  for (const std::unique_ptr<Device> &dev : devices)
+  {
+    Device *target;
+    if (dev->role == base)
+      target = dev.get();
+    else if (dev->role == forwarder)
+      target = BestOf(*dev, base, true);
+    else
+    {
+      target = BestOf(*dev, base, true);
+      Device *relay = BestOf(*dev, forwarder, true);
+      if (LinkMargin(*dev, *target) < DIRECT_LINK_MARGIN && relay != NULL && relay->reachable &&
+          LinkMargin(*dev, *relay) > LinkMargin(*dev, *target))
+        target = relay;
+    }
+    dev->baseId = target->nodeId;
+    dev->rng.seed(config.seed * 7919 + dev->index);
+  }
+  return true;
+}
+
+// ===== Report =====
+
+static const char *RoleName(Role role)
+{
+  switch (role)
+  {
+  case sensor:
+    return "sensor";
+  case forwarder:
+    return "forwarder";
+  case base:
+  default:
+    return "base";
+  }
+}
+
+static double Seconds(uint64_t usec)
+{
+  return usec / 1000000.0;
+}
+
+static void Report(const Config &config)
+{
+  Stats total;
+  memset(&total, 0, sizeof(total));
+  uint32_t unreachable = 0;
+  double airtime[3] = {0, 0, 0}, airtimeMax[3] = {0, 0, 0}, rxOn[3] = {0, 0, 0};
+  uint32_t count[3] = {0, 0, 0};
+  uint32_t collisions = 0;
+
+  for (const std::unique_ptr<Device> &dev : devices)
+  {
+    const Stats &s = dev->stats;
+    total.frames += s.frames;
+    total.linkAcks += s.linkAcks;
+    total.retries += s.retries;
+    total.channelBusy += s.channelBusy;
+    for (int t = 0; t < 16; ++t)
+      total.byType[t] += s.byType[t];
+    if (dev->role == sensor)
+    {
+      total.events += s.events;
+      total.acked += s.acked;
+      total.delivered += s.delivered;
+      total.duplicates += s.duplicates;
+      total.readings += s.readings;
+      total.readingsDelivered += s.readingsDelivered;
+      total.latency += s.latency;
+      total.commands += s.commands;
+      total.commandsDelivered += s.commandsDelivered;
+      total.commandLatency += s.commandLatency;
+      total.updatesCommanded += s.updatesCommanded;
+      total.updated += s.updated;
+      total.updateTime += s.updateTime;
+      if (!dev->reachable)
+        ++unreachable;
+    }
+
+    double tx = Seconds(dev->driver.GetModeTime(RH_RF95::RHModeTx));
+    airtime[dev->role] += tx;
+    if (tx > airtimeMax[dev->role])
+      airtimeMax[dev->role] = tx;
+    rxOn[dev->role] += Seconds(dev->driver.GetModeTime(RH_RF95::RHModeRx) + dev->driver.GetModeTime(RH_RF95::RHModeCad));
+    total.commandsDropped += s.commandsDropped;
+    total.duplicatesDropped += s.duplicatesDropped;
+    ++count[dev->role];
+    collisions += dev->driver.rxBad();
+  }
+
+  printf("Arpa_RF95 fleet simulation\n");
+  printf("  %u sensors, %u forwarders, %u bases on %u channel(s), %.0f m field, seed %u\n",
+         config.sensors, config.forwarders, config.bases, config.channels, config.area, config.seed);
+  printf("  %.2f h simulated, %.2f events per sensor per hour, %u sensors out of range\n",
+         config.hours, config.eventsPerHour, unreachable);
+  if (Channel::Instance().fade > 0)
+    printf("  every link loses %.1f dB more after %.2f h\n", Channel::Instance().fade, config.fadeAt);
+
+  printf("\nDelivery\n");
+  printf("  events              %u\n", total.events);
+  printf("  delivered to base   %u (%.1f %%, %.1f per hour)\n", total.delivered,
+         total.events ? 100.0 * total.delivered / total.events : 0.0, total.delivered / config.hours);
+  printf("  duplicates at base  %u (%u more dropped by sequence number)\n", total.duplicates, total.duplicatesDropped);
+  printf("  acked at sensor     %u\n", total.acked);
+  printf("  mean latency        %.2f s\n", total.delivered ? Seconds(total.latency) / total.delivered : 0.0);
+  printf("  readings            %u taken, %u delivered (events and periodic readings)\n",
+         total.readings, total.readingsDelivered);
+
+  if (config.commandsPerHour > 0)
+  {
+    printf("\nDownlink commands\n");
+    printf("  queued at base      %u (%u dropped, queue full)\n", total.commands, total.commandsDropped);
+    printf("  received by sensor  %u (%.1f %%)\n", total.commandsDelivered,
+           total.commands ? 100.0 * total.commandsDelivered / total.commands : 0.0);
+    printf("  mean delay          %.1f s\n",
+           total.commandsDelivered ? Seconds(total.commandLatency) / total.commandsDelivered : 0.0);
+    printf("  CMD frames          %u\n", total.byType[ARPA_TYPE_ID_CMD]);
+  }
+
+  if (config.updateBytes > 0)
+  {
+    printf("\nFirmware update (%u bytes)\n", config.updateBytes);
+    printf("  commanded           %u sensors\n", total.updatesCommanded);
+    printf("  installed           %u (%.1f %%)\n", total.updated,
+           total.updatesCommanded ? 100.0 * total.updated / total.updatesCommanded : 0.0);
+    printf("  mean time           %.1f s from queueing the command\n",
+           total.updated ? Seconds(total.updateTime) / total.updated : 0.0);
+    printf("  UPDATE frames       %u\n", total.byType[ARPA_TYPE_ID_UPDATE]);
+  }
+
+  printf("\nFrames on air\n");
+  printf("  total               %u\n", total.frames);
+  printf("  SYN %u  DATA %u  ONESHOT %u  ACK %u  NACK %u  FIN %u  CHECK %u  ADR %u  TIME %u  ROUTE %u  BATCH %u\n",
+         total.byType[ARPA_TYPE_ID_SYN], total.byType[ARPA_TYPE_ID_DATA], total.byType[ARPA_TYPE_ID_DATA_ONESHOT],
+         total.byType[ARPA_TYPE_ID_ACK], total.byType[ARPA_TYPE_ID_NACK], total.byType[ARPA_TYPE_ID_FIN],
+         total.byType[ARPA_TYPE_ID_CHECK], total.byType[ARPA_TYPE_ID_ADR], total.byType[ARPA_TYPE_ID_TIME],
+         total.byType[ARPA_TYPE_ID_ROUTE], total.byType[ARPA_TYPE_ID_BATCH]);
+  printf("  link ACKs           %u\n", total.linkAcks);
+  printf("  link retries        %u\n", total.retries);
+  printf("  CAD channel busy    %u\n", total.channelBusy);
+  printf("  corrupted receptions %u\n", collisions);
+
+  printf("\nAirtime (TX) and receiver on time per device\n");
+  for (int r = sensor; r <= base; ++r)
+  {
+    if (count[r] == 0)
+      continue;
+    printf("  %-10s TX mean %8.2f s  max %8.2f s   RX mean %10.1f s\n", RoleName((Role)r),
+           airtime[r] / count[r], airtimeMax[r], rxOn[r] / count[r]);
+  }
+}
+
+static bool WriteCsv(const char *path)
+{
+  FILE *f = fopen(path, "w");
+  if (f == NULL)
+  {
+    perror(path);
+    return false;
+  }
+
+  fprintf(f, "name,role,channel,id,next_hop,x,y,reachable,frames,link_acks,retries,syn,data,oneshot,ack,nack,fin,"
+             "events,acked,delivered,mean_latency_s,tx_airtime_s,rx_on_s\n");
+  for (const std::unique_ptr<Device> &dev : devices)
+  {
+    const Stats &s = dev->stats;
+    fprintf(f, "%s,%s,%u,%u,%u,%.1f,%.1f,%d,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%.3f,%.3f,%.1f\n",
+            dev->name, RoleName(dev->role), dev->channel, dev->nodeId, dev->baseId,
+            dev->driver.GetX(), dev->driver.GetY(), dev->reachable ? 1 : 0,
+            s.frames, s.linkAcks, s.retries, s.byType[ARPA_TYPE_ID_SYN], s.byType[ARPA_TYPE_ID_DATA],
+            s.byType[ARPA_TYPE_ID_DATA_ONESHOT], s.byType[ARPA_TYPE_ID_ACK], s.byType[ARPA_TYPE_ID_NACK], s.byType[ARPA_TYPE_ID_FIN],
+            s.events, s.acked, s.delivered, s.delivered ? Seconds(s.latency) / s.delivered : 0.0,
+            Seconds(dev->driver.GetModeTime(RH_RF95::RHModeTx)),
+            Seconds(dev->driver.GetModeTime(RH_RF95::RHModeRx) + dev->driver.GetModeTime(RH_RF95::RHModeCad)));
+  }
+  fclose(f);
+  return true;
+}
+
+} // namespace sim
+
+using namespace sim;
+
+static void Usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --sensors N       sensor nodes (default 100)\n"
+          "  --forwarders N    forwarders (default 0)\n"
+          "  --bases N         bases (default 1)\n"
+          "  --channels N      frequency channels the bases are spread over (default 1)\n"
+          "  --area M          side of the square field in meters (default 2000)\n"
+          "  --hours H         simulated time (default 24)\n"
+          "  --rate R          gas events per sensor per hour (default 1)\n"
+          "  --exponent N      path loss exponent (default 3.5)\n"
+          "  --fade DB         every link loses DB more from --fade-at on, e.g. rain\n"
+          "                    after the sensors lowered their data rate (default 0)\n"
+          "  --fade-at H       hours into the run the fade starts (default half of --hours)\n"
+          "  --seed N          random seed for placement and events (default 1)\n"
+          "  --handshake       sensors open a connection (syn, data, fin) instead of\n"
+          "                    sending one-shot messages\n"
+          "  --no-adr          sensors keep SF12, CR 4/8 and full power instead of asking\n"
+          "                    their next hop for a data rate\n"
+          "  --slotted         bases send time beacons and sensors send in slots\n"
+          "  --frame-slots N   slots per frame with --slotted, sensor n sends in slot\n"
+          "                    n %% N and sleeps until then, 0 for random slots (default 16)\n"
+          "  --sample-interval S  sensors also read the gas pin every S seconds and\n"
+          "                    send buffered readings together (default 0, off)\n"
+          "  --listen-interval MS  forwarders sleep and check the channel every MS\n"
+          "                    milliseconds, frames to them get a longer preamble (default 0, off)\n"
+          "  --commands R      commands per hour the bases queue for each sensor they\n"
+          "                    serve directly, sensors listen for them (default 0, off)\n"
+          "  --update BYTES    bases tell the sensors they serve directly to fetch a\n"
+          "                    firmware update of this size from them (default 0, off)\n"
+          "  --csv FILE        write per device statistics\n"
+          "  --trace           print the Serial output of every device\n",
+          prog);
+}
+
+int main(int argc, char **argv)
+{
+  Config config;
+  config.sensors = 100;
+  config.forwarders = 0;
+  config.bases = 1;
+  config.channels = 1;
+  config.area = 2000.0;
+  config.hours = 24.0;
+  config.fadeAt = -1.0;
+  config.eventsPerHour = 1.0;
+  config.seed = 1;
+  config.handshake = false;
+  config.adr = true;
+  config.slotted = false;
+  config.frameSlots = 16;
+  config.sampleInterval = 0;
+  config.listenInterval = 0;
+  config.commandsPerHour = 0;
+  config.updateBytes = 0;
+  config.csvPath = NULL;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    const char *arg = argv[i];
+    const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(arg, "--trace") == 0)
+    {
+      traceEnabled = true;
+      continue;
+    }
+    if (strcmp(arg, "--handshake") == 0)
+    {
+      config.handshake = true;
+      continue;
+    }
+    if (strcmp(arg, "--slotted") == 0)
+    {
+      config.slotted = true;
+      continue;
+    }
+    if (strcmp(arg, "--no-adr") == 0)
+    {
+      config.adr = false;
+      continue;
+    }
+    if (val == NULL)
+    {
+      Usage(argv[0]);
+      return 1;
+    }
+    ++i;
+
+    if (strcmp(arg, "--sensors") == 0)
+      config.sensors = strtoul(val, NULL, 10);
+    else if (strcmp(arg, "--forwarders") == 0)
+      config.forwarders = strtoul(val, NULL, 10);
+    else if (strcmp(arg, "--bases") == 0)
+      config.bases = strtoul(val, NULL, 10);
+    else if (strcmp(arg, "--channels") == 0)
+      config.channels = strtoul(val, NULL, 10);
+    else if (strcmp(arg, "--area") == 0)
+      config.area = strtod(val, NULL);
+    else if (strcmp(arg, "--hours") == 0)
+      config.hours = strtod(val, NULL);
+    else if (strcmp(arg, "--rate") == 0)
+      config.eventsPerHour = strtod(val, NULL);
+    else if (strcmp(arg, "--exponent") == 0)
+      Channel::Instance().pathLossExponent = strtod(val, NULL);
+    else if (strcmp(arg, "--fade") == 0)
+      Channel::Instance().fade = strtod(val, NULL);
+    else if (strcmp(arg, "--fade-at") == 0)
+      config.fadeAt = strtod(val, NULL);
+    else if (strcmp(arg, "--seed") == 0)
+      config.seed = strtoul(val, NULL, 10);
+    else if (strcmp(arg, "--sample-interval") == 0)
+      config.sampleInterval = strtoul(val, NULL, 10);
+    else if (strcmp(arg, "--frame-slots") == 0)
+      config.frameSlots = strtoul(val, NULL, 10);
+    else if (strcmp(arg, "--listen-interval") == 0)
+      config.listenInterval = strtoul(val, NULL, 10);
+    else if (strcmp(arg, "--commands") == 0)
+      config.commandsPerHour = strtod(val, NULL);
+    else if (strcmp(arg, "--update") == 0)
+      config.updateBytes = strtoul(val, NULL, 10);
+    else if (strcmp(arg, "--csv") == 0)
+      config.csvPath = val;
+    else
+    {
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (config.bases == 0 || config.channels == 0 || config.channels > config.bases || config.hours <= 0)
+  {
+    fprintf(stderr, "Need at least one base, and between 1 and --bases channels\n");
+    return 1;
+  }
+  if (config.fadeAt < 0)
+    config.fadeAt = config.hours / 2;
+  Channel::Instance().fadeAt = (usec_t)(config.fadeAt * 3600.0 * 1000000.0);
+
+  if (!BuildFleet(config))
+    return 1;
+
+  Channel::Instance().onTransmit = CountFrame;
+  for (const std::unique_ptr<Device> &dev : devices)
+  {
+    Device *d = dev.get();
+    const Config *c = &config;
+    switch (d->role)
+    {
+    case sensor:
+      Scheduler::Instance().Spawn([d, c]() { RunSensor(*d, *c); }, d);
+      break;
+    case forwarder:
+      Scheduler::Instance().Spawn([d, c]() { RunForwarder(*d, *c); }, d);
+      break;
+    case base:
+      Scheduler::Instance().Spawn([d, c]() { RunBase(*d, *c); }, d);
+      break;
+    }
+  }
+
+  Scheduler::Instance().Run((usec_t)(config.hours * 3600.0 * 1000000.0));
+
+  Report(config);
+  if (config.csvPath != NULL && !WriteCsv(config.csvPath))
+    return 1;
+  return 0;
+}
@@ -0,0 +1,143 @@
+/*
+  Simulator.h - Devices, roles and statistics of the host-side Arpa_RF95
+  fleet simulator.
+
+  Each device owns a simulated RH_RF95 and runs the same role loop as
+  Combined.ino (sensor node, forwarder or base) on its own fiber, with the
+  unmodified Arpa_RF95 protocol code on top.
+*/
+#ifndef Sim_Simulator_h
+#define Sim_Simulator_h
+
+#include "Scheduler.h"
+#include "RH_RF95.h"
+#include <stdint.h>
+#include <deque>
+#include <random>
+#include <vector>
+
+namespace sim
+{
+
+// Same values as Configuration::NodeType
+enum Role
+{
+  sensor = 0,
+  forwarder = 1,
+  base = 2
+};
+
+struct Stats
+{
+  // Frames put on air by this device
+  uint32_t frames;
+  uint32_t linkAcks;
+  uint32_t retries;
+  // CAD attempts that found the channel busy
+  uint32_t channelBusy;
+  // First transmissions by Arpa message type (low nibble of the id byte)
+  uint32_t byType[16];
+
+  // Sensors: gas events, exchanges the node saw succeed, and events the base received
+  // Bases: DATA messages handed to the LTE module
+  uint32_t events;
+  uint32_t acked;
+  uint32_t delivered;
+  // Sensors: copies of an event the base received again
+  uint32_t duplicates;
+  // Bases and forwarders: data messages dropped as copies by their sequence number
+  uint32_t duplicatesDropped;
+  // Sensors: readings taken (events and periodic ones) and readings the base received
+  uint32_t readings;
+  uint32_t readingsDelivered;
+
+  // Sum of event to base delivery time, for the mean latency
+  usec_t latency;
+
+  // Sensors: downlink commands the base got for the node and commands the node received,
+  // with the sum of their queue to node time
+  uint32_t commands;
+  uint32_t commandsDelivered;
+  usec_t commandLatency;
+  // Bases: commands dropped because the queue was full
+  uint32_t commandsDropped;
+
+  // Sensors: told to fetch a firmware update, and installed it, with the sum of
+  // the command queued to update installed time
+  uint32_t updatesCommanded;
+  uint32_t updated;
+  usec_t updateTime;
+};
+
+struct Device
+{
+  uint32_t index;
+  Role role;
+  uint8_t channel;
+  uint8_t nodeId;
+  uint8_t baseId; // Where this device sends to, the base itself for bases
+  bool reachable; // False if the device has nothing in range to send to
+  float freq;
+  char name[16];
+
+  RH_RF95 driver;
+  Stats stats;
+
+  // Sensors: time of the event currently being reported
+  usec_t eventTime;
+  bool eventDelivered;
+  // Sensors: seconds between periodic readings, changed by commands,
+  // and when the commands still on their way were queued
+  uint32_t sampleInterval;
+  std::deque<usec_t> commandTimes;
+  // Sensors: firmware version the last update command named, when it was queued,
+  // and the flash the update is staged in
+  uint16_t updateVersion;
+  usec_t updateQueuedAt;
+  std::vector<uint8_t> staging;
+  std::mt19937 rng;
+};
+
+struct Config
+{
+  uint32_t sensors;
+  uint32_t forwarders;
+  uint32_t bases;
+  uint32_t channels;
+  double area;          // Side of the square field in meters
+  double hours;         // Simulated time
+  double fadeAt;        // Hours into the run every link loses --fade dB more, negative for half way
+  double eventsPerHour; // Mean gas events per sensor per hour (Poisson)
+  uint32_t seed;
+  bool handshake;       // Sensors send with syn/data/fin instead of one-shots
+  bool adr;             // Sensors ask their next hop for a data rate
+  bool slotted;         // Bases send time beacons, sensors send in slots
+  uint8_t frameSlots;   // Slots per frame the bases assign with slotted, 0 for random slots
+  uint32_t sampleInterval; // Seconds between periodic readings on sensors, 0 for none
+  uint16_t listenInterval; // Milliseconds between CADs of duty cycled forwarders, 0 for always on
+  double commandsPerHour; // Downlink commands per directly served sensor per hour, 0 for none
+  uint32_t updateBytes; // Size of the firmware update bases send their direct sensors, 0 for none
+  const char *csvPath;
+};
+
+extern bool traceEnabled;
+
+/// Name of the device owning a fiber, used to prefix traced Serial output
+const char *DeviceName(void *user);
+
+/// Role loops, mirroring SetupNode()/NodeLoop(), SetupForwarder() and
+/// SetupBase()/BaseLoop() in Combined.ino. They never return.
+void RunSensor(Device &dev, const Config &config);
+void RunForwarder(Device &dev, const Config &config);
+void RunBase(Device &dev, const Config &config);
+
+/// Called by a base when it hands a DATA message from originId to the LTE module.
+/// A gas reading of 1 in the payload is the sensor's current event.
+void RecordDelivery(Device &base, uint8_t originId, const uint8_t *payload, uint8_t len);
+
+/// Sensors that send to the base without a forwarder, the ones it can send commands to
+std::vector<Device *> DirectSensors(const Device &base);
+
+} // namespace sim
+
+#endif
@@ -0,0 +1,74 @@
+/*
+  Arduino.h - Minimal host replacement for the Arduino core used by the
+  simulator. Time is virtual: millis() and delay() are driven by
+  sim::Scheduler and only advance for the calling simulated device.
+*/
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+
+#define RISING 3
+
+#define F(str) (str)
+
+// Same as the STM32 core, min/max come from std so they need matching types
+#include <algorithm>
+using std::max;
+using std::min;
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+void randomSeed(unsigned long seed);
+long random(long howbig);
+long random(long howsmall, long howbig);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+/// Serial output of the simulated device.
+/// Discarded unless tracing is enabled in the simulator.
+class HardwareSerial
+{
+public:
+  void begin(unsigned long baud);
+  operator bool() const;
+
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buf, size_t len);
+  /// Free space in the transmit buffer, the stm32duino default size as it never fills here
+  int availableForWrite();
+  size_t print(const char *str);
+  size_t print(char c);
+  size_t print(int num);
+  size_t print(unsigned int num);
+  size_t print(long num);
+  size_t print(unsigned long num);
+  size_t print(double num);
+  size_t println();
+  size_t println(const char *str);
+  size_t println(char c);
+  size_t println(int num);
+  size_t println(unsigned int num);
+  size_t println(long num);
+  size_t println(unsigned long num);
+  size_t println(double num);
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,51 @@
+/*
+  RHReliableDatagram.h - Host replacement for the RadioHead reliable datagram
+  manager. The acknowledgement, retry and duplicate detection logic follows
+  RadioHead so the simulated link layer behaves like the one on the boards.
+*/
+#ifndef RHReliableDatagram_h
+#define RHReliableDatagram_h
+
+#include "RH_RF95.h"
+
+#define RH_DEFAULT_TIMEOUT 200
+#define RH_DEFAULT_RETRIES 3
+
+class RHReliableDatagram
+{
+public:
+  RHReliableDatagram(RH_RF95 &driver, uint8_t thisAddress = 0);
+
+  bool init();
+  void setThisAddress(uint8_t thisAddress);
+  void setTimeout(uint16_t timeout);
+  void setRetries(uint8_t retries);
+  uint8_t retries();
+
+  bool sendtoWait(uint8_t *buf, uint8_t len, uint8_t address);
+  bool recvfromAck(uint8_t *buf, uint8_t *len, uint8_t *from = NULL, uint8_t *to = NULL, uint8_t *id = NULL, uint8_t *flags = NULL);
+  bool recvfromAckTimeout(uint8_t *buf, uint8_t *len, uint16_t timeout, uint8_t *from = NULL, uint8_t *to = NULL, uint8_t *id = NULL, uint8_t *flags = NULL);
+
+  bool available();
+  bool waitAvailableTimeout(uint16_t timeout);
+  bool waitPacketSent();
+  bool sendto(uint8_t *buf, uint8_t len, uint8_t address);
+  bool recvfrom(uint8_t *buf, uint8_t *len, uint8_t *from = NULL, uint8_t *to = NULL, uint8_t *id = NULL, uint8_t *flags = NULL);
+
+  uint8_t thisAddress();
+  uint32_t retransmissions();
+  void resetRetransmissions();
+
+private:
+  void acknowledge(uint8_t id, uint8_t from);
+
+  RH_RF95 &_driver;
+  uint8_t _thisAddress;
+  uint16_t _timeout;
+  uint8_t _retries;
+  uint8_t _lastSequenceNumber;
+  uint32_t _retransmissions;
+  uint8_t _seenIds[256];
+};
+
+#endif
@@ -0,0 +1,184 @@
+/*
+  RH_RF95.h - Host replacement for the RadioHead RH_RF95 driver.
+
+  Keeps the part of the RadioHead API that the ARPA firmware uses, but
+  instead of talking to an SX1276 over SPI every radio is attached to the
+  shared sim::Channel, which models airtime, range and collisions.
+  Blocking calls suspend the calling simulated device in virtual time.
+*/
+#ifndef RH_RF95_h
+#define RH_RF95_h
+
+#include "Arduino.h"
+#include <memory>
+#include <vector>
+
+#define RH_RF95_MAX_PAYLOAD_LEN 255
+#define RH_RF95_HEADER_LEN 4
+#define RH_RF95_MAX_MESSAGE_LEN (RH_RF95_MAX_PAYLOAD_LEN - RH_RF95_HEADER_LEN)
+
+#define RH_BROADCAST_ADDRESS 0xff
+
+#define RH_FLAGS_NONE 0x00
+#define RH_FLAGS_RESERVED 0xf0
+#define RH_FLAGS_APPLICATION_SPECIFIC 0x0f
+#define RH_FLAGS_ACK 0x80
+#define RH_FLAGS_RETRY 0x40
+
+// SX1276 registers the firmware reads back
+#define RH_RF95_REG_01_OP_MODE 0x01
+#define RH_RF95_REG_06_FRF_MSB 0x06
+#define RH_RF95_REG_07_FRF_MID 0x07
+#define RH_RF95_REG_08_FRF_LSB 0x08
+#define RH_RF95_REG_09_PA_CONFIG 0x09
+#define RH_RF95_REG_18_MODEM_STAT 0x18
+#define RH_RF95_REG_1D_MODEM_CONFIG1 0x1d
+#define RH_RF95_REG_1E_MODEM_CONFIG2 0x1e
+#define RH_RF95_REG_20_PREAMBLE_MSB 0x20
+#define RH_RF95_REG_21_PREAMBLE_LSB 0x21
+#define RH_RF95_REG_26_MODEM_CONFIG3 0x26
+#define RH_RF95_REG_4D_PA_DAC 0x4d
+#define RH_RF95_MODEM_STATUS_CLEAR 0x10
+#define RH_RF95_MODEM_STATUS_HEADER_INFO_VALID 0x08
+#define RH_RF95_MODEM_STATUS_RX_ONGOING 0x04
+#define RH_RF95_MODEM_STATUS_SIGNAL_SYNCHRONIZED 0x02
+#define RH_RF95_MODEM_STATUS_SIGNAL_DETECTED 0x01
+#define RH_RF95_FXOSC 32000000.0
+#define RH_RF95_FSTEP (RH_RF95_FXOSC / 524288)
+
+#define RH_RF95_TO_POS 0
+#define RH_RF95_FROM_POS 1
+#define RH_RF95_ID_POS 2
+#define RH_RF95_FLAGS_POS 3
+
+namespace sim
+{
+class Channel;
+struct Fiber;
+struct Frame;
+}
+
+class RH_RF95
+{
+public:
+  typedef enum
+  {
+    RHModeInitialising = 0,
+    RHModeSleep,
+    RHModeIdle,
+    RHModeTx,
+    RHModeRx,
+    RHModeCad
+  } RHMode;
+
+  RH_RF95(uint8_t slaveSelectPin = 10, uint8_t interruptPin = 2);
+
+  bool init();
+  bool available();
+  bool recv(uint8_t *buf, uint8_t *len);
+  bool send(const uint8_t *data, uint8_t len);
+  bool waitPacketSent();
+  bool waitAvailableTimeout(uint16_t timeout);
+  uint8_t maxMessageLength();
+
+  bool setFrequency(float centre);
+  void setTxPower(int8_t power, bool useRFO = false);
+  void setSpreadingFactor(uint8_t sf);
+  void setSignalBandwidth(long sbw);
+  void setCodingRate4(uint8_t denominator);
+  void setPreambleLength(uint16_t bytes);
+  void setCADTimeout(unsigned long cad_timeout);
+
+  void setModeIdle();
+  void setModeRx();
+  void setModeTx();
+  bool sleep();
+  RHMode mode();
+
+  /// Channel activity detection. Takes one CAD period of virtual time.
+  bool isChannelActive();
+
+  /// Register value the configuration would give on an SX1276.
+  /// Only the registers above are modelled, the rest read 0. The modem status
+  /// shows a signal while the radio is locked onto a frame.
+  uint8_t spiRead(uint8_t reg);
+
+  int16_t lastRssi();
+  int lastSNR();
+
+  void setThisAddress(uint8_t thisAddress);
+  void setHeaderTo(uint8_t to);
+  void setHeaderFrom(uint8_t from);
+  void setHeaderId(uint8_t id);
+  void setHeaderFlags(uint8_t set, uint8_t clear = RH_FLAGS_APPLICATION_SPECIFIC);
+  void setPromiscuous(bool promiscuous);
+  uint8_t headerTo();
+  uint8_t headerFrom();
+  uint8_t headerId();
+  uint8_t headerFlags();
+
+  uint16_t rxBad();
+  uint16_t rxGood();
+  uint16_t txGood();
+
+  // Simulation only, not part of the RadioHead API
+
+  /// Place the radio in the simulated field, in meters
+  void SetPosition(double x, double y);
+  double GetX() const;
+  double GetY() const;
+
+  float GetFrequency() const;
+  uint8_t GetSpreadingFactor() const;
+  long GetBandwidth() const;
+  uint8_t GetCodingRate() const;
+  uint16_t GetPreambleLength() const;
+  int8_t GetTxPower() const;
+
+  /// Total virtual time in microseconds the radio has spent in a mode
+  uint64_t GetModeTime(RHMode mode) const;
+
+  /// Opaque pointer for the simulator to find its device from the radio
+  void *user;
+
+private:
+  friend class sim::Channel;
+
+  void SetMode(RHMode mode);
+  void Deliver(const uint8_t *data, uint8_t len, double rssi, double snr);
+  bool WaitWhileTransmitting();
+
+  RHMode _mode;
+  float _freq;
+  uint8_t _sf, _cr;
+  long _bw;
+  uint16_t _preamble;
+  int8_t _power;
+  unsigned long _cad_timeout;
+
+  uint8_t _thisAddress;
+  bool _promiscuous;
+  uint8_t _txHeaderTo, _txHeaderFrom, _txHeaderId, _txHeaderFlags;
+  uint8_t _rxHeaderTo, _rxHeaderFrom, _rxHeaderId, _rxHeaderFlags;
+
+  uint8_t _buf[RH_RF95_MAX_PAYLOAD_LEN];
+  uint8_t _bufLen;
+  bool _rxBufValid;
+  int16_t _lastRssi;
+  int _lastSNR;
+  uint16_t _rxBad, _rxGood, _txGood;
+
+  double x, y;
+  uint64_t modeSince;
+  uint64_t modeTime[RHModeCad + 1];
+
+  // Fiber blocked on this radio, woken on RX done and TX done
+  sim::Fiber *waiter;
+
+  // Frame currently being demodulated, dropped when the radio leaves RX
+  std::shared_ptr<sim::Frame> lock;
+  bool lockCorrupt;
+  double lockRssi;
+};
+
+#endif
@@ -0,0 +1,9 @@
+/*
+  SPI.h - Empty host replacement. The simulated RH_RF95 never touches SPI.
+*/
+#ifndef SPI_h
+#define SPI_h
+
+#include "Arduino.h"
+
+#endif
@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+
+"""Turn the event log of a node or forwarder back into text
+
+The firmware keeps events in RAM and sends them on its serial port in binary frames
+(see Arpa_EventLog.h), instead of printing text. Read them from the port, or from a
+file the port was captured to:
+
+    decode_events.py --port /dev/ttyUSB0
+    decode_events.py capture.bin
+
+Every line is the time of the event in seconds on the device clock (the RTC on sensor
+nodes, millis() elsewhere), its name and its text. The texts are read out of
+Arpa_EventLog.h, so a newer header decodes the events of newer firmware.
+
+"""
+
+import argparse
+import binascii
+import os
+import re
+import sys
+
+# Arpa_EventLog.h
+EVENT_SYNC = 0xE5
+FRAME_LENGTH = 14
+HEADER = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                      '..', '..', 'STM Code', 'STM Code_program', 'Combined', 'Arpa_EventLog.h')
+EVENT_LINE = re.compile(r'^\s*ARPA_EV_(\w+)\s*=\s*(0x[0-9A-Fa-f]+),?\s*//\s*(.*)$')
+ARG = re.compile(r'\{([abc])(:s)?\}')
+
+
+def read_events(header):
+    """Event id => (name, text) out of the enum in Arpa_EventLog.h"""
+    events = {}
+    with open(header) as f:
+        for line in f:
+            match = EVENT_LINE.match(line)
+            if match:
+                events[int(match.group(2), 16)] = (match.group(1), match.group(3).strip())
+    return events
+
+
+def format_event(events, event_id, args):
+    name, text = events.get(event_id, ('EVENT_' + hex(event_id), '{a} {b} {c}'))
+
+    def arg(match):
+        value = args['abc'.index(match.group(1))]
+        if match.group(2) and value >= 0x8000:
+            value -= 0x10000
+        return str(value)
+    return name, ARG.sub(arg, text)
+
+
+def decode(stream, events, out):
+    """Decodes frames until the stream ends, skipping bytes that are not part of one"""
+    buf = b''
+    while True:
+        data = stream.read(1 if hasattr(stream, 'in_waiting') else 4096)
+        if not data:
+            break
+        buf += data
+
+        while len(buf) >= FRAME_LENGTH:
+            if buf[0] != EVENT_SYNC:
+                buf = buf[1:]
+                continue
+            frame = buf[:FRAME_LENGTH]
+            crc = int.from_bytes(frame[12:14], 'little')
+            if binascii.crc_hqx(frame[1:12], 0xFFFF) != crc:
+                # Cut off by deep sleep, or a sync byte inside another frame
+                buf = buf[1:]
+                continue
+            buf = buf[FRAME_LENGTH:]
+
+            time = int.from_bytes(frame[2:6], 'little')
+            args = [int.from_bytes(frame[6 + 2 * i:8 + 2 * i], 'little') for i in range(3)]
+            name, text = format_event(events, frame[1], args)
+            out.write('{:12.3f} {:<20} {}\n'.format(time / 1000.0, name, text))
+            out.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode the event log of a node or forwarder')
+    parser.add_argument('capture', nargs='?', help='file the serial port was captured to, - for stdin')
+    parser.add_argument('--port', help='serial port to read, needs pyserial')
+    parser.add_argument('--baud', type=int, default=9600)
+    parser.add_argument('--header', default=HEADER, help='Arpa_EventLog.h of the firmware')
+    args = parser.parse_args()
+    if (args.capture is None) == (args.port is None):
+        parser.error('give a capture file or --port')
+
+    events = read_events(args.header)
+    if args.port:
+        import serial
+        stream = serial.Serial(args.port, args.baud)
+    elif args.capture == '-':
+        stream = sys.stdin.buffer
+    else:
+        stream = open(args.capture, 'rb')
+    try:
+        decode(stream, events, sys.stdout)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        stream.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -10,7 +10,8 @@ This script receives MQTT data and saves those to InfluxDB.
 """
 
 import re
-from typing import NamedTuple
+import time as clock
+from typing import NamedTuple, Optional
 
 import paho.mqtt.client as mqtt
 from influxdb import InfluxDBClient
@@ -29,6 +30,29 @@ MQTT_REGEX = 'arpa/([^/]+)/([^/]+)'
 MQTT_CLIENT_ID = 'MQTTInfluxDBBridge'
 MQTT_CLIENT_PORT = 4000
 
+# Binary payloads from the nodes, see Arpa_Payload.h in the firmware:
+# [version][type][len][value]... with context records applying to the readings after them
+PAYLOAD_VERSION = 0x01
+TLV_SENSOR = 0x01
+TLV_AGE = 0x02
+TLV_TIME = 0x03
+TLV_BASE = 0x04
+TLV_SEQ = 0x05
+# Reading type => (measurement, scale to the stored unit)
+TLV_READINGS = {
+    0x10: ('gas', 1),
+    0x11: ('temperature', 0.01),
+    0x12: ('humidity', 0.01),
+    0x13: ('battery', 0.001),
+}
+
+# Messages the gateway publishes together on arpa/batch/<base>, see MQTT_BATCH_WINDOW in LTE.ino:
+# [version] then [node][length 2][message] for each, the messages as they would be on arpa/msg/<node>
+BATCH_VERSION = 0x01
+
+# Sequence numbers remembered per node, the same window as Arpa_Dedup.h
+DEDUP_WINDOW = 32
+
 influxdb_client = InfluxDBClient(INFLUXDB_ADDRESS, INFLUXDB_PORT, INFLUXDB_USER, INFLUXDB_PASSWORD, None)
 
 
@@ -36,6 +60,60 @@ class SensorData(NamedTuple):
     location: str
     measurement: str
     value: float
+    sensor: int = 0
+    base: Optional[int] = None
+    time: Optional[int] = None  # unix seconds, None for the time it is written
+    age: int = 0  # seconds the reading was taken before it arrived, used when time is None
+
+
+class SequenceWindow:
+    """Sequence numbers a node sent recently, like Arpa_Dedup in the firmware.
+
+    Copies of a message that got past the base and the LTE gateway still reach us with the
+    sequence number of the first one. Their readings are written with the times and base of
+    the first copy, so InfluxDB overwrites the same points instead of adding new ones.
+    """
+
+    def __init__(self):
+        self.sequence = None
+        self.seen = {}  # sequence number => readings of the first copy
+
+    def first_copy(self, sequence, readings):
+        """Returns the readings of a message as they are to be written"""
+        ahead = (sequence - self.sequence) & 0xFF if self.sequence is not None else 0
+        if ahead >= 0x80:
+            ahead -= 0x100
+        if self.sequence is None or (sequence == 0 and self.sequence != 0) or ahead <= -DEDUP_WINDOW:
+            # New node, or one that started over
+            self.sequence = sequence
+            self.seen = {}
+        elif ahead > 0:
+            self.sequence = sequence
+        if sequence in self.seen:
+            print('Copy of sequence ' + str(sequence) + ', rewriting the first one')
+            # A copy carries the same readings in the same order
+            first = self.seen[sequence]
+            return [r._replace(time=f.time, base=f.base) for r, f in zip(readings, first)]
+
+        # Numbers that fell out of the window
+        self.seen = {s: v for s, v in self.seen.items() if (self.sequence - s) & 0xFF < DEDUP_WINDOW}
+        # The time of the first copy is needed to overwrite it
+        readings = _arrival_times(readings)
+        self.seen[sequence] = readings
+        return readings
+
+
+windows = {}  # location => SequenceWindow
+
+
+def _arrival_times(readings):
+    """Times readings without one by when they arrived, less their age.
+
+    Without a gateway time the buffered readings of a message would all get the same
+    time and overwrite each other in InfluxDB.
+    """
+    now = int(clock.time())
+    return [r if r.time is not None else r._replace(time=now - r.age) for r in readings]
 
 
 def on_connect(client, userdata, flags, rc):
@@ -47,40 +125,106 @@ def on_connect(client, userdata, flags, rc):
 def on_message(client, userdata, msg):
     """The callback for when a PUBLISH message is received from the server."""
     print(msg.topic + ' ' + str(msg.payload))
-    sensor_data = _parse_mqtt_message(msg.topic, msg.payload.decode('utf-8'))
-    if sensor_data is not None:
+    for sensor_data in _parse_mqtt_message(msg.topic, msg.payload):
         _send_sensor_data_to_influxdb(sensor_data)
 
 
 def _parse_mqtt_message(topic, payload):
     match = re.match(MQTT_REGEX, topic)
-    if match:
-        measurement = match.group(1)
-        location = match.group(2)
-        if measurement == 'status':
-            return None
-        try:
-            return SensorData(location, measurement, float(payload))
-        except ValueError as e:
-            print("Payload not as expected: ")
-            print(e)
-    else:
-        return None
+    if not match:
+        return []
+    measurement = match.group(1)
+    location = match.group(2)
+    # Commands to the nodes go out on arpa/cmd/<node>, see send_command.py
+    if measurement in ('status', 'cmd'):
+        return []
+    if measurement == 'batch':
+        return _split_batch(payload)
+
+    if payload[:1] == bytes([PAYLOAD_VERSION]):
+        return _decode_payload(location, payload)
+
+    try:
+        text = payload.decode('utf-8')
+        # Text from the old nodes, "gas=1;1" is reading=value;base
+        if '=' in text:
+            reading, _, base = text.partition(';')
+            measurement, _, value = reading.partition('=')
+            return [SensorData(location, measurement, float(value), base=int(base) if base else None)]
+        return [SensorData(location, measurement, float(text))]
+    except ValueError as e:
+        print("Payload not as expected: ")
+        print(e)
+        return []
+
+
+def _split_batch(payload):
+    if payload[:1] != bytes([BATCH_VERSION]):
+        print("Batch not as expected: version " + str(payload[:1]))
+        return []
+    readings = []
+    pos = 1
+    while pos + 3 <= len(payload):
+        node, length = payload[pos], int.from_bytes(payload[pos + 1:pos + 3], 'little')
+        message = payload[pos + 3:pos + 3 + length]
+        if len(message) != length:
+            print("Batch not as expected: broken message at byte " + str(pos))
+            break
+        pos += 3 + length
+        readings += _parse_mqtt_message('arpa/msg/' + str(node), message)
+    return readings
+
+
+def _decode_payload(location, payload):
+    readings = []
+    sensor, age, time, base, sequence = 0, 0, None, None, None
+    pos = 1
+    while pos + 2 <= len(payload):
+        tlv_type, length = payload[pos], payload[pos + 1]
+        value = payload[pos + 2:pos + 2 + length]
+        if len(value) != length or length > 4:
+            print("Payload not as expected: broken record at byte " + str(pos))
+            break
+        pos += 2 + length
+
+        if tlv_type == TLV_SENSOR:
+            sensor = int.from_bytes(value, 'little')
+        elif tlv_type == TLV_AGE:
+            age = int.from_bytes(value, 'little')
+        elif tlv_type == TLV_TIME:
+            time = int.from_bytes(value, 'little')
+        elif tlv_type == TLV_BASE:
+            base = int.from_bytes(value, 'little')
+        elif tlv_type == TLV_SEQ:
+            sequence = int.from_bytes(value, 'little')
+        elif tlv_type in TLV_READINGS and length > 0:
+            measurement, scale = TLV_READINGS[tlv_type]
+            raw = int.from_bytes(value, 'little', signed=True)
+            readings.append(SensorData(location, measurement, raw * scale, sensor, base,
+                                       time - age if time is not None else None, age))
+        # Other record types are from newer nodes and skipped
+    if sequence is not None:
+        return windows.setdefault(location, SequenceWindow()).first_copy(sequence, readings)
+    return _arrival_times(readings)
 
 
 def _send_sensor_data_to_influxdb(sensor_data):
-    json_body = [
-        {
-            'measurement': sensor_data.measurement,
-            'tags': {
-                'location': sensor_data.location
-            },
-            'fields': {
-                'value': sensor_data.value
-            }
+    tags = {
+        'location': sensor_data.location,
+        'sensor': sensor_data.sensor
+    }
+    if sensor_data.base is not None:
+        tags['base'] = sensor_data.base
+    point = {
+        'measurement': sensor_data.measurement,
+        'tags': tags,
+        'fields': {
+            'value': float(sensor_data.value)
         }
-    ]
-    influxdb_client.write_points(json_body)
+    }
+    if sensor_data.time is not None:
+        point['time'] = sensor_data.time
+    influxdb_client.write_points([point], time_precision='s')
 
 
 def _init_influxdb_database():
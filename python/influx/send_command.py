@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+
+"""Send a command to a node
+
+The LTE module of the base hands it to the base, which sends it down to the node
+after the next message from the node, so it can take until the node's next reading.
+
+    send_command.py 5 --sample-interval 300
+    send_command.py 5 --data-rate
+    send_command.py 5 --update 3
+
+An update needs its image on the LTE module first, see python/ota/make_update.py.
+
+"""
+
+import argparse
+
+import paho.mqtt.publish as publish
+
+MQTT_ADDRESS = 'sensor-node.hatasaka.com'
+MQTT_USER = 'sensor-node'
+MQTT_PASSWORD = 'SensorNode$'
+MQTT_CLIENT_PORT = 4000
+MQTT_TOPIC = 'arpa/cmd/{}'
+
+# Same format as the readings, see Arpa_Payload.h in the firmware
+PAYLOAD_VERSION = 0x01
+TLV_CMD_SAMPLE_INTERVAL = 0x20
+TLV_CMD_DATA_RATE = 0x21
+TLV_CMD_UPDATE = 0x22
+# ARPA_CMD_MAX_LENGTH on the base
+CMD_MAX_LENGTH = 16
+
+
+def _record(tlv_type, value):
+    # Fewest of 1, 2 or 4 bytes, signed, like Arpa_PayloadWriter::AddReading()
+    for width in (1, 2, 4):
+        if -(1 << (8 * width - 1)) <= value < (1 << (8 * width - 1)):
+            return bytes([tlv_type, width]) + value.to_bytes(width, 'little', signed=True)
+    raise ValueError('value out of range: ' + str(value))
+
+
+def encode_command(sample_interval=None, data_rate=False, update=None):
+    payload = bytes([PAYLOAD_VERSION])
+    if sample_interval is not None:
+        payload += _record(TLV_CMD_SAMPLE_INTERVAL, sample_interval)
+    if data_rate:
+        payload += _record(TLV_CMD_DATA_RATE, 1)
+    if update is not None:
+        payload += _record(TLV_CMD_UPDATE, update)
+    if len(payload) > CMD_MAX_LENGTH:
+        raise ValueError('command too long')
+    return payload
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Send a command to a node')
+    parser.add_argument('node', type=int, help='node id')
+    parser.add_argument('--sample-interval', type=int, metavar='S',
+                        help='seconds between periodic readings, 0 for none')
+    parser.add_argument('--data-rate', action='store_true',
+                        help='ask the next hop for a data rate at the next send')
+    parser.add_argument('--update', type=int, metavar='VERSION',
+                        help='fetch this firmware version from the base and install it')
+    args = parser.parse_args()
+
+    if args.update is not None and not 0 < args.update < 0x8000:
+        parser.error('version out of range')
+
+    payload = encode_command(args.sample_interval, args.data_rate, args.update)
+    if len(payload) == 1:
+        parser.error('no command given')
+
+    publish.single(MQTT_TOPIC.format(args.node), payload, qos=1, hostname=MQTT_ADDRESS,
+                   port=MQTT_CLIENT_PORT, auth={'username': MQTT_USER, 'password': MQTT_PASSWORD})
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,171 @@
+#!/usr/bin/env python3
+
+"""Build a firmware update image for the nodes and hand it to the LTE module
+
+A full image carries the whole firmware. A delta only carries what changed against
+the firmware the nodes run now, as commands copying from it and inserting new bytes,
+so far fewer chunks go over LoRa. See Arpa_Update.h in the firmware for the format.
+
+    make_update.py Combined.bin --version 3 --publish
+    make_update.py Combined.bin --version 3 --base old/Combined.bin --base-version 2 --publish
+
+Only sensor nodes fetch updates, so give it the node image of Combined/build_images.sh
+(build/node/Combined.ino.bin): it is smaller than the combined one and takes fewer chunks.
+A delta has to be made against the image the nodes run, node or combined.
+
+Then tell the nodes, e.g. python/influx/send_command.py 5 --update 3.
+The LTE module only keeps one image, publish it again after the module restarted.
+
+"""
+
+import argparse
+import struct
+import zlib
+
+MQTT_ADDRESS = 'sensor-node.hatasaka.com'
+MQTT_USER = 'sensor-node'
+MQTT_PASSWORD = 'SensorNode$'
+MQTT_CLIENT_PORT = 4000
+MQTT_TOPIC = 'arpa/fw'
+
+# Arpa_Update.h
+UPDATE_MAGIC = b'AU'
+UPDATE_FULL = 0
+UPDATE_DELTA = 1
+DELTA_COPY = 0x00
+DELTA_INSERT = 0x01
+# FIRMWARE_MAX_SIZE in Combined.ino
+FIRMWARE_MAX_SIZE = 0x7800
+# FW_PART_LENGTH and FW_MAX_LENGTH in LTE.ino
+PART_LENGTH = 1024
+IMAGE_MAX_LENGTH = 65536
+
+# Shorter matches cost more as a copy command than as inserted bytes
+MIN_COPY = 8
+MAX_COMMAND = 0xFFFF
+# Bytes a match is indexed by, and the places kept for each, so runs of the same
+# bytes (erased flash, zero padding) don't make the search quadratic
+INDEX_LENGTH = 4
+INDEX_CANDIDATES = 32
+
+
+def make_header(fmt, version, base_version, firmware):
+    return (UPDATE_MAGIC + struct.pack('<BBHHII', fmt, 0, version, base_version,
+                                       len(firmware), zlib.crc32(firmware)))
+
+
+def make_delta(old, new):
+    index = {}
+    for i in range(len(old) - INDEX_LENGTH + 1):
+        candidates = index.setdefault(old[i:i + INDEX_LENGTH], [])
+        if len(candidates) < INDEX_CANDIDATES:
+            candidates.append(i)
+
+    body = bytearray()
+    literal = bytearray()
+
+    def flush_literal():
+        for start in range(0, len(literal), MAX_COMMAND):
+            part = literal[start:start + MAX_COMMAND]
+            body.extend(struct.pack('<BH', DELTA_INSERT, len(part)) + part)
+        literal.clear()
+
+    pos = 0
+    while pos < len(new):
+        best_from, best_len = 0, 0
+        for candidate in index.get(new[pos:pos + INDEX_LENGTH], ()):
+            length = 0
+            while (length < MAX_COMMAND and pos + length < len(new) and candidate + length < len(old)
+                   and old[candidate + length] == new[pos + length]):
+                length += 1
+            if length > best_len:
+                best_from, best_len = candidate, length
+
+        if best_len >= MIN_COPY:
+            flush_literal()
+            body.extend(struct.pack('<BIH', DELTA_COPY, best_from, best_len))
+            pos += best_len
+        else:
+            literal.append(new[pos])
+            pos += 1
+    flush_literal()
+    return bytes(body)
+
+
+def apply_delta(old, body):
+    """What Arpa_Update builds out of a delta, to check it before it goes out"""
+    out = bytearray()
+    pos = 0
+    while pos < len(body):
+        if body[pos] == DELTA_COPY:
+            start, length = struct.unpack_from('<IH', body, pos + 1)
+            out += old[start:start + length]
+            pos += 7
+        elif body[pos] == DELTA_INSERT:
+            length, = struct.unpack_from('<H', body, pos + 1)
+            out += body[pos + 3:pos + 3 + length]
+            pos += 3 + length
+        else:
+            raise ValueError('bad delta command')
+    return bytes(out)
+
+
+def make_image(new, version, old=None, base_version=0):
+    if old is None:
+        return make_header(UPDATE_FULL, version, 0, new) + new
+
+    body = make_delta(old, new)
+    if apply_delta(old, body) != new:
+        raise RuntimeError('delta does not rebuild the firmware')
+    return make_header(UPDATE_DELTA, version, base_version, new) + body
+
+
+def parts(image, version):
+    for offset in range(0, len(image), PART_LENGTH):
+        yield struct.pack('<HII', version, len(image), offset) + image[offset:offset + PART_LENGTH]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Build a firmware update image for the nodes')
+    parser.add_argument('firmware', help='new firmware, a .bin linked for the bootloader')
+    parser.add_argument('--version', type=int, required=True,
+                        help='FIRMWARE_VERSION of the new firmware')
+    parser.add_argument('--base', metavar='BIN', help='firmware the nodes run now, to build a delta')
+    parser.add_argument('--base-version', type=int, help='FIRMWARE_VERSION of --base')
+    parser.add_argument('--output', metavar='FILE', help='write the image to a file')
+    parser.add_argument('--publish', action='store_true', help='send the image to the LTE module')
+    args = parser.parse_args()
+
+    if not 0 < args.version < 0x8000:
+        parser.error('version out of range')
+    if args.base and not args.base_version:
+        parser.error('--base needs --base-version')
+
+    with open(args.firmware, 'rb') as f:
+        new = f.read()
+    if len(new) > FIRMWARE_MAX_SIZE:
+        parser.error('firmware does not fit the {} bytes after the bootloader'.format(FIRMWARE_MAX_SIZE))
+    old = None
+    if args.base:
+        with open(args.base, 'rb') as f:
+            old = f.read()
+
+    image = make_image(new, args.version, old, args.base_version or 0)
+    if len(image) > IMAGE_MAX_LENGTH:
+        parser.error('image of {} bytes is too large for the LTE module'.format(len(image)))
+    print('{} image of {} bytes for {} bytes of firmware'.format(
+        'Delta' if old else 'Full', len(image), len(new)))
+
+    if args.output:
+        with open(args.output, 'wb') as f:
+            f.write(image)
+
+    if args.publish:
+        import paho.mqtt.publish as publish
+        messages = [(MQTT_TOPIC, part, 1, False) for part in parts(image, args.version)]
+        publish.multiple(messages, hostname=MQTT_ADDRESS, port=MQTT_CLIENT_PORT,
+                         auth={'username': MQTT_USER, 'password': MQTT_PASSWORD})
+
+
+if __name__ == '__main__':
+    main()